@@ -8,14 +8,29 @@
  */
 #include "motion.h"
 #include "alg.h"
+#include "alg_simd.h"
+#include "alg_workers.h"
 
-#ifdef __MMX__
-#define HAVE_MMX
-#include "mmx.h"
-#endif
+/*
+ * The despeckle filters and the labeling work on a copy of the motion image
+ * with one bit per pixel, 64 pixels to a word (pixel x is bit x % 64 of word
+ * x / 64). Lines are bits_stride words apart and there is an empty line above
+ * the first and below the last line of the image, so the filters need no
+ * special cases for the top and bottom lines. Bits beyond the width are
+ * always 0.
+ */
+#define BITS_LINE(bits, stride, y) ((bits) + ((y) + 1) * (stride))
+
+/* Word i of a line shifted so each bit holds its left or right neighbour. */
+#define BITS_LEFT(line, i)          ((line)[i] << 1 | ((i) > 0 ? (line)[(i) - 1] >> 63 : 0))
+#define BITS_RIGHT(line, i, stride) ((line)[i] >> 1 | ((i) + 1 < (stride) ? (line)[(i) + 1] << 63 : 0))
 
-#define MAX2(x, y) ((x) > (y) ? (x) : (y))
-#define MAX3(x, y, z) ((x) > (y) ? ((x) > (z) ? (x) : (z)) : ((y) > (z) ? (y) : (z)))
+/*
+ * Pixels of the full image covered by one pixel of the detection image.
+ * Counts leave alg.c multiplied by this, so diffs and threshold keep their
+ * meaning at any detection_scale.
+ */
+#define DET_AREA(imgs) ((imgs)->det_scale * (imgs)->det_scale)
 
 /**
  * alg_locate_center_size
@@ -23,9 +38,10 @@
  */
 void alg_locate_center_size(struct images *imgs, int width, int height, struct coord *cent)
 {
-    unsigned char *out = imgs->out;
-    int *labels = imgs->labels;
+    unsigned char *out = imgs->det_out;
+    unsigned short *labels = imgs->labels;
     int x, y, centc = 0, xdist = 0, ydist = 0;
+    int det_width = imgs->det_width, det_height = imgs->det_height;
 
     cent->x = 0;
     cent->y = 0;
@@ -34,50 +50,40 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
     cent->minx = width;
     cent->miny = height;
 
-    /* If Labeling enabled - locate center of largest labelgroup. */
+    /* If Labeling enabled - locate center and size of largest labelgroup. */
     if (imgs->labelsize_max) {
-        /* Locate largest labelgroup */
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(labels++) & 32768) {
-                    cent->x += x;
-                    cent->y += y;
-                    centc++;
-                }
-            }
-        }
-
-    } else {
-        /* Locate movement */
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(out++)) {
-                    cent->x += x;
-                    cent->y += y;
-                    centc++;
-                }
-            }
-        }
+        struct label_info *info = imgs->label_info;
+        long long sumx = 0, sumy = 0;
+        int i, minx = det_width, maxx = -1, miny = det_height, maxy = -1;
 
-    }
-
-    if (centc) {
-        cent->x = cent->x / centc;
-        cent->y = cent->y / centc;
-    }
+        /* Locate largest labelgroup from the area of each label. */
+        for (i = 0; i < imgs->label_count; i++) {
+            if (!info[i].above)
+                continue;
 
-    /* Now we find the size of the Motion. */
+            sumx += info[i].sumx;
+            sumy += info[i].sumy;
+            centc += info[i].area;
+            if (minx > info[i].minx)
+                minx = info[i].minx;
+            if (maxx < info[i].maxx)
+                maxx = info[i].maxx;
+            if (miny > info[i].miny)
+                miny = info[i].miny;
+            if (maxy < info[i].maxy)
+                maxy = info[i].maxy;
+        }
 
-    /* First reset pointers back to initial value. */
-    centc = 0;
-    labels = imgs->labels;
-    out = imgs->out;
+        if (centc) {
+            cent->x = sumx / centc;
+            cent->y = sumy / centc;
+        }
 
-    /* If Labeling then we find the area around largest labelgroup instead. */
-    if (imgs->labelsize_max) {
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                if (*(labels++) & 32768) {
+        /* The size only needs the pixels inside the labelgroup. */
+        centc = 0;
+        for (y = miny; y <= maxy; y++) {
+            for (x = minx; x <= maxx; x++) {
+                if (labels[y * det_width + x] & 32768) {
                     if (x > cent->x)
                         xdist += x - cent->x;
                     else if (x < cent->x)
@@ -94,8 +100,28 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
         }
 
     } else {
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
+        /* Locate movement */
+        for (y = 0; y < det_height; y++) {
+            for (x = 0; x < det_width; x++) {
+                if (*(out++)) {
+                    cent->x += x;
+                    cent->y += y;
+                    centc++;
+                }
+            }
+        }
+
+        if (centc) {
+            cent->x = cent->x / centc;
+            cent->y = cent->y / centc;
+        }
+
+        /* Now we find the size of the Motion. */
+        centc = 0;
+        out = imgs->det_out;
+
+        for (y = 0; y < det_height; y++) {
+            for (x = 0; x < det_width; x++) {
                 if (*(out++)) {
                     if (x > cent->x)
                         xdist += x - cent->x;
@@ -114,6 +140,14 @@ void alg_locate_center_size(struct images *imgs, int width, int height, struct c
 
     }
 
+    /* Back to coordinates of the full image, centered in the scaled pixel. */
+    if (imgs->det_scale > 1) {
+        cent->x = cent->x * imgs->det_scale + imgs->det_scale / 2;
+        cent->y = cent->y * imgs->det_scale + imgs->det_scale / 2;
+        xdist *= imgs->det_scale;
+        ydist *= imgs->det_scale;
+    }
+
     if (centc) {
         cent->minx = cent->x - xdist / centc * 2;
         cent->maxx = cent->x + xdist / centc * 2;
@@ -365,7 +399,7 @@ void alg_noise_tune(struct context *cnt, unsigned char *new)
     unsigned char *mask = imgs->mask;
     unsigned char *smartmask = imgs->smartmask_final;
 
-    i = imgs->motionsize;
+    i = imgs->det_motionsize;
 
     for (; i > 0; i--) {
         diff = ABS(*ref - *new);
@@ -431,85 +465,62 @@ void alg_threshold_tune(struct context *cnt, int diffs, int motion)
 
 /*
  * Labeling by Joerg Weber. Based on an idea from Hubert Mara.
- * Floodfill enhanced by Ian McConnel based on code from
- * http://www.acm.org/pubs/tog/GraphicsGems/
- * http://www.codeproject.com/gdi/QuickFill.asp
-
- * Filled horizontal segment of scanline y for xl <= x <= xr.
- * Parent segment was on line y - dy.  dy = 1 or -1
+ *
+ * The motion image is labeled in two passes over runs of motion pixels.
+ * The first pass collects the runs of every line and joins runs that touch
+ * a run of the line above (4-connected) with union-find. The second pass
+ * numbers the resulting areas and collects their size, bounding box and
+ * centroid, so the pixels are only visited once.
  */
 
-#define MAXS 10000               /* max depth of stack */
-
-#define PUSH(Y, XL, XR, DY)     /* push new segment on stack */  \
-        if (sp<stack+MAXS && Y+(DY) >= 0 && Y+(DY) < height)     \
-        {sp->y = Y; sp->xl = XL; sp->xr = XR; sp->dy = DY; sp++;}
-
-#define POP(Y, XL, XR, DY)      /* pop segment off stack */      \
-        {sp--; Y = sp->y+(DY = sp->dy); XL = sp->xl; XR = sp->xr;}
-
-typedef struct {
-    short y, xl, xr, dy;
-} Segment;
-
 /**
- * iflood
- *
+ * bits_next
+ *      Returns the first pixel from x on in a line of the bit image that is
+ *      set (set = 1) or clear (set = 0), or width if there is none.
  */
-static int iflood(int x, int y, int width, int height,
-                  unsigned char *out, int *labels, int newvalue, int oldvalue)
+static int bits_next(const uint64_t *line, int x, int width, int set)
 {
-    int l, x1, x2, dy;
-    Segment stack[MAXS], *sp = stack;    /* Stack of filled segments. */
-    int count = 0;
+    int i = x / 64;
+    uint64_t w = (set ? line[i] : ~line[i]) & (~0ULL << (x % 64));
 
-    if (x < 0 || x >= width || y < 0 || y >= height)
-        return 0;
-
-    PUSH(y, x, x, 1);             /* Needed in some cases. */
-    PUSH(y+1, x, x, -1);          /* Seed segment (popped 1st). */
-
-    while (sp > stack) {
-        /* Pop segment off stack and fill a neighboring scan line. */
-        POP(y, x1, x2, dy);
-        /*
-         * Segment of scan line y-dy for x1<=x<=x2 was previously filled,
-         * now explore adjacent pixels in scan line y
-         */
-        for (x = x1; x >= 0 && out[y * width + x] != 0 && labels[y * width + x] == oldvalue; x--) {
-            labels[y * width + x] = newvalue;
-            count++;
-        }
-
-        if (x >= x1)
-            goto skip;
-
-        l = x + 1;
-
-        if (l < x1)
-            PUSH(y, l, x1 - 1, -dy);  /* Leak on left? */
-
-        x = x1 + 1;
-
-        do {
-            for (; x < width && out[y * width + x] != 0 && labels[y * width + x] == oldvalue; x++) {
-                labels[y * width + x] = newvalue;
-                count++;
-            }
+    while (!w) {
+        if (++i * 64 >= width)
+            return width;
+        w = set ? line[i] : ~line[i];
+    }
 
-            PUSH(y, l, x - 1, dy);
+    x = i * 64 + __builtin_ctzll(w);
 
-            if (x > x2 + 1)
-                PUSH(y, x2 + 1, x - 1, -dy);  /* Leak on right? */
+    return x < width ? x : width;
+}
 
-            skip:
+/**
+ * label_find
+ *      Returns the root run of run i, halving the path on the way.
+ */
+static int label_find(struct label_run *runs, int i)
+{
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
 
-            for (x++; x <= x2 && !(out[y * width + x] != 0 && labels[y * width + x] == oldvalue); x++);
+/**
+ * label_union
+ *      Joins the areas of runs a and b. The lowest run becomes the root,
+ *      so a run's parent is always a run that came before it.
+ */
+static void label_union(struct label_run *runs, int a, int b)
+{
+    a = label_find(runs, a);
+    b = label_find(runs, b);
 
-            l = x;
-        } while (x <= x2);
-    }
-    return count;
+    if (a < b)
+        runs[b].parent = a;
+    else if (b < a)
+        runs[a].parent = b;
 }
 
 /**
@@ -519,13 +530,13 @@ static int iflood(int x, int y, int width, int height,
 static int alg_labeling(struct context *cnt)
 {
     struct images *imgs = &cnt->imgs;
-    unsigned char *out = imgs->out;
-    int *labels = imgs->labels;
-    int ix, iy, pixelpos;
-    int width = imgs->width;
-    int height = imgs->height;
-    int labelsize = 0;
-    int current_label = 2;
+    unsigned short *labels = imgs->labels;
+    struct label_run *runs = imgs->label_runs;
+    struct label_info *info;
+    int x, y, i, j, k, label;
+    int width = imgs->det_width;
+    int height = imgs->det_height;
+    int nruns = 0, prev_start = 0, prev_end = 0, line_start;
     /* Keep track of the area just under the threshold.  */
     int max_under = 0;
 
@@ -534,53 +545,133 @@ static int alg_labeling(struct context *cnt)
     /* ALL labels above threshold are counted as labelgroup. */
     imgs->labelgroup_max = 0;
     imgs->labels_above = 0;
+    imgs->label_count = 0;
 
-    /* Init: 0 means no label set / not checked. */
-    memset(labels, 0, width * height * sizeof(*labels));
-    pixelpos = 0;
-
-    for (iy = 0; iy < height - 1; iy++) {
-        for (ix = 0; ix < width - 1; ix++, pixelpos++) {
-            /* No motion - no label */
-            if (out[pixelpos] == 0) {
-                labels[pixelpos] = 1;
-                continue;
+    /* Pass 1: collect the runs from the bit image and join the ones that touch. */
+    for (y = 0; y < height; y++) {
+        const uint64_t *line = BITS_LINE(imgs->motion_bits, imgs->bits_stride, y);
+
+        line_start = nruns;
+        j = prev_start;
+
+        for (x = bits_next(line, 0, width, 1); x < width; x = bits_next(line, x, width, 1)) {
+            if (nruns == imgs->label_max) {
+                imgs->label_max = imgs->label_max ? imgs->label_max * 2 : 1024;
+                imgs->label_runs = myrealloc(imgs->label_runs, imgs->label_max * sizeof(*runs),
+                                             "alg_labeling");
+                imgs->label_info = myrealloc(imgs->label_info,
+                                             imgs->label_max * sizeof(*imgs->label_info),
+                                             "alg_labeling");
+                runs = imgs->label_runs;
             }
 
-            /* Already visited by iflood */
-            if (labels[pixelpos] > 0)
-                continue;
+            runs[nruns].y = y;
+            runs[nruns].x1 = x;
+            x = bits_next(line, x, width, 0);
+            runs[nruns].x2 = x - 1;
+            runs[nruns].parent = nruns;
 
-            labelsize = iflood(ix, iy, width, height, out, labels, current_label, 0);
+            /*
+             * Runs of the line above that overlap this one. The first one
+             * just adopts this run, only further ones need a union.
+             */
+            while (j < prev_end && runs[j].x2 < runs[nruns].x1)
+                j++;
+            k = j;
+            if (k < prev_end && runs[k].x1 <= runs[nruns].x2)
+                runs[nruns].parent = label_find(runs, k++);
+            for (; k < prev_end && runs[k].x1 <= runs[nruns].x2; k++)
+                label_union(runs, k, nruns);
+
+            nruns++;
+        }
 
-            if (labelsize > 0) {
-                MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: Label: %i (%i) Size: %i (%i,%i)",
-                            current_label, cnt->current_image->total_labels,
-                           labelsize, ix, iy);
+        prev_start = line_start;
+        prev_end = nruns;
+    }
 
-                /* Label above threshold? Mark it again (add 32768 to labelnumber). */
-                if (labelsize > cnt->threshold) {
-                    labelsize = iflood(ix, iy, width, height, out, labels, current_label + 32768, current_label);
-                    imgs->labelgroup_max += labelsize;
-                    imgs->labels_above++;
-                } else if(max_under < labelsize)
-                    max_under = labelsize;
+    /*
+     * Pass 2: number the areas in the order they were found. A run's parent
+     * came before it and already has its label in place of the parent index.
+     */
+    info = imgs->label_info;
+
+    for (i = 0; i < nruns; i++) {
+        struct label_run *run = &runs[i];
+        int len = run->x2 - run->x1 + 1;
+
+        if (run->parent == i) {
+            label = imgs->label_count++;
+            info[label].area = 0;
+            info[label].minx = run->x1;
+            info[label].maxx = run->x2;
+            info[label].miny = run->y;
+            info[label].maxy = run->y;
+            info[label].sumx = 0;
+            info[label].sumy = 0;
+        } else {
+            label = runs[run->parent].parent;
+        }
+        run->parent = label;
+
+        info[label].area += len;
+        info[label].sumx += (long long)(run->x1 + run->x2) * len / 2;
+        info[label].sumy += (long long)run->y * len;
+        if (info[label].minx > run->x1)
+            info[label].minx = run->x1;
+        if (info[label].maxx < run->x2)
+            info[label].maxx = run->x2;
+        info[label].maxy = run->y;
+    }
 
-                if (imgs->labelsize_max < labelsize) {
-                    imgs->labelsize_max = labelsize;
-                    imgs->largest_label = current_label;
-                }
+    for (label = 0; label < imgs->label_count; label++) {
+        int labelsize = info[label].area * DET_AREA(imgs);
 
-                cnt->current_image->total_labels++;
-                current_label++;
-            }
+        info[label].x = info[label].sumx / info[label].area;
+        info[label].y = info[label].sumy / info[label].area;
+
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: Label: %i Size: %i (%i,%i)",
+                   label + 1, labelsize, info[label].x * imgs->det_scale,
+                   info[label].y * imgs->det_scale);
+
+        info[label].above = (labelsize > cnt->threshold);
+
+        if (info[label].above) {
+            imgs->labelgroup_max += labelsize;
+            imgs->labels_above++;
+        } else if (max_under < labelsize) {
+            max_under = labelsize;
+        }
+
+        if (imgs->labelsize_max < labelsize) {
+            imgs->labelsize_max = labelsize;
+            imgs->largest_label = label + 1;
         }
-        pixelpos++; /* Compensate for ix < width - 1 */
+    }
+
+    cnt->current_image->total_labels = imgs->label_count;
+
+    /*
+     * Write the labels, 0 means no motion. Labels above threshold get 32768
+     * added, labels beyond what fits in the remaining 15 bits share 32767.
+     */
+    memset(labels, 0, imgs->det_motionsize * sizeof(*labels));
+
+    for (i = 0; i < nruns; i++) {
+        unsigned short value;
+
+        label = runs[i].parent;
+        value = label < 32767 ? label + 1 : 32767;
+        if (info[label].above)
+            value |= 32768;
+
+        for (x = runs[i].x1; x <= runs[i].x2; x++)
+            labels[runs[i].y * width + x] = value;
     }
 
     MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: %i Labels found. Largest connected Area: %i Pixel(s). "
-               "Largest Label: %i", imgs->largest_label, imgs->labelsize_max,
-               cnt->current_image->total_labels);
+               "Largest Label: %i", cnt->current_image->total_labels, imgs->labelsize_max,
+               imgs->largest_label);
 
     /* Return group of significant labels or if that's none, the next largest
      * group (which is under the threshold, but especially for setup gives an
@@ -590,279 +681,201 @@ static int alg_labeling(struct context *cnt)
 }
 
 /**
- * dilate9
- *      Dilates a 3x3 box.
+ * bits_morph
+ *      Erodes or dilates lines y0 to y1 of the bit image src into dst with
+ *      a 3x3 box or a + shape. The left and right columns are cleared like
+ *      the byte filters used to do.
+ *
+ * Returns: number of pixels set in those lines of dst.
  */
-static int dilate9(unsigned char *img, int width, int height, void *buffer)
+static int bits_morph(const uint64_t *src, uint64_t *dst, int stride, int width, int y0, int y1,
+                      int erode, int box)
 {
-    /*
-     * - row1, row2 and row3 represent lines in the temporary buffer.
-     * - Window is a sliding window containing max values of the columns
-     *   in the 3x3 matrix.
-     * - width is an index into the sliding window (this is faster than
-     *   doing modulo 3 on i).
-     * - blob keeps the current max value.
-     */
-    int y, i, sum = 0, widx;
-    unsigned char *row1, *row2, *row3, *rowTemp,*yp;
-    unsigned char window[3], blob, latest;
-
-    /* Set up row pointers in the temporary buffer. */
-    row1 = buffer;
-    row2 = row1 + width;
-    row3 = row2 + width;
-
-    /* Init rows 2 and 3. */
-    memset(row2, 0, width);
-    memcpy(row3, img, width);
-
-    /* Pointer to the current row in img. */
-    yp = img;
-
-    for (y = 0; y < height; y++) {
-        /* Move down one step; row 1 becomes the previous row 2 and so on. */
-        rowTemp = row1;
-        row1 = row2;
-        row2 = row3;
-        row3 = rowTemp;
-
-        /* If we're at the last row, fill with zeros, otherwise copy from img. */
-        if (y == height - 1)
-            memset(row3, 0, width);
-        else
-            memcpy(row3, yp+width, width);
-
-        /* Init slots 0 and 1 in the moving window. */
-        window[0] = MAX3(row1[0], row2[0], row3[0]);
-        window[1] = MAX3(row1[1], row2[1], row3[1]);
-
-        /* Init blob to the current max, and set window index. */
-        blob = MAX2(window[0], window[1]);
-        widx = 2;
-
-        /*
-         * Iterate over the current row; index i is off by one to eliminate
-         * a lot of +1es in the loop.
-         */
-        for (i = 2; i <= width - 1; i++) {
-            /* Get the max value of the next column in the 3x3 matrix. */
-            latest = window[widx] = MAX3(row1[i], row2[i], row3[i]);
-
-            /*
-             * If the value is larger than the current max, use it. Otherwise,
-             * calculate a new max (because the new value may not be the max.
-             */
-            if (latest >= blob)
-                blob = latest;
-            else
-                blob = MAX3(window[0], window[1], window[2]);
-
-            /* Write the max value (blob) to the image. */
-            if (blob != 0) {
-                *(yp + i - 1) = blob;
-                sum++;
+    uint64_t last = (width % 64) ? (1ULL << (width % 64)) - 1 : ~0ULL;
+    uint64_t edge = 1ULL << ((width - 1) % 64);
+    int x, y, sum = 0;
+
+    for (y = y0; y < y1; y++) {
+        const uint64_t *up = BITS_LINE(src, stride, y - 1);
+        const uint64_t *line = BITS_LINE(src, stride, y);
+        const uint64_t *down = BITS_LINE(src, stride, y + 1);
+        uint64_t *out = BITS_LINE(dst, stride, y);
+        uint64_t vprev = 0, v = 0, vnext, w;
+
+        if (box)
+            v = erode ? up[0] & line[0] & down[0] : up[0] | line[0] | down[0];
+
+        for (x = 0; x < stride; x++) {
+            if (box) {
+                /* Combine the column first, then its neighbours. */
+                if (x + 1 < stride)
+                    vnext = erode ? up[x + 1] & line[x + 1] & down[x + 1]
+                                  : up[x + 1] | line[x + 1] | down[x + 1];
+                else
+                    vnext = 0;
+
+                if (erode)
+                    w = v & (v << 1 | vprev >> 63) & (v >> 1 | vnext << 63);
+                else
+                    w = v | (v << 1 | vprev >> 63) | (v >> 1 | vnext << 63);
+
+                vprev = v;
+                v = vnext;
+            } else if (erode) {
+                w = up[x] & down[x] & line[x] & BITS_LEFT(line, x) & BITS_RIGHT(line, x, stride);
+            } else {
+                w = up[x] | down[x] | line[x] | BITS_LEFT(line, x) | BITS_RIGHT(line, x, stride);
             }
 
-            /* Wrap around the window index if necessary. */
-            if (++widx == 3)
-                widx = 0;
+            out[x] = w;
         }
 
-        /* Store zeros in the vertical sides. */
-        *yp = *(yp + width - 1) = 0;
-        yp += width;
+        out[0] &= ~1ULL;
+        out[stride - 1] &= last;
+        out[(width - 1) / 64] &= ~edge;
+
+        for (x = 0; x < stride; x++)
+            sum += __builtin_popcountll(out[x]);
     }
 
     return sum;
 }
 
+/* Arguments of morph_band */
+struct morph_args {
+    const uint64_t *src;
+    uint64_t *dst;
+    int erode;
+    int box;
+};
+
 /**
- * dilate5
- *      Dilates a + shape.
+ * morph_band
+ *      bits_morph for one band. The lines above and below the band are
+ *      only read from src, so all bands can run at the same time.
  */
-static int dilate5(unsigned char *img, int width, int height, void *buffer)
+static int morph_band(struct context *cnt, void *arg, int y0, int y1)
 {
-    /*
-     * - row1, row2 and row3 represent lines in the temporary buffer.
-     * - mem holds the max value of the overlapping part of two + shapes.
-     */
-    int y, i, sum = 0;
-    unsigned char *row1, *row2, *row3, *rowTemp, *yp;
-    unsigned char blob, mem, latest;
-
-    /* Set up row pointers in the temporary buffer. */
-    row1 = buffer;
-    row2 = row1 + width;
-    row3 = row2 + width;
-
-    /* Init rows 2 and 3. */
-    memset(row2, 0, width);
-    memcpy(row3, img, width);
-
-    /* Pointer to the current row in img. */
-    yp = img;
-
-    for (y = 0; y < height; y++) {
-        /* Move down one step; row 1 becomes the previous row 2 and so on. */
-        rowTemp = row1;
-        row1 = row2;
-        row2 = row3;
-        row3 = rowTemp;
-
-        /* If we're at the last row, fill with zeros, otherwise copy from img. */
-        if (y == height - 1)
-            memset(row3, 0, width);
-        else
-            memcpy(row3, yp + width, width);
+    struct morph_args *morph = arg;
 
-        /* Init mem and set blob to force an evaluation of the entire + shape. */
-        mem = MAX2(row2[0], row2[1]);
-        blob = 1; /* dummy value, must be > 0 */
+    return bits_morph(morph->src, morph->dst, cnt->imgs.bits_stride, cnt->imgs.det_width,
+                      y0, y1, morph->erode, morph->box);
+}
 
-        for (i = 1; i < width - 1; i++) {
-            /* Get the max value of the "right edge" of the + shape. */
-            latest = MAX3(row1[i], row2[i + 1], row3[i]);
+/**
+ * bits_morph_image
+ *      Runs bits_morph on imgs->motion_bits and swaps the bit images, so the
+ *      result is in imgs->motion_bits again.
+ *
+ * Returns: number of pixels set, in pixels of the full image.
+ */
+static int bits_morph_image(struct context *cnt, int erode, int box)
+{
+    struct images *imgs = &cnt->imgs;
+    struct morph_args morph = { imgs->motion_bits, imgs->motion_bits_tmp, erode, box };
+    uint64_t *tmp;
+    int sum;
 
-            if (blob == 0) {
-                /* In case the last blob is zero, only latest matters. */
-                blob = latest;
-                mem = row2[i + 1];
-            } else {
-                /* Otherwise, we have to check both latest and mem. */
-                blob = MAX2(mem, latest);
-                mem = MAX2(row2[i], row2[i + 1]);
-            }
+    sum = alg_workers_run(cnt, imgs->det_height, 1, morph_band, &morph) * DET_AREA(imgs);
 
-            /* Write the max value (blob) to the image. */
-            if (blob != 0) {
-                *(yp + i) = blob;
-                sum++;
-            }
-        }
+    tmp = imgs->motion_bits;
+    imgs->motion_bits = imgs->motion_bits_tmp;
+    imgs->motion_bits_tmp = tmp;
 
-        /* Store zeros in the vertical sides. */
-        *yp = *(yp + width - 1) = 0;
-        yp += width;
-    }
     return sum;
 }
 
 /**
- * erode9
- *      Erodes a 3x3 box.
+ * pack_band
+ *      Packs the lines of a band of the motion image into imgs->motion_bits.
  */
-static int erode9(unsigned char *img, int width, int height, void *buffer, unsigned char flag)
+static int pack_band(struct context *cnt, void *arg ATTRIBUTE_UNUSED, int y0, int y1)
 {
-    int y, i, sum = 0;
-    char *Row1,*Row2,*Row3;
-
-    Row1 = buffer;
-    Row2 = Row1 + width;
-    Row3 = Row1 + 2 * width;
-    memset(Row2, flag, width);
-    memcpy(Row3, img, width);
-
-    for (y = 0; y < height; y++) {
-        memcpy(Row1, Row2, width);
-        memcpy(Row2, Row3, width);
+    struct images *imgs = &cnt->imgs;
 
-        if (y == height-1)
-            memset(Row3, flag, width);
-        else
-            memcpy(Row3, img + (y+1) * width, width);
-
-        for (i = width - 2; i >= 1; i--) {
-            if (Row1[i - 1] == 0 ||
-                Row1[i]     == 0 ||
-                Row1[i + 1] == 0 ||
-                Row2[i - 1] == 0 ||
-                Row2[i]     == 0 ||
-                Row2[i + 1] == 0 ||
-                Row3[i - 1] == 0 ||
-                Row3[i]     == 0 ||
-                Row3[i + 1] == 0)
-                img[y * width + i] = 0;
-            else
-                sum++;
-        }
+    alg_simd_pack(imgs->det_out + y0 * imgs->det_width,
+                  BITS_LINE(imgs->motion_bits, imgs->bits_stride, y0),
+                  imgs->det_width, y1 - y0, imgs->bits_stride);
 
-        img[y * width] = img[y * width + width - 1] = flag;
-    }
-    return sum;
+    return 0;
 }
 
 /**
- * erode5
- *      Erodes in a + shape.
+ * unpack_band
+ *      Writes a band of the bit image back to the motion image. Pixels that
+ *      were eroded are cleared, pixels added by dilation get their value
+ *      from the current frame (at least 1 so they still count as motion).
  */
-static int erode5(unsigned char *img, int width, int height, void *buffer, unsigned char flag)
+static int unpack_band(struct context *cnt, void *arg ATTRIBUTE_UNUSED, int y0, int y1)
 {
-    int y, i, sum = 0;
-    char *Row1,*Row2,*Row3;
+    struct images *imgs = &cnt->imgs;
+    unsigned char *out = imgs->det_out + y0 * imgs->det_width;
+    unsigned char *virgin = imgs->det_image + y0 * imgs->det_width;
+    int stride = imgs->bits_stride;
+    int x, y, b, n;
 
-    Row1 = buffer;
-    Row2 = Row1 + width;
-    Row3 = Row1 + 2 * width;
-    memset(Row2, flag, width);
-    memcpy(Row3, img, width);
+    for (y = y0; y < y1; y++) {
+        const uint64_t *line = BITS_LINE(imgs->motion_bits, stride, y);
 
-    for (y = 0; y < height; y++) {
-        memcpy(Row1, Row2, width);
-        memcpy(Row2, Row3, width);
+        for (x = 0; x < imgs->det_width; x += 64) {
+            uint64_t w = line[x / 64];
 
-        if (y == height-1)
-            memset(Row3, flag, width);
-        else
-            memcpy(Row3, img + (y + 1) * width, width);
-
-        for (i = width - 2; i >= 1; i--) {
-            if (Row1[i]     == 0 ||
-                Row2[i - 1] == 0 ||
-                Row2[i]     == 0 ||
-                Row2[i + 1] == 0 ||
-                Row3[i]     == 0)
-                img[y * width + i] = 0;
-            else
-                sum++;
+            n = imgs->det_width - x < 64 ? imgs->det_width - x : 64;
+
+            if (!w) {
+                memset(out + x, 0, n);
+                continue;
+            }
+
+            for (b = 0; b < n; b++) {
+                if (!(w >> b & 1))
+                    out[x + b] = 0;
+                else if (!out[x + b])
+                    out[x + b] = virgin[x + b] ? virgin[x + b] : 1;
+            }
         }
 
-        img[y * width] = img[y * width + width - 1] = flag;
+        out += imgs->det_width;
+        virgin += imgs->det_width;
     }
-    return sum;
+
+    return 0;
 }
 
 /**
  * alg_despeckle
  *      Despeckling routine to remove noisy detections.
+ *      The filters run on a bit image of the motion image, which is only
+ *      written back at the end. The labeling reads the bit image as well.
  */
 int alg_despeckle(struct context *cnt, int olddiffs)
 {
+    struct images *imgs = &cnt->imgs;
     int diffs = 0;
-    unsigned char *out = cnt->imgs.out;
-    int width = cnt->imgs.width;
-    int height = cnt->imgs.height;
-    int done = 0, i, len = strlen(cnt->conf.despeckle_filter);
-    unsigned char *common_buffer = cnt->imgs.common_buffer;
+    int done = 0, morphed = 0, i, len = strlen(cnt->conf.despeckle_filter);
+
+    if (strpbrk(cnt->conf.despeckle_filter, "EeDdl"))
+        alg_workers_run(cnt, imgs->det_height, 1, pack_band, NULL);
 
     for (i = 0; i < len; i++) {
         switch (cnt->conf.despeckle_filter[i]) {
         case 'E':
-            if ((diffs = erode9(out, width, height, common_buffer, 0)) == 0)
+            if ((diffs = bits_morph_image(cnt, 1, 1)) == 0)
                 i = len;
-            done = 1;
+            done = morphed = 1;
             break;
         case 'e':
-            if ((diffs = erode5(out, width, height, common_buffer, 0)) == 0)
+            if ((diffs = bits_morph_image(cnt, 1, 0)) == 0)
                 i = len;
-            done = 1;
+            done = morphed = 1;
             break;
         case 'D':
-            diffs = dilate9(out, width, height, common_buffer);
-            done = 1;
+            diffs = bits_morph_image(cnt, 0, 1);
+            done = morphed = 1;
             break;
         case 'd':
-            diffs = dilate5(out, width, height, common_buffer);
-            done = 1;
+            diffs = bits_morph_image(cnt, 0, 0);
+            done = morphed = 1;
             break;
         /* No further despeckle after labeling! */
         case 'l':
@@ -873,379 +886,365 @@ int alg_despeckle(struct context *cnt, int olddiffs)
         }
     }
 
+    if (morphed)
+        alg_workers_run(cnt, imgs->det_height, 1, unpack_band, NULL);
+
     /* If conf.despeckle_filter contains any valid action EeDdl */
     if (done) {
         if (done != 2)
-            cnt->imgs.labelsize_max = 0; // Disable Labeling
+            imgs->labelsize_max = 0; // Disable Labeling
         return diffs;
     } else {
-        cnt->imgs.labelsize_max = 0; // Disable Labeling
+        imgs->labelsize_max = 0; // Disable Labeling
     }
 
     return olddiffs;
 }
 
+/*
+ * The smartmask tuning is spread over this many frames, so no single frame
+ * pays for a pass over the whole smartmask.
+ */
+#define SMARTMASK_SLICES 8
+
 /**
- * alg_tune_smartmask
- *      Generates actual smartmask. Calculate sensitivity based on motion.
+ * smartmask_band
+ *      Updates the smartmask of a band of lines and marks the pixels that
+ *      are masked in imgs->smartmask_bits. arg points to the first line of
+ *      the slice, the band lines are relative to it.
  */
-void alg_tune_smartmask(struct context *cnt)
+static int smartmask_band(struct context *cnt, void *arg, int y0, int y1)
 {
-    int i, diff;
-    int motionsize = cnt->imgs.motionsize;
-    unsigned char *smartmask = cnt->imgs.smartmask;
-    unsigned char *smartmask_final = cnt->imgs.smartmask_final;
-    int *smartmask_buffer = cnt->imgs.smartmask_buffer;
+    struct images *imgs = &cnt->imgs;
+    int x, y, i, diff;
+    int width = imgs->det_width;
+    int stride = imgs->bits_stride;
+    int first = *(int *)arg;
+    unsigned char *smartmask = imgs->smartmask;
+    unsigned short *smartmask_buffer = imgs->smartmask_buffer;
     int sensitivity = cnt->lastrate * (11 - cnt->smartmask_speed);
+    /*
+     * smartmask_buffer / sensitivity as a multiplication. Rounding the
+     * reciprocal up gives the exact quotient for 16 bit values as long as
+     * sensitivity is below 65536.
+     */
+    uint64_t reciprocal = ((1ULL << 32) + sensitivity - 1) / sensitivity;
+
+    for (y = first + y0; y < first + y1; y++) {
+        uint64_t *line = BITS_LINE(imgs->smartmask_bits, stride, y);
+
+        memset(line, 0, stride * sizeof(*line));
 
-    for (i = 0; i < motionsize; i++) {
-        /* Decrease smart_mask sensitivity every 5*speed seconds only. */
-        if (smartmask[i] > 0)
-            smartmask[i]--;
-        /* Increase smart_mask sensitivity based on the buffered values. */
-        diff = smartmask_buffer[i]/sensitivity;
-
-        if (diff) {
-            if (smartmask[i] <= diff + 80)
-                smartmask[i] += diff;
-            else
-                smartmask[i] = 80;
-            smartmask_buffer[i] %= sensitivity;
+        for (x = 0, i = y * width; x < width; x++, i++) {
+            /* Nothing to do for pixels that never had motion. */
+            if (!smartmask[i] && !smartmask_buffer[i])
+                continue;
+
+            /* Decrease smart_mask sensitivity every 5*speed seconds only. */
+            if (smartmask[i] > 0)
+                smartmask[i]--;
+            /* Increase smart_mask sensitivity based on the buffered values. */
+            diff = (smartmask_buffer[i] * reciprocal) >> 32;
+
+            if (diff) {
+                if (smartmask[i] <= diff + 80)
+                    smartmask[i] += diff;
+                else
+                    smartmask[i] = 80;
+                smartmask_buffer[i] -= diff * sensitivity;
+            }
+            /* Pixels above the trigger value are masked in the final stage. */
+            if (smartmask[i] > 20)
+                line[x / 64] |= 1ULL << (x % 64);
         }
-        /* Transfer raw mask to the final stage when above trigger value. */
-        if (smartmask[i] > 20)
-            smartmask_final[i] = 0;
-        else
-            smartmask_final[i] = 255;
     }
-    /* Further expansion (here:erode due to inverted logic!) of the mask. */
-    diff = erode9(smartmask_final, cnt->imgs.width, cnt->imgs.height,
-                  cnt->imgs.common_buffer, 255);
-    diff = erode5(smartmask_final, cnt->imgs.width, cnt->imgs.height,
-                  cnt->imgs.common_buffer, 255);
-}
 
-/* Increment for *smartmask_buffer in alg_diff_standard. */
-#define SMARTMASK_SENSITIVITY_INCR 5
+    return 0;
+}
 
 /**
- * alg_diff_standard
- *
+ * smartmask_final_band
+ *      Writes a band of the expanded mask to smartmask_final.
  */
-int alg_diff_standard(struct context *cnt, unsigned char *new)
+static int smartmask_final_band(struct context *cnt, void *arg ATTRIBUTE_UNUSED, int y0, int y1)
 {
     struct images *imgs = &cnt->imgs;
-    int i, diffs = 0;
-    int noise = cnt->noise;
-    int smartmask_speed = cnt->smartmask_speed;
-    unsigned char *ref = imgs->ref;
-    unsigned char *out = imgs->out;
-    unsigned char *mask = imgs->mask;
-    unsigned char *smartmask_final = imgs->smartmask_final;
-    int *smartmask_buffer = imgs->smartmask_buffer;
-#ifdef HAVE_MMX
-    mmx_t mmtemp; /* Used for transferring to/from memory. */
-    int unload;   /* Counter for unloading diff counts. */
-#endif
+    unsigned char *smartmask_final = imgs->smartmask_final + y0 * imgs->det_width;
+    int x, y, b, n;
 
-    i = imgs->motionsize;
-    memset(out + i, 128, i / 2); /* Motion pictures are now b/w i.o. green */
-    /*
-     * Keeping this memset in the MMX case when zeroes are necessarily
-     * written anyway seems to be beneficial in terms of speed. Perhaps a
-     * cache thing?
-     */
-    memset(out, 0, i);
+    for (y = y0; y < y1; y++) {
+        const uint64_t *line = BITS_LINE(imgs->smartmask_bits, imgs->bits_stride, y);
 
-#ifdef HAVE_MMX
-    /*
-     * NOTE: The Pentium has two instruction pipes: U and V. I have grouped MMX
-     * instructions in pairs according to how I think they will be scheduled in
-     * the U and V pipes. Due to pairing constraints, the V pipe will sometimes
-     * be empty (for example, memory access always goes into the U pipe).
-     *
-     * The following MMX registers are kept throughout the loop:
-     * mm5 - 8 separate diff counters (unloaded periodically)
-     * mm6 - mask: 00ff 00ff 00ff 00ff
-     * mm7 - noise level as 8 packed bytes
-     *
-     * -- Per Jonsson
-     */
+        for (x = 0; x < imgs->det_width; x += 64) {
+            uint64_t w = line[x / 64];
 
-    /*
-     * To avoid a div, we work with differences multiplied by 255 in the
-     * default case and *mask otherwise. Thus, the limit to compare with is
-     * 255 * (noise + 1) - 1).
-     */
-    mmtemp.uw[0] = mmtemp.uw[1] = mmtemp.uw[2] = mmtemp.uw[3] =
-                   (unsigned short)(noise * 255 + 254);
+            n = imgs->det_width - x < 64 ? imgs->det_width - x : 64;
 
-    /*
-     * Reset mm5 to zero, set the mm6 mask, and store the multiplied noise
-     * level as four words in mm7.
-     */
-    movq_m2r(mmtemp, mm7);             /* U */
-    pcmpeqb_r2r(mm6, mm6);             /* V */
+            /* Most of the image is usually not masked at all. */
+            if (!w) {
+                memset(smartmask_final + x, 255, n);
+                continue;
+            }
 
-    pxor_r2r(mm5, mm5);                /* U */
-    psrlw_i2r(8, mm6);                 /* V */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            /* Spread each byte of w over 8 bytes, bit b ends up in byte b. */
+            for (b = 0; b + 8 <= n; b += 8) {
+                uint64_t v = ((w >> b) & 0xff) * 0x0101010101010101ULL;
 
-    /*
-     * We must unload mm5 every 255th round, because the diffs accumulate
-     * in each packed byte, which can hold at most 255 diffs before it
-     * gets saturated.
-     */
-    unload = 255;
+                v = ((v & 0x8040201008040201ULL) + 0x7f7f7f7f7f7f7f7fULL) & 0x8080808080808080ULL;
+                v = ~((v >> 7) * 0xff);
+                memcpy(smartmask_final + x + b, &v, sizeof(v));
+            }
+#else
+            b = 0;
+#endif
+            for (; b < n; b++)
+                smartmask_final[x + b] = (w >> b & 1) ? 0 : 255;
+        }
 
-    for (; i > 7; i -= 8) {
-        /* Calculate abs(*ref-*new) for 8 pixels in parallel. */
-        movq_m2r(*ref, mm0);           /* U: mm0 = r7 r6 r5 r4 r3 r2 r1 r0 */
-        pxor_r2r(mm4, mm4);            /* V: mm4 = 0 */
+        smartmask_final += imgs->det_width;
+    }
 
-        movq_m2r(*new, mm1);           /* U: mm1 = n7 n6 n5 n4 n3 n2 n1 n0 */
-        movq_r2r(mm0, mm2);            /* V: mm2 = r7 r6 r5 r4 r3 r2 r1 r0 */
+    return 0;
+}
 
-        /* These subtractions are saturated, i.e. won't go below 0. */
-        psubusb_r2r(mm1, mm0);         /* U: mm0 = (r7-n7) ... (r0-n0) */
-        psubusb_r2r(mm2, mm1);         /* V: mm1 = (n7-r7) ... (n0-r0) */
+/**
+ * alg_tune_smartmask_slice
+ *      Runs the next slice of a smartmask tuning started by
+ *      alg_tune_smartmask. The last slice expands the mask and replaces
+ *      smartmask_final, which is left alone until then.
+ */
+void alg_tune_smartmask_slice(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    struct morph_args morph;
+    int slice = imgs->smartmask_tuning;
+    int y0, y1;
 
-        /* Each byte dX in mm0 is abs(nX-rX). */
-        por_r2r(mm1, mm0);             /* U: mm0 = d7 d6 d5 d4 d3 d2 d1 d0 */
+    if (!slice)
+        return;
 
-        /* Expand the absolute differences to words in mm0 and mm1. */
-        movq_r2r(mm0, mm1);            /* U: mm1 = d7 d6 d5 d4 d3 d2 d1 d0 */
-        punpcklbw_r2r(mm4, mm0);       /* V: mm0 =    d3    d2    d1    d0 */
+    y0 = imgs->det_height * (slice - 1) / SMARTMASK_SLICES;
+    y1 = imgs->det_height * slice / SMARTMASK_SLICES;
+    alg_workers_run(cnt, y1 - y0, 1, smartmask_band, &y0);
 
-        punpckhbw_r2r(mm4, mm1);       /* U: mm1 =    d7    d6    d5    d4 */
+    if (slice < SMARTMASK_SLICES) {
+        imgs->smartmask_tuning++;
+        return;
+    }
 
-        if (mask) {
-            /*
-             * Load and expand 8 mask bytes to words in mm2 and mm3. Then
-             * multiply by mm0 and mm1, respectively.
-             */
-            movq_m2r(*mask, mm2);      /* U: mm2 = m7 m6 m5 m4 m3 m2 m1 m0 */
+    imgs->smartmask_tuning = 0;
 
-            movq_r2r(mm2, mm3);        /* U: mm3 = m7 m6 m5 m4 m3 m2 m1 m0 */
-            punpcklbw_r2r(mm4, mm2);   /* v: mm2 =    m3    m2    m1    m0 */
+    /*
+     * Further expansion (here:erode due to inverted logic!) of the mask.
+     * Eroding the unmasked pixels with the border counted as unmasked is
+     * the same as dilating the masked pixels with an empty border, which
+     * is done on the bit images of alg_despeckle. motion_bits_tmp is not
+     * needed anymore by the despeckle of this frame.
+     */
+    morph.src = imgs->smartmask_bits;
+    morph.dst = imgs->motion_bits_tmp;
+    morph.erode = 0;
+    morph.box = 1;
+    alg_workers_run(cnt, imgs->det_height, 1, morph_band, &morph);
+
+    morph.src = imgs->motion_bits_tmp;
+    morph.dst = imgs->smartmask_bits;
+    morph.box = 0;
+    alg_workers_run(cnt, imgs->det_height, 1, morph_band, &morph);
+
+    alg_workers_run(cnt, imgs->det_height, 1, smartmask_final_band, NULL);
+}
 
-            punpckhbw_r2r(mm4, mm3);   /* U: mm3 =    m7    m6    m5    m4 */
-            pmullw_r2r(mm2, mm0);      /* V: mm0 = (d3*m3) ... (d0*m0) */
+/**
+ * alg_tune_smartmask
+ *      Generates actual smartmask. Calculate sensitivity based on motion.
+ *      Starts a new tuning, which alg_tune_smartmask_slice finishes over the
+ *      next frames. A tuning that is still running is continued instead.
+ */
+void alg_tune_smartmask(struct context *cnt)
+{
+    if (!cnt->imgs.smartmask_tuning)
+        cnt->imgs.smartmask_tuning = 1;
 
-            pmullw_r2r(mm3, mm1);      /* U: mm1 = (d7*m7) ... (d4*m4) */
+    alg_tune_smartmask_slice(cnt);
+}
 
-            mask += 8;
-        } else {
-            /*
-             * Not using mask - multiply the absolute differences by 255. We
-             * do this by left-shifting 8 places and then subtracting dX.
-             */
-            movq_r2r(mm0, mm2);        /* U: mm2 =    d3    d2    d1    d0 */
-            psllw_i2r(8, mm0);         /* V: mm2 = (256*d3) ... (256*d0) */
+/**
+ * alg_diff_flags
+ *      Returns the smartmask flags for alg_simd_diff.
+ */
+static int alg_diff_flags(struct context *cnt)
+{
+    int flags = 0;
 
-            movq_r2r(mm1, mm3);        /* U: mm3 =    d7    d6    d5    d4 */
-            psllw_i2r(8, mm1);         /* V: mm3 = (256*d7) ... (256*d4) */
+    if (cnt->smartmask_speed) {
+        flags |= ALG_DIFF_SMARTMASK;
+        if (cnt->event_nr != cnt->prev_event)
+            flags |= ALG_DIFF_SMARTMASK_INCR;
+    }
 
-            psubusw_r2r(mm2, mm0);     /* U */
-            psubusw_r2r(mm3, mm1);     /* V */
-        }
+    return flags;
+}
 
-        /*
-         * Next, compare the multiplied absolute differences with the multiplied
-         * noise level (repeated as 4 words in mm7), resulting in a "motion flag"
-         * for each pixel.
-         *
-         * Since pcmpgtw performs signed comparisons, we have to subtract noise,
-         * test for equality to 0 and then invert the result.
-         *
-         * Note that it is safe to generate the "motion flags" before the
-         * smartmask code, as all that can happen is that individual flags get
-         * reset to 0 because of the smartmask.
-         */
-        psubusw_r2r(mm7, mm0);         /* U: subtract by (multiplied) noise */
-        psubusw_r2r(mm7, mm1);         /* V */
+/* Arguments of the diff band functions */
+struct diff_args {
+    unsigned char *new;
+    int flags;
+};
 
-        pcmpeqw_r2r(mm4, mm0);         /* U: test for equality with 0 */
-        pcmpeqw_r2r(mm4, mm1);         /* V */
+/**
+ * diff_standard_band
+ *      Full diff of the lines of a band.
+ */
+static int diff_standard_band(struct context *cnt, void *arg, int y0, int y1)
+{
+    struct images *imgs = &cnt->imgs;
+    struct diff_args *diff = arg;
+    int pos = y0 * imgs->det_width;
+
+    return alg_simd_diff(imgs->ref + pos, diff->new + pos, imgs->det_out + pos,
+                         imgs->mask ? imgs->mask + pos : NULL,
+                         imgs->bg_noise ? imgs->bg_noise + pos : NULL,
+                         imgs->smartmask_final + pos, imgs->smartmask_buffer + pos,
+                         (y1 - y0) * imgs->det_width, cnt->noise, diff->flags);
+}
 
-        pand_r2r(mm6, mm0);            /* U: convert 0xffff -> 0x00ff */
-        pand_r2r(mm6, mm1);            /* V */
+/**
+ * alg_diff_standard
+ *
+ */
+int alg_diff_standard(struct context *cnt, unsigned char *new)
+{
+    struct images *imgs = &cnt->imgs;
+    struct diff_args diff = { new, alg_diff_flags(cnt) };
+    int i = imgs->det_motionsize;
 
-        pxor_r2r(mm6, mm0);            /* U: invert the result */
-        pxor_r2r(mm6, mm1);            /* V */
+    memset(imgs->det_out + i, 128, i / 2); /* Motion pictures are now b/w i.o. green */
+    imgs->det_still = 0;
 
-        /* Each fX is the "motion flag" = 0 for no motion, 0xff for motion. */
-        packuswb_r2r(mm1, mm0);        /* U: mm0 = f7 f6 f5 f4 f3 f2 f1 f0 */
+    /* The kernel writes every pixel of the motion image, no need to clear it first. */
+    return alg_workers_run(cnt, imgs->det_height, 1, diff_standard_band, &diff) * DET_AREA(imgs);
+}
 
-        if (smartmask_speed) {
-            /*
-             * Apply the smartmask. Basically, if *smartmask_final is 0, the
-             * corresponding "motion flag" in mm0 will be reset.
-             */
-            movq_m2r(*smartmask_final, mm3); /* U: mm3 = s7 s6 s5 s4 s3 s2 s1 s0 */
+/**
+ * diff_tile_changed
+ *      Tells if a tile has any pixel above the noise level. The lines are
+ *      counted a few at a time, so a tile with changes is mostly left after
+ *      its first ones.
+ */
+static int diff_tile_changed(struct context *cnt, unsigned char *new, int pos, int w, int h)
+{
+    struct images *imgs = &cnt->imgs;
+    int y, lines;
 
-            /*
-             * ...but move the "motion flags" to memory before, in order to
-             * increment *smartmask_buffer properly below.
-             */
-            movq_r2m(mm0, mmtemp);           /* U */
-            pcmpeqb_r2r(mm4, mm3);           /* V: mm3 = 0xff where sX==0 */
-
-            /* AND negates the target before anding. */
-            pandn_r2r(mm0, mm3);             /* U: mm3 = 0xff where dX>noise && sX>0 */
-
-            movq_r2r(mm3, mm0);              /* U */
-
-            /* Add to *smartmask_buffer. This is probably the fastest way to do it. */
-            if (cnt->event_nr != cnt->prev_event) {
-                if (mmtemp.ub[0]) smartmask_buffer[0] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[1]) smartmask_buffer[1] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[2]) smartmask_buffer[2] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[3]) smartmask_buffer[3] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[4]) smartmask_buffer[4] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[5]) smartmask_buffer[5] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[6]) smartmask_buffer[6] += SMARTMASK_SENSITIVITY_INCR;
-                if (mmtemp.ub[7]) smartmask_buffer[7] += SMARTMASK_SENSITIVITY_INCR;
-            }
+    for (y = 0; y < h; y += ALG_TILE_PROBE) {
+        lines = h - y < ALG_TILE_PROBE ? h - y : ALG_TILE_PROBE;
+        if (alg_simd_count(imgs->ref + pos, new + pos, imgs->det_width, w, lines, cnt->noise))
+            return 1;
+        pos += ALG_TILE_PROBE * imgs->det_width;
+    }
 
-            smartmask_buffer += 8;
-            smartmask_final += 8;
-        }
+    return 0;
+}
 
-        movq_m2r(*new, mm2);           /* U: mm1 = n7 n6 n5 n4 n3 n2 n1 n0 */
+/**
+ * diff_tiles_band
+ *      Same as diff_standard_band, but only visits the tiles of
+ *      ALG_TILE_WIDTH x ALG_TILE_HEIGHT pixels that have pixels above the
+ *      noise level, which are marked in imgs->tiles a row of tiles at a time
+ *      right before the row is diffed. The masks can only remove motion, so
+ *      the motion image of the other tiles is all zero and the result is
+ *      identical to alg_diff_standard. Bands are aligned to whole tiles.
+ */
+static int diff_tiles_band(struct context *cnt, void *arg, int y0, int y1)
+{
+    struct images *imgs = &cnt->imgs;
+    struct diff_args *diff = arg;
+    int width = imgs->det_width;
+    int ty, y, h, tx, end, x, x1, pos, diffs = 0;
 
-        /*
-         * Cancel out pixels in *new according to the "motion flags" in mm0.
-         * Each NX is either 0 or nX as from *new.
-         */
-        pand_r2r(mm0, mm2);            /* U: mm1 = N7 N6 N5 N4 N3 N2 N1 N0 */
-        psubb_r2r(mm0, mm4);           /* V: mm4 = 0x01 where dX>noise */
+    for (ty = y0; ty < y1; ty += ALG_TILE_HEIGHT) {
+        unsigned char *tiles = imgs->tiles + (ty / ALG_TILE_HEIGHT) * imgs->tiles_x;
 
-        /*
-         * mm5 holds 8 separate counts - each one is increased according to
-         * the contents of mm4 (where each byte is either 0x00 or 0x01).
-         */
-        movq_r2m(mm2, *out);           /* U: this will stall */
-        paddusb_r2r(mm4, mm5);         /* V: add counts to mm5 */
+        h = y1 - ty < ALG_TILE_HEIGHT ? y1 - ty : ALG_TILE_HEIGHT;
 
-        /*
-         * Every 255th turn, we need to unload mm5 into the diffs variable,
-         * because otherwise the packed bytes will get saturated.
-         */
-        if (--unload == 0) {
-            /* Unload mm5 to memory and reset it. */
-            movq_r2m(mm5, mmtemp);     /* U */
-            pxor_r2r(mm5, mm5);        /* V: mm5 = 0 */
-
-            diffs += mmtemp.ub[0] + mmtemp.ub[1] + mmtemp.ub[2] + mmtemp.ub[3] +
-                     mmtemp.ub[4] + mmtemp.ub[5] + mmtemp.ub[6] + mmtemp.ub[7];
-            unload = 255;
+        for (tx = 0; tx < imgs->tiles_x; tx++) {
+            x = tx * ALG_TILE_WIDTH;
+            tiles[tx] = diff_tile_changed(cnt, diff->new, ty * width + x,
+                                          width - x < ALG_TILE_WIDTH ? width - x : ALG_TILE_WIDTH, h);
         }
 
-        out += 8;
-        ref += 8;
-        new += 8;
-    }
-
-    /*
-     * Check if there are diffs left in mm5 that need to be copied to the
-     * diffs variable.
-     */
-    if (unload < 255) {
-        movq_r2m(mm5, mmtemp);
-        diffs += mmtemp.ub[0] + mmtemp.ub[1] + mmtemp.ub[2] + mmtemp.ub[3] +
-                 mmtemp.ub[4] + mmtemp.ub[5] + mmtemp.ub[6] + mmtemp.ub[7];
-    }
-
-    emms();
-
-#endif
-    /*
-     * Note that the non-MMX code is present even if the MMX code is present.
-     * This is necessary if the resolution is not a multiple of 8, in which
-     * case the non-MMX code needs to take care of the remaining pixels.
-     */
-
-    for (; i > 0; i--) {
-        register unsigned char curdiff = (int)(abs(*ref - *new)); /* Using a temp variable is 12% faster. */
-        /* Apply fixed mask */
-        if (mask)
-            curdiff = ((int)(curdiff * *mask++) / 255);
-
-        if (smartmask_speed) {
-            if (curdiff > noise) {
-                /*
-                 * Increase smart_mask sensitivity every frame when motion
-                 * is detected. (with speed=5, mask is increased by 1 every
-                 * second. To be able to increase by 5 every second (with
-                 * speed=10) we add 5 here. NOT related to the 5 at ratio-
-                 * calculation.
-                 */
-                if (cnt->event_nr != cnt->prev_event)
-                    (*smartmask_buffer) += SMARTMASK_SENSITIVITY_INCR;
-                /* Apply smart_mask */
-                if (!*smartmask_final)
-                    curdiff = 0;
+        for (y = ty; y < ty + h; y++) {
+            /* Handle runs of neighbouring tiles with the same state in one go. */
+            for (tx = 0; tx < imgs->tiles_x; tx = end) {
+                for (end = tx + 1; end < imgs->tiles_x && tiles[end] == tiles[tx]; end++);
+
+                x = tx * ALG_TILE_WIDTH;
+                x1 = end * ALG_TILE_WIDTH;
+                if (x1 > width)
+                    x1 = width;
+                pos = y * width + x;
+
+                if (tiles[tx])
+                    diffs += alg_simd_diff(imgs->ref + pos, diff->new + pos, imgs->det_out + pos,
+                                           imgs->mask ? imgs->mask + pos : NULL,
+                                           imgs->bg_noise ? imgs->bg_noise + pos : NULL,
+                                           imgs->smartmask_final + pos,
+                                           imgs->smartmask_buffer + pos,
+                                           x1 - x, cnt->noise, diff->flags);
+                else
+                    memset(imgs->det_out + pos, 0, x1 - x);
             }
-            smartmask_final++;
-            smartmask_buffer++;
-        }
-        /* Pixel still in motion after all the masks? */
-        if (curdiff > noise) {
-            *out = *new;
-            diffs++;
         }
-        out++;
-        ref++;
-        new++;
     }
+
     return diffs;
 }
 
 /**
- * alg_diff_fast
- *      Very fast diff function, does not apply mask overlaying.
+ * diff_fast_band
+ *      Counts the pixels above the noise level in one of every
+ *      ALG_SAMPLE_LINES lines of a band, and returns the estimate for the
+ *      whole band.
  */
-static char alg_diff_fast(struct context *cnt, int max_n_changes, unsigned char *new)
+static int diff_fast_band(struct context *cnt, void *arg, int y0, int y1)
 {
     struct images *imgs = &cnt->imgs;
-    int i, diffs = 0, step = imgs->motionsize/10000;
-    int noise = cnt->noise;
-    unsigned char *ref = imgs->ref;
+    struct diff_args *diff = arg;
+    int y = y0 + ALG_SAMPLE_LINES / 2;
 
-    if (!step % 2)
-        step++;
-    /* We're checking only 1 of several pixels. */
-    max_n_changes /= step;
-
-    i = imgs->motionsize;
-
-    for (; i > 0; i -= step) {
-        register unsigned char curdiff = (int)(abs((char)(*ref - *new))); /* Using a temp variable is 12% faster. */
-        if (curdiff >  noise) {
-            diffs++;
-            if (diffs > max_n_changes)
-                return 1;
-        }
-        ref += step;
-        new += step;
-    }
+    if (y >= y1)
+        return 0;
 
-    return 0;
+    return alg_simd_count(imgs->ref + y * imgs->det_width, diff->new + y * imgs->det_width,
+                          ALG_SAMPLE_LINES * imgs->det_width, imgs->det_width,
+                          (y1 - y + ALG_SAMPLE_LINES - 1) / ALG_SAMPLE_LINES, cnt->noise) *
+           ALG_SAMPLE_LINES;
 }
 
 /**
  * alg_diff
- *      Uses diff_fast to quickly decide if there is anything worth
- *      sending to diff_standard.
+ *      Uses a fast pre-screen without masks on a sample of the lines to
+ *      quickly decide if there is anything worth sending to the full diff,
+ *      so a quiet frame only costs a fraction of a pass over it. The full
+ *      diff then only looks at the tiles with changed pixels. A quiet frame
+ *      leaves the motion image of an earlier frame, and det_still set.
  */
 int alg_diff(struct context *cnt, unsigned char *new)
 {
-    int diffs = 0;
+    struct images *imgs = &cnt->imgs;
+    struct diff_args diff = { new, alg_diff_flags(cnt) };
+
+    if (alg_workers_run(cnt, imgs->det_height, ALG_TILE_HEIGHT, diff_fast_band, &diff) *
+        DET_AREA(imgs) <= cnt->conf.max_changes / 2)
+        return 0;
 
-    if (alg_diff_fast(cnt, cnt->conf.max_changes / 2, new))
-        diffs = alg_diff_standard(cnt, new);
+    memset(imgs->det_out + imgs->det_motionsize, 128, imgs->det_motionsize / 2);
+    imgs->det_still = 0;
 
-    return diffs;
+    return alg_workers_run(cnt, imgs->det_height, ALG_TILE_HEIGHT, diff_tiles_band, &diff) *
+           DET_AREA(imgs);
 }
 
 /**
@@ -1270,33 +1269,99 @@ int alg_lightswitch(struct context *cnt, int diffs)
     return 0;
 }
 
+/* Distance between the lines and pixels sampled by alg_lightswitch_prescreen */
+#define LIGHTSWITCH_STEP 4
+/* Percent above lightswitch that the samples must reach to skip the diff */
+#define LIGHTSWITCH_MARGIN 5
+
+/**
+ * alg_lightswitch_prescreen
+ *      Runs before the diff and compares only every LIGHTSWITCH_STEP-th pixel
+ *      of every LIGHTSWITCH_STEP-th line with the reference frame, with the
+ *      same masks as the diff. The frame is a lightswitch and the full diff
+ *      can be skipped if more than lightswitch + LIGHTSWITCH_MARGIN percent
+ *      of these pixels changed and the mean brightness of the samples moved
+ *      by more than the noise level. A large object close to the camera
+ *      changes many pixels but hardly the mean. The motion image is cleared
+ *      when the diff is skipped since no diff writes it. Frames closer to
+ *      the limit or with a steady mean are left to alg_lightswitch.
+ */
+int alg_lightswitch_prescreen(struct context *cnt, unsigned char *new)
+{
+    struct images *imgs = &cnt->imgs;
+    unsigned char *ref = imgs->ref;
+    int smartmask = cnt->smartmask_speed != 0;
+    int x, y, i, curdiff, limit;
+    int samples = 0, changed = 0;
+    long newsum = 0, refsum = 0, shift;
+
+    for (y = LIGHTSWITCH_STEP / 2; y < imgs->det_height; y += LIGHTSWITCH_STEP) {
+        i = y * imgs->det_width + LIGHTSWITCH_STEP / 2;
+
+        for (x = LIGHTSWITCH_STEP / 2; x < imgs->det_width; x += LIGHTSWITCH_STEP, i += LIGHTSWITCH_STEP) {
+            curdiff = abs(ref[i] - new[i]);
+
+            if (imgs->mask)
+                curdiff = curdiff * imgs->mask[i] / 255;
+            if (smartmask && !imgs->smartmask_final[i])
+                curdiff = 0;
+
+            limit = cnt->noise;
+            if (imgs->bg_noise && imgs->bg_noise[i] > limit)
+                limit = imgs->bg_noise[i];
+
+            changed += curdiff > limit;
+            newsum += new[i];
+            refsum += ref[i];
+            samples++;
+        }
+    }
+
+    if (!samples ||
+        (long)changed * 100 <= (long)samples * (cnt->conf.lightswitch + LIGHTSWITCH_MARGIN))
+        return 0;
+
+    shift = labs(newsum - refsum) / samples;
+    if (shift <= cnt->noise)
+        return 0;
+
+    MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: %d%% of the samples changed, brightness %ld -> %ld",
+               changed * 100 / samples, refsum / samples, newsum / samples);
+
+    memset(imgs->det_out, 0, imgs->det_motionsize);
+    memset(imgs->det_out + imgs->det_motionsize, 128, imgs->det_motionsize / 2);
+
+    return 1;
+}
+
 /**
  * alg_switchfilter
  *
  */
 int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
 {
-    int linediff = diffs / cnt->imgs.height;
-    unsigned char *out = cnt->imgs.out;
+    struct images *imgs = &cnt->imgs;
+    int linediff = diffs / DET_AREA(imgs) / imgs->det_height;
+    unsigned char *out = imgs->det_out;
     int y, x, line;
     int lines = 0, vertlines = 0;
 
-    for (y = 0; y < cnt->imgs.height; y++) {
+    for (y = 0; y < imgs->det_height; y++) {
         line = 0;
-        for (x = 0; x < cnt->imgs.width; x++) {
+        for (x = 0; x < imgs->det_width; x++) {
             if (*(out++))
                 line++;
         }
 
-        if (line > cnt->imgs.width / 18)
+        if (line > imgs->det_width / 18)
             vertlines++;
 
         if (line > linediff * 2)
             lines++;
     }
 
-    if (vertlines > cnt->imgs.height / 10 && lines < vertlines / 3 &&
-        (vertlines > cnt->imgs.height / 4 || lines - vertlines > lines / 2)) {
+    if (vertlines > imgs->det_height / 10 && lines < vertlines / 3 &&
+        (vertlines > imgs->det_height / 4 || lines - vertlines > lines / 2)) {
         if (cnt->conf.text_changes) {
             char tmp[80];
             sprintf(tmp, "%d %d", lines, vertlines);
@@ -1307,12 +1372,203 @@ int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
     return 0;
 }
 
+#define ACCEPT_STATIC_OBJECT_TIME 10  /* Seconds */
+#define EXCLUDE_LEVEL_PERCENT 20
+
+/* Arguments of update_band */
+struct update_args {
+    int threshold;
+    int accept;
+};
+
+/**
+ * update_band
+ *      Updates the reference frame for the lines of a band.
+ */
+static int update_band(struct context *cnt, void *arg, int y0, int y1)
+{
+    struct images *imgs = &cnt->imgs;
+    struct update_args *update = arg;
+    int pos = y0 * imgs->det_width;
+
+    alg_simd_update_ref(imgs->ref + pos, imgs->det_image + pos, imgs->smartmask_final + pos,
+                        imgs->det_out + pos, imgs->ref_dyn + pos, (y1 - y0) * imgs->det_width,
+                        update->threshold, update->accept);
+
+    return 0;
+}
+
+/**
+ * reference_update
+ *      Background model "reference": a single reference frame that follows
+ *      the image, except for moving objects. These are excluded from the
+ *      reference frame for a certain amount of time to improve detection.
+ */
+static void reference_update(struct context *cnt)
+{
+    int accept_timer = cnt->lastrate * ACCEPT_STATIC_OBJECT_TIME;
+    struct update_args update;
+
+    if (cnt->lastrate > 5)  /* Match rate limit */
+        accept_timer /= (cnt->lastrate / 3);
+
+    update.threshold = cnt->noise * EXCLUDE_LEVEL_PERCENT / 100;
+    update.accept = accept_timer;
+
+    alg_workers_run(cnt, cnt->imgs.det_height, 1, update_band, &update);
+}
+
+/**
+ * reference_reset
+ *      Starts the reference frame over from the current image.
+ */
+static void reference_reset(struct context *cnt)
+{
+    /* Copy fresh image */
+    memcpy(cnt->imgs.ref, cnt->imgs.det_image, cnt->imgs.det_motionsize);
+    /* Reset static objects */
+    memset(cnt->imgs.ref_dyn, 0, cnt->imgs.det_motionsize * sizeof(*cnt->imgs.ref_dyn));
+}
+
+/**
+ * median_init
+ *      Allocates the state of the median background model.
+ */
+static void median_init(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+
+    imgs->bg_median = mymalloc(imgs->det_motionsize * sizeof(*imgs->bg_median));
+    imgs->bg_dev = mymalloc(imgs->det_motionsize * sizeof(*imgs->bg_dev));
+    imgs->bg_noise = mymalloc(imgs->det_motionsize);
+    imgs->bg_still = mymalloc(imgs->det_motionsize);
+}
+
+/**
+ * median_band
+ *      Updates the median background model for the lines of a band, with
+ *      the motion image given by arg.
+ */
+static int median_band(struct context *cnt, void *arg, int y0, int y1)
+{
+    struct images *imgs = &cnt->imgs;
+    unsigned char *out = arg;
+    int pos = y0 * imgs->det_width;
+
+    alg_simd_update_median(imgs->ref + pos, imgs->det_image + pos, out + pos,
+                           imgs->bg_median + pos, imgs->bg_dev + pos, imgs->bg_noise + pos,
+                           (y1 - y0) * imgs->det_width);
+
+    return 0;
+}
+
+/**
+ * median_update
+ *      Background model "median": an approximate running median of every
+ *      pixel plus how much the pixel usually deviates from it. The median
+ *      is the reference frame, and pixels that keep changing on their own,
+ *      like leaves or water, get a higher noise level for the diff.
+ */
+static void median_update(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    unsigned char *out = imgs->det_out;
+    int i;
+
+    /* The first update after a reset starts the median from a captured image. */
+    if (imgs->bg_frames == 0) {
+        for (i = 0; i < imgs->det_motionsize; i++)
+            imgs->bg_median[i] = imgs->det_image[i] << 8;
+
+        memcpy(imgs->ref, imgs->det_image, imgs->det_motionsize);
+        imgs->bg_frames++;
+        return;
+    }
+
+    /*
+     * Every pixel follows the image at the fast rate until the deviation
+     * has settled, and on frames with no motion image of their own.
+     */
+    if (imgs->bg_frames < BACKGROUND_WARMUP || imgs->det_still)
+        out = imgs->bg_still;
+
+    alg_workers_run(cnt, imgs->det_height, 1, median_band, out);
+
+    if (imgs->bg_frames < BACKGROUND_WARMUP)
+        imgs->bg_frames++;
+}
+
+/**
+ * median_reset
+ *      Starts the median over, without deviation. The reset image may be
+ *      a blank one from before the first capture, so the median itself is
+ *      only started by the next median_update.
+ */
+static void median_reset(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+
+    reference_reset(cnt);
+
+    imgs->bg_frames = 0;
+    memset(imgs->bg_dev, 0, imgs->det_motionsize * sizeof(*imgs->bg_dev));
+    memset(imgs->bg_noise, 0, imgs->det_motionsize);
+}
+
+/* Background models for the background_model option, the first is the default. */
+struct alg_background {
+    const char *name;
+    void (*init)(struct context *);
+    void (*update)(struct context *);
+    void (*reset)(struct context *);
+};
+
+static const struct alg_background backgrounds[] = {
+    { "reference", NULL,        reference_update, reference_reset },
+    { "median",    median_init, median_update,    median_reset    }
+};
+
+#define BACKGROUND_COUNT (int)(sizeof(backgrounds) / sizeof(backgrounds[0]))
+
+/**
+ * alg_background_init
+ *      Selects the background model given by background_model and allocates
+ *      its state. Needs the detection geometry, and must be called before
+ *      the first alg_update_reference_frame.
+ */
+void alg_background_init(struct context *cnt)
+{
+    const char *name = cnt->conf.background_model;
+    int i;
+
+    cnt->imgs.background = &backgrounds[0];
+
+    if (name) {
+        for (i = 0; i < BACKGROUND_COUNT; i++) {
+            if (strcasecmp(name, backgrounds[i].name) == 0)
+                break;
+        }
+
+        if (i < BACKGROUND_COUNT)
+            cnt->imgs.background = &backgrounds[i];
+        else
+            MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Unknown background_model %s, using %s",
+                       name, backgrounds[0].name);
+    }
+
+    if (cnt->imgs.background->init)
+        cnt->imgs.background->init(cnt);
+
+    if (cnt->imgs.background != &backgrounds[0])
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Using the %s background model",
+                   cnt->imgs.background->name);
+}
+
 /**
  * alg_update_reference_frame
  *
- *   Called from 'motion_loop' to calculate the reference frame
- *   Moving objects are excluded from the reference frame for a certain
- *   amount of time to improve detection.
+ *   Called from 'motion_loop' to calculate the reference frame with the
+ *   background model selected by alg_background_init.
  *
  * Parameters:
  *
@@ -1320,55 +1576,157 @@ int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
  *   action - UPDATE_REF_FRAME or RESET_REF_FRAME
  *
  */
-#define ACCEPT_STATIC_OBJECT_TIME 10  /* Seconds */
-#define EXCLUDE_LEVEL_PERCENT 20
 void alg_update_reference_frame(struct context *cnt, int action)
 {
-    int accept_timer = cnt->lastrate * ACCEPT_STATIC_OBJECT_TIME;
-    int i, threshold_ref;
-    int *ref_dyn = cnt->imgs.ref_dyn;
-    unsigned char *image_virgin = cnt->imgs.image_virgin;
-    unsigned char *ref = cnt->imgs.ref;
-    unsigned char *smartmask = cnt->imgs.smartmask_final;
-    unsigned char *out = cnt->imgs.out;
+    if (action == UPDATE_REF_FRAME)  /* Black&white only for better performance. */
+        cnt->imgs.background->update(cnt);
+    else    /* action == RESET_REF_FRAME - also used to initialize the frame at startup. */
+        cnt->imgs.background->reset(cnt);
+}
 
-    if (cnt->lastrate > 5)  /* Match rate limit */
-        accept_timer /= (cnt->lastrate / 3);
+/**
+ * scale_down
+ *      Box filter of lines y0 to y1 of the scaled down image dst. Every pixel
+ *      is the rounded average of scale x scale pixels of src, scale is 2 or 4.
+ */
+static void scale_down(const unsigned char *src, unsigned char *dst, int width, int scale,
+                       int y0, int y1)
+{
+    int det_width = width / scale;
+    int x, y, j, sum;
+
+    for (y = y0; y < y1; y++) {
+        const unsigned char *in = src + y * scale * width;
+        const unsigned char *in2 = in + width;
+        unsigned char *det = dst + y * det_width;
+
+        if (scale == 2) {
+            for (x = 0; x < det_width; x++, in += 2, in2 += 2)
+                det[x] = (in[0] + in[1] + in2[0] + in2[1] + 2) >> 2;
+            continue;
+        }
 
-    if (action == UPDATE_REF_FRAME) { /* Black&white only for better performance. */
-        threshold_ref = cnt->noise * EXCLUDE_LEVEL_PERCENT / 100;
-
-        for (i = cnt->imgs.motionsize; i > 0; i--) {
-            /* Exclude pixels from ref frame well below noise level. */
-            if (((int)(abs(*ref - *image_virgin)) > threshold_ref) && (*smartmask)) {
-                if (*ref_dyn == 0) { /* Always give new pixels a chance. */
-                    *ref_dyn = 1;
-                } else if (*ref_dyn > accept_timer) { /* Include static Object after some time. */
-                    *ref_dyn = 0;
-                    *ref = *image_virgin;
-                } else if (*out) {
-                    (*ref_dyn)++; /* Motionpixel? Keep excluding from ref frame. */
-                } else {
-                    *ref_dyn = 0; /* Nothing special - release pixel. */
-                    *ref = (*ref + *image_virgin) / 2;
-                }
+        /* scale == 4 */
+        for (x = 0; x < det_width; x++, in += 4) {
+            sum = 8;
+            for (j = 0; j < 4 * width; j += width)
+                sum += in[j] + in[j + 1] + in[j + 2] + in[j + 3];
+            det[x] = sum >> 4;
+        }
+    }
+}
 
-            } else {  /* No motion: copy to ref frame. */
-                *ref_dyn = 0; /* Reset pixel */
-                *ref = *image_virgin;
-            }
+/**
+ * scale_down_band
+ *      Scales a band of image_virgin down to det_image.
+ */
+static int scale_down_band(struct context *cnt, void *arg ATTRIBUTE_UNUSED, int y0, int y1)
+{
+    struct images *imgs = &cnt->imgs;
+
+    scale_down(imgs->image_virgin, imgs->det_image, imgs->width, imgs->det_scale, y0, y1);
+
+    return 0;
+}
+
+/**
+ * alg_detection_image
+ *      Builds det_image from image_virgin when the detection runs at a
+ *      reduced size. At scale 1 det_image is image_virgin itself, which is
+ *      a different buffer for every frame.
+ */
+void alg_detection_image(struct context *cnt)
+{
+    if (cnt->imgs.det_scale > 1)
+        alg_workers_run(cnt, cnt->imgs.det_height, 1, scale_down_band, NULL);
+    else
+        cnt->imgs.det_image = cnt->imgs.image_virgin;
+}
 
-            ref++;
-            image_virgin++;
-            smartmask++;
-            ref_dyn++;
-            out++;
-        } /* end for i */
-
-    } else {   /* action == RESET_REF_FRAME - also used to initialize the frame at startup. */
-        /* Copy fresh image */
-        memcpy(cnt->imgs.ref, cnt->imgs.image_virgin, cnt->imgs.size);
-        /* Reset static objects */
-        memset(cnt->imgs.ref_dyn, 0, cnt->imgs.motionsize * sizeof(*cnt->imgs.ref_dyn));
+/**
+ * alg_half_image
+ *      Scales an image of the camera down to half its width and height,
+ *      the chroma planes of YUV420P as well. Both must stay even.
+ */
+void alg_half_image(struct context *cnt, const unsigned char *src, unsigned char *dst)
+{
+    int width = cnt->imgs.width, height = cnt->imgs.height;
+
+    scale_down(src, dst, width, 2, 0, height / 2);
+
+    if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
+        src += width * height;
+        dst += width * height / 4;
+        scale_down(src, dst, width / 2, 2, 0, height / 4);
+
+        src += width * height / 4;
+        dst += width * height / 16;
+        scale_down(src, dst, width / 2, 2, 0, height / 4);
     }
 }
+
+/**
+ * alg_detection_mask
+ *      Replaces the mask loaded at the full size with one at the detection
+ *      size. Partly masked blocks get the average weight.
+ */
+void alg_detection_mask(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    unsigned char *mask;
+
+    if (imgs->det_scale == 1 || !imgs->mask)
+        return;
+
+    mask = mymalloc(imgs->det_motionsize);
+    scale_down(imgs->mask, mask, imgs->width, imgs->det_scale, 0, imgs->det_height);
+
+    free(imgs->mask);
+    imgs->mask = mask;
+}
+
+/**
+ * scale_up
+ *      Enlarges a plane of width x height pixels by repeating every pixel
+ *      scale times in both directions.
+ */
+static void scale_up(const unsigned char *src, unsigned char *dst, int width, int height, int scale)
+{
+    int x, y, i;
+
+    for (y = 0; y < height; y++) {
+        unsigned char *line = dst;
+
+        for (x = 0; x < width; x++) {
+            memset(dst, src[x], scale);
+            dst += scale;
+        }
+
+        for (i = 1; i < scale; i++) {
+            memcpy(dst, line, width * scale);
+            dst += width * scale;
+        }
+
+        src += width;
+    }
+}
+
+/**
+ * alg_motion_image
+ *      Copies the motion image of the detection into imgs->out at the full
+ *      size, for motion pictures, the debug movie and setup mode.
+ */
+void alg_motion_image(struct context *cnt)
+{
+    struct images *imgs = &cnt->imgs;
+    int width = imgs->det_width, height = imgs->det_height;
+
+    if (imgs->det_scale == 1)
+        return;
+
+    scale_up(imgs->det_out, imgs->out, width, height, imgs->det_scale);
+    scale_up(imgs->det_out + imgs->det_motionsize, imgs->out + imgs->motionsize,
+             width / 2, height / 2, imgs->det_scale);
+    scale_up(imgs->det_out + imgs->det_motionsize * 5 / 4, imgs->out + imgs->motionsize * 5 / 4,
+             width / 2, height / 2, imgs->det_scale);
+}
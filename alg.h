@@ -12,6 +12,16 @@
 
 #include "motion.h"
 
+/* Size of the tiles used by the pre-screen in alg_diff */
+#define ALG_TILE_WIDTH  64
+#define ALG_TILE_HEIGHT 16
+/* Lines of a tile counted at a time to find out if it changed */
+#define ALG_TILE_PROBE  4
+/* The pre-screen of alg_diff counts one of this many lines */
+#define ALG_SAMPLE_LINES 8
+/* Median updates after a reset that use the fast rate for every pixel */
+#define BACKGROUND_WARMUP 32
+
 struct coord {
     int x;
     int y;
@@ -23,6 +33,28 @@ struct coord {
     int maxy;
 };
 
+/* Horizontal run of motion pixels, used by the labeling in alg_despeckle */
+struct label_run {
+    int y;
+    int x1;
+    int x2;
+    int parent;
+};
+
+/* Connected area of motion pixels found by the labeling */
+struct label_info {
+    int area;
+    int minx;
+    int maxx;
+    int miny;
+    int maxy;
+    int x;              /* Centroid */
+    int y;
+    int above;          /* Area is above threshold */
+    long long sumx;
+    long long sumy;
+};
+
 struct segment {
     struct coord coord;
     int width;
@@ -37,11 +69,18 @@ void alg_draw_red_location(struct coord *, struct images *, int width, unsigned
 int alg_diff(struct context *, unsigned char *);
 int alg_diff_standard(struct context *, unsigned char *);
 int alg_lightswitch(struct context *, int diffs);
+int alg_lightswitch_prescreen(struct context *, unsigned char *);
 int alg_switchfilter(struct context *, int, unsigned char *);
 void alg_noise_tune(struct context *, unsigned char *);
 void alg_threshold_tune(struct context *, int, int);
 int alg_despeckle(struct context *, int);
 void alg_tune_smartmask(struct context *);
+void alg_tune_smartmask_slice(struct context *);
+void alg_background_init(struct context *);
 void alg_update_reference_frame(struct context *, int);
+void alg_detection_image(struct context *);
+void alg_detection_mask(struct context *);
+void alg_half_image(struct context *, const unsigned char *, unsigned char *);
+void alg_motion_image(struct context *);
 
 #endif /* _INCLUDE_ALG_H */
@@ -0,0 +1,1302 @@
+/*
+ *    alg_simd.c
+ *
+ *    Vectorized kernels for the motion detection in alg.c.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    Every kernel exists as a portable C reference version and as SSE2,
+ *    AVX2 (x86) and NEON (ARM) versions. The vector versions are compiled
+ *    with target attributes so a generic build still contains all of them,
+ *    and the best one supported by the CPU is selected at runtime by
+ *    alg_simd_init. The vector kernels must produce exactly the same result
+ *    as the C version; alg_simd_init checks this before selecting one.
+ */
+#include "motion.h"
+#include "alg_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ALG_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ALG_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+typedef int (*alg_diff_func)(const unsigned char *, const unsigned char *,
+                             unsigned char *, const unsigned char *, const unsigned char *,
+                             const unsigned char *, unsigned short *, int, int, int);
+
+typedef int (*alg_count_func)(const unsigned char *, const unsigned char *,
+                              int, int, int, int);
+
+typedef void (*alg_update_func)(unsigned char *, const unsigned char *,
+                                const unsigned char *, const unsigned char *,
+                                unsigned char *, int, int, int);
+
+typedef void (*alg_pack_func)(const unsigned char *, uint64_t *, int, int, int);
+
+typedef void (*alg_median_func)(unsigned char *, const unsigned char *, const unsigned char *,
+                                unsigned short *, unsigned short *, unsigned char *, int);
+
+struct alg_simd_kernel {
+    const char *name;
+    int (*supported)(void);
+    alg_diff_func diff;
+    alg_count_func count;
+    alg_update_func update;
+    alg_pack_func pack;
+    alg_median_func median;
+};
+
+/**
+ * diff_c
+ *      Reference version of alg_simd_diff. Also used for the pixels left
+ *      over at the end of a line by the vector versions.
+ */
+static int diff_c(const unsigned char *ref, const unsigned char *new,
+                  unsigned char *out, const unsigned char *mask, const unsigned char *noise_map,
+                  const unsigned char *smartmask_final, unsigned short *smartmask_buffer,
+                  int count, int noise, int flags)
+{
+    int i, diffs = 0;
+
+    for (i = 0; i < count; i++) {
+        int curdiff = abs(ref[i] - new[i]);
+        int limit = noise;
+
+        if (noise_map && noise_map[i] > noise)
+            limit = noise_map[i];
+
+        /* Apply fixed mask */
+        if (mask)
+            curdiff = curdiff * mask[i] / 255;
+
+        if (curdiff > limit) {
+            /*
+             * Increase smart_mask sensitivity every frame when motion
+             * is detected. (with speed=5, mask is increased by 1 every
+             * second. To be able to increase by 5 every second (with
+             * speed=10) we add 5 here. NOT related to the 5 at ratio-
+             * calculation.
+             */
+            if (flags & ALG_DIFF_SMARTMASK_INCR) {
+                if (smartmask_buffer[i] < 65535 - SMARTMASK_SENSITIVITY_INCR)
+                    smartmask_buffer[i] += SMARTMASK_SENSITIVITY_INCR;
+                else
+                    smartmask_buffer[i] = 65535;
+            }
+            /* Apply smart_mask */
+            if ((flags & ALG_DIFF_SMARTMASK) && !smartmask_final[i])
+                curdiff = 0;
+        }
+
+        /* Pixel still in motion after all the masks? */
+        if (curdiff > limit) {
+            out[i] = new[i];
+            diffs++;
+        } else {
+            out[i] = 0;
+        }
+    }
+
+    return diffs;
+}
+
+/**
+ * count_c
+ *      Reference version of alg_simd_count.
+ */
+static int count_c(const unsigned char *ref, const unsigned char *new,
+                   int stride, int width, int height, int noise)
+{
+    int x, y, diffs = 0;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            if (abs(ref[x] - new[x]) > noise)
+                diffs++;
+        }
+        ref += stride;
+        new += stride;
+    }
+
+    return diffs;
+}
+
+/**
+ * update_c
+ *      Reference version of alg_simd_update_ref.
+ */
+static void update_c(unsigned char *ref, const unsigned char *virgin,
+                     const unsigned char *smartmask_final, const unsigned char *out,
+                     unsigned char *ref_dyn, int count, int threshold, int accept)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        /* Exclude pixels from ref frame well below noise level. */
+        if (abs(ref[i] - virgin[i]) > threshold && smartmask_final[i]) {
+            if (ref_dyn[i] == 0) {            /* Always give new pixels a chance. */
+                ref_dyn[i] = 1;
+            } else if (ref_dyn[i] > accept) { /* Include static Object after some time. */
+                ref_dyn[i] = 0;
+                ref[i] = virgin[i];
+            } else if (out[i]) {
+                ref_dyn[i]++;                 /* Motionpixel? Keep excluding from ref frame. */
+            } else {
+                ref_dyn[i] = 0;               /* Nothing special - release pixel. */
+                ref[i] = (ref[i] + virgin[i]) / 2;
+            }
+        } else {                              /* No motion: copy to ref frame. */
+            ref_dyn[i] = 0;
+            ref[i] = virgin[i];
+        }
+    }
+}
+
+/**
+ * pack_c
+ *      Reference version of alg_simd_pack.
+ */
+static void pack_c(const unsigned char *img, uint64_t *bits, int width, int height, int stride)
+{
+    int x, y, b;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x += 64) {
+            uint64_t w = 0;
+
+            for (b = 0; b < 64 && x + b < width; b++) {
+                if (img[x + b])
+                    w |= 1ULL << b;
+            }
+            bits[x / 64] = w;
+        }
+        img += width;
+        bits += stride;
+    }
+}
+
+/**
+ * median_c
+ *      Reference version of alg_simd_update_median.
+ */
+static void median_c(unsigned char *ref, const unsigned char *virgin, const unsigned char *out,
+                     unsigned short *median, unsigned short *dev, unsigned char *noise_map, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        int v = virgin[i] << 8;
+        int m = median[i];
+        int step = out[i] ? BACKGROUND_STEP_MOTION : BACKGROUND_STEP;
+        int t;
+
+        /* Move the median towards the pixel, by at most step. */
+        if (v > m)
+            m += (v - m < step) ? v - m : step;
+        else
+            m -= (m - v < step) ? m - v : step;
+
+        /* Same for the deviation and four times the distance to the new median. */
+        t = 4 * abs(v - m);
+        if (t > 65535)
+            t = 65535;
+
+        if (t > dev[i])
+            dev[i] += (t - dev[i] < BACKGROUND_DEV_STEP) ? t - dev[i] : BACKGROUND_DEV_STEP;
+        else
+            dev[i] -= (dev[i] - t < BACKGROUND_DEV_STEP) ? dev[i] - t : BACKGROUND_DEV_STEP;
+
+        median[i] = m;
+        ref[i] = (m + 128) >> 8;
+        noise_map[i] = dev[i] >> 8;
+    }
+}
+
+static int supported_c(void)
+{
+    return 1;
+}
+
+#ifdef ALG_SIMD_X86
+
+/*
+ * The x86 versions work on 16 (SSE2) or 32 (AVX2) pixels at a time.
+ *
+ * To avoid a div, the masked difference is compared as diff * mask against
+ * 255 * (noise + 1). As there is no unsigned compare for words, the compare
+ * is done by a saturated subtraction of 255 * noise + 254 followed by a test
+ * for zero. The unmasked difference is compared the same way on bytes. The
+ * result is a "motion flag" of 0x00 or 0xff for each pixel. With a noise map
+ * the limits are computed per pixel from max(noise, noise_map).
+ */
+__attribute__((target("sse2")))
+static int diff_sse2(const unsigned char *ref, const unsigned char *new,
+                     unsigned char *out, const unsigned char *mask, const unsigned char *noise_map,
+                     const unsigned char *smartmask_final, unsigned short *smartmask_buffer,
+                     int count, int noise, int flags)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i incr = _mm_set1_epi16(SMARTMASK_SENSITIVITY_INCR);
+    const __m128i noise8 = _mm_set1_epi8((char)noise);
+    const __m128i limit16 = _mm_set1_epi16((short)(unsigned short)(noise * 255 + 254));
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i c254 = _mm_set1_epi16(254);
+    __m128i acc = zero;
+    int i, diffs;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m128i r = _mm_loadu_si128((const __m128i *)(ref + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(r, n), _mm_subs_epu8(n, r));
+        __m128i t = noise8;
+        __m128i f;
+
+        if (noise_map)
+            t = _mm_max_epu8(t, _mm_loadu_si128((const __m128i *)(noise_map + i)));
+
+        if (mask) {
+            __m128i m = _mm_loadu_si128((const __m128i *)(mask + i));
+            __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(m, zero));
+            __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(m, zero));
+            __m128i limlo = limit16, limhi = limit16;
+
+            if (noise_map) {
+                limlo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(t, zero), c255), c254);
+                limhi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(t, zero), c255), c254);
+            }
+
+            lo = _mm_cmpeq_epi16(_mm_subs_epu16(lo, limlo), zero);
+            hi = _mm_cmpeq_epi16(_mm_subs_epu16(hi, limhi), zero);
+            f = _mm_packs_epi16(lo, hi);
+        } else {
+            f = _mm_cmpeq_epi8(_mm_subs_epu8(d, t), zero);
+        }
+        /* f is 0xff where there is no motion, invert it. */
+        f = _mm_cmpeq_epi8(f, zero);
+
+        if ((flags & ALG_DIFF_SMARTMASK_INCR) && _mm_movemask_epi8(f)) {
+            __m128i *buf = (__m128i *)(smartmask_buffer + i);
+
+            _mm_storeu_si128(buf, _mm_adds_epu16(_mm_loadu_si128(buf),
+                             _mm_and_si128(_mm_unpacklo_epi8(f, f), incr)));
+            _mm_storeu_si128(buf + 1, _mm_adds_epu16(_mm_loadu_si128(buf + 1),
+                             _mm_and_si128(_mm_unpackhi_epi8(f, f), incr)));
+        }
+
+        if (flags & ALG_DIFF_SMARTMASK) {
+            __m128i s = _mm_loadu_si128((const __m128i *)(smartmask_final + i));
+            f = _mm_andnot_si128(_mm_cmpeq_epi8(s, zero), f);
+        }
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(f, n));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_and_si128(f, ones), zero));
+    }
+
+    diffs = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+
+    if (i < count)
+        diffs += diff_c(ref + i, new + i, out + i, mask ? mask + i : NULL,
+                        noise_map ? noise_map + i : NULL, smartmask_final + i, smartmask_buffer + i,
+                        count - i, noise, flags);
+
+    return diffs;
+}
+
+__attribute__((target("sse2")))
+static int count_sse2(const unsigned char *ref, const unsigned char *new,
+                      int stride, int width, int height, int noise)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i noise8 = _mm_set1_epi8((char)noise);
+    __m128i acc = zero;
+    int x, y, w16 = width & ~15, diffs;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < w16; x += 16) {
+            __m128i r = _mm_loadu_si128((const __m128i *)(ref + x));
+            __m128i n = _mm_loadu_si128((const __m128i *)(new + x));
+            __m128i d = _mm_or_si128(_mm_subs_epu8(r, n), _mm_subs_epu8(n, r));
+            __m128i f = _mm_cmpeq_epi8(_mm_subs_epu8(d, noise8), zero);
+
+            /* f is 0xff where there is no motion, so count those and subtract. */
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_and_si128(f, ones), zero));
+        }
+        ref += stride;
+        new += stride;
+    }
+
+    diffs = w16 * height - _mm_cvtsi128_si32(acc) - _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+
+    if (w16 < width)
+        diffs += count_c(ref - height * stride + w16, new - height * stride + w16,
+                         stride, width - w16, height, noise);
+
+    return diffs;
+}
+
+/*
+ * The reference frame update evaluates all branches of update_c for every
+ * pixel and selects the result with masks:
+ *   hold - new pixel, or motion pixel that is still below the accept time:
+ *          keep ref, ref_dyn becomes 1 or is increased.
+ *   avg  - changed pixel without motion: ref becomes the (rounded down)
+ *          average of ref and virgin, ref_dyn is cleared.
+ *   all other pixels copy virgin and clear ref_dyn.
+ */
+__attribute__((target("sse2")))
+static void update_sse2(unsigned char *ref, const unsigned char *virgin,
+                        const unsigned char *smartmask_final, const unsigned char *out,
+                        unsigned char *ref_dyn, int count, int threshold, int accept)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i low7 = _mm_set1_epi8(0x7f);
+    const __m128i threshold8 = _mm_set1_epi8((char)threshold);
+    const __m128i accept8 = _mm_set1_epi8((char)accept);
+    int i;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m128i r = _mm_loadu_si128((const __m128i *)(ref + i));
+        __m128i v = _mm_loadu_si128((const __m128i *)(virgin + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(smartmask_final + i));
+        __m128i o = _mm_loadu_si128((const __m128i *)(out + i));
+        __m128i dyn = _mm_loadu_si128((const __m128i *)(ref_dyn + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(r, v), _mm_subs_epu8(v, r));
+        /* 0xff where the pixel is simply copied from virgin */
+        __m128i copy = _mm_or_si128(_mm_cmpeq_epi8(_mm_subs_epu8(d, threshold8), zero),
+                                    _mm_cmpeq_epi8(s, zero));
+        __m128i dyn0 = _mm_cmpeq_epi8(dyn, zero);
+        __m128i below = _mm_cmpeq_epi8(_mm_subs_epu8(dyn, accept8), zero);
+        __m128i out0 = _mm_cmpeq_epi8(o, zero);
+        __m128i live = _mm_andnot_si128(copy, _mm_andnot_si128(dyn0, below));
+        __m128i first = _mm_andnot_si128(copy, dyn0);
+        __m128i motion = _mm_andnot_si128(out0, live);
+        __m128i avg = _mm_and_si128(out0, live);
+        __m128i hold = _mm_or_si128(first, motion);
+        __m128i half = _mm_add_epi8(_mm_and_si128(r, v),
+                                    _mm_and_si128(_mm_srli_epi16(_mm_xor_si128(r, v), 1), low7));
+
+        dyn = _mm_or_si128(_mm_and_si128(first, ones), _mm_and_si128(motion, _mm_adds_epu8(dyn, ones)));
+        r = _mm_or_si128(_mm_and_si128(hold, r),
+                         _mm_or_si128(_mm_and_si128(avg, half),
+                                      _mm_andnot_si128(_mm_or_si128(hold, avg), v)));
+
+        _mm_storeu_si128((__m128i *)(ref + i), r);
+        _mm_storeu_si128((__m128i *)(ref_dyn + i), dyn);
+    }
+
+    if (i < count)
+        update_c(ref + i, virgin + i, smartmask_final + i, out + i, ref_dyn + i,
+                 count - i, threshold, accept);
+}
+
+/*
+ * movemask collects the top bit of every byte, which is exactly one bit per
+ * pixel in the right order. Partial words at the end of a line are left to
+ * the C version.
+ */
+__attribute__((target("sse2")))
+static void pack_sse2(const unsigned char *img, uint64_t *bits, int width, int height, int stride)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x, y, k, w64 = width & ~63;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < w64; x += 64) {
+            uint64_t w = 0;
+
+            for (k = 0; k < 4; k++) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(img + x + 16 * k));
+                unsigned int m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xffff;
+
+                w |= (uint64_t)m << (16 * k);
+            }
+            bits[x / 64] = w;
+        }
+        if (w64 < width)
+            pack_c(img + w64, bits + w64 / 64, width - w64, 1, stride);
+        img += width;
+        bits += stride;
+    }
+}
+
+/*
+ * The median update works on words. SSE2 has no unsigned word minimum,
+ * min(a, b) is computed as a - subs(a, b). Only one of the saturated
+ * differences towards the target is non zero, so adding one and
+ * subtracting the other moves by at most step without overflow.
+ */
+__attribute__((target("sse2")))
+static void median_sse2(unsigned char *ref, const unsigned char *virgin, const unsigned char *out,
+                        unsigned short *median, unsigned short *dev, unsigned char *noise_map, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i step_still = _mm_set1_epi16(BACKGROUND_STEP);
+    const __m128i step_motion = _mm_set1_epi16(BACKGROUND_STEP_MOTION);
+    const __m128i dev_step = _mm_set1_epi16(BACKGROUND_DEV_STEP);
+    const __m128i round = _mm_set1_epi16(128);
+    int i, k;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(virgin + i));
+        __m128i still = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(out + i)), zero);
+        __m128i r[2], nm[2];
+
+        for (k = 0; k < 2; k++) {
+            __m128i *mp = (__m128i *)(median + i + 8 * k);
+            __m128i *dp = (__m128i *)(dev + i + 8 * k);
+            __m128i v16 = k ? _mm_unpackhi_epi8(zero, v) : _mm_unpacklo_epi8(zero, v);
+            __m128i s16 = k ? _mm_unpackhi_epi8(still, still) : _mm_unpacklo_epi8(still, still);
+            __m128i step = _mm_or_si128(_mm_and_si128(s16, step_still), _mm_andnot_si128(s16, step_motion));
+            __m128i m = _mm_loadu_si128(mp);
+            __m128i d = _mm_loadu_si128(dp);
+            __m128i up = _mm_subs_epu16(v16, m);
+            __m128i down = _mm_subs_epu16(m, v16);
+            __m128i t;
+
+            up = _mm_sub_epi16(up, _mm_subs_epu16(up, step));
+            down = _mm_sub_epi16(down, _mm_subs_epu16(down, step));
+            m = _mm_sub_epi16(_mm_add_epi16(m, up), down);
+
+            t = _mm_or_si128(_mm_subs_epu16(v16, m), _mm_subs_epu16(m, v16));
+            t = _mm_adds_epu16(t, t);
+            t = _mm_adds_epu16(t, t);
+            up = _mm_subs_epu16(t, d);
+            down = _mm_subs_epu16(d, t);
+            up = _mm_sub_epi16(up, _mm_subs_epu16(up, dev_step));
+            down = _mm_sub_epi16(down, _mm_subs_epu16(down, dev_step));
+            d = _mm_sub_epi16(_mm_add_epi16(d, up), down);
+
+            _mm_storeu_si128(mp, m);
+            _mm_storeu_si128(dp, d);
+            r[k] = _mm_srli_epi16(_mm_add_epi16(m, round), 8);
+            nm[k] = _mm_srli_epi16(d, 8);
+        }
+
+        _mm_storeu_si128((__m128i *)(ref + i), _mm_packus_epi16(r[0], r[1]));
+        _mm_storeu_si128((__m128i *)(noise_map + i), _mm_packus_epi16(nm[0], nm[1]));
+    }
+
+    if (i < count)
+        median_c(ref + i, virgin + i, out + i, median + i, dev + i, noise_map + i, count - i);
+}
+
+static int supported_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("avx2")))
+static int diff_avx2(const unsigned char *ref, const unsigned char *new,
+                     unsigned char *out, const unsigned char *mask, const unsigned char *noise_map,
+                     const unsigned char *smartmask_final, unsigned short *smartmask_buffer,
+                     int count, int noise, int flags)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i incr = _mm256_set1_epi16(SMARTMASK_SENSITIVITY_INCR);
+    const __m256i noise8 = _mm256_set1_epi8((char)noise);
+    const __m256i limit16 = _mm256_set1_epi16((short)(unsigned short)(noise * 255 + 254));
+    const __m256i c255 = _mm256_set1_epi16(255);
+    const __m256i c254 = _mm256_set1_epi16(254);
+    __m256i acc = zero;
+    __m128i sum;
+    int i, diffs;
+
+    for (i = 0; i + 32 <= count; i += 32) {
+        __m256i r = _mm256_loadu_si256((const __m256i *)(ref + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new + i));
+        __m256i d = _mm256_or_si256(_mm256_subs_epu8(r, n), _mm256_subs_epu8(n, r));
+        __m256i t = noise8;
+        __m256i f;
+
+        if (noise_map)
+            t = _mm256_max_epu8(t, _mm256_loadu_si256((const __m256i *)(noise_map + i)));
+
+        if (mask) {
+            __m256i m = _mm256_loadu_si256((const __m256i *)(mask + i));
+            /* unpack and pack work per 128 bit lane, so the pixel order is kept */
+            __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(m, zero));
+            __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(m, zero));
+            __m256i limlo = limit16, limhi = limit16;
+
+            if (noise_map) {
+                limlo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(t, zero), c255), c254);
+                limhi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(t, zero), c255), c254);
+            }
+
+            lo = _mm256_cmpeq_epi16(_mm256_subs_epu16(lo, limlo), zero);
+            hi = _mm256_cmpeq_epi16(_mm256_subs_epu16(hi, limhi), zero);
+            f = _mm256_packs_epi16(lo, hi);
+        } else {
+            f = _mm256_cmpeq_epi8(_mm256_subs_epu8(d, t), zero);
+        }
+        f = _mm256_cmpeq_epi8(f, zero);
+
+        if ((flags & ALG_DIFF_SMARTMASK_INCR) && _mm256_movemask_epi8(f)) {
+            __m128i flo = _mm256_castsi256_si128(f);
+            __m128i fhi = _mm256_extracti128_si256(f, 1);
+            __m256i *buf = (__m256i *)(smartmask_buffer + i);
+
+            _mm256_storeu_si256(buf, _mm256_adds_epu16(_mm256_loadu_si256(buf),
+                                _mm256_and_si256(_mm256_cvtepi8_epi16(flo), incr)));
+            _mm256_storeu_si256(buf + 1, _mm256_adds_epu16(_mm256_loadu_si256(buf + 1),
+                                _mm256_and_si256(_mm256_cvtepi8_epi16(fhi), incr)));
+        }
+
+        if (flags & ALG_DIFF_SMARTMASK) {
+            __m256i s = _mm256_loadu_si256((const __m256i *)(smartmask_final + i));
+            f = _mm256_andnot_si256(_mm256_cmpeq_epi8(s, zero), f);
+        }
+
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_and_si256(f, n));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_and_si256(f, ones), zero));
+    }
+
+    sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    diffs = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+
+    if (i < count)
+        diffs += diff_sse2(ref + i, new + i, out + i, mask ? mask + i : NULL,
+                           noise_map ? noise_map + i : NULL, smartmask_final + i, smartmask_buffer + i,
+                           count - i, noise, flags);
+
+    return diffs;
+}
+
+__attribute__((target("avx2")))
+static int count_avx2(const unsigned char *ref, const unsigned char *new,
+                      int stride, int width, int height, int noise)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i noise8 = _mm256_set1_epi8((char)noise);
+    __m256i acc = zero;
+    __m128i sum;
+    int x, y, w32 = width & ~31, diffs;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < w32; x += 32) {
+            __m256i r = _mm256_loadu_si256((const __m256i *)(ref + x));
+            __m256i n = _mm256_loadu_si256((const __m256i *)(new + x));
+            __m256i d = _mm256_or_si256(_mm256_subs_epu8(r, n), _mm256_subs_epu8(n, r));
+            __m256i f = _mm256_cmpeq_epi8(_mm256_subs_epu8(d, noise8), zero);
+
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_and_si256(f, ones), zero));
+        }
+        ref += stride;
+        new += stride;
+    }
+
+    sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    diffs = w32 * height - _mm_cvtsi128_si32(sum) - _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+
+    if (w32 < width)
+        diffs += count_sse2(ref - height * stride + w32, new - height * stride + w32,
+                            stride, width - w32, height, noise);
+
+    return diffs;
+}
+
+__attribute__((target("avx2")))
+static void update_avx2(unsigned char *ref, const unsigned char *virgin,
+                        const unsigned char *smartmask_final, const unsigned char *out,
+                        unsigned char *ref_dyn, int count, int threshold, int accept)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i low7 = _mm256_set1_epi8(0x7f);
+    const __m256i threshold8 = _mm256_set1_epi8((char)threshold);
+    const __m256i accept8 = _mm256_set1_epi8((char)accept);
+    int i;
+
+    for (i = 0; i + 32 <= count; i += 32) {
+        __m256i r = _mm256_loadu_si256((const __m256i *)(ref + i));
+        __m256i v = _mm256_loadu_si256((const __m256i *)(virgin + i));
+        __m256i s = _mm256_loadu_si256((const __m256i *)(smartmask_final + i));
+        __m256i o = _mm256_loadu_si256((const __m256i *)(out + i));
+        __m256i dyn = _mm256_loadu_si256((const __m256i *)(ref_dyn + i));
+        __m256i d = _mm256_or_si256(_mm256_subs_epu8(r, v), _mm256_subs_epu8(v, r));
+        __m256i copy = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(d, threshold8), zero),
+                                       _mm256_cmpeq_epi8(s, zero));
+        __m256i dyn0 = _mm256_cmpeq_epi8(dyn, zero);
+        __m256i below = _mm256_cmpeq_epi8(_mm256_subs_epu8(dyn, accept8), zero);
+        __m256i out0 = _mm256_cmpeq_epi8(o, zero);
+        __m256i live = _mm256_andnot_si256(copy, _mm256_andnot_si256(dyn0, below));
+        __m256i first = _mm256_andnot_si256(copy, dyn0);
+        __m256i motion = _mm256_andnot_si256(out0, live);
+        __m256i avg = _mm256_and_si256(out0, live);
+        __m256i hold = _mm256_or_si256(first, motion);
+        __m256i half = _mm256_add_epi8(_mm256_and_si256(r, v),
+                                       _mm256_and_si256(_mm256_srli_epi16(_mm256_xor_si256(r, v), 1), low7));
+
+        dyn = _mm256_or_si256(_mm256_and_si256(first, ones),
+                              _mm256_and_si256(motion, _mm256_adds_epu8(dyn, ones)));
+        r = _mm256_or_si256(_mm256_and_si256(hold, r),
+                            _mm256_or_si256(_mm256_and_si256(avg, half),
+                                            _mm256_andnot_si256(_mm256_or_si256(hold, avg), v)));
+
+        _mm256_storeu_si256((__m256i *)(ref + i), r);
+        _mm256_storeu_si256((__m256i *)(ref_dyn + i), dyn);
+    }
+
+    if (i < count)
+        update_sse2(ref + i, virgin + i, smartmask_final + i, out + i, ref_dyn + i,
+                    count - i, threshold, accept);
+}
+
+__attribute__((target("avx2")))
+static void pack_avx2(const unsigned char *img, uint64_t *bits, int width, int height, int stride)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int x, y, w64 = width & ~63;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < w64; x += 64) {
+            __m256i lo = _mm256_loadu_si256((const __m256i *)(img + x));
+            __m256i hi = _mm256_loadu_si256((const __m256i *)(img + x + 32));
+            uint32_t mlo = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zero));
+            uint32_t mhi = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, zero));
+
+            bits[x / 64] = (uint64_t)mhi << 32 | mlo;
+        }
+        if (w64 < width)
+            pack_c(img + w64, bits + w64 / 64, width - w64, 1, stride);
+        img += width;
+        bits += stride;
+    }
+}
+
+/*
+ * Same as median_sse2 on 16 pixels at a time. The pixels are widened with
+ * cvtepu8 so the words are in memory order, unlike with unpack.
+ */
+__attribute__((target("avx2")))
+static void median_avx2(unsigned char *ref, const unsigned char *virgin, const unsigned char *out,
+                        unsigned short *median, unsigned short *dev, unsigned char *noise_map, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m256i step_still = _mm256_set1_epi16(BACKGROUND_STEP);
+    const __m256i step_motion = _mm256_set1_epi16(BACKGROUND_STEP_MOTION);
+    const __m256i dev_step = _mm256_set1_epi16(BACKGROUND_DEV_STEP);
+    const __m256i round = _mm256_set1_epi16(128);
+    int i;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m128i still = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(out + i)), zero);
+        __m256i v16 = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(virgin + i))), 8);
+        __m256i s16 = _mm256_cvtepi8_epi16(still);
+        __m256i step = _mm256_blendv_epi8(step_motion, step_still, s16);
+        __m256i m = _mm256_loadu_si256((const __m256i *)(median + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dev + i));
+        __m256i up = _mm256_min_epu16(_mm256_subs_epu16(v16, m), step);
+        __m256i down = _mm256_min_epu16(_mm256_subs_epu16(m, v16), step);
+        __m256i t, r, nm;
+
+        m = _mm256_sub_epi16(_mm256_add_epi16(m, up), down);
+
+        t = _mm256_or_si256(_mm256_subs_epu16(v16, m), _mm256_subs_epu16(m, v16));
+        t = _mm256_adds_epu16(t, t);
+        t = _mm256_adds_epu16(t, t);
+        up = _mm256_min_epu16(_mm256_subs_epu16(t, d), dev_step);
+        down = _mm256_min_epu16(_mm256_subs_epu16(d, t), dev_step);
+        d = _mm256_sub_epi16(_mm256_add_epi16(d, up), down);
+
+        _mm256_storeu_si256((__m256i *)(median + i), m);
+        _mm256_storeu_si256((__m256i *)(dev + i), d);
+
+        r = _mm256_srli_epi16(_mm256_add_epi16(m, round), 8);
+        nm = _mm256_srli_epi16(d, 8);
+        _mm_storeu_si128((__m128i *)(ref + i),
+                         _mm_packus_epi16(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1)));
+        _mm_storeu_si128((__m128i *)(noise_map + i),
+                         _mm_packus_epi16(_mm256_castsi256_si128(nm), _mm256_extracti128_si256(nm, 1)));
+    }
+
+    if (i < count)
+        median_c(ref + i, virgin + i, out + i, median + i, dev + i, noise_map + i, count - i);
+}
+
+static int supported_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif /* ALG_SIMD_X86 */
+
+#ifdef ALG_SIMD_NEON
+
+/*
+ * NEON has unsigned compares, so the masked difference is compared directly
+ * as diff * mask >= 255 * (noise + 1).
+ */
+static int diff_neon(const unsigned char *ref, const unsigned char *new,
+                     unsigned char *out, const unsigned char *mask, const unsigned char *noise_map,
+                     const unsigned char *smartmask_final, unsigned short *smartmask_buffer,
+                     int count, int noise, int flags)
+{
+    const uint8x16_t ones = vdupq_n_u8(1);
+    const uint16x8_t incr = vdupq_n_u16(SMARTMASK_SENSITIVITY_INCR);
+    const uint8x16_t noise8 = vdupq_n_u8((uint8_t)noise);
+    const uint16x8_t limit16 = vdupq_n_u16((uint16_t)(noise * 255 + 255));
+    const uint8x8_t c255 = vdup_n_u8(255);
+    const uint16x8_t c255w = vdupq_n_u16(255);
+    uint32x4_t acc = vdupq_n_u32(0);
+    int i, diffs;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        uint8x16_t r = vld1q_u8(ref + i);
+        uint8x16_t n = vld1q_u8(new + i);
+        uint8x16_t d = vabdq_u8(r, n);
+        uint8x16_t t = noise8;
+        uint8x16_t f;
+
+        if (noise_map)
+            t = vmaxq_u8(t, vld1q_u8(noise_map + i));
+
+        if (mask) {
+            uint8x16_t m = vld1q_u8(mask + i);
+            uint16x8_t lo = vmull_u8(vget_low_u8(d), vget_low_u8(m));
+            uint16x8_t hi = vmull_u8(vget_high_u8(d), vget_high_u8(m));
+            uint16x8_t limlo = limit16, limhi = limit16;
+
+            if (noise_map) {
+                limlo = vmlal_u8(c255w, vget_low_u8(t), c255);
+                limhi = vmlal_u8(c255w, vget_high_u8(t), c255);
+            }
+
+            f = vcombine_u8(vmovn_u16(vcgeq_u16(lo, limlo)),
+                            vmovn_u16(vcgeq_u16(hi, limhi)));
+        } else {
+            f = vcgtq_u8(d, t);
+        }
+
+        if (flags & ALG_DIFF_SMARTMASK_INCR) {
+            uint64x2_t any = vreinterpretq_u64_u8(f);
+
+            if (vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) {
+                int8x16_t sf = vreinterpretq_s8_u8(f);
+                uint16x8_t wlo = vreinterpretq_u16_s16(vmovl_s8(vget_low_s8(sf)));
+                uint16x8_t whi = vreinterpretq_u16_s16(vmovl_s8(vget_high_s8(sf)));
+                unsigned short *buf = smartmask_buffer + i;
+
+                vst1q_u16(buf, vqaddq_u16(vld1q_u16(buf), vandq_u16(wlo, incr)));
+                vst1q_u16(buf + 8, vqaddq_u16(vld1q_u16(buf + 8), vandq_u16(whi, incr)));
+            }
+        }
+
+        if (flags & ALG_DIFF_SMARTMASK) {
+            uint8x16_t s = vld1q_u8(smartmask_final + i);
+            f = vandq_u8(f, vtstq_u8(s, s));
+        }
+
+        vst1q_u8(out + i, vandq_u8(f, n));
+        acc = vpadalq_u16(acc, vpaddlq_u8(vandq_u8(f, ones)));
+    }
+
+    diffs = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+            vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+
+    if (i < count)
+        diffs += diff_c(ref + i, new + i, out + i, mask ? mask + i : NULL,
+                        noise_map ? noise_map + i : NULL, smartmask_final + i, smartmask_buffer + i,
+                        count - i, noise, flags);
+
+    return diffs;
+}
+
+static int count_neon(const unsigned char *ref, const unsigned char *new,
+                      int stride, int width, int height, int noise)
+{
+    const uint8x16_t ones = vdupq_n_u8(1);
+    const uint8x16_t noise8 = vdupq_n_u8((uint8_t)noise);
+    uint32x4_t acc = vdupq_n_u32(0);
+    int x, y, w16 = width & ~15, diffs;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < w16; x += 16) {
+            uint8x16_t d = vabdq_u8(vld1q_u8(ref + x), vld1q_u8(new + x));
+
+            acc = vpadalq_u16(acc, vpaddlq_u8(vandq_u8(vcgtq_u8(d, noise8), ones)));
+        }
+        ref += stride;
+        new += stride;
+    }
+
+    diffs = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+            vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+
+    if (w16 < width)
+        diffs += count_c(ref - height * stride + w16, new - height * stride + w16,
+                         stride, width - w16, height, noise);
+
+    return diffs;
+}
+
+static void update_neon(unsigned char *ref, const unsigned char *virgin,
+                        const unsigned char *smartmask_final, const unsigned char *out,
+                        unsigned char *ref_dyn, int count, int threshold, int accept)
+{
+    const uint8x16_t ones = vdupq_n_u8(1);
+    const uint8x16_t threshold8 = vdupq_n_u8((uint8_t)threshold);
+    const uint8x16_t accept8 = vdupq_n_u8((uint8_t)accept);
+    int i;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        uint8x16_t r = vld1q_u8(ref + i);
+        uint8x16_t v = vld1q_u8(virgin + i);
+        uint8x16_t s = vld1q_u8(smartmask_final + i);
+        uint8x16_t o = vld1q_u8(out + i);
+        uint8x16_t dyn = vld1q_u8(ref_dyn + i);
+        uint8x16_t changed = vandq_u8(vcgtq_u8(vabdq_u8(r, v), threshold8), vtstq_u8(s, s));
+        uint8x16_t dyn0 = vceqq_u8(dyn, vdupq_n_u8(0));
+        uint8x16_t live = vbicq_u8(vbicq_u8(changed, dyn0), vcgtq_u8(dyn, accept8));
+        uint8x16_t first = vandq_u8(changed, dyn0);
+        uint8x16_t motion = vandq_u8(live, vtstq_u8(o, o));
+        uint8x16_t avg = vbicq_u8(live, vtstq_u8(o, o));
+
+        dyn = vorrq_u8(vandq_u8(first, ones), vandq_u8(motion, vqaddq_u8(dyn, ones)));
+        r = vbslq_u8(vorrq_u8(first, motion), r, vbslq_u8(avg, vhaddq_u8(r, v), v));
+
+        vst1q_u8(ref + i, r);
+        vst1q_u8(ref_dyn + i, dyn);
+    }
+
+    if (i < count)
+        update_c(ref + i, virgin + i, smartmask_final + i, out + i, ref_dyn + i,
+                 count - i, threshold, accept);
+}
+
+/*
+ * NEON has no movemask. The bytes are reduced to bits by masking each one
+ * with its bit value within a group of 8 and adding the groups up with
+ * pairwise adds, which unlike vaddv are there on ARMv7 as well. Three
+ * rounds of them leave the 8 bytes of the word in order.
+ */
+static void pack_neon(const unsigned char *img, uint64_t *bits, int width, int height, int stride)
+{
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t weight = vld1q_u8(weights);
+    int x, y, k, w64 = width & ~63;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < w64; x += 64) {
+            uint8x8_t sum[4];
+
+            for (k = 0; k < 4; k++) {
+                uint8x16_t v = vld1q_u8(img + x + 16 * k);
+                uint8x16_t m = vandq_u8(vtstq_u8(v, v), weight);
+
+                sum[k] = vpadd_u8(vget_low_u8(m), vget_high_u8(m));
+            }
+            sum[0] = vpadd_u8(vpadd_u8(sum[0], sum[1]), vpadd_u8(sum[2], sum[3]));
+            bits[x / 64] = vget_lane_u64(vreinterpret_u64_u8(sum[0]), 0);
+        }
+        if (w64 < width)
+            pack_c(img + w64, bits + w64 / 64, width - w64, 1, stride);
+        img += width;
+        bits += stride;
+    }
+}
+
+static void median_neon(unsigned char *ref, const unsigned char *virgin, const unsigned char *out,
+                        unsigned short *median, unsigned short *dev, unsigned char *noise_map, int count)
+{
+    const uint16x8_t step_still = vdupq_n_u16(BACKGROUND_STEP);
+    const uint16x8_t step_motion = vdupq_n_u16(BACKGROUND_STEP_MOTION);
+    const uint16x8_t dev_step = vdupq_n_u16(BACKGROUND_DEV_STEP);
+    int i, k;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        uint8x16_t v = vld1q_u8(virgin + i);
+        int8x16_t still = vreinterpretq_s8_u8(vceqq_u8(vld1q_u8(out + i), vdupq_n_u8(0)));
+        uint8x8_t r[2], nm[2];
+
+        for (k = 0; k < 2; k++) {
+            uint16x8_t v16 = vshll_n_u8(k ? vget_high_u8(v) : vget_low_u8(v), 8);
+            uint16x8_t s16 = vreinterpretq_u16_s16(vmovl_s8(k ? vget_high_s8(still) : vget_low_s8(still)));
+            uint16x8_t step = vbslq_u16(s16, step_still, step_motion);
+            uint16x8_t m = vld1q_u16(median + i + 8 * k);
+            uint16x8_t d = vld1q_u16(dev + i + 8 * k);
+            uint16x8_t t;
+
+            m = vsubq_u16(vaddq_u16(m, vminq_u16(vqsubq_u16(v16, m), step)),
+                          vminq_u16(vqsubq_u16(m, v16), step));
+
+            t = vabdq_u16(v16, m);
+            t = vqshlq_n_u16(t, 2);
+            d = vsubq_u16(vaddq_u16(d, vminq_u16(vqsubq_u16(t, d), dev_step)),
+                          vminq_u16(vqsubq_u16(d, t), dev_step));
+
+            vst1q_u16(median + i + 8 * k, m);
+            vst1q_u16(dev + i + 8 * k, d);
+            r[k] = vrshrn_n_u16(m, 8);
+            nm[k] = vshrn_n_u16(d, 8);
+        }
+
+        vst1q_u8(ref + i, vcombine_u8(r[0], r[1]));
+        vst1q_u8(noise_map + i, vcombine_u8(nm[0], nm[1]));
+    }
+
+    if (i < count)
+        median_c(ref + i, virgin + i, out + i, median + i, dev + i, noise_map + i, count - i);
+}
+
+static int supported_neon(void)
+{
+    return 1;
+}
+
+#endif /* ALG_SIMD_NEON */
+
+/* Candidate kernels, best first. The last one is always the C version. */
+static const struct alg_simd_kernel simd_kernels[] = {
+#ifdef ALG_SIMD_X86
+    { "avx2", supported_avx2, diff_avx2, count_avx2, update_avx2, pack_avx2, median_avx2 },
+    { "sse2", supported_sse2, diff_sse2, count_sse2, update_sse2, pack_sse2, median_sse2 },
+#endif
+#ifdef ALG_SIMD_NEON
+    { "neon", supported_neon, diff_neon, count_neon, update_neon, pack_neon, median_neon },
+#endif
+    { "c",    supported_c,    diff_c,    count_c,    update_c,    pack_c,    median_c    }
+};
+
+#define SIMD_KERNEL_COUNT (int)(sizeof(simd_kernels) / sizeof(simd_kernels[0]))
+
+static const struct alg_simd_kernel *simd_kernel = &simd_kernels[SIMD_KERNEL_COUNT - 1];
+
+/* Pixels in the synthetic verification frame. Deliberately not a multiple of 32. */
+#define SIMD_VERIFY_SIZE 4123
+
+/**
+ * simd_verify_update
+ *      Runs the reference frame update of a kernel and the C version on
+ *      frames with every ref_dyn value and threshold/accept edge cases.
+ *
+ * Returns: 1 if the results are identical, 0 otherwise.
+ */
+static int simd_verify_update(const struct alg_simd_kernel *kernel)
+{
+    static const int thresholds[] = { 0, 1, 6, 51, 254, 255 };
+    static const int accepts[] = { 0, 1, 30, 254 };
+    unsigned char *buf = mymalloc(SIMD_VERIFY_SIZE * 7);
+    unsigned char *virgin = buf, *smartmask = virgin + SIMD_VERIFY_SIZE;
+    unsigned char *out = smartmask + SIMD_VERIFY_SIZE;
+    unsigned char *ref_c = out + SIMD_VERIFY_SIZE, *ref_k = ref_c + SIMD_VERIFY_SIZE;
+    unsigned char *dyn_c = ref_k + SIMD_VERIFY_SIZE, *dyn_k = dyn_c + SIMD_VERIFY_SIZE;
+    unsigned int seed = 54321;
+    int i, t, a, ok = 1;
+
+    for (t = 0; t < (int)(sizeof(thresholds) / sizeof(thresholds[0])) && ok; t++) {
+        for (a = 0; a < (int)(sizeof(accepts) / sizeof(accepts[0])) && ok; a++) {
+            for (i = 0; i < SIMD_VERIFY_SIZE; i++) {
+                seed = seed * 1103515245 + 12345;
+                ref_c[i] = ref_k[i] = seed >> 16;
+                virgin[i] = (i % 5) ? ref_c[i] + (int)((seed >> 8) % 61) - 30 : seed >> 24;
+                smartmask[i] = (i % 11) ? 255 : 0;
+                out[i] = (i % 3) ? virgin[i] : 0;
+                dyn_c[i] = dyn_k[i] = (i % 2) ? i & 0xff : (i >> 1) % (accepts[a] + 2);
+            }
+
+            update_c(ref_c, virgin, smartmask, out, dyn_c, SIMD_VERIFY_SIZE,
+                     thresholds[t], accepts[a]);
+            kernel->update(ref_k, virgin, smartmask, out, dyn_k, SIMD_VERIFY_SIZE,
+                           thresholds[t], accepts[a]);
+
+            if (memcmp(ref_c, ref_k, SIMD_VERIFY_SIZE) || memcmp(dyn_c, dyn_k, SIMD_VERIFY_SIZE)) {
+                MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Kernel %s reference update differs "
+                           "from C version (threshold %d, accept %d)", kernel->name,
+                           thresholds[t], accepts[a]);
+                ok = 0;
+            }
+        }
+    }
+
+    free(buf);
+
+    return ok;
+}
+
+/**
+ * simd_verify_median
+ *      Runs the background median update of a kernel and the C version a few
+ *      times on the same frames, with states at the ends of their ranges.
+ *
+ * Returns: 1 if the results are identical, 0 otherwise.
+ */
+static int simd_verify_median(const struct alg_simd_kernel *kernel)
+{
+    unsigned char *buf = mymalloc(SIMD_VERIFY_SIZE * 6);
+    unsigned short *state = mymalloc(SIMD_VERIFY_SIZE * 4 * sizeof(*state));
+    unsigned char *virgin = buf, *out = virgin + SIMD_VERIFY_SIZE;
+    unsigned char *ref_c = out + SIMD_VERIFY_SIZE, *ref_k = ref_c + SIMD_VERIFY_SIZE;
+    unsigned char *map_c = ref_k + SIMD_VERIFY_SIZE, *map_k = map_c + SIMD_VERIFY_SIZE;
+    unsigned short *med_c = state, *med_k = med_c + SIMD_VERIFY_SIZE;
+    unsigned short *dev_c = med_k + SIMD_VERIFY_SIZE, *dev_k = dev_c + SIMD_VERIFY_SIZE;
+    unsigned int seed = 24680;
+    int i, round, ok = 1;
+
+    /* The median never exceeds 255 << 8, the deviation can be anything. */
+    for (i = 0; i < SIMD_VERIFY_SIZE; i++) {
+        seed = seed * 1103515245 + 12345;
+        med_c[i] = med_k[i] = (i % 7) ? (seed >> 8) % (255 * 256 + 1) : (i % 2) * 255 * 256;
+        dev_c[i] = dev_k[i] = (i % 5) ? seed >> 16 : (i % 2) * 65535;
+    }
+
+    for (round = 0; round < 4 && ok; round++) {
+        for (i = 0; i < SIMD_VERIFY_SIZE; i++) {
+            seed = seed * 1103515245 + 12345;
+            virgin[i] = (i % 3) ? med_c[i] / 256 + (int)((seed >> 8) % 21) - 10 : seed >> 24;
+            out[i] = (i % 4) ? 0 : virgin[i] | 1;
+        }
+
+        median_c(ref_c, virgin, out, med_c, dev_c, map_c, SIMD_VERIFY_SIZE);
+        kernel->median(ref_k, virgin, out, med_k, dev_k, map_k, SIMD_VERIFY_SIZE);
+
+        if (memcmp(ref_c, ref_k, SIMD_VERIFY_SIZE) || memcmp(map_c, map_k, SIMD_VERIFY_SIZE) ||
+            memcmp(med_c, med_k, SIMD_VERIFY_SIZE * sizeof(*state)) ||
+            memcmp(dev_c, dev_k, SIMD_VERIFY_SIZE * sizeof(*state))) {
+            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Kernel %s median update differs "
+                       "from C version", kernel->name);
+            ok = 0;
+        }
+    }
+
+    free(state);
+    free(buf);
+
+    return ok;
+}
+
+/**
+ * simd_verify
+ *      Runs a kernel and the C version on the same pseudo random frames
+ *      with all combinations of mask, noise map, smartmask and noise edge
+ *      cases.
+ *
+ * Returns: 1 if the results are identical, 0 otherwise.
+ */
+static int simd_verify(const struct alg_simd_kernel *kernel)
+{
+    static const int noise_levels[] = { 0, 1, 17, 128, 254, 255 };
+    unsigned char *buf = mymalloc(SIMD_VERIFY_SIZE * 7);
+    unsigned short *smb = mymalloc(SIMD_VERIFY_SIZE * 2 * sizeof(*smb));
+    unsigned char *ref = buf, *new = ref + SIMD_VERIFY_SIZE;
+    unsigned char *mask = new + SIMD_VERIFY_SIZE;
+    unsigned char *noise_map = mask + SIMD_VERIFY_SIZE;
+    unsigned char *smartmask = noise_map + SIMD_VERIFY_SIZE;
+    unsigned char *out_c = smartmask + SIMD_VERIFY_SIZE;
+    unsigned char *out_k = out_c + SIMD_VERIFY_SIZE;
+    unsigned short *smb_c = smb, *smb_k = smb + SIMD_VERIFY_SIZE;
+    unsigned int seed = 12345;
+    int i, n, m, flags, ok = 1;
+
+    for (i = 0; i < SIMD_VERIFY_SIZE; i++) {
+        seed = seed * 1103515245 + 12345;
+        ref[i] = seed >> 16;
+        /* Mostly small differences with some large ones, in both directions. */
+        new[i] = (i % 7) ? ref[i] + (int)((seed >> 8) % 41) - 20 : seed >> 24;
+        mask[i] = (i % 5) ? (seed >> 4) & 0xff : ((i % 10) ? 255 : 0);
+        noise_map[i] = (i % 4) ? (seed >> 12) % 40 : (seed >> 20) & 0xff;
+        smartmask[i] = (i % 3) ? 255 : 0;
+    }
+
+    for (n = 0; n < (int)(sizeof(noise_levels) / sizeof(noise_levels[0])) && ok; n++) {
+        /* m bit 0 selects the mask, bit 1 the noise map */
+        for (m = 0; m < 4 && ok; m++) {
+            for (flags = 0; flags < 4 && ok; flags++) {
+                int diffs_c, diffs_k, above_c, above_k;
+
+                /* Include values close to 65535 to check the saturation. */
+                for (i = 0; i < SIMD_VERIFY_SIZE; i++)
+                    smb_c[i] = smb_k[i] = (i % 11) ? i : 65535 - i % 13;
+                memset(out_c, 0x55, SIMD_VERIFY_SIZE);
+                memset(out_k, 0xaa, SIMD_VERIFY_SIZE);
+
+                diffs_c = diff_c(ref, new, out_c, (m & 1) ? mask : NULL,
+                                 (m & 2) ? noise_map : NULL, smartmask, smb_c,
+                                 SIMD_VERIFY_SIZE, noise_levels[n], flags);
+                diffs_k = kernel->diff(ref, new, out_k, (m & 1) ? mask : NULL,
+                                       (m & 2) ? noise_map : NULL, smartmask, smb_k,
+                                       SIMD_VERIFY_SIZE, noise_levels[n], flags);
+
+                /* The count kernel is checked on an odd sized block with a stride. */
+                above_c = count_c(ref + 3, new + 3, 97, 88, 41, noise_levels[n]);
+                above_k = kernel->count(ref + 3, new + 3, 97, 88, 41, noise_levels[n]);
+
+                if (diffs_c != diffs_k || above_c != above_k ||
+                    memcmp(out_c, out_k, SIMD_VERIFY_SIZE) ||
+                    memcmp(smb_c, smb_k, SIMD_VERIFY_SIZE * sizeof(*smb))) {
+                    MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Kernel %s differs from C version "
+                               "(noise %d, mask %d, flags %d)", kernel->name,
+                               noise_levels[n], m, flags);
+                    ok = 0;
+                }
+            }
+        }
+    }
+
+    /* Pack a 200x20 block, which has a partial word at the end of each line. */
+    if (ok) {
+        uint64_t bits_c[4 * 20], bits_k[4 * 20];
+
+        memset(bits_c, 0x55, sizeof(bits_c));
+        memset(bits_k, 0x55, sizeof(bits_k));
+        pack_c(smartmask, bits_c, 200, 20, 4);
+        kernel->pack(smartmask, bits_k, 200, 20, 4);
+
+        if (memcmp(bits_c, bits_k, sizeof(bits_c))) {
+            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Kernel %s pack differs from C version",
+                       kernel->name);
+            ok = 0;
+        }
+    }
+
+    free(smb);
+    free(buf);
+
+    return ok && simd_verify_update(kernel) && simd_verify_median(kernel);
+}
+
+/**
+ * alg_simd_init
+ *
+ */
+void alg_simd_init(void)
+{
+    int i;
+
+    for (i = 0; i < SIMD_KERNEL_COUNT - 1; i++) {
+        if (simd_kernels[i].supported() && simd_verify(&simd_kernels[i]))
+            break;
+    }
+
+    simd_kernel = &simd_kernels[i];
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Using %s motion detection kernels",
+               simd_kernel->name);
+}
+
+/**
+ * alg_simd_name
+ *
+ */
+const char *alg_simd_name(void)
+{
+    return simd_kernel->name;
+}
+
+/**
+ * alg_simd_select
+ *
+ */
+int alg_simd_select(const char *name)
+{
+    int i;
+
+    for (i = 0; i < SIMD_KERNEL_COUNT; i++) {
+        if (!strcmp(simd_kernels[i].name, name) && simd_kernels[i].supported()) {
+            simd_kernel = &simd_kernels[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * alg_simd_diff
+ *
+ */
+int alg_simd_diff(const unsigned char *ref, const unsigned char *new,
+                  unsigned char *out, const unsigned char *mask, const unsigned char *noise_map,
+                  const unsigned char *smartmask_final, unsigned short *smartmask_buffer,
+                  int count, int noise, int flags)
+{
+    /*
+     * A negative noise level lets even unchanged pixels through, which the
+     * vector versions can't express. Above 255 no pixel can have motion, so
+     * that is the same as 255.
+     */
+    if (noise < 0)
+        return diff_c(ref, new, out, mask, noise_map, smartmask_final, smartmask_buffer,
+                      count, noise, flags);
+
+    if (noise > 255)
+        noise = 255;
+
+    return simd_kernel->diff(ref, new, out, mask, noise_map, smartmask_final, smartmask_buffer,
+                             count, noise, flags);
+}
+
+/**
+ * alg_simd_count
+ *
+ */
+int alg_simd_count(const unsigned char *ref, const unsigned char *new,
+                   int stride, int width, int height, int noise)
+{
+    if (noise < 0)
+        return width * height;
+
+    if (noise > 254)
+        return 0;
+
+    return simd_kernel->count(ref, new, stride, width, height, noise);
+}
+
+/**
+ * alg_simd_update_ref
+ *
+ */
+void alg_simd_update_ref(unsigned char *ref, const unsigned char *virgin,
+                         const unsigned char *smartmask_final, const unsigned char *out,
+                         unsigned char *ref_dyn, int count, int threshold, int accept)
+{
+    /* ref_dyn is 8 bit, it must be able to count one past accept. */
+    if (accept < 0)
+        accept = 0;
+    else if (accept > 254)
+        accept = 254;
+
+    /* Same as for alg_simd_diff, a negative threshold is left to the C version. */
+    if (threshold < 0) {
+        update_c(ref, virgin, smartmask_final, out, ref_dyn, count, threshold, accept);
+        return;
+    }
+
+    if (threshold > 255)
+        threshold = 255;
+
+    simd_kernel->update(ref, virgin, smartmask_final, out, ref_dyn, count, threshold, accept);
+}
+
+/**
+ * alg_simd_pack
+ *
+ */
+void alg_simd_pack(const unsigned char *img, uint64_t *bits, int width, int height, int stride)
+{
+    simd_kernel->pack(img, bits, width, height, stride);
+}
+
+/**
+ * alg_simd_update_median
+ *
+ */
+void alg_simd_update_median(unsigned char *ref, const unsigned char *virgin, const unsigned char *out,
+                            unsigned short *median, unsigned short *dev, unsigned char *noise_map,
+                            int count)
+{
+    simd_kernel->median(ref, virgin, out, median, dev, noise_map, count);
+}
@@ -0,0 +1,186 @@
+/*
+ *    alg_simd.h
+ *
+ *    Include file for the vectorized motion detection kernels.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_ALG_SIMD_H
+#define _INCLUDE_ALG_SIMD_H
+
+#include <stdint.h>
+
+/* Flags for alg_simd_diff */
+#define ALG_DIFF_SMARTMASK        1   /* Clear motion where smartmask is 0 */
+#define ALG_DIFF_SMARTMASK_INCR   2   /* Add to smartmask_buffer on motion */
+
+/* Increment for *smartmask_buffer in alg_simd_diff. */
+#define SMARTMASK_SENSITIVITY_INCR 5
+
+/* Largest change per frame in alg_simd_update_median, in 1/256 of a level */
+#define BACKGROUND_STEP           256  /* median of a pixel without motion */
+#define BACKGROUND_STEP_MOTION    32   /* median of a pixel with motion    */
+#define BACKGROUND_DEV_STEP       256  /* deviation                        */
+
+/**
+ * alg_simd_init
+ *
+ *  Selects the fastest diff kernel supported by the running CPU. Every
+ *  candidate is verified against the scalar reference kernel on a synthetic
+ *  frame before it is used, so a miscompiled or buggy kernel falls back to
+ *  the scalar code instead of producing different motion results.
+ *
+ * Returns: nothing
+ */
+void alg_simd_init(void);
+
+/**
+ * alg_simd_name
+ *
+ *  Returns the name of the kernel selected by alg_simd_init.
+ */
+const char *alg_simd_name(void);
+
+/**
+ * alg_simd_select
+ *
+ *  Selects a kernel by name in place of the one alg_simd_init picked, without
+ *  verifying it. Used by alg_simd_test to compare every kernel with the C
+ *  version.
+ *
+ * Parameters:
+ *
+ *   name - "avx2", "sse2", "neon" or "c"
+ *
+ * Returns: 0 on success, -1 if the kernel is not built in or not supported
+ *          by the CPU
+ */
+int alg_simd_select(const char *name);
+
+/**
+ * alg_simd_diff
+ *
+ *  Computes the motion image for count pixels in a single pass:
+ *  abs(ref - new), optionally scaled by the fixed mask (mask / 255), is
+ *  compared with noise, or with noise_map where that is higher. If
+ *  ALG_DIFF_SMARTMASK_INCR is set, smartmask_buffer is increased for every
+ *  pixel above noise, saturating at 65535. If ALG_DIFF_SMARTMASK is set,
+ *  pixels where smartmask_final is 0 are cleared. Every out pixel is
+ *  written, either with the new pixel (motion) or with 0.
+ *
+ * Parameters:
+ *
+ *   ref              - reference frame
+ *   new              - current frame
+ *   out              - motion image
+ *   mask             - fixed mask or NULL
+ *   noise_map        - per pixel noise level or NULL
+ *   smartmask_final  - smartmask (only read with ALG_DIFF_SMARTMASK)
+ *   smartmask_buffer - smartmask sensitivity (only with
+ *                      ALG_DIFF_SMARTMASK_INCR)
+ *   count            - number of pixels
+ *   noise            - noise level
+ *   flags            - ALG_DIFF_* flags
+ *
+ * Returns: number of pixels with motion
+ */
+int alg_simd_diff(const unsigned char *ref, const unsigned char *new,
+                  unsigned char *out, const unsigned char *mask, const unsigned char *noise_map,
+                  const unsigned char *smartmask_final, unsigned short *smartmask_buffer,
+                  int count, int noise, int flags);
+
+/**
+ * alg_simd_count
+ *
+ *  Counts the pixels in a block where abs(ref - new) is above noise. No mask
+ *  is applied, so the result is an upper bound for what alg_simd_diff finds
+ *  in the same block.
+ *
+ * Parameters:
+ *
+ *   ref    - top left pixel of the block in the reference frame
+ *   new    - top left pixel of the block in the current frame
+ *   stride - distance in bytes between two lines
+ *   width  - width of the block
+ *   height - height of the block
+ *   noise  - noise level
+ *
+ * Returns: number of pixels above noise
+ */
+int alg_simd_count(const unsigned char *ref, const unsigned char *new,
+                   int stride, int width, int height, int noise);
+
+/**
+ * alg_simd_update_ref
+ *
+ *  Updates the reference frame and the static object counters in ref_dyn in
+ *  a single pass. Pixels that differ more than threshold from virgin and are
+ *  not masked by the smartmask are kept out of the reference frame while
+ *  they have motion in out, for at most accept frames.
+ *
+ * Parameters:
+ *
+ *   ref              - reference frame, updated
+ *   virgin           - current frame
+ *   smartmask_final  - smartmask
+ *   out              - motion image
+ *   ref_dyn          - frames each pixel has been excluded, updated
+ *   count            - number of pixels
+ *   threshold        - minimum difference for a pixel to be excluded
+ *   accept           - frames after which an excluded pixel is accepted,
+ *                      limited to 254
+ *
+ * Returns: nothing
+ */
+void alg_simd_update_ref(unsigned char *ref, const unsigned char *virgin,
+                         const unsigned char *smartmask_final, const unsigned char *out,
+                         unsigned char *ref_dyn, int count, int threshold, int accept);
+
+/**
+ * alg_simd_pack
+ *
+ *  Converts an image to one bit per pixel, set where the pixel is not 0.
+ *  Pixel x of a line is bit x % 64 of word x / 64, the unused bits of the
+ *  last word of a line are cleared.
+ *
+ * Parameters:
+ *
+ *   img    - image, width * height bytes
+ *   bits   - first line of the bit image
+ *   width  - width of the image
+ *   height - height of the image
+ *   stride - distance in 64 bit words between two lines of the bit image
+ *
+ * Returns: nothing
+ */
+void alg_simd_pack(const unsigned char *img, uint64_t *bits, int width, int height, int stride);
+
+/**
+ * alg_simd_update_median
+ *
+ *  Updates the approximate median background model in a single pass. The
+ *  median of every pixel moves towards the current frame by at most
+ *  BACKGROUND_STEP per frame, or BACKGROUND_STEP_MOTION where out has
+ *  motion. The deviation moves the same way towards four times the distance
+ *  of the pixel to the median, by at most BACKGROUND_DEV_STEP. Both are 8.8
+ *  fixed point values. The median, rounded to a whole level, is written
+ *  to ref and the whole levels of the deviation to noise_map.
+ *
+ * Parameters:
+ *
+ *   ref       - reference frame, written
+ *   virgin    - current frame
+ *   out       - motion image
+ *   median    - background median, at most 255 << 8, updated
+ *   dev       - background deviation, updated
+ *   noise_map - per pixel noise level for alg_simd_diff, written
+ *   count     - number of pixels
+ *
+ * Returns: nothing
+ */
+void alg_simd_update_median(unsigned char *ref, const unsigned char *virgin, const unsigned char *out,
+                            unsigned short *median, unsigned short *dev, unsigned char *noise_map,
+                            int count);
+
+#endif /* _INCLUDE_ALG_SIMD_H */
@@ -0,0 +1,473 @@
+/*
+ *    alg_simd_test.c
+ *
+ *    Checks every vector kernel of alg_simd.c that the CPU supports against
+ *    the C version, and times them with "alg_simd_test bench".
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    Unlike the check alg_simd_init runs on a single frame, the buffers here
+ *    are pseudo random in content, length and alignment, so the tails of the
+ *    vector loops, the masks, the smartmask, the noise map and the edges of
+ *    noise, threshold and accept all get their turn. The output buffers are
+ *    followed by guard bytes that no kernel may touch.
+ */
+#include "motion.h"
+#include "alg_simd.h"
+#include <stdarg.h>
+
+/* Random cases of each kernel */
+#define TEST_ROUNDS 3000
+/* Longest buffer of a case */
+#define TEST_MAX    5000
+/* Bytes after a buffer that must stay as they are */
+#define TEST_GUARD  64
+/* Greatest misalignment of a buffer */
+#define TEST_ALIGN  32
+
+static const char *test_kernels[] = { "avx2", "sse2", "neon" };
+
+static unsigned int test_seed = 20240601;
+
+/**
+ * motion_log
+ *      Stands in for the logger of motion, which alg_simd.c logs through.
+ */
+void motion_log(int level, unsigned int type, int errno_flag, const char *fmt, ...)
+{
+    va_list ap;
+
+    (void)level;
+    (void)type;
+    (void)errno_flag;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+/**
+ * mymalloc
+ *      Same as the one of motion.c.
+ */
+void *mymalloc(size_t nbytes)
+{
+    void *dummy = calloc(nbytes, 1);
+
+    if (!dummy) {
+        fprintf(stderr, "Could not allocate %zu bytes\n", nbytes);
+        exit(1);
+    }
+
+    return dummy;
+}
+
+/**
+ * test_random
+ *      Next pseudo random number of a xorshift generator.
+ */
+static unsigned int test_random(void)
+{
+    test_seed ^= test_seed << 13;
+    test_seed ^= test_seed >> 17;
+    test_seed ^= test_seed << 5;
+
+    return test_seed;
+}
+
+/**
+ * test_fill
+ *      Fills a buffer with random bytes, or with bytes close to those of
+ *      near, which is what most pixels of a frame are.
+ */
+static void test_fill(unsigned char *buf, const unsigned char *near, int len, int spread)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (near && test_random() % 8)
+            buf[i] = near[i] + (int)(test_random() % (2 * spread + 1)) - spread;
+        else
+            buf[i] = test_random();
+    }
+}
+
+/**
+ * test_edge
+ *      A random value that is an edge case of a range most of the time.
+ */
+static int test_edge(const int *edges, int count, int low, int high)
+{
+    if (test_random() % 4)
+        return edges[test_random() % count];
+
+    return low + (int)(test_random() % (high - low + 1));
+}
+
+/**
+ * test_buffer
+ *      A misaligned buffer inside block.
+ */
+static unsigned char *test_buffer(unsigned char *block)
+{
+    return block + test_random() % TEST_ALIGN;
+}
+
+/**
+ * test_diff
+ *      alg_simd_diff and alg_simd_count of a kernel against the C version.
+ */
+static int test_diff(const char *kernel)
+{
+    static const int noises[] = { -1, 0, 1, 17, 128, 254, 255, 256, 1000 };
+    unsigned char *block = mymalloc(7 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+    unsigned short *smb = mymalloc(2 * (TEST_MAX + TEST_GUARD) * sizeof(*smb));
+    unsigned char *blocks[7];
+    unsigned char *ref, *new, *mask, *noise_map, *smartmask, *out_c, *out_k;
+    unsigned short *smb_c = smb, *smb_k = smb + TEST_MAX + TEST_GUARD;
+    int i, round, len, noise, flags, diffs_c, diffs_k, failed = 0;
+    int stride, width, height;
+
+    for (i = 0; i < 7; i++)
+        blocks[i] = block + i * (TEST_MAX + TEST_ALIGN + TEST_GUARD);
+
+    for (round = 0; round < TEST_ROUNDS && !failed; round++) {
+        len = (round % 4) ? 1 + test_random() % 300 : 1 + test_random() % TEST_MAX;
+        noise = test_edge(noises, sizeof(noises) / sizeof(noises[0]), -2, 300);
+        flags = test_random() % 4;
+
+        ref = test_buffer(blocks[0]);
+        new = test_buffer(blocks[1]);
+        mask = (test_random() % 2) ? test_buffer(blocks[2]) : NULL;
+        noise_map = (test_random() % 2) ? test_buffer(blocks[3]) : NULL;
+        smartmask = test_buffer(blocks[4]);
+        out_c = test_buffer(blocks[5]);
+        out_k = test_buffer(blocks[6]);
+
+        test_fill(ref, NULL, len, 0);
+        test_fill(new, ref, len, 20 + noise % 40);
+        if (mask) {
+            test_fill(mask, NULL, len, 0);
+            for (i = 0; i < len; i += 1 + test_random() % 8)
+                mask[i] = (test_random() % 2) ? 255 : 0;
+        }
+        if (noise_map) {
+            for (i = 0; i < len; i++)
+                noise_map[i] = (test_random() % 4) ? test_random() % 40 : test_random();
+        }
+        for (i = 0; i < len; i++)
+            smartmask[i] = (test_random() % 3) ? 255 : 0;
+        for (i = 0; i < len + TEST_GUARD; i++)
+            smb_c[i] = smb_k[i] = (test_random() % 8) ? test_random() % 1000 :
+                                  65535 - test_random() % 8;
+        memset(out_c, 0x55, len + TEST_GUARD);
+        memset(out_k, 0x55, len + TEST_GUARD);
+
+        alg_simd_select("c");
+        diffs_c = alg_simd_diff(ref, new, out_c, mask, noise_map, smartmask, smb_c,
+                                len, noise, flags);
+        alg_simd_select(kernel);
+        diffs_k = alg_simd_diff(ref, new, out_k, mask, noise_map, smartmask, smb_k,
+                                len, noise, flags);
+
+        if (diffs_c != diffs_k || memcmp(out_c, out_k, len + TEST_GUARD) ||
+            memcmp(smb_c, smb_k, (len + TEST_GUARD) * sizeof(*smb))) {
+            fprintf(stderr, "%s: diff differs, length %d, noise %d, flags %d, mask %d, "
+                    "noise map %d\n", kernel, len, noise, flags, mask != NULL, noise_map != NULL);
+            failed = 1;
+        }
+
+        /* A block with a stride within the same frames */
+        width = 1 + test_random() % 200;
+        stride = width + test_random() % 40;
+        if (len < width)
+            continue;
+        height = 1 + (len - width) / stride;
+
+        alg_simd_select("c");
+        diffs_c = alg_simd_count(ref, new, stride, width, height, noise);
+        alg_simd_select(kernel);
+        diffs_k = alg_simd_count(ref, new, stride, width, height, noise);
+
+        if (diffs_c != diffs_k) {
+            fprintf(stderr, "%s: count differs, %dx%d stride %d, noise %d\n", kernel,
+                    width, height, stride, noise);
+            failed = 1;
+        }
+    }
+
+    free(smb);
+    free(block);
+
+    return failed;
+}
+
+/**
+ * test_update
+ *      alg_simd_update_ref of a kernel against the C version.
+ */
+static int test_update(const char *kernel)
+{
+    static const int edges[] = { -1, 0, 1, 6, 51, 254, 255, 256, 1000 };
+    unsigned char *block = mymalloc(7 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+    unsigned char *virgin, *smartmask, *out, *ref_c, *ref_k, *dyn_c, *dyn_k;
+    int i, round, len, threshold, accept, failed = 0;
+
+    for (round = 0; round < TEST_ROUNDS && !failed; round++) {
+        len = (round % 4) ? 1 + test_random() % 300 : 1 + test_random() % TEST_MAX;
+        threshold = test_edge(edges, sizeof(edges) / sizeof(edges[0]), -2, 300);
+        accept = test_edge(edges, sizeof(edges) / sizeof(edges[0]), -2, 300);
+
+        virgin = test_buffer(block);
+        smartmask = test_buffer(block + 1 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+        out = test_buffer(block + 2 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+        ref_c = test_buffer(block + 3 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+        ref_k = test_buffer(block + 4 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+        dyn_c = test_buffer(block + 5 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+        dyn_k = test_buffer(block + 6 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+
+        test_fill(ref_c, NULL, len + TEST_GUARD, 0);
+        memcpy(ref_k, ref_c, len + TEST_GUARD);
+        test_fill(virgin, ref_c, len, 40);
+        for (i = 0; i < len; i++) {
+            smartmask[i] = (test_random() % 7) ? 255 : 0;
+            out[i] = (test_random() % 3) ? virgin[i] : 0;
+        }
+        for (i = 0; i < len + TEST_GUARD; i++)
+            dyn_c[i] = dyn_k[i] = (test_random() % 2) ? test_random() :
+                                  test_random() % (accept > 0 && accept < 254 ? accept + 2 : 256);
+
+        alg_simd_select("c");
+        alg_simd_update_ref(ref_c, virgin, smartmask, out, dyn_c, len, threshold, accept);
+        alg_simd_select(kernel);
+        alg_simd_update_ref(ref_k, virgin, smartmask, out, dyn_k, len, threshold, accept);
+
+        if (memcmp(ref_c, ref_k, len + TEST_GUARD) || memcmp(dyn_c, dyn_k, len + TEST_GUARD)) {
+            fprintf(stderr, "%s: reference update differs, length %d, threshold %d, "
+                    "accept %d\n", kernel, len, threshold, accept);
+            failed = 1;
+        }
+    }
+
+    free(block);
+
+    return failed;
+}
+
+/**
+ * test_pack
+ *      alg_simd_pack of a kernel against the C version.
+ */
+static int test_pack(const char *kernel)
+{
+    unsigned char *block = mymalloc(TEST_MAX + TEST_ALIGN);
+    uint64_t bits_c[128], bits_k[128];
+    unsigned char *img;
+    int i, round, width, height, stride, words, failed = 0;
+
+    for (round = 0; round < TEST_ROUNDS && !failed; round++) {
+        width = 1 + test_random() % 400;
+        stride = (width + 63) / 64 + test_random() % 3;
+        height = 1 + test_random() % (sizeof(bits_c) / sizeof(bits_c[0]) / stride);
+        if (height * width > TEST_MAX)
+            height = TEST_MAX / width;
+        words = height * stride;
+
+        img = test_buffer(block);
+        for (i = 0; i < width * height; i++)
+            img[i] = (test_random() % 2) ? test_random() % 4 : 0;
+
+        memset(bits_c, 0x55, sizeof(bits_c));
+        memset(bits_k, 0x55, sizeof(bits_k));
+
+        alg_simd_select("c");
+        alg_simd_pack(img, bits_c, width, height, stride);
+        alg_simd_select(kernel);
+        alg_simd_pack(img, bits_k, width, height, stride);
+
+        if (memcmp(bits_c, bits_k, sizeof(bits_c))) {
+            fprintf(stderr, "%s: pack differs, %dx%d stride %d (%d words)\n", kernel,
+                    width, height, stride, words);
+            failed = 1;
+        }
+    }
+
+    free(block);
+
+    return failed;
+}
+
+/**
+ * test_median
+ *      alg_simd_update_median of a kernel against the C version, a few
+ *      frames in a row on the same state.
+ */
+static int test_median(const char *kernel)
+{
+    unsigned char *block = mymalloc(6 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+    unsigned short *state = mymalloc(4 * (TEST_MAX + TEST_GUARD) * sizeof(*state));
+    unsigned short *med_c = state, *med_k = med_c + TEST_MAX + TEST_GUARD;
+    unsigned short *dev_c = med_k + TEST_MAX + TEST_GUARD, *dev_k = dev_c + TEST_MAX + TEST_GUARD;
+    unsigned char *virgin, *out, *ref_c, *ref_k, *map_c, *map_k;
+    int i, round, frame, len, failed = 0;
+
+    for (round = 0; round < TEST_ROUNDS / 4 && !failed; round++) {
+        len = (round % 4) ? 1 + test_random() % 300 : 1 + test_random() % TEST_MAX;
+
+        virgin = test_buffer(block);
+        out = test_buffer(block + 1 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+        ref_c = test_buffer(block + 2 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+        ref_k = test_buffer(block + 3 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+        map_c = test_buffer(block + 4 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+        map_k = test_buffer(block + 5 * (TEST_MAX + TEST_ALIGN + TEST_GUARD));
+
+        /* The median never exceeds 255 << 8, the deviation can be anything. */
+        for (i = 0; i < len + TEST_GUARD; i++) {
+            med_c[i] = med_k[i] = (test_random() % 8) ? test_random() % (255 * 256 + 1) :
+                                  (test_random() % 2) * 255 * 256;
+            dev_c[i] = dev_k[i] = (test_random() % 8) ? test_random() % 4096 :
+                                  (test_random() % 2) * 65535;
+        }
+        memset(ref_c, 0x55, len + TEST_GUARD);
+        memset(ref_k, 0x55, len + TEST_GUARD);
+        memset(map_c, 0x55, len + TEST_GUARD);
+        memset(map_k, 0x55, len + TEST_GUARD);
+
+        for (frame = 0; frame < 4 && !failed; frame++) {
+            for (i = 0; i < len; i++) {
+                virgin[i] = (test_random() % 4) ? med_c[i] / 256 + (int)(test_random() % 21) - 10 :
+                                                  test_random();
+                out[i] = (test_random() % 4) ? 0 : virgin[i] | 1;
+            }
+
+            alg_simd_select("c");
+            alg_simd_update_median(ref_c, virgin, out, med_c, dev_c, map_c, len);
+            alg_simd_select(kernel);
+            alg_simd_update_median(ref_k, virgin, out, med_k, dev_k, map_k, len);
+
+            if (memcmp(ref_c, ref_k, len + TEST_GUARD) || memcmp(map_c, map_k, len + TEST_GUARD) ||
+                memcmp(med_c, med_k, (len + TEST_GUARD) * sizeof(*state)) ||
+                memcmp(dev_c, dev_k, (len + TEST_GUARD) * sizeof(*state))) {
+                fprintf(stderr, "%s: median update differs, length %d, frame %d\n", kernel,
+                        len, frame);
+                failed = 1;
+            }
+        }
+    }
+
+    free(state);
+    free(block);
+
+    return failed;
+}
+
+/**
+ * test_now
+ *      Monotonic time in ns.
+ */
+static long long test_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * test_bench
+ *      Times each kernel on frames of width x height with little motion,
+ *      like most frames of a camera, and prints ms per frame.
+ */
+static void test_bench(int width, int height)
+{
+    static const char *names[] = { "c", "sse2", "avx2", "neon" };
+    int size = width * height, stride = (width + 63) / 64;
+    unsigned char *frames = mymalloc(7 * size);
+    unsigned char *ref = frames, *new = ref + size, *mask = new + size;
+    unsigned char *smartmask = mask + size, *out = smartmask + size;
+    unsigned char *dyn = out + size, *map = dyn + size;
+    unsigned short *smb = mymalloc(3 * size * sizeof(*smb));
+    unsigned short *median = smb + size, *dev = median + size;
+    uint64_t *bits = mymalloc(stride * height * sizeof(*bits));
+    long long start, t[5];
+    int i, k, n, runs = 20;
+
+    test_fill(ref, NULL, size, 0);
+    test_fill(new, ref, size, 3);
+    test_fill(mask, NULL, size, 0);
+    memset(smartmask, 255, size);
+    for (i = 0; i < size; i++)
+        median[i] = ref[i] << 8;
+
+    printf("%-6s %10s %10s %10s %10s %10s   ms per %dx%d frame\n", "kernel", "diff", "count",
+           "update", "pack", "median", width, height);
+
+    for (k = 0; k < (int)(sizeof(names) / sizeof(names[0])); k++) {
+        if (alg_simd_select(names[k]))
+            continue;
+
+        memset(t, 0, sizeof(t));
+
+        for (n = 0; n < runs; n++) {
+            start = test_now();
+            alg_simd_diff(ref, new, out, mask, NULL, smartmask, smb, size, 6,
+                          ALG_DIFF_SMARTMASK | ALG_DIFF_SMARTMASK_INCR);
+            t[0] += test_now() - start;
+
+            start = test_now();
+            alg_simd_count(ref, new, width, width, height, 6);
+            t[1] += test_now() - start;
+
+            start = test_now();
+            alg_simd_update_ref(ref, new, smartmask, out, dyn, size, 6, 100);
+            t[2] += test_now() - start;
+
+            start = test_now();
+            alg_simd_pack(out, bits, width, height, stride);
+            t[3] += test_now() - start;
+
+            start = test_now();
+            alg_simd_update_median(ref, new, out, median, dev, map, size);
+            t[4] += test_now() - start;
+        }
+
+        printf("%-6s %10.3f %10.3f %10.3f %10.3f %10.3f\n", names[k], t[0] / 1e6 / runs,
+               t[1] / 1e6 / runs, t[2] / 1e6 / runs, t[3] / 1e6 / runs, t[4] / 1e6 / runs);
+    }
+
+    free(bits);
+    free(smb);
+    free(frames);
+}
+
+int main(int argc, char **argv)
+{
+    int k, bad, failed = 0, tested = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+        test_bench(argc > 3 ? atoi(argv[2]) : 1920, argc > 3 ? atoi(argv[3]) : 1080);
+        return 0;
+    }
+
+    for (k = 0; k < (int)(sizeof(test_kernels) / sizeof(test_kernels[0])); k++) {
+        if (alg_simd_select(test_kernels[k])) {
+            printf("%s: not supported here\n", test_kernels[k]);
+            continue;
+        }
+
+        bad = test_diff(test_kernels[k]) | test_update(test_kernels[k]) |
+              test_pack(test_kernels[k]) | test_median(test_kernels[k]);
+        failed |= bad;
+        tested++;
+
+        printf("%s: %s\n", test_kernels[k], bad ? "FAILED" : "same as c");
+    }
+
+    if (!tested)
+        printf("No vector kernels to test\n");
+
+    return failed;
+}
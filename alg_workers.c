@@ -0,0 +1,253 @@
+/*
+ *    alg_workers.c
+ *
+ *    Worker threads that split the motion detection of one camera into
+ *    horizontal bands.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    The camera thread hands out a job by bumping the generation counter,
+ *    works on the first band itself and waits for the workers to finish
+ *    theirs. The results are added up in band order, and every band does
+ *    exactly what the single threaded code does for those lines, so the
+ *    outcome doesn't depend on the number of threads.
+ */
+#include "motion.h"
+#include "alg_workers.h"
+
+/* More threads than this only add overhead, even at 4K. */
+#define ALG_WORKERS_MAX 32
+
+struct alg_worker {
+    pthread_t thread_id;
+    struct alg_workers *pool;
+    int band;
+    int result;
+};
+
+struct alg_workers {
+    struct context *cnt;
+    int count;                      /* Bands, including the camera thread */
+    struct alg_worker *worker;      /* count - 1 worker threads */
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned int generation;        /* Bumped for every job */
+    int pending;                    /* Workers still busy with the job */
+    int finish;
+
+    /* Current job */
+    alg_band_func func;
+    void *arg;
+    int height;
+    int align;
+};
+
+/**
+ * band_range
+ *      Lines of a band. The lines are split in units of align lines, the
+ *      last band also gets the lines that don't fill a whole unit.
+ */
+static void band_range(struct alg_workers *pool, int band, int *y0, int *y1)
+{
+    int units = (pool->height + pool->align - 1) / pool->align;
+
+    *y0 = pool->align * (units * band / pool->count);
+    *y1 = pool->align * (units * (band + 1) / pool->count);
+
+    if (*y0 > pool->height)
+        *y0 = pool->height;
+    if (*y1 > pool->height)
+        *y1 = pool->height;
+}
+
+/**
+ * band_run
+ *      Runs the current job on one band.
+ */
+static int band_run(struct alg_workers *pool, int band)
+{
+    int y0, y1;
+
+    band_range(pool, band, &y0, &y1);
+
+    if (y0 == y1)
+        return 0;
+
+    return pool->func(pool->cnt, pool->arg, y0, y1);
+}
+
+/**
+ * worker_loop
+ *      Waits for jobs and runs them on the band of the worker.
+ */
+static void *worker_loop(void *arg)
+{
+    struct alg_worker *worker = arg;
+    struct alg_workers *pool = worker->pool;
+    struct context *cnt = pool->cnt;
+    unsigned int seen;
+    char tname[16];
+
+    snprintf(tname, sizeof(tname), "ml%d:det%d", cnt->threadnr, worker->band);
+    MOTION_PTHREAD_SETNAME(tname);
+
+    /* Store the motion thread number in TLS for 'MOTION_LOG'. */
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    /*
+     * The pool starts at generation 0 and the first job may already have
+     * been handed out before this thread got here, so don't read the
+     * current generation.
+     */
+    seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (;;) {
+        while (pool->generation == seen && !pool->finish)
+            pthread_cond_wait(&pool->start, &pool->lock);
+
+        if (pool->finish)
+            break;
+
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        worker->result = band_run(pool, worker->band);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/**
+ * pool_free
+ *      Frees a pool without running workers.
+ */
+static void pool_free(struct alg_workers *pool)
+{
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->worker);
+    free(pool);
+}
+
+/**
+ * alg_workers_init
+ *
+ */
+void alg_workers_init(struct context *cnt)
+{
+    struct alg_workers *pool;
+    int i, count = cnt->conf.detection_threads;
+
+    cnt->workers = NULL;
+
+    if (count <= 1)
+        return;
+
+    if (count > ALG_WORKERS_MAX) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: detection_threads %d is too high, using %d",
+                   count, ALG_WORKERS_MAX);
+        count = ALG_WORKERS_MAX;
+    }
+
+    pool = mymalloc(sizeof(*pool));
+    pool->cnt = cnt;
+    pool->worker = mymalloc((count - 1) * sizeof(*pool->worker));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    /* Only count the workers that actually started. */
+    pool->count = 1;
+    for (i = 0; i < count - 1; i++) {
+        pool->worker[i].pool = pool;
+        pool->worker[i].band = i + 1;
+
+        if (pthread_create(&pool->worker[i].thread_id, NULL, worker_loop, &pool->worker[i])) {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start detection thread %d",
+                       i + 1);
+            break;
+        }
+        pool->count++;
+    }
+
+    if (pool->count == 1) {
+        pool_free(pool);
+        return;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Motion detection runs on %d threads",
+               pool->count);
+
+    cnt->workers = pool;
+}
+
+/**
+ * alg_workers_deinit
+ *
+ */
+void alg_workers_deinit(struct context *cnt)
+{
+    struct alg_workers *pool = cnt->workers;
+    int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->finish = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->count - 1; i++)
+        pthread_join(pool->worker[i].thread_id, NULL);
+
+    pool_free(pool);
+    cnt->workers = NULL;
+}
+
+/**
+ * alg_workers_run
+ *
+ */
+int alg_workers_run(struct context *cnt, int height, int align, alg_band_func func, void *arg)
+{
+    struct alg_workers *pool = cnt->workers;
+    int i, result;
+
+    if (!pool)
+        return func(cnt, arg, 0, height);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->arg = arg;
+    pool->height = height;
+    pool->align = align > 0 ? align : 1;
+    pool->pending = pool->count - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    result = band_run(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->count - 1; i++)
+        result += pool->worker[i].result;
+
+    return result;
+}
@@ -0,0 +1,70 @@
+/*
+ *    alg_workers.h
+ *
+ *    Include file for the per camera detection worker threads.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_ALG_WORKERS_H
+#define _INCLUDE_ALG_WORKERS_H
+
+#include "motion.h"
+
+/*
+ * Work on one horizontal band of the image, lines y0 up to (not including)
+ * y1. Bands run at the same time, so a band function may only write to its
+ * own lines. Lines of other bands may be read if nothing writes to them in
+ * the same run.
+ */
+typedef int (*alg_band_func)(struct context *cnt, void *arg, int y0, int y1);
+
+/**
+ * alg_workers_init
+ *
+ *  Starts detection_threads - 1 worker threads for the camera. Together with
+ *  the camera thread they each handle one band of the image. Nothing is
+ *  started if detection_threads is 0 or 1.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void alg_workers_init(struct context *cnt);
+
+/**
+ * alg_workers_deinit
+ *
+ *  Stops and joins the worker threads started by alg_workers_init.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void alg_workers_deinit(struct context *cnt);
+
+/**
+ * alg_workers_run
+ *
+ *  Splits height lines into one band per thread and runs func on all bands
+ *  in parallel. The camera thread does the first band itself and returns
+ *  when all bands are done. Without worker threads func is simply called
+ *  for the whole image.
+ *
+ * Parameters:
+ *
+ *   cnt    - current thread's context structure
+ *   height - number of lines
+ *   align  - bands start at a multiple of align lines
+ *   func   - band function
+ *   arg    - passed to func
+ *
+ * Returns: the sum of the results of func for all bands
+ */
+int alg_workers_run(struct context *cnt, int height, int align, alg_band_func func, void *arg);
+
+#endif /* _INCLUDE_ALG_WORKERS_H */
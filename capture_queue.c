@@ -0,0 +1,374 @@
+/*
+ *    capture_queue.c
+ *
+ *    Capture thread that reads frames from the camera into a queue, so a
+ *    slow motion thread doesn't hold up the camera.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    The queue is a single producer / single consumer ring of pointers to
+ *    preallocated frames. The capture thread always fills a spare frame of
+ *    its own and then publishes it. The motion thread takes the image
+ *    buffer of the oldest frame and hands the frame back through a second
+ *    ring, the capture thread gets a new buffer from the image pool for it.
+ *    Neither side takes a lock to pass frames. The only lock is used to
+ *    wake up the motion thread when it waits for a frame.
+ *
+ *    When the queue is full the capture thread either drops the frame it
+ *    just captured, or takes the oldest frame back out of the queue. The
+ *    motion thread competes for that oldest frame with a compare and swap
+ *    on the read position, so exactly one of them gets it.
+ */
+#include "motion.h"
+#include "capture_queue.h"
+#include "video_common.h"
+#include "image_pool.h"
+#include "executor.h"
+
+struct capture_frame {
+    unsigned char *image;           /* NULL once taken by the motion thread */
+    int result;                     /* Return code of vid_next */
+};
+
+struct capture_queue {
+    struct context *cnt;
+    int size;                       /* Frames the queue can hold */
+    int drop_newest;                /* Drop policy when the queue is full */
+    struct capture_frame *frames;   /* size + 2 frames */
+    struct capture_frame *spare;    /* Filled next by the capture thread */
+
+    /*
+     * Queued frames, head is only written by the capture thread. The
+     * positions count up and wrap, the rings have a power of 2 entries so
+     * the masked positions stay right across the wrap.
+     */
+    struct capture_frame **ring;
+    unsigned int ring_mask;
+    unsigned int head;
+    unsigned int tail;
+
+    /* Frames handed back by the motion thread */
+    struct capture_frame **free;
+    unsigned int free_mask;
+    unsigned int free_head;         /* Written by the motion thread */
+    unsigned int free_tail;         /* Written by the capture thread */
+
+    unsigned long dropped;
+
+    pthread_t thread_id;
+    int running;
+    int finish;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int waiting;                    /* The motion thread waits for ready */
+};
+
+/**
+ * queue_take_free
+ *      Takes a frame handed back by the motion thread. There always is one,
+ *      as the queue, the motion thread and the capture thread together can
+ *      only hold size + 1 of the size + 2 frames.
+ */
+static struct capture_frame *queue_take_free(struct capture_queue *queue)
+{
+    struct capture_frame *frame;
+
+    if (queue->free_tail == __atomic_load_n(&queue->free_head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    frame = queue->free[queue->free_tail & queue->free_mask];
+    __atomic_store_n(&queue->free_tail, queue->free_tail + 1, __ATOMIC_RELEASE);
+
+    return frame;
+}
+
+/**
+ * queue_push
+ *      Publishes a filled frame. Returns the frame the capture thread fills
+ *      next.
+ */
+static struct capture_frame *queue_push(struct capture_queue *queue, struct capture_frame *frame)
+{
+    struct capture_frame *spare = NULL;
+    unsigned int head = queue->head;
+    unsigned int tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == (unsigned int)queue->size) {
+        if (queue->drop_newest) {
+            __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+            return frame;
+        }
+
+        /* Take the oldest frame back, unless the motion thread got it first. */
+        spare = __atomic_load_n(&queue->ring[tail & queue->ring_mask], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&queue->tail, &tail, tail + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+        else
+            spare = NULL;
+    }
+
+    __atomic_store_n(&queue->ring[head & queue->ring_mask], frame, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&queue->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_signal(&queue->ready);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    /* On the thread pool the camera runs once a frame is queued. */
+    executor_wake(queue->cnt);
+
+    return spare ? spare : queue_take_free(queue);
+}
+
+/**
+ * capture_loop
+ *      Captures frames at up to frame_limit frames per second until stopped
+ *      or until vid_next reports a fatal error.
+ */
+static void *capture_loop(void *arg)
+{
+    struct capture_queue *queue = arg;
+    struct context *cnt = queue->cnt;
+    struct timespec deadline = {0, 0};
+    char tname[16];
+    int result;
+
+    snprintf(tname, sizeof(tname), "ml%d:cap", cnt->threadnr);
+    MOTION_PTHREAD_SETNAME(tname);
+
+    /* Store the motion thread number in TLS for 'MOTION_LOG'. */
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    while (!__atomic_load_n(&queue->finish, __ATOMIC_ACQUIRE)) {
+        if (!queue->spare->image)
+            queue->spare->image = image_get(cnt);
+
+        result = vid_next(cnt, queue->spare->image);
+        queue->spare->result = result;
+        queue->spare = queue_push(queue, queue->spare);
+
+        /* The motion thread closes the device after a fatal error. */
+        if (result < 0)
+            break;
+
+        /*
+         * Keep to frame_limit. Unless wait_for_frames is set, netcams hand
+         * out the last frame without waiting for a new one, so this is the
+         * only pace they get.
+         */
+        frame_sleep(&deadline, cnt->conf.frame_limit ? 1000000L / cnt->conf.frame_limit : 0);
+    }
+
+    return NULL;
+}
+
+/**
+ * ring_mask
+ *      Mask for a ring with room for at least count entries.
+ */
+static unsigned int ring_mask(int count)
+{
+    unsigned int size = 1;
+
+    while (size < (unsigned int)count)
+        size <<= 1;
+
+    return size - 1;
+}
+
+/**
+ * capture_queue_init
+ *
+ */
+void capture_queue_init(struct context *cnt)
+{
+    struct capture_queue *queue;
+    int i, count, size;
+
+    cnt->capture = NULL;
+
+    /* Only netcams and synthetic cameras capture on the thread pool, see executor.c */
+    size = cnt->conf.capture_queue;
+    if (size <= 0 && cnt->task && cnt->camera_type != CAMERA_TYPE_NETCAM &&
+        cnt->camera_type != CAMERA_TYPE_SYNTH) {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Capturing from a thread of its own "
+                   "on the camera thread pool");
+        size = 2;
+    }
+
+    if (size <= 0)
+        return;
+
+    queue = mymalloc(sizeof(*queue));
+    queue->cnt = cnt;
+    queue->size = size;
+    count = queue->size + 2;
+
+    if (cnt->conf.capture_queue_drop && strcasecmp(cnt->conf.capture_queue_drop, "newest") == 0)
+        queue->drop_newest = 1;
+    else if (cnt->conf.capture_queue_drop && strcasecmp(cnt->conf.capture_queue_drop, "oldest"))
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Unknown capture_queue_drop %s, using oldest",
+                   cnt->conf.capture_queue_drop);
+
+    queue->ring_mask = ring_mask(queue->size);
+    queue->free_mask = ring_mask(count);
+    queue->frames = mymalloc(count * sizeof(*queue->frames));
+    queue->ring = mymalloc((queue->ring_mask + 1) * sizeof(*queue->ring));
+    queue->free = mymalloc((queue->free_mask + 1) * sizeof(*queue->free));
+
+    /* All frames start out free, the buffers are taken when needed. */
+    for (i = 0; i < count; i++)
+        queue->free[i] = &queue->frames[i];
+    queue->free_head = count;
+    queue->spare = queue_take_free(queue);
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Capture queue of %d frames, dropping the %s",
+               queue->size, queue->drop_newest ? "newest" : "oldest");
+
+    cnt->capture = queue;
+}
+
+/**
+ * capture_queue_deinit
+ *
+ */
+void capture_queue_deinit(struct context *cnt)
+{
+    struct capture_queue *queue = cnt->capture;
+    int i;
+
+    if (!queue)
+        return;
+
+    capture_queue_stop(cnt);
+
+    for (i = 0; i < queue->size + 2; i++)
+        image_unref(queue->frames[i].image);
+
+    pthread_cond_destroy(&queue->ready);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->free);
+    free(queue->ring);
+    free(queue->frames);
+    free(queue);
+    cnt->capture = NULL;
+}
+
+/**
+ * capture_queue_start
+ *
+ */
+void capture_queue_start(struct context *cnt)
+{
+    struct capture_queue *queue = cnt->capture;
+
+    if (!queue || queue->running)
+        return;
+
+    queue->finish = 0;
+
+    if (pthread_create(&queue->thread_id, NULL, capture_loop, queue)) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start the capture thread");
+        return;
+    }
+
+    queue->running = 1;
+}
+
+/**
+ * capture_queue_stop
+ *
+ */
+void capture_queue_stop(struct context *cnt)
+{
+    struct capture_queue *queue = cnt->capture;
+
+    if (!queue || !queue->running)
+        return;
+
+    __atomic_store_n(&queue->finish, 1, __ATOMIC_RELEASE);
+    pthread_join(queue->thread_id, NULL);
+    queue->running = 0;
+}
+
+/**
+ * capture_queue_wait
+ *
+ */
+int capture_queue_wait(struct context *cnt, long usec)
+{
+    struct capture_queue *queue = cnt->capture;
+    struct timespec deadline;
+    struct timeval tv;
+    int queued;
+
+    if (!queue)
+        return 0;
+
+    pthread_mutex_lock(&queue->lock);
+    __atomic_store_n(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+
+    gettimeofday(&tv, NULL);
+    deadline.tv_sec = tv.tv_sec + (tv.tv_usec + usec) / 1000000L;
+    deadline.tv_nsec = ((tv.tv_usec + usec) % 1000000L) * 1000;
+
+    while (!(queued = __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) !=
+                      __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST))) {
+        if (pthread_cond_timedwait(&queue->ready, &queue->lock, &deadline))
+            break;
+    }
+
+    __atomic_store_n(&queue->waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&queue->lock);
+
+    return queued;
+}
+
+/**
+ * capture_queue_next
+ *
+ */
+int capture_queue_next(struct context *cnt, unsigned char **image)
+{
+    struct capture_queue *queue = cnt->capture;
+    struct capture_frame *frame;
+    unsigned int tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    int result;
+
+    /* On a failed compare and swap tail is reloaded. */
+    do {
+        if (tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+            return 1;
+        frame = __atomic_load_n(&queue->ring[tail & queue->ring_mask], __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&queue->tail, &tail, tail + 1, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    *image = frame->image;
+    frame->image = NULL;
+    result = frame->result;
+
+    queue->free[queue->free_head & queue->free_mask] = frame;
+    __atomic_store_n(&queue->free_head, queue->free_head + 1, __ATOMIC_RELEASE);
+
+    return result;
+}
+
+/**
+ * capture_queue_dropped
+ *
+ */
+unsigned long capture_queue_dropped(struct context *cnt)
+{
+    if (!cnt->capture)
+        return 0;
+
+    return __atomic_load_n(&cnt->capture->dropped, __ATOMIC_RELAXED);
+}
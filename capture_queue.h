@@ -0,0 +1,108 @@
+/*
+ *    capture_queue.h
+ *
+ *    Include file for the per camera capture thread and frame queue.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_CAPTURE_QUEUE_H
+#define _INCLUDE_CAPTURE_QUEUE_H
+
+#include "motion.h"
+
+/**
+ * capture_queue_init
+ *
+ *  Allocates the frame queue when capture_queue is set. The capture thread
+ *  is not started yet, see capture_queue_start.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void capture_queue_init(struct context *cnt);
+
+/**
+ * capture_queue_deinit
+ *
+ *  Stops the capture thread and frees the queue.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void capture_queue_deinit(struct context *cnt);
+
+/**
+ * capture_queue_start
+ *
+ *  Starts the capture thread if there is a queue and the thread isn't
+ *  running. From then on only the capture thread may call vid_next.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void capture_queue_start(struct context *cnt);
+
+/**
+ * capture_queue_stop
+ *
+ *  Stops and joins the capture thread. Must be called before the camera is
+ *  closed. Frames still in the queue are kept.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void capture_queue_stop(struct context *cnt);
+
+/**
+ * capture_queue_wait
+ *
+ *  Waits until the queue holds a frame, at most usec microseconds.
+ *
+ * Parameters:
+ *
+ *   cnt  - current thread's context structure
+ *   usec - timeout in microseconds
+ *
+ * Returns: 1 if a frame is queued, 0 on timeout
+ */
+int capture_queue_wait(struct context *cnt, long usec);
+
+/**
+ * capture_queue_next
+ *
+ *  Takes the oldest frame out of the queue. Used instead of vid_next by the
+ *  motion thread while the capture thread runs.
+ *
+ * Parameters:
+ *
+ *   cnt   - current thread's context structure
+ *   image - set to the image buffer of the frame, the caller owns the
+ *           reference, see image_pool.h. Left alone if the queue is empty.
+ *
+ * Returns: the result of vid_next for the frame, or 1 (non fatal) if the
+ *          queue is empty
+ */
+int capture_queue_next(struct context *cnt, unsigned char **image);
+
+/**
+ * capture_queue_dropped
+ *
+ *  Returns the number of frames the queue dropped because the motion thread
+ *  didn't keep up, since the queue was allocated.
+ */
+unsigned long capture_queue_dropped(struct context *cnt);
+
+#endif /* _INCLUDE_CAPTURE_QUEUE_H */
@@ -59,6 +59,12 @@ struct config conf_template = {
     .noise =                           DEF_NOISELEVEL,
     .noise_tune =                      1,
     .minimum_frame_time =              0,
+    .wait_for_frames =                 0,
+    .cpu_budget =                      0,
+    .camera_threads =                  0,
+    .capture_queue =                   0,
+    .capture_queue_drop =              "oldest",
+    .output_queue =                    0,
     .lightswitch =                     0,
     .autobright =                      0,
     .brightness =                      0,
@@ -69,6 +75,7 @@ struct config conf_template = {
     .roundrobin_frames =               1,
     .roundrobin_skip =                 1,
     .pre_capture =                     0,
+    .pre_capture_quality =             0,
     .post_capture =                    0,
     .switchfilter =                    0,
     .ffmpeg_output =                   0,
@@ -85,6 +92,7 @@ struct config conf_template = {
     .stream_maxrate =                  1,
     .stream_localhost =                1,
     .stream_limit =                    0,
+    .stream_zerocopy =                 0,
     .stream_auth_method =              0,
     .stream_authentication =           NULL,
     .stream_preview_scale =            25,
@@ -142,6 +150,7 @@ struct config conf_template = {
     mmalcam_name:                   NULL,
     mmalcam_control_params:         NULL,
 #endif
+    .synthetic_camera =                NULL,
     .text_changes =                    0,
     .text_left =                       NULL,
     .text_right =                      DEF_TIMESTAMP,
@@ -150,6 +159,9 @@ struct config conf_template = {
     .despeckle_filter =                NULL,
     .area_detect =                     NULL,
     .minimum_motion_frames =           1,
+    .detection_threads =               1,
+    .detection_scale =                 1,
+    .background_model =                "reference",
     .exif_text =                       NULL,
     .pid_file =                        NULL,
     .log_file =                        NULL,
@@ -359,6 +371,65 @@ config_param config_params[] = {
     print_int
     },
     {
+    "wait_for_frames",
+    "# Wait for a new frame from V4L2 devices and rtsp network cameras instead of\n"
+    "# taking whatever frame is there when the next one is due. Older frames that\n"
+    "# V4L2 drivers have queued up are skipped. Default: off",
+    0,
+    CONF_OFFSET(wait_for_frames),
+    copy_bool,
+    print_bool
+    },
+    {
+    "cpu_budget",
+    "# Percentage of all CPUs the cameras together may use. Above it, cameras\n"
+    "# without motion run the detection on fewer frames. Only the value in\n"
+    "# motion.conf is used. Default: 0 = no limit",
+    0,
+    CONF_OFFSET(cpu_budget),
+    copy_int,
+    print_int
+    },
+    {
+    "camera_threads",
+    "# Number of threads that run the cameras together, instead of a thread for\n"
+    "# each camera. Only the value in motion.conf is used.\n"
+    "# Default: 0 = a thread for each camera",
+    0,
+    CONF_OFFSET(camera_threads),
+    copy_int,
+    print_int
+    },
+    {
+    "capture_queue",
+    "# Number of frames a separate capture thread can queue up while the camera\n"
+    "# thread is busy with detection or saving pictures. Default: 0 = capture in\n"
+    "# the camera thread",
+    0,
+    CONF_OFFSET(capture_queue),
+    copy_int,
+    print_int
+    },
+    {
+    "capture_queue_drop",
+    "# Frame to drop when the capture queue is full. Valid values: oldest,\n"
+    "# newest. Default: oldest",
+    0,
+    CONF_OFFSET(capture_queue_drop),
+    copy_string,
+    print_string
+    },
+    {
+    "output_queue",
+    "# Number of frames a separate output thread can queue up to save pictures and\n"
+    "# encode movies, so the camera thread does not wait for the disk.\n"
+    "# Default: 0 = write from the camera thread",
+    0,
+    CONF_OFFSET(output_queue),
+    copy_int,
+    print_int
+    },
+    {
     "netcam_url",
     "# URL to use if you are using a network camera, size will be autodetected (incl http:// ftp:// mjpg:// rtsp:// mjpeg:// or file:///)\n"
     "# Must be a URL that returns single jpeg pictures or a raw mjpeg stream. A trailing slash may be required for some cameras.\n"
@@ -438,6 +509,16 @@ config_param config_params[] = {
     print_string
     },
 #endif
+    {
+    "synthetic_camera",
+    "# Generate the frames instead of capturing them, with the settings given as\n"
+    "# a comma separated list, for example objects=2,noise=4,light=40 or just on.\n"
+    "# Default: Not defined",
+    0,
+    CONF_OFFSET(synthetic_camera),
+    copy_string,
+    print_string
+    },
     {
     "auto_brightness",
     "# Let motion regulate the brightness of a video device (default: off).\n"
@@ -638,6 +719,36 @@ config_param config_params[] = {
     print_int
     },
     {
+    "detection_threads",
+    "# Number of threads used for the motion detection of this camera. The image\n"
+    "# is split into horizontal bands, one for each thread. Useful for high\n"
+    "# resolution cameras. Default: 1 = detect in the camera thread only",
+    0,
+    CONF_OFFSET(detection_threads),
+    copy_int,
+    print_int
+    },
+    {
+    "detection_scale",
+    "# Run the motion detection on an image scaled down by this factor. Valid\n"
+    "# values: 1, 2 or 4. Diffs and thresholds stay in pixels of the full image.\n"
+    "# Default: 1 = detect at the full resolution",
+    0,
+    CONF_OFFSET(detection_scale),
+    copy_int,
+    print_int
+    },
+    {
+    "background_model",
+    "# Background model the images are compared with. Valid values: reference,\n"
+    "# median. 'median' adapts the noise level of every pixel to how much it\n"
+    "# changes on its own, which helps with trees and water. Default: reference",
+    0,
+    CONF_OFFSET(background_model),
+    copy_string,
+    print_string
+    },
+    {
     "pre_capture",
     "# Specifies the number of pre-captured (buffered) pictures from before motion\n"
     "# was detected that will be output at motion detection.\n"
@@ -650,6 +761,16 @@ config_param config_params[] = {
     print_int
     },
     {
+    "pre_capture_quality",
+    "# Keep the pre-captured pictures compressed as jpeg with this quality while\n"
+    "# no event needs them, so a long pre_capture takes little memory. Costs one\n"
+    "# jpeg per frame. 0 keeps them uncompressed (default: 0)",
+    0,
+    CONF_OFFSET(pre_capture_quality),
+    copy_int,
+    print_int
+    },
+    {
     "post_capture",
     "# Number of frames to capture after motion is no longer detected (default: 0)",
     0,
@@ -1101,6 +1222,15 @@ config_param config_params[] = {
     print_int
     },
     {
+    "stream_zerocopy",
+    "# Send large stream frames without copying them into the kernel, which\n"
+    "# saves CPU with many clients on Linux 4.14 and later (default: off)",
+    0,
+    CONF_OFFSET(stream_zerocopy),
+    copy_bool,
+    print_bool
+    },
+    {
     "stream_auth_method",
     "# Set the authentication method (default: 0)\n"
     "# 0 = disabled\n"
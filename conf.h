@@ -51,6 +51,12 @@ struct config {
     int noise;
     int noise_tune;
     int minimum_frame_time;
+    int wait_for_frames;
+    int cpu_budget;
+    int camera_threads;
+    int capture_queue;
+    const char *capture_queue_drop;
+    int output_queue;
     int lightswitch;
     int autobright;
     int brightness;
@@ -61,6 +67,7 @@ struct config {
     int roundrobin_frames;
     int roundrobin_skip;
     int pre_capture;
+    int pre_capture_quality;
     int post_capture;
     int switchfilter;
     int ffmpeg_output;
@@ -75,6 +82,7 @@ struct config {
     int stream_maxrate;
     int stream_localhost;
     int stream_limit;
+    int stream_zerocopy;
     int stream_auth_method;
     const char *stream_authentication;
     int stream_preview_scale;
@@ -132,6 +140,7 @@ struct config {
     const char *mmalcam_name;
     const char *mmalcam_control_params;
 #endif
+    const char *synthetic_camera;
     int text_changes;
     const char *text_left;
     const char *text_right;
@@ -141,6 +150,9 @@ struct config {
     const char *area_detect;
     const char *camera_dir;
     int minimum_motion_frames;
+    int detection_threads;
+    int detection_scale;
+    const char *background_model;
     const char *exif_text;
     char *pid_file;
     int argc;
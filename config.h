@@ -0,0 +1,18 @@
+/* Settings */
+#define VERSION "4.0.1+git281b401"
+#define sysconfdir "/usr/local/etc"
+
+/* Optional components */
+/* #undef HAVE_FFMPEG */
+/* #undef HAVE_MMAL */
+/* #undef HAVE_MYSQL */
+#define HAVE_PGSQL
+#define HAVE_SQLITE3
+/* #undef HAVE_BKTR */
+#define HAVE_V4L2
+
+/* Optional headers */
+#define HAVE_LINUX_VIDEODEV2_H
+#define HAVE_SYS_EPOLL_H
+#define HAVE_LINUX_ERRQUEUE_H
+
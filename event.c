@@ -13,6 +13,7 @@
 #include "event.h"
 #include "video_loopback.h"
 #include "video_common.h"
+#include "latency.h"
 
 /* Various functions (most doing the actual action) */
 
@@ -342,8 +343,13 @@ static void event_stream_put(struct context *cnt,
             unsigned char *img, char *dummy1 ATTRIBUTE_UNUSED,
             void *dummy2 ATTRIBUTE_UNUSED, struct timeval *tv1 ATTRIBUTE_UNUSED)
 {
-    if (cnt->conf.stream_port)
+    long long start;
+
+    if (cnt->conf.stream_port) {
+        start = latency_now();
         stream_put(cnt, img);
+        latency_add(cnt, LATENCY_STREAM, start);
+    }
 }
 
 
@@ -0,0 +1,493 @@
+/*
+ *    executor.c
+ *
+ *    Thread pool that runs the motion loops of all cameras on a fixed
+ *    number of worker threads, for systems with many cameras.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    Each camera is a task that runs one pass of its motion loop at a time,
+ *    see motion_task. Instead of sleeping until the next frame is due, the
+ *    pass returns and the camera is run again when it is ready: once its
+ *    frame time is up, and for netcams and cameras with a capture thread
+ *    once a new frame has arrived as well. Waiting for a frame that doesn't
+ *    come ends after a second, like the motion thread would stop waiting.
+ *
+ *    A camera is added to the worker with the fewest cameras. Workers first
+ *    run the ready cameras of their own, and only take a ready camera from
+ *    another worker when that worker hasn't got to it within a millisecond,
+ *    so a camera mostly stays on the same CPU. A camera never runs on two
+ *    workers at once. All of this is kept under a single lock, which is only
+ *    held to pick a camera, never while one runs.
+ *
+ *    Only netcams and synthetic cameras capture on the workers. Other
+ *    cameras always get a capture thread, as a V4L2 device shared by round
+ *    robin stays locked by the thread that captured from it.
+ *
+ *    The watchdog of main covers the cameras of the pool as well. A worker
+ *    can't be killed like a camera thread, so when a pass hangs the worker
+ *    is interrupted with signals until the camera stops, and a spare worker
+ *    takes its place in the meantime, see executor_stuck.
+ */
+#include "motion.h"
+#include "executor.h"
+
+/* Longest a worker waits before looking at the cameras again */
+#define EXECUTOR_MAX_WAIT 100000000LL
+/* Time the worker of a camera has to run it before another one may */
+#define EXECUTOR_STEAL_DELAY 1000000LL
+/* Time a camera waits for a frame before it is run without one */
+#define EXECUTOR_FRAME_WAIT 1000000000LL
+
+struct executor_task {
+    struct context *cnt;
+    struct executor_task *next;     /* Next camera of the same worker */
+    int home;                       /* Worker the camera was added to */
+    int started;
+    int running;
+    int worker;                     /* Worker running the camera */
+    int frames;                     /* Waits for a frame, not only the time */
+    int woken;                      /* A frame arrived since the last pass */
+    long long due;                  /* Monotonic ns when the next pass is due */
+};
+
+struct executor_worker {
+    int nr;
+    pthread_t thread_id;
+    pthread_cond_t wake;
+    int idle;
+    int stuck;                      /* The pass it runs hangs, see executor_stuck */
+    int count;                      /* Cameras added to this worker */
+    struct executor_task *tasks;
+    unsigned long passes;
+    unsigned long stolen;           /* Passes of cameras of other workers */
+};
+
+static struct {
+    executor_func func;
+    int count;                      /* Workers */
+    int size;                       /* Workers there is room for, with spares */
+    struct executor_worker *workers;
+    int finish;
+    pthread_mutex_t lock;
+} executor = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/**
+ * executor_now
+ *      Monotonic time in ns.
+ */
+static long long executor_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * executor_ready_at
+ *      Time the camera is ready to run. Called with the lock held.
+ */
+static long long executor_ready_at(struct executor_task *task)
+{
+    if (!task->started)
+        return 0;
+
+    if (task->frames && !task->woken && !__atomic_load_n(&task->cnt->finish, __ATOMIC_RELAXED))
+        return task->due + EXECUTOR_FRAME_WAIT;
+
+    return task->due;
+}
+
+/**
+ * executor_pick
+ *      Picks the ready camera that has waited longest, preferring the
+ *      cameras of the worker. When none is ready, wait is set to the time
+ *      until the next one is. Called with the lock held.
+ */
+static struct executor_task *executor_pick(struct executor_worker *worker, long long now,
+                                           long long *wait)
+{
+    struct executor_task *task, *best = NULL;
+    long long at, best_at = 0;
+    int i;
+
+    *wait = EXECUTOR_MAX_WAIT;
+
+    for (i = 0; i < executor.count; i++) {
+        struct executor_worker *owner = &executor.workers[(worker->nr + i) % executor.count];
+
+        for (task = owner->tasks; task; task = task->next) {
+            if (task->running)
+                continue;
+
+            at = executor_ready_at(task);
+            if (owner != worker)
+                at += EXECUTOR_STEAL_DELAY;
+
+            if (at > now) {
+                if (at - now < *wait)
+                    *wait = at - now;
+            } else if (!best || at < best_at) {
+                best = task;
+                best_at = at;
+            }
+        }
+    }
+
+    return best;
+}
+
+/**
+ * executor_signal
+ *      Wakes up the worker of a camera, or any idle worker when that one
+ *      is busy. Called with the lock held.
+ */
+static void executor_signal(int home)
+{
+    int i;
+
+    for (i = 0; i < executor.count; i++) {
+        struct executor_worker *worker = &executor.workers[(home + i) % executor.count];
+
+        if (worker->idle) {
+            pthread_cond_signal(&worker->wake);
+            return;
+        }
+    }
+}
+
+/**
+ * executor_remove
+ *      Removes a stopped camera from its worker. Called with the lock held.
+ */
+static void executor_remove(struct executor_task *task)
+{
+    struct executor_worker *owner = &executor.workers[task->home];
+    struct executor_task **prev;
+
+    for (prev = &owner->tasks; *prev; prev = &(*prev)->next) {
+        if (*prev == task) {
+            *prev = task->next;
+            break;
+        }
+    }
+    owner->count--;
+
+    /* The camera may have been added again already. */
+    if (task->cnt->task == task)
+        task->cnt->task = NULL;
+
+    free(task);
+}
+
+/**
+ * executor_loop
+ *      Runs ready cameras until the pool is stopped.
+ */
+static void *executor_loop(void *arg)
+{
+    struct executor_worker *worker = arg;
+    struct executor_task *task;
+    struct context *cnt;
+    struct timespec timeout;
+    long long now, wait, due = 0;
+    char tname[16];
+    int first, stop, frames = 0;
+
+    snprintf(tname, sizeof(tname), "pool%d", worker->nr);
+    MOTION_PTHREAD_SETNAME(tname);
+
+    pthread_mutex_lock(&executor.lock);
+
+    while (!executor.finish) {
+        now = executor_now();
+        task = executor_pick(worker, now, &wait);
+
+        if (!task) {
+            timeout.tv_sec = (now + wait) / 1000000000LL;
+            timeout.tv_nsec = (now + wait) % 1000000000LL;
+            worker->idle = 1;
+            pthread_cond_timedwait(&worker->wake, &executor.lock, &timeout);
+            worker->idle = 0;
+            continue;
+        }
+
+        first = !task->started;
+        task->started = 1;
+        task->running = 1;
+        task->worker = worker->nr;
+        task->woken = 0;
+        worker->passes++;
+        if (task->home != worker->nr)
+            worker->stolen++;
+
+        pthread_mutex_unlock(&executor.lock);
+
+        cnt = task->cnt;
+
+        /* Store the thread number of the camera in TLS for 'MOTION_LOG'. */
+        pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+        stop = executor.func(cnt, first);
+
+        /*
+         * A capture thread sets the pace of its camera, otherwise the pass
+         * set the deadline of the next frame, see mlp_frametiming.
+         */
+        if (!stop) {
+            frames = (cnt->video_dev >= 0 && cnt->capture) || cnt->netcam;
+            if (frames && cnt->capture && !cnt->conf.minimum_frame_time)
+                due = executor_now();
+            else
+                due = cnt->frame_deadline.tv_sec * 1000000000LL + cnt->frame_deadline.tv_nsec;
+        }
+
+        pthread_mutex_lock(&executor.lock);
+        task->running = 0;
+        worker->stuck = 0;
+
+        if (stop) {
+            executor_remove(task);
+        } else {
+            task->frames = frames;
+            task->due = due;
+        }
+    }
+
+    pthread_mutex_unlock(&executor.lock);
+
+    return NULL;
+}
+
+/**
+ * executor_start
+ *      Starts another worker, if there is room for it. Called with the lock
+ *      held.
+ */
+static int executor_start(void)
+{
+    struct executor_worker *worker = &executor.workers[executor.count];
+    pthread_condattr_t attr;
+
+    if (executor.count >= executor.size)
+        return -1;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    memset(worker, 0, sizeof(*worker));
+    worker->nr = executor.count;
+    pthread_cond_init(&worker->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&worker->thread_id, NULL, executor_loop, worker)) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start worker %d of the "
+                   "camera thread pool", worker->nr);
+        pthread_cond_destroy(&worker->wake);
+        return -1;
+    }
+
+    executor.count++;
+
+    return 0;
+}
+
+/**
+ * executor_init
+ *
+ */
+void executor_init(struct context **cnt_list, executor_func func)
+{
+    int i, cameras, threads;
+
+    cameras = 0;
+    for (i = cnt_list[1] != NULL ? 1 : 0; cnt_list[i]; i++)
+        cameras++;
+
+    threads = cnt_list[0]->conf.camera_threads;
+    if (threads <= 0)
+        return;
+    if (threads > cameras)
+        threads = cameras;
+
+    executor.func = func;
+    executor.finish = 0;
+
+    /* Room for a spare worker for each camera whose pass may hang */
+    executor.size = threads + cameras;
+    executor.workers = mymalloc(executor.size * sizeof(*executor.workers));
+
+    /* The workers only look at the count with the lock held. */
+    pthread_mutex_lock(&executor.lock);
+    for (i = 0; i < threads; i++) {
+        if (executor_start() < 0)
+            break;
+    }
+    pthread_mutex_unlock(&executor.lock);
+
+    if (!executor.count) {
+        MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: No camera thread pool, each camera "
+                   "gets a thread of its own");
+        free(executor.workers);
+        executor.workers = NULL;
+        return;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Running %d cameras on a pool of %d threads",
+               cameras, executor.count);
+}
+
+/**
+ * executor_deinit
+ *
+ */
+void executor_deinit(void)
+{
+    struct executor_task *task;
+    unsigned long passes = 0, stolen = 0;
+    int i;
+
+    if (!executor.workers)
+        return;
+
+    pthread_mutex_lock(&executor.lock);
+    executor.finish = 1;
+    for (i = 0; i < executor.count; i++)
+        pthread_cond_signal(&executor.workers[i].wake);
+    pthread_mutex_unlock(&executor.lock);
+
+    for (i = 0; i < executor.count; i++)
+        pthread_join(executor.workers[i].thread_id, NULL);
+
+    for (i = 0; i < executor.count; i++) {
+        struct executor_worker *worker = &executor.workers[i];
+
+        /* Only cameras that never started can be left. */
+        while ((task = worker->tasks))
+            executor_remove(task);
+
+        passes += worker->passes;
+        stolen += worker->stolen;
+        pthread_cond_destroy(&worker->wake);
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Camera thread pool stopped after %lu passes, "
+               "%lu of them taken over from another worker", passes, stolen);
+
+    free(executor.workers);
+    executor.workers = NULL;
+    executor.count = 0;
+    executor.size = 0;
+}
+
+/**
+ * executor_add
+ *
+ */
+int executor_add(struct context *cnt)
+{
+    struct executor_task *task;
+    int i, home = 0;
+
+    if (!executor.workers)
+        return -1;
+
+    task = mymalloc(sizeof(*task));
+    task->cnt = cnt;
+
+    pthread_mutex_lock(&executor.lock);
+
+    for (i = 1; i < executor.count; i++) {
+        if (executor.workers[i].count < executor.workers[home].count)
+            home = i;
+    }
+
+    task->home = home;
+    task->next = executor.workers[home].tasks;
+    executor.workers[home].tasks = task;
+    executor.workers[home].count++;
+    cnt->task = task;
+
+    executor_signal(home);
+    pthread_mutex_unlock(&executor.lock);
+
+    return 0;
+}
+
+/**
+ * executor_stuck
+ *
+ */
+int executor_stuck(struct context *cnt)
+{
+    struct executor_worker *worker;
+    struct executor_task *task;
+
+    if (!executor.workers)
+        return -1;
+
+    pthread_mutex_lock(&executor.lock);
+
+    task = cnt->task;
+    if (!task) {
+        pthread_mutex_unlock(&executor.lock);
+        return -1;
+    }
+
+    /* Not run at all, the camera finishes once a worker gets to it. */
+    if (!task->running) {
+        pthread_mutex_unlock(&executor.lock);
+        return 0;
+    }
+
+    worker = &executor.workers[task->worker];
+
+    /* Interrupts a blocking call, like for a camera thread. */
+    pthread_kill(worker->thread_id, SIGVTALRM);
+
+    if (!worker->stuck) {
+        worker->stuck = 1;
+
+        if (executor_start() == 0) {
+            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Thread %d - Watchdog timeout, worker %d "
+                       "of the camera thread pool is stuck, started worker %d instead",
+                       cnt->threadnr, worker->nr, executor.count - 1);
+        } else {
+            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Thread %d - Watchdog timeout, worker %d "
+                       "of the camera thread pool is stuck", cnt->threadnr, worker->nr);
+        }
+    }
+
+    pthread_mutex_unlock(&executor.lock);
+
+    return 0;
+}
+
+/**
+ * executor_wake
+ *
+ */
+void executor_wake(struct context *cnt)
+{
+    struct executor_task *task;
+
+    /* The pool outlives the capture threads and netcams of the cameras. */
+    if (!executor.workers)
+        return;
+
+    pthread_mutex_lock(&executor.lock);
+
+    task = cnt->task;
+    if (task && !task->woken) {
+        task->woken = 1;
+        if (!task->running)
+            executor_signal(task->home);
+    }
+
+    pthread_mutex_unlock(&executor.lock);
+}
@@ -0,0 +1,96 @@
+/*
+ *    executor.h
+ *
+ *    Include file for the thread pool that runs the cameras when
+ *    camera_threads is set, instead of a thread for each camera.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_EXECUTOR_H
+#define _INCLUDE_EXECUTOR_H
+
+#include "motion.h"
+
+/*
+ * Runs one pass of the motion loop of a camera, see motion_task. first is
+ * set on the first pass after the camera was added. Returns 1 when the
+ * camera has stopped.
+ */
+typedef int (*executor_func)(struct context *cnt, int first);
+
+/**
+ * executor_init
+ *
+ *  Starts camera_threads worker threads, but no more than there are cameras.
+ *  Nothing is started when camera_threads is 0, the cameras then each get a
+ *  thread of their own. Called before the cameras start, again after a
+ *  restart.
+ *
+ * Parameters:
+ *
+ *   cnt_list - list of all contexts, the first one is the global context
+ *   func     - function that runs a pass of the motion loop
+ *
+ * Returns: nothing
+ */
+void executor_init(struct context **cnt_list, executor_func func);
+
+/**
+ * executor_deinit
+ *
+ *  Stops the worker threads. Called once the cameras have stopped.
+ *
+ * Parameters: none
+ *
+ * Returns: nothing
+ */
+void executor_deinit(void);
+
+/**
+ * executor_add
+ *
+ *  Adds a camera to the pool. Its passes of the motion loop then run on
+ *  whichever worker is free when a frame is ready, until the pass returns
+ *  that the camera stopped.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: 0 when added, -1 when there is no pool
+ */
+int executor_add(struct context *cnt);
+
+/**
+ * executor_stuck
+ *
+ *  Called from the watchdog of main for a camera that didn't finish in
+ *  time. A worker can't be killed, so the one running the camera is sent
+ *  SIGVTALRM to break out of a blocking call, and the first time another
+ *  worker is started to take its place. The stuck worker stays in the pool
+ *  once its pass returns, until the pool stops.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: 0 when the camera is on the pool, -1 when it has a thread
+ */
+int executor_stuck(struct context *cnt);
+
+/**
+ * executor_wake
+ *
+ *  Tells the pool that the capture thread or the netcam handler has a new
+ *  frame for the camera. Does nothing without a pool.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void executor_wake(struct context *cnt);
+
+#endif /* _INCLUDE_EXECUTOR_H */
@@ -0,0 +1,151 @@
+/*
+ *    governor.c
+ *
+ *    Load governor that keeps the cameras within cpu_budget by lowering
+ *    the detection rate of cameras that have no event going on.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    All cameras share one measurement, the CPU time of the whole process,
+ *    so the streams, encoders and capture threads count as well. The camera
+ *    thread that first sees the second end does the measurement, the others
+ *    only read the resulting skip count. Cameras in an event keep their full
+ *    detection rate, the idle ones still capture every frame for the
+ *    pre_capture ring and the streams but run the detection on fewer.
+ */
+#include "motion.h"
+#include "governor.h"
+
+static struct {
+    int budget;                     /* Percent of all CPUs, 0 = off */
+    int cpus;
+    int load;                       /* Percent used in the last second */
+    int skip;                       /* Frames skipped by idle cameras */
+    struct timespec wall;           /* Start of the measurement */
+    struct timespec cpu;
+    pthread_mutex_t lock;
+} governor = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/**
+ * governor_update
+ *      Measures the load once a second and adjusts the skip count.
+ */
+static void governor_update(void)
+{
+    struct timespec wall, cpu;
+    long long wall_us, cpu_us;
+    int skip;
+
+    if (pthread_mutex_trylock(&governor.lock))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    wall_us = (wall.tv_sec - governor.wall.tv_sec) * 1000000LL +
+              (wall.tv_nsec - governor.wall.tv_nsec) / 1000;
+
+    if (wall_us < 1000000) {
+        pthread_mutex_unlock(&governor.lock);
+        return;
+    }
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    cpu_us = (cpu.tv_sec - governor.cpu.tv_sec) * 1000000LL +
+             (cpu.tv_nsec - governor.cpu.tv_nsec) / 1000;
+
+    governor.wall = wall;
+    governor.cpu = cpu;
+    governor.load = cpu_us * 100 / (wall_us * governor.cpus);
+
+    /* Back off only well below the budget, so the skip doesn't flap. */
+    skip = governor.skip;
+    if (governor.load > governor.budget && skip < GOVERNOR_MAX_SKIP)
+        skip++;
+    else if (governor.load < governor.budget * 3 / 4 && skip > 0)
+        skip--;
+
+    if (skip != governor.skip) {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Load %d%% of %d CPUs, budget %d%%. "
+                   "Idle cameras now skip %d frames per detection",
+                   governor.load, governor.cpus, governor.budget, skip);
+        __atomic_store_n(&governor.skip, skip, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&governor.lock);
+}
+
+/**
+ * governor_init
+ *
+ */
+void governor_init(struct context *cnt)
+{
+    pthread_mutex_lock(&governor.lock);
+
+    governor.budget = cnt->conf.cpu_budget;
+    governor.cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (governor.cpus < 1)
+        governor.cpus = 1;
+    governor.load = 0;
+    governor.skip = 0;
+    clock_gettime(CLOCK_MONOTONIC, &governor.wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &governor.cpu);
+
+    pthread_mutex_unlock(&governor.lock);
+
+    if (governor.budget > 0)
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Shedding detection of idle cameras above "
+                   "%d%% of %d CPUs", governor.budget, governor.cpus);
+}
+
+/**
+ * governor_detect
+ *
+ */
+int governor_detect(struct context *cnt)
+{
+    int skip;
+
+    if (governor.budget <= 0)
+        return 1;
+
+    governor_update();
+
+    skip = __atomic_load_n(&governor.skip, __ATOMIC_RELAXED);
+
+    /*
+     * Full rate from the first frame with motion until the event ends, so
+     * minimum_motion_frames and the event itself see every frame. Here
+     * current_image is still the previous frame.
+     */
+    if (cnt->event_nr == cnt->prev_event ||
+        (cnt->current_image && (cnt->current_image->flags & IMAGE_MOTION)))
+        skip = 0;
+    else if (skip && cnt->rolling_average > cnt->required_frame_time * 5 / 4)
+        skip++;
+
+    cnt->shed_skip = skip;
+
+    if (cnt->shed_count >= skip) {
+        cnt->shed_count = 0;
+        return 1;
+    }
+
+    cnt->shed_count++;
+    cnt->frames_shed++;
+
+    return 0;
+}
+
+/**
+ * governor_load
+ *
+ */
+int governor_load(int *skip)
+{
+    *skip = __atomic_load_n(&governor.skip, __ATOMIC_RELAXED);
+
+    return governor.load;
+}
@@ -0,0 +1,60 @@
+/*
+ *    governor.h
+ *
+ *    Include file for the load governor that sheds detection work of idle
+ *    cameras when the cameras together use more CPU than cpu_budget.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_GOVERNOR_H
+#define _INCLUDE_GOVERNOR_H
+
+#include "motion.h"
+
+/* Most frames an idle camera skips for each one it processes */
+#define GOVERNOR_MAX_SKIP 9
+
+/**
+ * governor_init
+ *
+ *  Reads cpu_budget and starts measuring the CPU time of the process.
+ *  Called before the camera threads start, again after a restart.
+ *
+ * Parameters:
+ *
+ *   cnt - global context structure
+ *
+ * Returns: nothing
+ */
+void governor_init(struct context *cnt);
+
+/**
+ * governor_detect
+ *
+ *  Decides whether the detection may run on a frame the camera would
+ *  otherwise process. Once a second the CPU time used since the last check
+ *  is compared to cpu_budget. While the process is over its budget every
+ *  idle camera skips one more frame for each frame it processes, up to
+ *  GOVERNOR_MAX_SKIP, and while it is well below one less. A camera that
+ *  sees motion or is in an event always processes its frames. An idle
+ *  camera that takes longer than its frame time skips one more than the
+ *  others.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: 1 to run the detection, 0 to skip it
+ */
+int governor_detect(struct context *cnt);
+
+/**
+ * governor_load
+ *
+ *  Returns the percentage of all CPUs the process used in the last second
+ *  that was measured, and stores the frames idle cameras skip in skip.
+ */
+int governor_load(int *skip);
+
+#endif /* _INCLUDE_GOVERNOR_H */
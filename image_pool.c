@@ -0,0 +1,453 @@
+/*
+ *    image_pool.c
+ *
+ *    Reference counted image buffers, so a frame can be passed between
+ *    the capture thread, the image ring, the detection, the preview and
+ *    the output thread without copying it.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    A captured frame is never written to once it is shared. Overlays such
+ *    as the text and the locate box are drawn on a copy made by
+ *    image_writable, only for the frames that get them, while the
+ *    detection keeps reading the untouched frame through image_virgin.
+ *
+ *    Each buffer has a small header in front of the image with the
+ *    reference count and the pool it returns to. The header is as large as
+ *    a cache line, which keeps the image itself aligned.
+ *
+ *    The buffers, and the other planes a camera needs for as long as it
+ *    runs, are carved from a few large blocks of memory instead of being
+ *    allocated one by one. The first block is sized at start for all the
+ *    frames the configuration can hold at once. Blocks are mapped with huge
+ *    pages when the system has them reserved, otherwise the kernel is asked
+ *    to back them with transparent huge pages. Nothing is returned before
+ *    the camera stops, so resizing the ring only moves buffers through the
+ *    free list.
+ *
+ *    A buffer also keeps the jpegs made of it, one per quality, so the
+ *    stream, the pictures and the snapshots of a frame compress it once.
+ *    They are added without a lock and are only dropped by the holder of the
+ *    last reference, when the buffer is written to or returns to the pool.
+ *    A jpeg has a reference count of its own, as the stream server may still
+ *    be sending it after the buffer has moved on.
+ */
+#include <sys/mman.h>
+
+#include "motion.h"
+#include "image_pool.h"
+
+#define IMAGE_HEADER_SIZE 64
+#define IMAGE_ALIGN(x) (((x) + 63) & ~(size_t)63)
+
+/* Blocks are a multiple of the usual huge page size */
+#define ARENA_PAGE (2 * 1024 * 1024)
+#define ARENA_ROUND(x) (((x) + ARENA_PAGE - 1) & ~(size_t)(ARENA_PAGE - 1))
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;                    /* Bytes in the block, header included */
+    size_t used;
+    int mapped;                     /* 0 malloc, 1 mmap, 2 mmap with MAP_HUGETLB */
+};
+
+struct image_buffer {
+    struct image_pool *pool;
+    struct image_buffer *next;      /* Next free buffer */
+    int refs;
+    struct image_jpeg *jpeg;        /* The image compressed, see image_jpeg_add */
+};
+
+struct image_pool {
+    size_t size;
+    size_t stride;                  /* Bytes per buffer, header included */
+    int count;                      /* Buffers allocated */
+    struct image_buffer *free;
+    struct arena_block *blocks;
+    size_t total;                   /* Bytes in all blocks */
+    pthread_mutex_t lock;
+};
+
+/**
+ * arena_map
+ *      Maps a block of memory, with huge pages if possible.
+ */
+static struct arena_block *arena_map(size_t size)
+{
+    struct arena_block *block;
+    void *map;
+    int mapped = 1;
+
+    map = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED)
+        mapped = 2;
+#endif
+    if (map == MAP_FAILED)
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (map == MAP_FAILED) {
+        /* Aligned like a mapped block, and zeroed like one. Exits like mymalloc. */
+        errno = posix_memalign(&map, IMAGE_HEADER_SIZE, size);
+        if (errno) {
+            MOTION_LOG(EMG, TYPE_ALL, SHOW_ERRNO, "%s: Could not allocate %llu bytes of "
+                       "image memory!", (unsigned long long)size);
+            exit(1);
+        }
+        memset(map, 0, size);
+        mapped = 0;
+    }
+#ifdef MADV_HUGEPAGE
+    else if (mapped == 1)
+        madvise(map, size, MADV_HUGEPAGE);
+#endif
+
+    block = map;
+    block->size = size;
+    block->used = IMAGE_ALIGN(sizeof(*block));
+    block->mapped = mapped;
+
+    return block;
+}
+
+/**
+ * arena_take
+ *      Carves size bytes from the blocks of the pool, mapping a new block
+ *      when none has room. The memory is zeroed and aligned to a cache line.
+ *      Called with the lock of the pool held.
+ */
+static void *arena_take(struct image_pool *pool, size_t size)
+{
+    struct arena_block *block;
+    size_t bytes;
+    void *mem;
+
+    size = IMAGE_ALIGN(size);
+
+    for (block = pool->blocks; block; block = block->next) {
+        if (block->size - block->used >= size)
+            break;
+    }
+
+    if (!block) {
+        /* Each block is at least as large as all before it together. */
+        bytes = IMAGE_ALIGN(sizeof(*block)) + size;
+        if (bytes < pool->total)
+            bytes = pool->total;
+
+        block = arena_map(ARENA_ROUND(bytes));
+        block->next = pool->blocks;
+        pool->blocks = block;
+        pool->total += block->size;
+
+        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Image memory grew to %lu kB in %s",
+                   (unsigned long)(pool->total / 1024),
+                   block->mapped == 2 ? "huge pages" : "normal pages");
+    }
+
+    mem = (unsigned char *)block + block->used;
+    block->used += size;
+
+    return mem;
+}
+
+/**
+ * buffer_of
+ *      Header of the buffer an image is in.
+ */
+static struct image_buffer *buffer_of(unsigned char *image)
+{
+    return (struct image_buffer *)(image - IMAGE_HEADER_SIZE);
+}
+
+/**
+ * image_jpeg_drop
+ *      Drops the compressed copies of an image that is about to change or
+ *      return to the pool. Only the holder of the last reference calls it.
+ */
+static void image_jpeg_drop(struct image_buffer *buffer)
+{
+    struct image_jpeg *jpeg;
+
+    while ((jpeg = buffer->jpeg)) {
+        buffer->jpeg = jpeg->next;
+        image_jpeg_unref(jpeg);
+    }
+}
+
+/**
+ * image_pool_get
+ *      Takes a free buffer or carves a new one from the blocks.
+ */
+static unsigned char *image_pool_get(struct image_pool *pool)
+{
+    struct image_buffer *buffer;
+
+    pthread_mutex_lock(&pool->lock);
+
+    buffer = pool->free;
+    if (buffer) {
+        pool->free = buffer->next;
+    } else {
+        buffer = arena_take(pool, pool->stride);
+        buffer->pool = pool;
+        pool->count++;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    buffer->next = NULL;
+    buffer->refs = 1;
+
+    return (unsigned char *)buffer + IMAGE_HEADER_SIZE;
+}
+
+/**
+ * image_pool_init
+ *
+ */
+void image_pool_init(struct context *cnt)
+{
+    struct image_pool *pool;
+    int frames;
+
+    pool = mymalloc(sizeof(*pool));
+    pool->size = cnt->imgs.size;
+    pool->stride = IMAGE_HEADER_SIZE + IMAGE_ALIGN(pool->size);
+    pthread_mutex_init(&pool->lock, NULL);
+
+    /*
+     * Room for the ring, the queues, image_virgin, the preview and a copy
+     * made by image_writable, so a camera normally lives in the first block.
+     */
+    frames = cnt->conf.minimum_motion_frames + 3;
+    /* A compressed pre_capture ring only takes buffers while they are output */
+    if (cnt->conf.pre_capture_quality <= 0)
+        frames += cnt->conf.pre_capture;
+    if (cnt->conf.capture_queue > 0)
+        frames += cnt->conf.capture_queue + 2;
+    if (cnt->conf.output_queue > 0)
+        frames += cnt->conf.output_queue;
+
+    pool->blocks = arena_map(ARENA_ROUND(IMAGE_ALIGN(sizeof(struct arena_block)) +
+                                         frames * pool->stride));
+    pool->total = pool->blocks->size;
+
+    cnt->imgs.pool = pool;
+}
+
+/**
+ * image_pool_deinit
+ *
+ */
+void image_pool_deinit(struct context *cnt)
+{
+    struct image_pool *pool = cnt->imgs.pool;
+    struct image_buffer *buffer;
+    struct arena_block *block;
+    int count = 0;
+
+    if (!pool)
+        return;
+
+    for (buffer = pool->free; buffer; buffer = buffer->next)
+        count++;
+
+    cnt->imgs.pool = NULL;
+
+    /* Buffers still in use would return to unmapped memory, so keep it. */
+    if (count != pool->count) {
+        MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: %d image buffers still in use",
+                   pool->count - count);
+        return;
+    }
+
+    while ((block = pool->blocks)) {
+        pool->blocks = block->next;
+        if (block->mapped)
+            munmap(block, block->size);
+        else
+            free(block);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/**
+ * image_pool_alloc
+ *
+ */
+void *image_pool_alloc(struct context *cnt, size_t size)
+{
+    struct image_pool *pool = cnt->imgs.pool;
+    void *mem;
+
+    pthread_mutex_lock(&pool->lock);
+    mem = arena_take(pool, size);
+    pthread_mutex_unlock(&pool->lock);
+
+    return mem;
+}
+
+/**
+ * image_pool_report
+ *
+ */
+void image_pool_report(struct context *cnt)
+{
+    struct image_pool *pool = cnt->imgs.pool;
+    struct arena_block *block;
+    size_t used = 0;
+    int blocks = 0, huge = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (block = pool->blocks; block; block = block->next) {
+        used += block->used;
+        blocks++;
+        if (block->mapped == 2)
+            huge++;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Image memory %lu kB in %d blocks, %d with huge "
+               "pages, %lu kB used, %d image buffers of %lu bytes",
+               (unsigned long)(pool->total / 1024), blocks, huge,
+               (unsigned long)(used / 1024), pool->count, (unsigned long)pool->stride);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * image_get
+ *
+ */
+unsigned char *image_get(struct context *cnt)
+{
+    return image_pool_get(cnt->imgs.pool);
+}
+
+/**
+ * image_ref
+ *
+ */
+unsigned char *image_ref(unsigned char *image)
+{
+    __atomic_add_fetch(&buffer_of(image)->refs, 1, __ATOMIC_RELAXED);
+
+    return image;
+}
+
+/**
+ * image_unref
+ *
+ */
+void image_unref(unsigned char *image)
+{
+    struct image_buffer *buffer;
+    struct image_pool *pool;
+
+    if (!image)
+        return;
+
+    buffer = buffer_of(image);
+    if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    image_jpeg_drop(buffer);
+
+    pool = buffer->pool;
+    pthread_mutex_lock(&pool->lock);
+    buffer->next = pool->free;
+    pool->free = buffer;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * image_writable
+ *
+ */
+void image_writable(unsigned char **image)
+{
+    struct image_buffer *buffer = buffer_of(*image);
+    unsigned char *copy;
+
+    /* Only the holder of the last reference can see a count of 1. */
+    if (__atomic_load_n(&buffer->refs, __ATOMIC_ACQUIRE) == 1) {
+        /* It is written to in place, so the jpegs of it are outdated. */
+        image_jpeg_drop(buffer);
+        return;
+    }
+
+    copy = image_pool_get(buffer->pool);
+    memcpy(copy, *image, buffer->pool->size);
+    image_unref(*image);
+    *image = copy;
+}
+
+/**
+ * image_jpeg_find
+ *
+ */
+struct image_jpeg *image_jpeg_find(unsigned char *image, int quality)
+{
+    struct image_jpeg *jpeg;
+
+    for (jpeg = __atomic_load_n(&buffer_of(image)->jpeg, __ATOMIC_ACQUIRE); jpeg; jpeg = jpeg->next) {
+        if (jpeg->quality == quality)
+            return jpeg;
+    }
+
+    return NULL;
+}
+
+/**
+ * image_jpeg_add
+ *
+ */
+struct image_jpeg *image_jpeg_add(unsigned char *image, struct image_jpeg *jpeg)
+{
+    struct image_buffer *buffer = buffer_of(image);
+    struct image_jpeg *head, *other;
+
+    head = __atomic_load_n(&buffer->jpeg, __ATOMIC_ACQUIRE);
+
+    do {
+        /* Another thread may have compressed it at the same time. */
+        for (other = head; other; other = other->next) {
+            if (other->quality == jpeg->quality) {
+                free(jpeg);
+                return other;
+            }
+        }
+        jpeg->next = head;
+        jpeg->ref = 1;
+    } while (!__atomic_compare_exchange_n(&buffer->jpeg, &head, jpeg, 0,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+    return jpeg;
+}
+
+/**
+ * image_jpeg_ref
+ *
+ */
+struct image_jpeg *image_jpeg_ref(struct image_jpeg *jpeg)
+{
+    __atomic_add_fetch(&jpeg->ref, 1, __ATOMIC_RELAXED);
+
+    return jpeg;
+}
+
+/**
+ * image_jpeg_unref
+ *
+ */
+void image_jpeg_unref(struct image_jpeg *jpeg)
+{
+    if (jpeg && !__atomic_sub_fetch(&jpeg->ref, 1, __ATOMIC_ACQ_REL))
+        free(jpeg);
+}
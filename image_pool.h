@@ -0,0 +1,196 @@
+/*
+ *    image_pool.h
+ *
+ *    Include file for the reference counted image buffers of a camera and
+ *    the memory they are carved from.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_IMAGE_POOL_H
+#define _INCLUDE_IMAGE_POOL_H
+
+#include "motion.h"
+
+/* A jpeg of an image, see image_jpeg_add */
+struct image_jpeg {
+    struct image_jpeg *next;
+    int ref;                        /* The buffer's and those of image_jpeg_ref */
+    int quality;
+    int size;
+    unsigned char data[];
+};
+
+/**
+ * image_pool_init
+ *
+ *  Creates the pool of image buffers of imgs.size bytes, and maps a block
+ *  large enough for the frames the configuration can hold at once. More
+ *  blocks are only mapped when the pool runs out, and buffers are kept for
+ *  reuse after that.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void image_pool_init(struct context *cnt);
+
+/**
+ * image_pool_deinit
+ *
+ *  Frees the pool and unmaps its blocks, including the memory handed out by
+ *  image_pool_alloc. All buffers must have been released by then.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void image_pool_deinit(struct context *cnt);
+
+/**
+ * image_pool_alloc
+ *
+ *  Allocates zeroed memory from the blocks of the pool, aligned to a cache
+ *  line. It is only freed together with the pool, so it is meant for the
+ *  planes a camera keeps until it stops.
+ *
+ * Parameters:
+ *
+ *   cnt  - current thread's context structure
+ *   size - number of bytes
+ *
+ * Returns: the memory, the process exits when none is left
+ */
+void *image_pool_alloc(struct context *cnt, size_t size);
+
+/**
+ * image_pool_report
+ *
+ *  Logs the memory mapped for the camera and how much of it is used.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void image_pool_report(struct context *cnt);
+
+/**
+ * image_get
+ *
+ *  Takes a buffer from the pool. The contents are undefined.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: the buffer, with a single reference held by the caller
+ */
+unsigned char *image_get(struct context *cnt);
+
+/**
+ * image_ref
+ *
+ *  Adds a reference to a buffer. A buffer with more than one reference is
+ *  shared and must not be written to, see image_writable.
+ *
+ * Parameters:
+ *
+ *   image - buffer from image_get
+ *
+ * Returns: image
+ */
+unsigned char *image_ref(unsigned char *image);
+
+/**
+ * image_unref
+ *
+ *  Drops a reference. The last one returns the buffer to its pool.
+ *
+ * Parameters:
+ *
+ *   image - buffer from image_get, or NULL
+ *
+ * Returns: nothing
+ */
+void image_unref(unsigned char *image);
+
+/**
+ * image_writable
+ *
+ *  Makes sure a buffer can be written to. A shared buffer is replaced by a
+ *  copy, and the reference to the shared one is dropped.
+ *
+ * Parameters:
+ *
+ *   image - pointer to the caller's reference to the buffer
+ *
+ * Returns: nothing
+ */
+void image_writable(unsigned char **image);
+
+/**
+ * image_jpeg_find
+ *
+ *  Looks for a jpeg of a buffer made with the given quality.
+ *
+ * Parameters:
+ *
+ *   image   - buffer from image_get
+ *   quality - jpeg quality
+ *
+ * Returns: the jpeg, valid for as long as the caller holds its reference to
+ *          the buffer, or NULL
+ */
+struct image_jpeg *image_jpeg_find(unsigned char *image, int quality);
+
+/**
+ * image_jpeg_add
+ *
+ *  Keeps a jpeg with a buffer until the buffer is written to or returns to
+ *  the pool, for the other users of the same frame. When another thread has
+ *  added one of the same quality in the meantime, that one is kept instead.
+ *
+ * Parameters:
+ *
+ *   image - buffer from image_get
+ *   jpeg  - jpeg from malloc, which the buffer takes over
+ *
+ * Returns: the jpeg kept, valid for as long as the caller holds its reference
+ *          to the buffer
+ */
+struct image_jpeg *image_jpeg_add(unsigned char *image, struct image_jpeg *jpeg);
+
+/**
+ * image_jpeg_ref
+ *
+ *  Keeps a jpeg of a buffer after the caller's reference to the buffer is
+ *  gone, for the stream clients that still send it.
+ *
+ * Parameters:
+ *
+ *   jpeg - jpeg from image_jpeg_find or image_jpeg_add
+ *
+ * Returns: jpeg
+ */
+struct image_jpeg *image_jpeg_ref(struct image_jpeg *jpeg);
+
+/**
+ * image_jpeg_unref
+ *
+ *  Drops a reference from image_jpeg_ref. Any thread may drop the last one.
+ *
+ * Parameters:
+ *
+ *   jpeg - jpeg from image_jpeg_ref, or NULL
+ *
+ * Returns: nothing
+ */
+void image_jpeg_unref(struct image_jpeg *jpeg);
+
+#endif /* _INCLUDE_IMAGE_POOL_H */
@@ -0,0 +1,404 @@
+/*
+ *    latency.c
+ *
+ *    Histograms of the time each camera spends in the stages of the motion
+ *    loop, to find out which stage uses up the frame time of a camera.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    Each stage of a camera has a histogram with buckets that grow with the
+ *    time, like an HDR histogram, so a few hundred counters cover times from
+ *    a microsecond to a minute within 1/8. The motion loop, the capture
+ *    thread and the output thread add to them without a lock, and the
+ *    webcontrol reads them at any time, see latency_prometheus. A reader
+ *    may see a time in the count but not yet in the sum, which is close
+ *    enough for statistics.
+ */
+#include "motion.h"
+#include "latency.h"
+#include <stdarg.h>
+
+struct latency_histogram {
+    unsigned long count[LATENCY_BUCKETS];
+    unsigned long long sum;         /* ns */
+    unsigned long max;              /* us */
+};
+
+struct latency {
+    struct latency_histogram stage[LATENCY_STAGES];
+    struct latency_histogram mark[LATENCY_STAGES];  /* As of the last latency_interval */
+};
+
+/* Text that grows as it is written, see latency_printf */
+struct latency_text {
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+static const char *latency_names[LATENCY_STAGES] = {
+    "capture", "decode", "rotate", "detection", "despeckle",
+    "overlay", "event", "encode", "stream", "frame"
+};
+
+/**
+ * latency_bucket
+ *      Bucket of a time in us.
+ */
+static int latency_bucket(unsigned long long usec)
+{
+    int shift;
+
+    if (usec < (2U << LATENCY_SUB_BITS))
+        return usec;
+
+    if (usec >> LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+
+    shift = 63 - __builtin_clzll(usec) - LATENCY_SUB_BITS;
+
+    return ((shift + 1) << LATENCY_SUB_BITS) + (usec >> shift) - (1 << LATENCY_SUB_BITS);
+}
+
+/**
+ * latency_upper
+ *      First time in us after a bucket.
+ */
+static unsigned long latency_upper(int bucket)
+{
+    int shift;
+
+    if (bucket < (2 << LATENCY_SUB_BITS))
+        return bucket + 1;
+
+    shift = (bucket >> LATENCY_SUB_BITS) - 1;
+
+    return (unsigned long)((bucket & ((1 << LATENCY_SUB_BITS) - 1)) + (1 << LATENCY_SUB_BITS) + 1) << shift;
+}
+
+/**
+ * latency_read
+ *      Copies the histogram of a stage, returns the number of times in it.
+ */
+static unsigned long latency_read(struct context *cnt, int stage, struct latency_histogram *hist)
+{
+    struct latency *latency = __atomic_load_n(&cnt->latency, __ATOMIC_ACQUIRE);
+    unsigned long total = 0;
+    int i;
+
+    if (!latency) {
+        memset(hist, 0, sizeof(*hist));
+        return 0;
+    }
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        hist->count[i] = __atomic_load_n(&latency->stage[stage].count[i], __ATOMIC_RELAXED);
+        total += hist->count[i];
+    }
+    hist->sum = __atomic_load_n(&latency->stage[stage].sum, __ATOMIC_RELAXED);
+    hist->max = __atomic_load_n(&latency->stage[stage].max, __ATOMIC_RELAXED);
+
+    return total;
+}
+
+/**
+ * latency_percentile
+ *      Time in ms below which the given part of the times are, the upper
+ *      end of the bucket but no more than the maximum.
+ */
+static double latency_percentile(struct latency_histogram *hist, unsigned long total,
+                                 double percent)
+{
+    unsigned long seen = 0, upper;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        seen += hist->count[i];
+        if (seen >= total * percent / 100)
+            break;
+    }
+
+    upper = latency_upper(i);
+    if (i == LATENCY_BUCKETS - 1 || upper > hist->max)
+        upper = hist->max;
+
+    return upper / 1000.0;
+}
+
+/**
+ * latency_fill
+ *      Fills in the stats of a histogram.
+ */
+static void latency_fill(struct latency_histogram *hist, unsigned long total,
+                         struct latency_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!total)
+        return;
+
+    stats->count = total;
+    stats->p50 = latency_percentile(hist, total, 50);
+    stats->p90 = latency_percentile(hist, total, 90);
+    stats->p99 = latency_percentile(hist, total, 99);
+    stats->max = hist->max / 1000.0;
+}
+
+/**
+ * latency_printf
+ *      Appends to a text.
+ */
+static void latency_printf(struct latency_text *text, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(text->buf + text->len, text->size - text->len, fmt, ap);
+        va_end(ap);
+
+        if (n >= 0 && text->len + n < text->size)
+            break;
+
+        text->size = text->size * 2 + n + 1;
+        text->buf = myrealloc(text->buf, text->size, "latency_printf");
+    }
+
+    text->len += n;
+}
+
+/**
+ * latency_text_start
+ *      Starts an empty text.
+ */
+static void latency_text_start(struct latency_text *text)
+{
+    text->size = 4096;
+    text->buf = mymalloc(text->size);
+    text->len = 0;
+}
+
+/**
+ * latency_init
+ *
+ */
+void latency_init(struct context *cnt)
+{
+    if (cnt->latency)
+        return;
+
+    /* The webcontrol may look at the histograms while they are set up. */
+    __atomic_store_n(&cnt->latency, mymalloc(sizeof(struct latency)), __ATOMIC_RELEASE);
+}
+
+/**
+ * latency_free
+ *
+ */
+void latency_free(struct context *cnt)
+{
+    free(cnt->latency);
+    cnt->latency = NULL;
+}
+
+/**
+ * latency_now
+ *
+ */
+long long latency_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * latency_add
+ *
+ */
+void latency_add(struct context *cnt, enum latency_stage stage, long long start)
+{
+    struct latency_histogram *hist;
+    long long nsec;
+    unsigned long usec;
+
+    if (!cnt->latency)
+        return;
+
+    nsec = latency_now() - start;
+    if (nsec < 0)
+        nsec = 0;
+    usec = nsec / 1000;
+
+    hist = &cnt->latency->stage[stage];
+    __atomic_fetch_add(&hist->count[latency_bucket(usec)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, nsec, __ATOMIC_RELAXED);
+
+    /* A maximum missed while two threads race is soon set again. */
+    if (usec > __atomic_load_n(&hist->max, __ATOMIC_RELAXED))
+        __atomic_store_n(&hist->max, usec, __ATOMIC_RELAXED);
+}
+
+/**
+ * latency_stats
+ *
+ */
+void latency_stats(struct context *cnt, enum latency_stage stage, struct latency_stats *stats)
+{
+    struct latency_histogram hist;
+
+    latency_fill(&hist, latency_read(cnt, stage, &hist), stats);
+}
+
+/**
+ * latency_interval
+ *
+ */
+void latency_interval(struct context *cnt, enum latency_stage stage, struct latency_stats *stats)
+{
+    struct latency_histogram hist, *mark;
+    unsigned long count, total = 0;
+    int i;
+
+    latency_read(cnt, stage, &hist);
+    if (!cnt->latency) {
+        latency_fill(&hist, 0, stats);
+        return;
+    }
+
+    /* Only this thread writes the mark, so the difference is all new times. */
+    mark = &cnt->latency->mark[stage];
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        count = hist.count[i];
+        hist.count[i] -= mark->count[i];
+        mark->count[i] = count;
+        total += hist.count[i];
+    }
+
+    latency_fill(&hist, total, stats);
+    if (total)
+        stats->max = latency_percentile(&hist, total, 100);
+}
+
+/**
+ * latency_summary
+ *
+ */
+void latency_summary(struct context *cnt, char *buf, size_t size)
+{
+    struct latency_histogram hist;
+    unsigned long total;
+    size_t len = 0;
+    int stage;
+
+    buf[0] = '\0';
+
+    for (stage = 0; stage < LATENCY_STAGES && len < size; stage++) {
+        total = latency_read(cnt, stage, &hist);
+        if (!total)
+            continue;
+
+        len += snprintf(buf + len, size - len, "%s%s %.2f/%.2f", len ? " " : "",
+                        latency_names[stage], latency_percentile(&hist, total, 50),
+                        latency_percentile(&hist, total, 99));
+    }
+}
+
+/**
+ * latency_prometheus
+ *
+ */
+char *latency_prometheus(struct context **cnt_list, int thread)
+{
+    struct latency_text text;
+    struct latency_histogram hist;
+    unsigned long total, seen;
+    int i, stage, bucket, bits;
+
+    latency_text_start(&text);
+    latency_printf(&text, "# HELP motion_stage_seconds Time a camera spent in a stage of the "
+                   "motion loop.\n# TYPE motion_stage_seconds histogram\n");
+
+    for (i = thread ? thread : (cnt_list[1] ? 1 : 0); cnt_list[i]; i++) {
+        for (stage = 0; stage < LATENCY_STAGES; stage++) {
+            total = latency_read(cnt_list[i], stage, &hist);
+            if (!total)
+                continue;
+
+            /* Only the powers of two, which are bucket boundaries as well */
+            seen = 0;
+            bucket = 0;
+            for (bits = 2; bits <= LATENCY_MAX_BITS; bits++) {
+                while (latency_upper(bucket) <= (1UL << bits) && bucket < LATENCY_BUCKETS - 1)
+                    seen += hist.count[bucket++];
+
+                latency_printf(&text, "motion_stage_seconds_bucket{thread=\"%d\",camera=\"%d\","
+                               "stage=\"%s\",le=\"%.6f\"} %lu\n", i, cnt_list[i]->conf.camera_id,
+                               latency_names[stage], (1UL << bits) / 1e6, seen);
+            }
+
+            latency_printf(&text, "motion_stage_seconds_bucket{thread=\"%d\",camera=\"%d\","
+                           "stage=\"%s\",le=\"+Inf\"} %lu\n", i, cnt_list[i]->conf.camera_id,
+                           latency_names[stage], total);
+            latency_printf(&text, "motion_stage_seconds_sum{thread=\"%d\",camera=\"%d\","
+                           "stage=\"%s\"} %.9f\n", i, cnt_list[i]->conf.camera_id,
+                           latency_names[stage], hist.sum / 1e9);
+            latency_printf(&text, "motion_stage_seconds_count{thread=\"%d\",camera=\"%d\","
+                           "stage=\"%s\"} %lu\n", i, cnt_list[i]->conf.camera_id,
+                           latency_names[stage], total);
+        }
+
+        if (thread)
+            break;
+    }
+
+    return text.buf;
+}
+
+/**
+ * latency_json
+ *
+ */
+char *latency_json(struct context **cnt_list, int thread)
+{
+    struct latency_text text;
+    struct latency_histogram hist;
+    unsigned long total;
+    int i, first, stage, stages;
+
+    latency_text_start(&text);
+    latency_printf(&text, "{\"cameras\":[");
+
+    first = thread ? thread : (cnt_list[1] ? 1 : 0);
+    for (i = first; cnt_list[i]; i++) {
+        latency_printf(&text, "%s{\"thread\":%d,\"camera\":%d,\"stages\":{",
+                       i == first ? "" : ",", i, cnt_list[i]->conf.camera_id);
+
+        stages = 0;
+        for (stage = 0; stage < LATENCY_STAGES; stage++) {
+            total = latency_read(cnt_list[i], stage, &hist);
+            if (!total)
+                continue;
+
+            latency_printf(&text, "%s\"%s\":{\"count\":%lu,\"sum_ms\":%.3f,\"max_ms\":%.3f,"
+                           "\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f}",
+                           stages++ ? "," : "", latency_names[stage], total, hist.sum / 1e6,
+                           hist.max / 1000.0, latency_percentile(&hist, total, 50),
+                           latency_percentile(&hist, total, 90),
+                           latency_percentile(&hist, total, 99),
+                           latency_percentile(&hist, total, 99.9));
+        }
+
+        latency_printf(&text, "}}");
+
+        if (thread)
+            break;
+    }
+
+    latency_printf(&text, "]}\n");
+
+    return text.buf;
+}
@@ -0,0 +1,181 @@
+/*
+ *    latency.h
+ *
+ *    Include file for the histograms of the time each camera spends in the
+ *    stages of the motion loop.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_LATENCY_H
+#define _INCLUDE_LATENCY_H
+
+#include "motion.h"
+
+enum latency_stage {
+    LATENCY_CAPTURE,        /* Getting the frame from the device, netcam or capture thread */
+    LATENCY_DECODE,         /* Converting or decompressing it to YUV420P */
+    LATENCY_ROTATE,
+    LATENCY_DETECTION,      /* Lightswitch, diff and switchfilter */
+    LATENCY_DESPECKLE,      /* Despeckle and labelling */
+    LATENCY_OVERLAY,        /* Text, locate and smartmask drawing */
+    LATENCY_EVENT,          /* Events and the image ring, see mlp_actions */
+    LATENCY_ENCODE,         /* Pictures and movie frames of an event */
+    LATENCY_STREAM,         /* Encoding the stream picture */
+    LATENCY_FRAME,          /* The whole frame, from the capture to the end of the pass */
+    LATENCY_STAGES
+};
+
+/*
+ * Buckets of a histogram, in microseconds. Below 16 us each bucket is one
+ * microsecond wide, above that each power of two is split into
+ * 1 << LATENCY_SUB_BITS buckets, so a bucket is at most 1/8 of its value
+ * wide. The last bucket holds everything from 2^LATENCY_MAX_BITS us, about
+ * a minute.
+ */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_MAX_BITS 26
+#define LATENCY_BUCKETS  (((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + 1)
+
+/* Times of a stage in ms, see latency_stats */
+struct latency_stats {
+    unsigned long count;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+/**
+ * latency_init
+ *
+ *  Allocates the histograms of a camera, unless it has them from before a
+ *  restart of the camera. They stay with the context until it is freed,
+ *  so the webcontrol can read them at any time.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void latency_init(struct context *cnt);
+
+/**
+ * latency_free
+ *
+ *  Frees the histograms of a context that is freed.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void latency_free(struct context *cnt);
+
+/**
+ * latency_now
+ *
+ *  Start of a stage, in monotonic ns, for latency_add.
+ */
+long long latency_now(void);
+
+/**
+ * latency_add
+ *
+ *  Adds the time since start to the histogram of a stage. Takes no lock,
+ *  the counters are only ever incremented with atomic operations, so it
+ *  can be called from the motion loop, the capture thread and the output
+ *  thread alike.
+ *
+ * Parameters:
+ *
+ *   cnt   - current thread's context structure, or a copy of it
+ *   stage - the stage that ran
+ *   start - what latency_now returned when the stage started
+ *
+ * Returns: nothing
+ */
+void latency_add(struct context *cnt, enum latency_stage stage, long long start);
+
+/**
+ * latency_stats
+ *
+ *  Counts the times of a stage since motion started and finds their
+ *  percentiles, the upper ends of their buckets.
+ *
+ * Parameters:
+ *
+ *   cnt   - current thread's context structure
+ *   stage - the stage to look at
+ *   stats - filled in with the count and the times
+ *
+ * Returns: nothing
+ */
+void latency_stats(struct context *cnt, enum latency_stage stage, struct latency_stats *stats);
+
+/**
+ * latency_interval
+ *
+ *  Like latency_stats, but only for the times since the last call for the
+ *  same stage, for a report every so often. The maximum is the upper end
+ *  of its bucket as well. Only the motion loop of the camera may call it.
+ *
+ * Parameters:
+ *
+ *   cnt   - current thread's context structure
+ *   stage - the stage to look at
+ *   stats - filled in with the count and the times
+ *
+ * Returns: nothing
+ */
+void latency_interval(struct context *cnt, enum latency_stage stage, struct latency_stats *stats);
+
+/**
+ * latency_summary
+ *
+ *  Writes the median and the 99th percentile of each stage that ran, as
+ *  "capture 0.1/0.5 decode 2.0/3.5 ..." in ms.
+ *
+ * Parameters:
+ *
+ *   cnt  - current thread's context structure
+ *   buf  - buffer for the text
+ *   size - size of the buffer
+ *
+ * Returns: nothing
+ */
+void latency_summary(struct context *cnt, char *buf, size_t size);
+
+/**
+ * latency_prometheus
+ *
+ *  Formats the histograms of one camera, or of all when thread is 0, in the
+ *  text format of Prometheus.
+ *
+ * Parameters:
+ *
+ *   cnt_list - list of all contexts, the first one is the global context
+ *   thread   - index of the camera in cnt_list, 0 for all
+ *
+ * Returns: the text, to be freed by the caller
+ */
+char *latency_prometheus(struct context **cnt_list, int thread);
+
+/**
+ * latency_json
+ *
+ *  Formats the count, the total, the maximum and the percentiles of each
+ *  stage of one camera, or of all when thread is 0, as JSON.
+ *
+ * Parameters:
+ *
+ *   cnt_list - list of all contexts, the first one is the global context
+ *   thread   - index of the camera in cnt_list, 0 for all
+ *
+ * Returns: the text, to be freed by the caller
+ */
+char *latency_json(struct context **cnt_list, int thread);
+
+#endif /* _INCLUDE_LATENCY_H */
@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# motion-bench.sh
+#
+# Runs a number of synthetic cameras through motion for a while and reports
+# the frame rate, the frame time, the time of each stage of the motion loop
+# and the CPU use of each camera and of all of them together, from the lines
+# motion logs when a camera stops.
+#
+# Usage: motion-bench.sh motion [cameras [seconds [width [height [framerate [camera_threads]]]]]]
+#
+# The synthetic_camera settings can be given in BENCH_SYNTH, for example
+# BENCH_SYNTH="objects=4,noise=6,light=40".
+#
+MOTION=${1:?"Usage: $0 motion [cameras [seconds [width [height [framerate [camera_threads]]]]]]"}
+CAMERAS=${2:-16}
+DURATION=${3:-30}
+WIDTH=${4:-640}
+HEIGHT=${5:-480}
+FRAMERATE=${6:-15}
+THREADS=${7:-0}
+SYNTH=${BENCH_SYNTH:-"objects=2,noise=3,light=30,period=5"}
+
+DIR=`mktemp -d ${TMPDIR:-/tmp}/motion-bench.XXXXXX` || exit 1
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+cat > "$DIR/motion.conf" << EOF
+daemon off
+setup_mode off
+log_level 6
+width $WIDTH
+height $HEIGHT
+framerate $FRAMERATE
+camera_threads $THREADS
+stream_port 0
+webcontrol_port 0
+output_pictures off
+ffmpeg_output_movies off
+target_dir $DIR/out
+EOF
+
+i=1
+while [ $i -le $CAMERAS ]; do
+	printf "synthetic_camera %s,seed=%d\n" "$SYNTH" $i > "$DIR/camera$i.conf"
+	echo "camera $DIR/camera$i.conf" >> "$DIR/motion.conf"
+	i=`expr $i + 1`
+done
+
+printf "Running %d synthetic cameras of %dx%d at %d fps for %d s, camera_threads %d\n" \
+	$CAMERAS $WIDTH $HEIGHT $FRAMERATE $DURATION $THREADS
+
+"$MOTION" -n -c "$DIR/motion.conf" > "$DIR/motion.log" 2>&1 &
+PID=$!
+sleep $DURATION
+kill -INT $PID
+wait $PID
+
+# [3:ml3] [NTC] [ALL] motion_loop_summary: Ran 448 frames in 30.1 s, 14.9 frames/s,
+# frame time p50 5.5 ms p90 6.0 ms p99 7.0 ms, 12.3% CPU
+# [3:ml3] [NTC] [ALL] motion_loop_summary: Stage time p50/p99 ms: capture 0.10/0.30 ...
+grep "motion_loop_summary: " "$DIR/motion.log" | sed 's/^\[\([0-9]*\):[^]]*\].*motion_loop_summary: /\1 /' |
+sort -n -s -k1,1 | awk '
+$2 == "Ran" {
+	printf("camera %3d: %6.1f frames/s, frame time p50 %5.1f ms p90 %5.1f ms p99 %5.1f ms, %5.1f%% CPU\n",
+	       $1, $8, $13, $16, $19, $21)
+	cameras++
+	fps += $8
+	cpu += $21
+	if ($19 > p99)
+		p99 = $19
+}
+$2 == "Stage" {
+	line = ""
+	for (i = 6; i < NF; i += 2) {
+		split($(i + 1), t, "/")
+		if (!(($i) in count))
+			names[stages++] = $i
+		count[$i]++
+		median[$i] += t[1]
+		if (t[2] > worst[$i])
+			worst[$i] = t[2]
+		line = line " " $i " " $(i + 1)
+	}
+	printf("            stage p50/p99 ms:%s\n", line)
+}
+END {
+	if (!cameras)
+		exit 1
+	printf("total:      %6.1f frames/s of %d cameras, worst p99 %.1f ms, %.1f%% CPU, %.1f%% per camera\n",
+	       fps, cameras, p99, cpu, cpu / cameras)
+	for (i = 0; i < stages; i++)
+		printf("            %-10s mean p50 %7.2f ms, worst p99 %7.2f ms\n", names[i],
+		       median[names[i]] / count[names[i]], worst[names[i]])
+}' || { echo "No camera reported, the log of motion:"; cat "$DIR/motion.log"; exit 1; }
@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# motion-startup-test.sh
+#
+# Runs a synthetic camera with moving objects and noise_tune on, restarts
+# motion with SIGHUP, and checks that every background model detects motion
+# both after the start and after the restart. A background model that starts
+# from a blank frame drives noise_tune up and misses these events. The last
+# run splits the detection over worker threads, which must take their first
+# job right after they are started.
+#
+# Usage: motion-startup-test.sh motion [seconds]
+#
+MOTION=${1:?"Usage: $0 motion [seconds]"}
+DURATION=${2:-6}
+RESTART_TIME=5  # motion waits this long in a restart
+
+DIR=`mktemp -d ${TMPDIR:-/tmp}/motion-startup.XXXXXX` || exit 1
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+FAILED=0
+
+for RUN in reference median threads; do
+	case $RUN in
+	threads)
+		MODEL=reference
+		THREADS=4
+		SCALE=2
+		;;
+	*)
+		MODEL=$RUN
+		THREADS=1
+		SCALE=1
+		;;
+	esac
+
+	cat > "$DIR/motion.conf" << EOF
+daemon off
+setup_mode off
+log_level 6
+width 320
+height 240
+framerate 10
+stream_port 0
+webcontrol_port 0
+output_pictures off
+ffmpeg_output_movies off
+target_dir $DIR/out
+synthetic_camera objects=2,noise=3,light=30,period=5
+background_model $MODEL
+noise_tune on
+event_gap 1
+detection_threads $THREADS
+detection_scale $SCALE
+EOF
+
+	"$MOTION" -n -c "$DIR/motion.conf" > "$DIR/motion.log" 2>&1 &
+	PID=$!
+	sleep $DURATION
+	kill -HUP $PID
+	sleep `expr $RESTART_TIME + $DURATION`
+	kill -INT $PID
+	# A hung camera thread keeps motion from stopping.
+	( sleep 30; kill -KILL $PID 2>/dev/null ) &
+	KILLER=$!
+	wait $PID
+	kill $KILLER 2>/dev/null
+
+	# [0:motion] [WRN] [ALL] main: Motion restarted
+	# [1:ml1] [NTC] [ALL] motion_detected: Motion detected - starting event 1
+	STARTED=`sed '/Motion restarted/,$d' "$DIR/motion.log" | grep -c 'starting event'`
+	RESTARTED=`sed '1,/Motion restarted/d' "$DIR/motion.log" | grep -c 'starting event'`
+
+	printf "%-9s events after the start %d, after the restart %d\n" $RUN $STARTED $RESTARTED
+
+	if [ $STARTED -eq 0 ] || [ $RESTARTED -eq 0 ]; then
+		FAILED=1
+		cat "$DIR/motion.log"
+	fi
+done
+
+exit $FAILED
@@ -12,9 +12,18 @@
 #include "video_loopback.h"
 #include "conf.h"
 #include "alg.h"
+#include "alg_simd.h"
+#include "alg_workers.h"
+#include "capture_queue.h"
+#include "output_queue.h"
+#include "image_pool.h"
+#include "governor.h"
+#include "executor.h"
+#include "latency.h"
 #include "track.h"
 #include "event.h"
 #include "picture.h"
+#include "jpegutils.h"
 #include "rotate.h"
 
 #define IMAGE_BUFFER_FLUSH ((unsigned int)-1)
@@ -111,13 +120,22 @@ static void image_ring_resize(struct context *cnt, int new_size)
                 memcpy(tmp, cnt->imgs.image_ring, sizeof(struct image_data) * smallest);
 
 
-            /* In the new buffers, allocate image memory */
+            /* In the new buffers, allocate image memory, release the ones dropped */
             {
                 int i;
                 for(i = smallest; i < new_size; i++) {
-                    tmp[i].image = mymalloc(cnt->imgs.size);
+                    /* A compressed ring shares the last frame instead of taking buffers */
+                    if (cnt->conf.pre_capture_quality > 0 && cnt->imgs.image_virgin) {
+                        tmp[i].image = image_ref(cnt->imgs.image_virgin);
+                        continue;
+                    }
+                    tmp[i].image = image_get(cnt);
                     memset(tmp[i].image, 0x80, cnt->imgs.size);  /* initialize to grey */
                 }
+                for(i = smallest; i < cnt->imgs.image_ring_size; i++) {
+                    image_unref(cnt->imgs.image_ring[i].image);
+                    free(cnt->imgs.image_ring[i].jpeg);
+                }
             }
 
             /* Free the old ring */
@@ -128,6 +146,10 @@ static void image_ring_resize(struct context *cnt, int new_size)
             cnt->current_image = NULL;
 
             cnt->imgs.image_ring_size = new_size;
+
+            /* The initial ring is reported at the end of motion_init */
+            if (smallest > 0)
+                image_pool_report(cnt);
         }
     }
 }
@@ -152,18 +174,94 @@ static void image_ring_destroy(struct context *cnt)
         return;
 
     /* Free all image buffers */
-    for (i = 0; i < cnt->imgs.image_ring_size; i++)
-        free(cnt->imgs.image_ring[i].image);
-
+    for (i = 0; i < cnt->imgs.image_ring_size; i++) {
+        image_unref(cnt->imgs.image_ring[i].image);
+        free(cnt->imgs.image_ring[i].jpeg);
+    }
 
     /* Free the ring */
     free(cnt->imgs.image_ring);
+    free(cnt->imgs.image_ring_jpeg);
 
     cnt->imgs.image_ring = NULL;
+    cnt->imgs.image_ring_jpeg = NULL;
     cnt->current_image = NULL;
     cnt->imgs.image_ring_size = 0;
 }
 
+/**
+ * image_ring_compress
+ *
+ * This routine is called for the previous image of the ring when a new one is
+ * captured. Unless an event is going to save it, the image is kept as a jpeg
+ * until it is overwritten or an event starts, see pre_capture_quality. The
+ * image is compressed into a buffer of the ring, as large as an image, and
+ * only the jpeg is copied to the slot.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *      img      Pointer to the image_data structure in the ring
+ *
+ * Returns:     nothing
+ */
+static void image_ring_compress(struct context *cnt, struct image_data *img)
+{
+    int size;
+
+    if (img->jpeg || !img->image || (img->flags & IMAGE_SAVE) ||
+        cnt->imgs.type != VIDEO_PALETTE_YUV420P)
+        return;
+
+    if (!cnt->imgs.image_ring_jpeg)
+        cnt->imgs.image_ring_jpeg = mymalloc(cnt->imgs.size);
+
+    size = put_picture_memory(cnt, cnt->imgs.image_ring_jpeg, cnt->imgs.size, img->image,
+                              cnt->conf.pre_capture_quality);
+
+    /* A jpeg larger than the image would not save anything */
+    if (size <= 0 || size >= cnt->imgs.size)
+        return;
+
+    img->jpeg = mymalloc(size);
+    memcpy(img->jpeg, cnt->imgs.image_ring_jpeg, size);
+    img->jpeg_size = size;
+    image_unref(img->image);
+    img->image = NULL;
+}
+
+/**
+ * image_ring_expand
+ *
+ * This routine is called when an event is about to save a compressed image of
+ * the ring. When the jpeg is corrupt, which it never should be, the image is grey.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *      img      Pointer to the image_data structure in the ring
+ *
+ * Returns:     nothing
+ */
+static void image_ring_expand(struct context *cnt, struct image_data *img)
+{
+    int plane = cnt->imgs.width * cnt->imgs.height;
+
+    if (!img->jpeg)
+        return;
+
+    img->image = image_get(cnt);
+    if (decode_jpeg_raw(img->jpeg, img->jpeg_size, 0, 420, cnt->imgs.width, cnt->imgs.height,
+                        img->image, img->image + plane, img->image + plane + plane / 4)) {
+        MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Corrupt pre_capture image");
+        memset(img->image, 0x80, cnt->imgs.size);
+    }
+
+    free(img->jpeg);
+    img->jpeg = NULL;
+    img->jpeg_size = 0;
+}
+
 /**
  * image_save_as_preview
  *
@@ -178,16 +276,12 @@ static void image_ring_destroy(struct context *cnt)
  */
 static void image_save_as_preview(struct context *cnt, struct image_data *img)
 {
-    void * image;
-    /* Save preview image pointer */
-    image = cnt->imgs.preview_image.image;
-    /* Copy all info */
-    memcpy(&cnt->imgs.preview_image.image, img, sizeof(struct image_data));
-    /* restore image pointer */
-    cnt->imgs.preview_image.image = image;
+    /* Release the previous preview image */
+    image_unref(cnt->imgs.preview_image.image);
 
-    /* Copy image */
-    memcpy(cnt->imgs.preview_image.image, img->image, cnt->imgs.size);
+    /* Copy all info, the image is shared until one of them draws on it */
+    memcpy(&cnt->imgs.preview_image, img, sizeof(struct image_data));
+    image_ref(cnt->imgs.preview_image.image);
 
     /*
      * If we set output_all to yes and during the event
@@ -198,6 +292,7 @@ static void image_save_as_preview(struct context *cnt, struct image_data *img)
 
     /* draw locate box here when mode = LOCATE_PREVIEW */
     if (cnt->locate_motion_mode == LOCATE_PREVIEW) {
+        image_writable(&cnt->imgs.preview_image.image);
 
         if (cnt->locate_motion_style == LOCATE_BOX) {
             alg_draw_location(&img->location, &cnt->imgs, cnt->imgs.width, cnt->imgs.preview_image.image,
@@ -277,6 +372,8 @@ static void context_destroy(struct context *cnt)
         }
     }
 
+    latency_free(cnt);
+
     free(cnt);
 }
 
@@ -470,6 +567,7 @@ static void motion_detected(struct context *cnt, int dev, struct image_data *img
 
     /* Draw location */
     if (cnt->locate_motion_mode == LOCATE_ON) {
+        image_writable(&img->image);
 
         if (cnt->locate_motion_style == LOCATE_BOX) {
             alg_draw_location(location, imgs, imgs->width, img->image, LOCATE_BOX,
@@ -586,6 +684,7 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
 
         /* Set inte global context that we are working with this image */
         cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_out];
+        image_ring_expand(cnt, cnt->current_image);
 
         if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot < cnt->conf.frame_limit) {
             if (cnt->log_level >= DBG) {
@@ -605,16 +704,32 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
 
                 mystrftime(cnt, tmp, sizeof(tmp), "%H%M%S-%q",
                            &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tv, NULL, 0);
+                image_writable(&cnt->imgs.image_ring[cnt->imgs.image_ring_out].image);
                 draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, 10, 20,
                           cnt->imgs.width, tmp, cnt->conf.text_double);
                 draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, 10, 30,
                           cnt->imgs.width, t, cnt->conf.text_double);
             }
+        }
 
-            /* Output the picture to jpegs and ffmpeg */
-            event(cnt, EVENT_IMAGE_DETECTED,
-                  cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, NULL, NULL,
-                  &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tv);
+        /* Store it as a preview image, only if it has motion */
+        if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & IMAGE_MOTION) {
+            /* Check for most significant preview-shot when output_pictures=best */
+            if (cnt->new_img & NEWIMG_BEST) {
+                if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].diffs > cnt->imgs.preview_image.diffs) {
+                    image_save_as_preview(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_out]);
+                }
+            }
+            /* Check for most significant preview-shot when output_pictures=center */
+            if (cnt->new_img & NEWIMG_CENTER) {
+                if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].cent_dist < cnt->imgs.preview_image.cent_dist) {
+                    image_save_as_preview(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_out]);
+                }
+            }
+        }
+
+        if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot < cnt->conf.frame_limit) {
+            int fillers = 0;
 
             /*
              * Check if we must add any "filler" frames into movie to keep up fps
@@ -622,37 +737,31 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
              * While the overall elapsed time might be correct, if there are
              * many duplicated frames, say 10 fps, 5 duplicated, the video will
              * look like it is frozen every second for half a second.
+             * movie_last_shot is -1 when file is created,
+             * we don't know how many frames there is in first sec
+             */
+            if (cnt->conf.ffmpeg_duplicate_frames &&
+                (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot == 0) &&
+                (cnt->ffmpeg_output || (cnt->conf.useextpipe && cnt->extpipe)) &&
+                (cnt->movie_last_shot >= 0))
+                fillers = cnt->movie_fps - (cnt->movie_last_shot + 1);
+
+            /*
+             * Output the picture to jpegs and ffmpeg. When the output queue
+             * is full the image stays in the ring until the next call.
              */
+            if (!output_queue_put(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_out], fillers,
+                                  max_images == IMAGE_BUFFER_FLUSH))
+                break;
+
+            if (fillers > 0)
+                MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: Added %d fillerframes into movie",
+                           fillers);
+
             if (!cnt->conf.ffmpeg_duplicate_frames) {
                 /* don't duplicate frames */
             } else if ((cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot == 0) &&
                 (cnt->ffmpeg_output || (cnt->conf.useextpipe && cnt->extpipe))) {
-                /*
-                 * movie_last_shoot is -1 when file is created,
-                 * we don't know how many frames there is in first sec
-                 */
-                if (cnt->movie_last_shot >= 0) {
-                    if (cnt_list[0]->log_level >= DBG) {
-                        int frames = cnt->movie_fps - (cnt->movie_last_shot + 1);
-                        if (frames > 0) {
-                            char tmp[25];
-                            MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: Added %d fillerframes into movie",
-                                       frames);
-                            sprintf(tmp, "Fillerframes %d", frames);
-                            draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, 10, 40,
-                                      cnt->imgs.width, tmp, cnt->conf.text_double);
-                        }
-                    }
-                    /* Check how many frames it was last sec */
-                    while ((cnt->movie_last_shot + 1) < cnt->movie_fps) {
-                        /* Add a filler frame into encoder */
-                        event(cnt, EVENT_FFMPEG_PUT,
-                              cnt->imgs.image_ring[cnt->imgs.image_ring_out].image, NULL, NULL,
-                              &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tv);
-
-                        cnt->movie_last_shot++;
-                    }
-                }
                 cnt->movie_last_shot = 0;
             } else if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot != (cnt->movie_last_shot + 1)) {
                 /* We are out of sync! Propably we got motion - no motion - motion */
@@ -670,20 +779,13 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
         /* Mark the image as saved */
         cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags |= IMAGE_SAVED;
 
-        /* Store it as a preview image, only if it has motion */
-        if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & IMAGE_MOTION) {
-            /* Check for most significant preview-shot when output_pictures=best */
-            if (cnt->new_img & NEWIMG_BEST) {
-                if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].diffs > cnt->imgs.preview_image.diffs) {
-                    image_save_as_preview(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_out]);
-                }
-            }
-            /* Check for most significant preview-shot when output_pictures=center */
-            if (cnt->new_img & NEWIMG_CENTER) {
-                if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].cent_dist < cnt->imgs.preview_image.cent_dist) {
-                    image_save_as_preview(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_out]);
-                }
-            }
+        /*
+         * With a compressed ring the buffer goes back to the pool once it is
+         * written, instead of all the pre_capture images staying decompressed.
+         */
+        if (cnt->conf.pre_capture_quality > 0 && cnt->current_image != saved_current_image) {
+            image_unref(cnt->current_image->image);
+            cnt->current_image->image = NULL;
         }
 
         /* Increment to image after last sended */
@@ -708,6 +810,11 @@ static int init_camera_type(struct context *cnt){
 
     cnt->camera_type = CAMERA_TYPE_UNKNOWN;
 
+    if (cnt->conf.synthetic_camera) {
+        cnt->camera_type = CAMERA_TYPE_SYNTH;
+        return 0;
+    }
+
 #ifdef HAVE_MMAL
     if (cnt->conf.mmalcam_name) {
         cnt->camera_type = CAMERA_TYPE_MMAL;
@@ -735,7 +842,7 @@ static int init_camera_type(struct context *cnt){
 #endif // HAVE_V4L2
 
 
-    MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Unable to determine camera type (MMAL, Netcam, V4L2, BKTR)");
+    MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Unable to determine camera type (MMAL, Netcam, V4L2, BKTR, synthetic)");
     return -1;
 
 }
@@ -830,6 +937,7 @@ static void init_mask_privacy(struct context *cnt){
 static int motion_init(struct context *cnt)
 {
     FILE *picture;
+    struct timespec ts;
     int indx;
 
     char tname[16];
@@ -837,7 +945,9 @@ static int motion_init(struct context *cnt)
              cnt->threadnr,
              cnt->conf.camera_name ? ":" : "",
              cnt->conf.camera_name ? cnt->conf.camera_name : "");
-    MOTION_PTHREAD_SETNAME(tname);
+    /* The workers of the thread pool keep their own name. */
+    if (!cnt->task)
+        MOTION_PTHREAD_SETNAME(tname);
 
     /* Store thread number in TLS. */
     pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
@@ -850,6 +960,9 @@ static int motion_init(struct context *cnt)
 
     cnt->smartmask_speed = 0;
 
+    /* Kept over a restart of the camera, see latency.c */
+    latency_init(cnt);
+
     /*
      * We initialize cnt->event_nr to 1 and cnt->prev_event to 0 (not really needed) so
      * that certain code below does not run until motion has been detected the first time
@@ -897,19 +1010,16 @@ static int motion_init(struct context *cnt)
         return -3;
     }
 
-    image_ring_resize(cnt, 1); /* Create a initial precapture ring buffer with 1 frame */
+    /*
+     * The ring, image_virgin and the preview share the buffers of the pool,
+     * the planes below are carved from the same memory.
+     */
+    image_pool_init(cnt);
 
-    cnt->imgs.ref = mymalloc(cnt->imgs.size);
-    cnt->imgs.out = mymalloc(cnt->imgs.size);
+    image_ring_resize(cnt, 1); /* Create a initial precapture ring buffer with 1 frame */
 
-    /* contains the moving objects of ref. frame */
-    cnt->imgs.ref_dyn = mymalloc(cnt->imgs.motionsize * sizeof(*cnt->imgs.ref_dyn));
-    cnt->imgs.image_virgin = mymalloc(cnt->imgs.size);
-    cnt->imgs.smartmask = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_final = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_buffer = mymalloc(cnt->imgs.motionsize * sizeof(*cnt->imgs.smartmask_buffer));
-    cnt->imgs.labels = mymalloc(cnt->imgs.motionsize * sizeof(*cnt->imgs.labels));
-    cnt->imgs.labelsize = mymalloc((cnt->imgs.motionsize/2+1) * sizeof(*cnt->imgs.labelsize));
+    cnt->imgs.out = image_pool_alloc(cnt, cnt->imgs.size);
+    cnt->imgs.image_virgin = image_get(cnt);
 
     /* Set output picture type */
     if (!strcmp(cnt->conf.picture_type, "ppm"))
@@ -926,14 +1036,11 @@ static int motion_init(struct context *cnt)
     else
         cnt->imgs.picture_type = IMAGE_TYPE_JPEG;
 
-    /* allocate buffer here for preview buffer */
-    cnt->imgs.preview_image.image = mymalloc(cnt->imgs.size);
-
     /*
      * Allocate a buffer for temp. usage in some places
-     * Only despeckle & bayer2rgb24() for now for now...
+     * Only bayer2rgb24() for now...
      */
-    cnt->imgs.common_buffer = mymalloc(3 * cnt->imgs.width * cnt->imgs.height);
+    cnt->imgs.common_buffer = image_pool_alloc(cnt, 3 * cnt->imgs.width * cnt->imgs.height);
 
     /*
      * Now is a good time to init rotation data. Since vid_start has been
@@ -946,8 +1053,65 @@ static int motion_init(struct context *cnt)
      */
     rotate_init(cnt); /* rotate_deinit is called in main */
 
-    /* Capture first image, or we will get an alarm on start */
-    if (cnt->video_dev > 0) {
+    /* The detection buffers have the rotated dimensions divided by detection_scale */
+    cnt->imgs.det_scale = cnt->conf.detection_scale;
+    if (cnt->imgs.det_scale != 1 && cnt->imgs.det_scale != 2 && cnt->imgs.det_scale != 4) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: detection_scale must be 1, 2 or 4, not %d. "
+                   "Using 1", cnt->imgs.det_scale);
+        cnt->imgs.det_scale = 1;
+    }
+    cnt->imgs.det_width = cnt->imgs.width / cnt->imgs.det_scale;
+    cnt->imgs.det_height = cnt->imgs.height / cnt->imgs.det_scale;
+    cnt->imgs.det_motionsize = cnt->imgs.det_width * cnt->imgs.det_height;
+
+    if (cnt->imgs.det_scale > 1) {
+        cnt->imgs.det_image = image_pool_alloc(cnt, cnt->imgs.det_motionsize);
+        cnt->imgs.det_out = image_pool_alloc(cnt, cnt->imgs.det_motionsize * 3 / 2);
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Motion detection at %dx%d",
+                   cnt->imgs.det_width, cnt->imgs.det_height);
+    } else {
+        cnt->imgs.det_image = cnt->imgs.image_virgin;
+        cnt->imgs.det_out = cnt->imgs.out;
+    }
+
+    /* Only the Y plane is used for the reference frame */
+    cnt->imgs.ref = image_pool_alloc(cnt, cnt->imgs.det_motionsize);
+
+    /* contains the moving objects of ref. frame */
+    cnt->imgs.ref_dyn = image_pool_alloc(cnt, cnt->imgs.det_motionsize * sizeof(*cnt->imgs.ref_dyn));
+    alg_background_init(cnt);
+    cnt->imgs.smartmask = image_pool_alloc(cnt, cnt->imgs.det_motionsize);
+    cnt->imgs.smartmask_final = image_pool_alloc(cnt, cnt->imgs.det_motionsize);
+    cnt->imgs.smartmask_buffer = image_pool_alloc(cnt, cnt->imgs.det_motionsize *
+                                                  sizeof(*cnt->imgs.smartmask_buffer));
+    cnt->imgs.labels = image_pool_alloc(cnt, cnt->imgs.det_motionsize * sizeof(*cnt->imgs.labels));
+    cnt->imgs.smartmask_tuning = 0;
+
+    /* One flag per tile for the pre-screen in alg_diff, needs the rotated dimensions */
+    cnt->imgs.tiles_x = (cnt->imgs.det_width + ALG_TILE_WIDTH - 1) / ALG_TILE_WIDTH;
+    cnt->imgs.tiles_y = (cnt->imgs.det_height + ALG_TILE_HEIGHT - 1) / ALG_TILE_HEIGHT;
+    cnt->imgs.tiles = image_pool_alloc(cnt, cnt->imgs.tiles_x * cnt->imgs.tiles_y);
+
+    /* Bit images for despeckle, with an empty line above and below */
+    cnt->imgs.bits_stride = (cnt->imgs.det_width + 63) / 64;
+    cnt->imgs.motion_bits = image_pool_alloc(cnt, cnt->imgs.bits_stride *
+                                             (cnt->imgs.det_height + 2) *
+                                             sizeof(*cnt->imgs.motion_bits));
+    cnt->imgs.motion_bits_tmp = image_pool_alloc(cnt, cnt->imgs.bits_stride *
+                                                 (cnt->imgs.det_height + 2) *
+                                                 sizeof(*cnt->imgs.motion_bits_tmp));
+    cnt->imgs.smartmask_bits = image_pool_alloc(cnt, cnt->imgs.bits_stride *
+                                                (cnt->imgs.det_height + 2) *
+                                                sizeof(*cnt->imgs.smartmask_bits));
+
+    /* Threads for the motion detection, the bands depend on the rotated height */
+    alg_workers_init(cnt);
+
+    /*
+     * Capture first image, or we will get an alarm on start. Netcams and
+     * synthetic cameras have device 0.
+     */
+    if (cnt->video_dev >= 0) {
         int i;
 
         for (i = 0; i < 5; i++) {
@@ -965,8 +1129,18 @@ static int motion_init(struct context *cnt)
     }
 
     /* create a reference frame */
+    alg_detection_image(cnt);
     alg_update_reference_frame(cnt, RESET_REF_FRAME);
 
+    output_queue_init(cnt);
+
+    /* From here on the capture thread calls vid_next, if capture_queue is set */
+    capture_queue_init(cnt);
+    if (cnt->video_dev >= 0)
+        capture_queue_start(cnt);
+
+    image_pool_report(cnt);
+
 #if defined(HAVE_V4L2) && !defined(__FreeBSD__)
     /* open video loopback devices if enabled */
     if (cnt->conf.vidpipe) {
@@ -1112,12 +1286,16 @@ static int motion_init(struct context *cnt)
         cnt->imgs.mask = NULL;
     }
 
+    /* The mask file has the full size, the detection may need it smaller */
+    alg_detection_mask(cnt);
+
     init_mask_privacy(cnt);
 
     /* Always initialize smart_mask - someone could turn it on later... */
-    memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
-    memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
-    memset(cnt->imgs.smartmask_buffer, 0, cnt->imgs.motionsize * sizeof(*cnt->imgs.smartmask_buffer));
+    memset(cnt->imgs.smartmask, 0, cnt->imgs.det_motionsize);
+    memset(cnt->imgs.smartmask_final, 255, cnt->imgs.det_motionsize);
+    memset(cnt->imgs.smartmask_buffer, 0,
+           cnt->imgs.det_motionsize * sizeof(*cnt->imgs.smartmask_buffer));
 
     /* Set noise level */
     cnt->noise = cnt->conf.noise;
@@ -1154,8 +1332,6 @@ static int motion_init(struct context *cnt)
 
     cnt->required_frame_time = 1000000L / cnt->conf.frame_limit;
 
-    cnt->frame_delay = cnt->required_frame_time;
-
     /*
      * Reserve enough space for a 10 second timing history buffer. Note that,
      * if there is any problem on the allocation, mymalloc does not return.
@@ -1167,6 +1343,7 @@ static int motion_init(struct context *cnt)
     /* Preset history buffer with expected frame rate */
     for (indx = 0; indx < cnt->rolling_average_limit; indx++)
         cnt->rolling_average_data[indx] = cnt->required_frame_time;
+    cnt->rolling_average_sum = (long long)cnt->required_frame_time * cnt->rolling_average_limit;
 
 
     if (cnt->track.type)
@@ -1202,6 +1379,12 @@ static int motion_init(struct context *cnt)
     cnt->minimum_frame_time_downcounter = cnt->conf.minimum_frame_time;
     cnt->get_image = 1;
 
+    cnt->frame_time_start = 0;
+    cnt->frame_run_count = 0;
+    cnt->run_cpu = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    cnt->run_start = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
     cnt->olddiffs = 0;
     cnt->smartmask_ratio = 0;
     cnt->smartmask_count = 20;
@@ -1239,43 +1422,64 @@ static int motion_init(struct context *cnt)
  */
 static void motion_cleanup(struct context *cnt)
 {
+    /* Let the output thread finish before the movie is closed */
+    output_queue_deinit(cnt);
+
     /* Stop stream */
     event(cnt, EVENT_STOP, NULL, NULL, NULL, NULL);
 
     event(cnt, EVENT_TIMELAPSEEND, NULL, NULL, NULL, NULL);
     event(cnt, EVENT_ENDMOTION, NULL, NULL, NULL, NULL);
 
+    /* The capture thread must be gone before the device is closed */
+    capture_queue_deinit(cnt);
+
     if (cnt->video_dev >= 0) {
         MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Calling vid_close() from motion_cleanup");
         vid_close(cnt);
     }
 
-    free(cnt->imgs.out);
-    cnt->imgs.out = NULL;
+    alg_workers_deinit(cnt);
 
-    free(cnt->imgs.ref);
-    cnt->imgs.ref = NULL;
+    /* The planes allocated from the pool are unmapped with it. */
+    cnt->imgs.det_image = NULL;
+    cnt->imgs.det_out = NULL;
 
-    free(cnt->imgs.ref_dyn);
+    cnt->imgs.out = NULL;
+    cnt->imgs.ref = NULL;
     cnt->imgs.ref_dyn = NULL;
 
-    free(cnt->imgs.image_virgin);
+    free(cnt->imgs.bg_median);
+    cnt->imgs.bg_median = NULL;
+
+    free(cnt->imgs.bg_dev);
+    cnt->imgs.bg_dev = NULL;
+
+    free(cnt->imgs.bg_noise);
+    cnt->imgs.bg_noise = NULL;
+
+    free(cnt->imgs.bg_still);
+    cnt->imgs.bg_still = NULL;
+
+    image_unref(cnt->imgs.image_virgin);
     cnt->imgs.image_virgin = NULL;
 
-    free(cnt->imgs.labels);
     cnt->imgs.labels = NULL;
 
-    free(cnt->imgs.labelsize);
-    cnt->imgs.labelsize = NULL;
+    free(cnt->imgs.label_runs);
+    cnt->imgs.label_runs = NULL;
 
-    free(cnt->imgs.smartmask);
-    cnt->imgs.smartmask = NULL;
+    free(cnt->imgs.label_info);
+    cnt->imgs.label_info = NULL;
+    cnt->imgs.label_max = 0;
 
-    free(cnt->imgs.smartmask_final);
+    cnt->imgs.smartmask = NULL;
     cnt->imgs.smartmask_final = NULL;
-
-    free(cnt->imgs.smartmask_buffer);
     cnt->imgs.smartmask_buffer = NULL;
+    cnt->imgs.tiles = NULL;
+    cnt->imgs.motion_bits = NULL;
+    cnt->imgs.motion_bits_tmp = NULL;
+    cnt->imgs.smartmask_bits = NULL;
 
     if (cnt->imgs.mask) free(cnt->imgs.mask);
     cnt->imgs.mask = NULL;
@@ -1286,14 +1490,15 @@ static void motion_cleanup(struct context *cnt)
     if (cnt->imgs.mask_privacy_uv) free(cnt->imgs.mask_privacy_uv);
     cnt->imgs.mask_privacy_uv = NULL;
 
-    free(cnt->imgs.common_buffer);
     cnt->imgs.common_buffer = NULL;
 
-    free(cnt->imgs.preview_image.image);
+    image_unref(cnt->imgs.preview_image.image);
     cnt->imgs.preview_image.image = NULL;
 
     image_ring_destroy(cnt); /* Cleanup the precapture ring buffer */
 
+    image_pool_deinit(cnt);
+
     rotate_deinit(cnt); /* cleanup image rotation data */
 
     if (cnt->pipe != -1) {
@@ -1341,6 +1546,8 @@ static void mlp_mask_privacy(struct context *cnt){
 
   if (cnt->imgs.mask_privacy == NULL) return;
 
+  image_writable(&cnt->current_image->image);
+
   /*
    * This function uses long operations to process 4 (32 bit) or 8 (64 bit)
    * bytes at a time, providing a significant boost in performance.
@@ -1445,6 +1652,10 @@ static void mlp_prepare(struct context *cnt){
         cnt->process_thisframe = 1;
     }
 
+    /* Idle cameras detect on fewer frames while the host is overloaded */
+    if (cnt->process_thisframe && !governor_detect(cnt))
+        cnt->process_thisframe = 0;
+
     /*
      * Since we don't have sanity checks done when options are set,
      * this sanity check must go in the main loop :(, before pre_captures
@@ -1527,6 +1738,18 @@ static void mlp_resetimages(struct context *cnt){
     old_image = cnt->current_image;
     cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_in];
 
+    /*
+     * The capture overwrites the image, so a compressed or released one is
+     * not needed. The previous one stays compressed until an event wants it.
+     */
+    free(cnt->current_image->jpeg);
+    cnt->current_image->jpeg = NULL;
+    if (!cnt->current_image->image)
+        cnt->current_image->image = image_ref(cnt->imgs.image_virgin);
+
+    if (cnt->conf.pre_capture_quality > 0 && old_image && old_image != cnt->current_image)
+        image_ring_compress(cnt, old_image);
+
     /* Init/clear current_image */
     if (cnt->process_thisframe) {
         /* set diffs to 0 now, will be written after we calculated diffs in new image */
@@ -1597,7 +1820,9 @@ static int mlp_capture(struct context *cnt){
     const char *tmpin;
     char tmpout[80];
     int vid_return_code = 0;        /* Return code used when calling vid_next */
+    unsigned char *image = NULL;    /* The new frame */
     struct timeval tv1;
+    long long start = latency_now();
 
     /***** MOTION LOOP - IMAGE CAPTURE SECTION *****/
     /*
@@ -1607,11 +1832,40 @@ static int mlp_capture(struct context *cnt){
      * 0 = OK, valid picture
      * <0 = fatal error - leave the thread by breaking out of the main loop
      * >0 = non fatal error - copy last image or show grey image with message
+     *
+     * With capture_queue the frame comes from the capture thread instead,
+     * together with what vid_next returned for it. A second without any
+     * frame counts as a non fatal error. The queue is not used with
+     * minimum_frame_time, which captures only now and then. On the thread
+     * pool the camera only runs once a frame is queued or a second has
+     * passed, so there is no need to wait.
+     *
+     * The frame is captured into a buffer of its own, which the ring slot
+     * and image_virgin then share without a copy.
+     *
+     * The capture time and the frame time start once the frame is there,
+     * the wait for the capture thread is not work of the camera.
      */
-    if (cnt->video_dev >= 0)
-        vid_return_code = vid_next(cnt, cnt->current_image->image);
-    else
+    if (cnt->video_dev >= 0 && cnt->capture && !cnt->conf.minimum_frame_time) {
+        capture_queue_start(cnt);
+        capture_queue_wait(cnt, cnt->task ? 0 : 1000000L);
+        start = latency_now();
+        vid_return_code = capture_queue_next(cnt, &image);
+
+        /* Like a netcam, the capture thread sets the pace. */
+        gettimeofday(&tv1, NULL);
+        cnt->timenow = tv1.tv_usec + 1000000L * tv1.tv_sec;
+    } else if (cnt->video_dev >= 0) {
+        capture_queue_stop(cnt);
+        image = image_get(cnt);
+        vid_return_code = vid_next(cnt, image);
+    } else {
         vid_return_code = 1; /* Non fatal error */
+    }
+
+    if (cnt->video_dev >= 0)
+        latency_add(cnt, LATENCY_CAPTURE, start);
+    cnt->frame_start = start;
 
     // VALID PICTURE
     if (vid_return_code == 0) {
@@ -1628,13 +1882,20 @@ static int mlp_capture(struct context *cnt){
         cnt->missing_frame_counter = 0;
 
         /*
-         * Save the newly captured still virgin image to a buffer
-         * which we will not alter with text and location graphics
+         * Keep the newly captured still virgin image, which we will not
+         * alter with text and location graphics. Those are drawn on a copy,
+         * see image_writable.
          */
-        memcpy(cnt->imgs.image_virgin, cnt->current_image->image, cnt->imgs.size);
+        image_unref(cnt->current_image->image);
+        cnt->current_image->image = image;
+        image_unref(cnt->imgs.image_virgin);
+        cnt->imgs.image_virgin = image_ref(image);
 
         mlp_mask_privacy(cnt);
 
+        /* The detection works on a smaller copy if detection_scale is set */
+        alg_detection_image(cnt);
+
         /*
          * If the camera is a netcam we let the camera decide the pace.
          * Otherwise we will keep on adding duplicate frames.
@@ -1649,13 +1910,16 @@ static int mlp_capture(struct context *cnt){
     } else if (vid_return_code < 0) {
         /* Fatal error - Close video device */
         MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Video device fatal error - Closing video device");
+        capture_queue_stop(cnt);
         vid_close(cnt);
         /*
          * Use virgin image, if we are not able to open it again next loop
          * a gray image with message is applied
          * flag lost_connection
          */
-        memcpy(cnt->current_image->image, cnt->imgs.image_virgin, cnt->imgs.size);
+        image_unref(image);
+        image_unref(cnt->current_image->image);
+        cnt->current_image->image = image_ref(cnt->imgs.image_virgin);
         cnt->lost_connection = 1;
     /* NO FATAL ERROR -
     *        copy last image or show grey image with message
@@ -1667,6 +1931,7 @@ static int mlp_capture(struct context *cnt){
     } else {
 
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: vid_return_code %d",vid_return_code);
+        image_unref(image);
         /*
          * Netcams that change dimensions while Motion is running will
          * require that Motion restarts to reinitialize all the many
@@ -1703,7 +1968,8 @@ static int mlp_capture(struct context *cnt){
 
         if (cnt->video_dev >= 0 &&
             cnt->missing_frame_counter < (MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit)) {
-            memcpy(cnt->current_image->image, cnt->imgs.image_virgin, cnt->imgs.size);
+            image_unref(cnt->current_image->image);
+            cnt->current_image->image = image_ref(cnt->imgs.image_virgin);
         } else {
             cnt->lost_connection = 1;
 
@@ -1714,6 +1980,8 @@ static int mlp_capture(struct context *cnt){
 
             tv1.tv_sec=cnt->connectionlosttime;
             tv1.tv_usec = 0;
+            image_unref(cnt->current_image->image);
+            cnt->current_image->image = image_get(cnt);
             memset(cnt->current_image->image, 0x80, cnt->imgs.size);
             mystrftime(cnt, tmpout, sizeof(tmpout), tmpin, &tv1, NULL, 0);
             draw_text(cnt->current_image->image, 10, 20 * cnt->text_size_factor, cnt->imgs.width,
@@ -1734,6 +2002,7 @@ static int mlp_capture(struct context *cnt){
                 (cnt->missing_frame_counter == (MISSING_FRAMES_TIMEOUT * 4) * cnt->conf.frame_limit)) {
                 MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Video signal still lost - "
                            "Trying to close video device");
+                capture_queue_stop(cnt);
                 vid_close(cnt);
             }
         }
@@ -1752,39 +2021,50 @@ static void mlp_detection(struct context *cnt){
      * Make a differences picture in image_out
      *
      * alg_diff_standard is the slower full feature motion detection algorithm
-     * alg_diff first calls a fast detection algorithm which only looks at a
-     * fraction of the pixels. If this detects possible motion alg_diff_standard
-     * is called.
+     * alg_diff first calls a fast detection algorithm which counts changed
+     * pixels on a sample of the lines without any masks. If this detects
+     * possible motion the full diff is done, but only in the tiles that have
+     * changed pixels.
      */
+    cnt->imgs.det_still = 1;
+
     if (cnt->process_thisframe) {
         if (cnt->threshold && !cnt->pause) {
-            /*
-             * If we've already detected motion and we want to see if there's
-             * still motion, don't bother trying the fast one first. IF there's
-             * motion, the alg_diff will trigger alg_diff_standard
-             * anyway
-             */
-            if (cnt->detecting_motion || cnt->conf.setup_mode)
-                cnt->current_image->diffs = alg_diff_standard(cnt, cnt->imgs.image_virgin);
-            else
-                cnt->current_image->diffs = alg_diff(cnt, cnt->imgs.image_virgin);
+            long long start = latency_now();
 
             /* Lightswitch feature - has light intensity changed?
              * This can happen due to change of light conditions or due to a sudden change of the camera
              * sensitivity. If alg_lightswitch detects lightswitch we suspend motion detection the next
              * 5 frames to allow the camera to settle.
              * Don't check if we have lost connection, we detect "Lost signal" frame as lightswitch
+             * A sampled check runs first, so most lightswitch frames don't need the full diff.
              */
-            if (cnt->conf.lightswitch > 1 && !cnt->lost_connection) {
-                if (alg_lightswitch(cnt, cnt->current_image->diffs)) {
-                    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Lightswitch detected");
+            int lightswitch = cnt->conf.lightswitch > 1 && !cnt->lost_connection;
 
-                    if (cnt->moved < 5)
-                        cnt->moved = 5;
+            if (lightswitch && alg_lightswitch_prescreen(cnt, cnt->imgs.det_image)) {
+                cnt->current_image->diffs = 0;
+            } else {
+                /*
+                 * If we've already detected motion and we want to see if there's
+                 * still motion, don't bother trying the fast one first. IF there's
+                 * motion, the alg_diff will do the full diff anyway
+                 */
+                if (cnt->detecting_motion || cnt->conf.setup_mode)
+                    cnt->current_image->diffs = alg_diff_standard(cnt, cnt->imgs.det_image);
+                else
+                    cnt->current_image->diffs = alg_diff(cnt, cnt->imgs.det_image);
 
-                    cnt->current_image->diffs = 0;
-                    alg_update_reference_frame(cnt, RESET_REF_FRAME);
-                }
+                lightswitch = lightswitch && alg_lightswitch(cnt, cnt->current_image->diffs);
+            }
+
+            if (lightswitch) {
+                MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Lightswitch detected");
+
+                if (cnt->moved < 5)
+                    cnt->moved = 5;
+
+                cnt->current_image->diffs = 0;
+                alg_update_reference_frame(cnt, RESET_REF_FRAME);
             }
 
             /*
@@ -1797,6 +2077,9 @@ static void mlp_detection(struct context *cnt){
              * because with Round Robin this is controlled by roundrobin_skip.
              */
             if (cnt->conf.switchfilter && cnt->current_image->diffs > cnt->threshold) {
+                /* It prints the line counts with text_changes */
+                if (cnt->conf.text_changes)
+                    image_writable(&cnt->current_image->image);
                 cnt->current_image->diffs = alg_switchfilter(cnt, cnt->current_image->diffs,
                                                              cnt->current_image->image);
 
@@ -1818,9 +2101,13 @@ static void mlp_detection(struct context *cnt){
             cnt->imgs.largest_label = 0;
             cnt->olddiffs = 0;
 
+            latency_add(cnt, LATENCY_DETECTION, start);
+
             if (cnt->conf.despeckle_filter && cnt->current_image->diffs > 0) {
+                start = latency_now();
                 cnt->olddiffs = cnt->current_image->diffs;
                 cnt->current_image->diffs = alg_despeckle(cnt, cnt->olddiffs);
+                latency_add(cnt, LATENCY_DESPECKLE, start);
             } else if (cnt->imgs.labelsize_max) {
                 cnt->imgs.labelsize_max = 0; /* Disable labeling if enabled */
             }
@@ -1836,6 +2123,9 @@ static void mlp_detection(struct context *cnt){
         (!--cnt->smartmask_count)) {
         alg_tune_smartmask(cnt);
         cnt->smartmask_count = cnt->smartmask_ratio;
+    } else {
+        /* The tuning is spread over a few frames to avoid a slow frame */
+        alg_tune_smartmask_slice(cnt);
     }
 
     /*
@@ -1864,7 +2154,7 @@ static void mlp_tuning(struct context *cnt){
      */
     if ((cnt->conf.noise_tune && cnt->shots == 0) &&
          (!cnt->detecting_motion && (cnt->current_image->diffs <= cnt->threshold)))
-        alg_noise_tune(cnt, cnt->imgs.image_virgin);
+        alg_noise_tune(cnt, cnt->imgs.det_image);
 
 
     /*
@@ -1938,17 +2228,22 @@ static void mlp_overlay(struct context *cnt){
     /* Smartmask overlay */
     if (cnt->smartmask_speed && (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug ||
         cnt->conf.setup_mode))
-        overlay_smartmask(cnt, cnt->imgs.out);
+        overlay_smartmask(cnt, cnt->imgs.det_out);
 
     /* Largest labels overlay */
     if (cnt->imgs.largest_label && (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug ||
         cnt->conf.setup_mode))
-        overlay_largest_label(cnt, cnt->imgs.out);
+        overlay_largest_label(cnt, cnt->imgs.det_out);
 
     /* Fixed mask overlay */
     if (cnt->imgs.mask && (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug ||
         cnt->conf.setup_mode))
-        overlay_fixed_mask(cnt, cnt->imgs.out);
+        overlay_fixed_mask(cnt, cnt->imgs.det_out);
+
+    /* Scale the motion image of a reduced size detection up to the picture size */
+    if (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug || cnt->conf.setup_mode ||
+        cnt->mpipe >= 0)
+        alg_motion_image(cnt);
 
     /* Initialize the double sized characters if needed. */
     if (cnt->conf.text_double && cnt->text_size_factor == 1) {
@@ -1965,6 +2260,7 @@ static void mlp_overlay(struct context *cnt){
         else
             sprintf(tmp, "-");
 
+        image_writable(&cnt->current_image->image);
         draw_text(cnt->current_image->image, cnt->imgs.width - 10, 10,
                   cnt->imgs.width, tmp, cnt->conf.text_double);
     }
@@ -1987,6 +2283,7 @@ static void mlp_overlay(struct context *cnt){
     if (cnt->conf.text_left) {
         mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_left,
                    &cnt->current_image->timestamp_tv, NULL, 0);
+        image_writable(&cnt->current_image->image);
         draw_text(cnt->current_image->image, 10, cnt->imgs.height - 10 * cnt->text_size_factor,
                   cnt->imgs.width, tmp, cnt->conf.text_double);
     }
@@ -1995,6 +2292,7 @@ static void mlp_overlay(struct context *cnt){
     if (cnt->conf.text_right) {
         mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_right,
                    &cnt->current_image->timestamp_tv, NULL, 0);
+        image_writable(&cnt->current_image->image);
         draw_text(cnt->current_image->image, cnt->imgs.width - 10,
                   cnt->imgs.height - 10 * cnt->text_size_factor,
                   cnt->imgs.width, tmp, cnt->conf.text_double);
@@ -2062,6 +2360,8 @@ static void mlp_actions(struct context *cnt){
              *  get a pause in the movie.
             */
             if ( (cnt->detecting_motion == 0) && (cnt->ffmpeg_output != NULL) ) {
+                /* The output thread must not be encoding while we change it */
+                output_queue_flush(cnt);
                 cnt->ffmpeg_output->start_time.tv_sec=cnt->current_image->timestamp_tv.tv_sec;
                 cnt->ffmpeg_output->start_time.tv_usec=cnt->current_image->timestamp_tv.tv_usec;
             }
@@ -2127,8 +2427,9 @@ static void mlp_actions(struct context *cnt){
           cnt->makemovie) {
         if (cnt->event_nr == cnt->prev_event || cnt->makemovie) {
 
-            /* Flush image buffer */
+            /* Flush image buffer, the movie is closed below */
             process_image_ring(cnt, IMAGE_BUFFER_FLUSH);
+            output_queue_flush(cnt);
 
             /* Save preview_shot here at the end of event */
             if (cnt->imgs.preview_image.diffs) {
@@ -2373,8 +2674,9 @@ static void mlp_parmsupdate(struct context *cnt){
         if (cnt->conf.smart_mask_speed != cnt->smartmask_speed ||
             cnt->smartmask_lastrate != cnt->lastrate) {
             if (cnt->conf.smart_mask_speed == 0) {
-                memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
-                memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
+                memset(cnt->imgs.smartmask, 0, cnt->imgs.det_motionsize);
+                memset(cnt->imgs.smartmask_final, 255, cnt->imgs.det_motionsize);
+                cnt->imgs.smartmask_tuning = 0;
             }
 
             cnt->smartmask_lastrate = cnt->lastrate;
@@ -2403,12 +2705,50 @@ static void mlp_parmsupdate(struct context *cnt){
 
 }
 
-static void mlp_frametiming(struct context *cnt){
+/**
+ * frame_time_add
+ *
+ *   Adds the processing time of a frame to the latency histograms and logs
+ *   the median, the 99th percentile and the maximum of the frames of the
+ *   last FRAME_TIME_REPORT seconds. Slow single frames, which hardly move
+ *   the rolling average, show up in the 99th percentile.
+ *
+ * Parameters:
+ *
+ *      cnt     Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void frame_time_add(struct context *cnt)
+{
+    struct latency_stats stats;
 
-    int indx;
-    struct timeval tv2;
-    unsigned long int elapsedtime;  //TODO: Need to evaluate logic for needing this.
-    long int delay_time_nsec;
+    latency_add(cnt, LATENCY_FRAME, cnt->frame_start);
+    cnt->frame_run_count++;
+
+    if (cnt->frame_time_start == 0)
+        cnt->frame_time_start = cnt->currenttime;
+
+    if (cnt->currenttime - cnt->frame_time_start < FRAME_TIME_REPORT)
+        return;
+
+    latency_interval(cnt, LATENCY_FRAME, &stats);
+
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Frame time of %lu frames: p50 %.1f ms, "
+               "p99 %.1f ms, max %.1f ms", stats.count, stats.p50, stats.p99, stats.max);
+
+    if (cnt->capture)
+        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Capture queue dropped %lu frames so far",
+                   capture_queue_dropped(cnt));
+
+    if (cnt->output)
+        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Output queue was full %lu times so far",
+                   output_queue_held(cnt));
+
+    cnt->frame_time_start = cnt->currenttime;
+}
+
+static void mlp_frametiming(struct context *cnt){
 
     /***** MOTION LOOP - FRAMERATE TIMING AND SLEEPING SECTION *****/
     /*
@@ -2420,83 +2760,144 @@ static void mlp_frametiming(struct context *cnt){
     else
         cnt->required_frame_time = 0;
 
-    /* Get latest time to calculate time taken to process video data */
-    gettimeofday(&tv2, NULL);
-    elapsedtime = (tv2.tv_usec + 1000000L * tv2.tv_sec) - cnt->timenow;
+    if (cnt->get_image)
+        frame_time_add(cnt);
 
     /*
      * Update history buffer but ignore first pass as timebefore
-     * variable will be inaccurate
+     * variable will be inaccurate. The sum is kept up to date with
+     * the entry that is replaced, so the average takes no loop.
      */
-    if (cnt->passflag)
+    if (cnt->passflag) {
+        cnt->rolling_average_sum -= cnt->rolling_average_data[cnt->rolling_frame];
         cnt->rolling_average_data[cnt->rolling_frame] = cnt->timenow - cnt->timebefore;
-    else
+        cnt->rolling_average_sum += cnt->rolling_average_data[cnt->rolling_frame];
+    } else {
         cnt->passflag = 1;
+    }
 
     cnt->rolling_frame++;
     if (cnt->rolling_frame >= cnt->rolling_average_limit)
         cnt->rolling_frame = 0;
 
-    /* Calculate 10 second average and use deviation in delay calculation */
-    cnt->rolling_average = 0L;
+    /* 10 second average of the frame time */
+    cnt->rolling_average = cnt->rolling_average_sum / cnt->rolling_average_limit;
 
-    for (indx = 0; indx < cnt->rolling_average_limit; indx++)
-        cnt->rolling_average += cnt->rolling_average_data[indx];
+    /*
+     * The capture thread keeps to frame_limit already and mlp_capture waits
+     * for its frames, unless minimum_frame_time skips the capture or the
+     * device is closed.
+     */
+    if (cnt->video_dev >= 0 && cnt->capture && !cnt->conf.minimum_frame_time)
+        return;
+
+    /* On the thread pool the camera runs again when the frame is due. */
+    if (cnt->task) {
+        frame_due(&cnt->frame_deadline, cnt->required_frame_time);
+        return;
+    }
+
+    /* Sleep until the next frame is due, see frame_sleep */
+    frame_sleep(&cnt->frame_deadline, cnt->required_frame_time);
+
+}
+
+/**
+ * motion_loop_pass
+ *
+ *   Runs one pass of the motion loop, for one frame.
+ *
+ * Returns: 1 when the loop ends, 0 otherwise
+ */
+static int motion_loop_pass(struct context *cnt)
+{
+    struct timespec cpu_start, cpu_end;
+    long long start;
 
-    cnt->rolling_average /= cnt->rolling_average_limit;
-    cnt->frame_delay = cnt->required_frame_time - elapsedtime - (cnt->rolling_average - cnt->required_frame_time);
+    if (cnt->finish && !cnt->makemovie)
+        return 1;
 
-    if (cnt->frame_delay > 0) {
-        /* Apply delay to meet frame time */
-        if (cnt->frame_delay > cnt->required_frame_time)
-            cnt->frame_delay = cnt->required_frame_time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
 
-        /* Delay time in nanoseconds for SLEEP */
-        delay_time_nsec = cnt->frame_delay * 1000;
+    mlp_prepare(cnt);
+    if (cnt->get_image) {
+        mlp_resetimages(cnt);
+        if (mlp_retry(cnt) == 1)  return 1;
+        if (mlp_capture(cnt) == 1)  return 1;
+        mlp_detection(cnt);
+        mlp_tuning(cnt);
 
-        if (delay_time_nsec > 999999999)
-            delay_time_nsec = 999999999;
+        start = latency_now();
+        mlp_overlay(cnt);
+        latency_add(cnt, LATENCY_OVERLAY, start);
 
-        /* SLEEP as defined in motion.h  A safe sleep using nanosleep */
-        SLEEP(0, delay_time_nsec);
+        start = latency_now();
+        mlp_actions(cnt);
+        latency_add(cnt, LATENCY_EVENT, start);
+
+        mlp_setupmode(cnt);
     }
+    mlp_snapshot(cnt);
+    mlp_timelapse(cnt);
+    mlp_loopback(cnt);
+    mlp_parmsupdate(cnt);
+    mlp_frametiming(cnt);
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    cnt->run_cpu += (cpu_end.tv_sec - cpu_start.tv_sec) * 1000000000LL +
+                    cpu_end.tv_nsec - cpu_start.tv_nsec;
 
+    return 0;
 }
 
 /**
- * motion_loop
+ * motion_loop_summary
  *
- *   Thread function for the motion handling threads.
+ *   Logs the frames, the frame rate and the CPU use of the camera since it
+ *   started, and the frame time and the time of each stage since motion
+ *   started, see motion-bench.sh.
  *
  */
-static void *motion_loop(void *arg)
+static void motion_loop_summary(struct context *cnt)
 {
-    struct context *cnt = arg;
+    struct latency_stats frame;
+    struct timespec now;
+    char stages[256];
+    double secs;
 
-    if (motion_init(cnt) < 0)  goto err;
-
-    while (!cnt->finish || cnt->makemovie) {
-        mlp_prepare(cnt);
-        if (cnt->get_image) {
-            mlp_resetimages(cnt);
-            if (mlp_retry(cnt) == 1)  break;
-            if (mlp_capture(cnt) == 1)  break;
-            mlp_detection(cnt);
-            mlp_tuning(cnt);
-            mlp_overlay(cnt);
-            mlp_actions(cnt);
-            mlp_setupmode(cnt);
-        }
-        mlp_snapshot(cnt);
-        mlp_timelapse(cnt);
-        mlp_loopback(cnt);
-        mlp_parmsupdate(cnt);
-        mlp_frametiming(cnt);
-    }
+    if (!cnt->frame_run_count)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec * 1000000000LL + now.tv_nsec - cnt->run_start) / 1e9;
+    if (secs <= 0)
+        return;
+
+    latency_stats(cnt, LATENCY_FRAME, &frame);
 
-err:
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Ran %u frames in %.1f s, %.1f frames/s, "
+               "frame time p50 %.1f ms p90 %.1f ms p99 %.1f ms, %.1f%% CPU",
+               cnt->frame_run_count, secs, cnt->frame_run_count / secs,
+               frame.p50, frame.p90, frame.p99, cnt->run_cpu / 1e7 / secs);
+
+    latency_summary(cnt, stages, sizeof(stages));
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Stage time p50/p99 ms: %s", stages);
+
+    cnt->frame_run_count = 0;
+}
+
+/**
+ * motion_loop_exit
+ *
+ *   Cleans up after the motion loop ended and flags the camera as stopped.
+ *
+ */
+static void motion_loop_exit(struct context *cnt)
+{
     free(cnt->rolling_average_data);
 
+    motion_loop_summary(cnt);
+
     cnt->lost_connection = 1;
     MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Thread exiting");
 
@@ -2511,10 +2912,46 @@ err:
 
     cnt->running = 0;
     cnt->finish = 0;
+}
+
+/**
+ * motion_loop
+ *
+ *   Thread function for the motion handling threads.
+ *
+ */
+static void *motion_loop(void *arg)
+{
+    struct context *cnt = arg;
+
+    if (motion_init(cnt) >= 0) {
+        while (!motion_loop_pass(cnt));
+    }
+
+    motion_loop_exit(cnt);
 
     pthread_exit(NULL);
 }
 
+/**
+ * motion_task
+ *
+ *   Runs a pass of the motion loop of a camera on the thread pool, see
+ *   executor.c. The first pass only initializes the camera, the next one
+ *   runs when the first frame is there.
+ *
+ * Returns: 1 when the camera has stopped, 0 otherwise
+ */
+static int motion_task(struct context *cnt, int first)
+{
+    if (first ? motion_init(cnt) < 0 : motion_loop_pass(cnt)) {
+        motion_loop_exit(cnt);
+        return 1;
+    }
+
+    return 0;
+}
+
 /**
  * become_daemon
  *
@@ -2762,6 +3199,8 @@ static void motion_startup(int daemonize, int argc, char *argv[])
 
     initialize_chars();
 
+    alg_simd_init();
+
     if (daemonize) {
         /*
          * If daemon mode is requested, and we're not going into setup mode,
@@ -2848,6 +3287,10 @@ static void start_motion_thread(struct context *cnt, pthread_attr_t *thread_attr
      * start another thread for this device. */
     cnt->running = 1;
 
+    /* With camera_threads the camera runs on the thread pool instead. */
+    if (executor_add(cnt) == 0)
+        return;
+
     /*
      * Create the actual thread. Use 'motion_loop' as the thread
      * function.
@@ -2965,6 +3408,9 @@ int main (int argc, char **argv)
             MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Motion restarted");
         }
 
+        governor_init(cnt_list[0]);
+        executor_init(cnt_list, motion_task);
+
         /*
          * Start the motion threads. First 'cnt_list' item is global if 'thread'
          * option is used, so start at 1 then and 0 otherwise.
@@ -3061,6 +3507,13 @@ int main (int argc, char **argv)
 
                 if (cnt_list[i]->watchdog > WATCHDOG_OFF) {
                     if (cnt_list[i]->watchdog == WATCHDOG_KILL) {
+                        /*
+                         * The worker running a camera of the thread pool can't be
+                         * killed, it is interrupted until the camera finishes.
+                         */
+                        if (executor_stuck(cnt_list[i]) == 0)
+                            continue;
+
                         /* if 0 then it finally did clean up (and will restart without any further action here)
                          * kill(, 0) == ESRCH means the thread is no longer running
                          * if it is no longer running with running set, then cleanup here so it can restart
@@ -3087,7 +3540,7 @@ int main (int argc, char **argv)
                             cnt_list[i]->finish = 1;
                         }
 
-                        if (cnt_list[i]->watchdog == WATCHDOG_KILL) {
+                        if (cnt_list[i]->watchdog == WATCHDOG_KILL && executor_stuck(cnt_list[i]) < 0) {
                             MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Thread %d - Watchdog timeout, did NOT restart graceful, "
                                        "killing it!", cnt_list[i]->threadnr);
                             /* The problem is pthread_cancel might just wake up the thread so it runs to completion
@@ -3108,6 +3561,8 @@ int main (int argc, char **argv)
 
         MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Threads finished");
 
+        executor_deinit();
+
         /* Rest for a while if we're supposed to restart. */
         if (restart)
             SLEEP(2, 0);
@@ -3130,6 +3585,70 @@ int main (int argc, char **argv)
     return 0;
 }
 
+/**
+ * frame_due
+ *
+ *   Moves the deadline on to the next frame, one frame time after the
+ *   previous deadline. The deadline is absolute on the monotonic clock, so
+ *   the time taken by the capture and the detection, and any oversleeping,
+ *   are made up on the next frame instead of adding up. After a stall of
+ *   more than a frame the deadline starts over from now rather than rushing
+ *   through the missed frames.
+ *
+ * Parameters:
+ *
+ *   deadline   - deadline of the previous frame, zero to start
+ *   frame_time - microseconds per frame, 0 for no limit
+ *
+ * Returns: nanoseconds until the next frame is due, 0 or less when it is
+ */
+long long frame_due(struct timespec *deadline, long frame_time)
+{
+    struct timespec now;
+    long long behind;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    deadline->tv_sec += frame_time / 1000000L;
+    deadline->tv_nsec += (frame_time % 1000000L) * 1000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_nsec -= 1000000000L;
+        deadline->tv_sec++;
+    }
+
+    behind = (now.tv_sec - deadline->tv_sec) * 1000000000LL + now.tv_nsec - deadline->tv_nsec;
+    if (behind > frame_time * 1000LL)
+        *deadline = now;
+
+    return -behind;
+}
+
+/**
+ * frame_sleep
+ *
+ *   Sleeps until the next frame is due, see frame_due.
+ *
+ * Parameters:
+ *
+ *   deadline   - deadline of the previous frame, zero to start
+ *   frame_time - microseconds per frame, 0 for no limit
+ *
+ * Returns: nothing
+ */
+void frame_sleep(struct timespec *deadline, long frame_time)
+{
+    long long left = frame_due(deadline, frame_time);
+
+    if (left <= 0)
+        return;
+
+#ifdef TIMER_ABSTIME
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR);
+#else
+    SLEEP(left / 1000000000LL, left % 1000000000LL);
+#endif
+}
+
 /**
  * mymalloc
  *
@@ -154,10 +154,12 @@
 #define WATCHDOG_KILL          -60   /* -60 sec grace period before calling thread cancel */
 #define WATCHDOG_OFF          -127   /* Turn off watchdog, used when we wants to quit a thread */
 
+#define FRAME_TIME_REPORT       60   /* Seconds between frame time log lines */
+
 #define CONNECTION_KO           "Lost connection"
 #define CONNECTION_OK           "Connection OK"
 
-#define DEF_MAXSTREAMS          10   /* Maximum number of stream clients per camera */
+#define DEF_MAXSTREAMS          10   /* Maximum number of stream clients authenticating at once */
 #define DEF_MAXWEBQUEUE         10   /* Maximum number of stream client in queue */
 
 #define DEF_TIMESTAMP           "%Y-%m-%d\\n%T"
@@ -242,7 +244,8 @@ enum CAMERA_TYPE {
     CAMERA_TYPE_V4L2,
     CAMERA_TYPE_BKTR,
     CAMERA_TYPE_MMAL,
-    CAMERA_TYPE_NETCAM
+    CAMERA_TYPE_NETCAM,
+    CAMERA_TYPE_SYNTH
 };
 
 struct image_data {
@@ -262,6 +265,9 @@ struct image_data {
     struct coord location;      /* coordinates for center and size of last motion detection*/
 
     int total_labels;
+
+    unsigned char *jpeg;        /* The image compressed while in the pre_capture ring, see pre_capture_quality */
+    int jpeg_size;
 };
 
 /*
@@ -294,16 +300,27 @@ struct image_data {
 int draw_text(unsigned char *image, unsigned int startx, unsigned int starty, unsigned int width, const char *text, unsigned int factor);
 int initialize_chars(void);
 
+/* Defined in alg.c */
+struct alg_background;
+
 struct images {
     struct image_data *image_ring;    /* The base address of the image ring buffer */
     int image_ring_size;
     int image_ring_in;                /* Index in image ring buffer we last added a image into */
     int image_ring_out;               /* Index in image ring buffer we want to process next time */
+    unsigned char *image_ring_jpeg;   /* Compresses the images of the ring, see image_ring_compress */
 
     unsigned char *ref;               /* The reference frame */
     unsigned char *out;               /* Picture buffer for motion images */
-    int *ref_dyn;                     /* Dynamic objects to be excluded from reference frame */
-    unsigned char *image_virgin;      /* Last picture frame with no text or locate overlay */
+    unsigned char *ref_dyn;           /* Dynamic objects to be excluded from reference frame */
+    const struct alg_background *background; /* Background model, see alg_background_init */
+    unsigned short *bg_median;        /* Median background model, 8.8 fixed point */
+    unsigned short *bg_dev;           /* Deviation from bg_median, 8.8 fixed point */
+    unsigned char *bg_noise;          /* Noise level per pixel or NULL */
+    unsigned char *bg_still;          /* Motion image without motion, for the median */
+    int bg_frames;                    /* Median updates since the last reset */
+    struct image_pool *pool;          /* Frame buffers of the ring, image_virgin and preview */
+    unsigned char *image_virgin;      /* Last picture frame with no text or locate overlay, shared */
     struct image_data preview_image;  /* Picture buffer for best image when enables */
     unsigned char *mask;              /* Buffer for the mask file */
     unsigned char *smartmask;
@@ -313,15 +330,39 @@ struct images {
     unsigned char *mask_privacy;      /* Buffer for the privacy mask values */
     unsigned char *mask_privacy_uv;   /* Buffer for the privacy U&V values */
 
-    int *smartmask_buffer;
-    int *labels;
-    int *labelsize;
+    unsigned short *smartmask_buffer; /* Motion per pixel since the last smartmask tuning */
+    uint64_t *smartmask_bits;         /* Masked pixels of the running smartmask tuning */
+    int smartmask_tuning;             /* Next slice of the tuning, 0 if none is running */
+    unsigned char *tiles;             /* Tiles with changed pixels, see alg_diff */
+    int tiles_x;
+    int tiles_y;
+    uint64_t *motion_bits;            /* Motion image with one bit per pixel, see alg_despeckle */
+    uint64_t *motion_bits_tmp;        /* Second bit image, the filters swap between the two */
+    int bits_stride;                  /* 64 bit words per line of motion_bits */
+    unsigned short *labels;           /* Label of each pixel, 32768 is added above threshold */
+    struct label_run *label_runs;     /* Runs of motion pixels, see alg_labeling */
+    struct label_info *label_info;    /* Area, bounding box and centroid of each label */
+    int label_max;                    /* Allocated entries in label_runs and label_info */
+    int label_count;                  /* Labels found in the last frame */
     int width;
     int height;
     int type;
     int picture_type;                 /* Output picture type IMAGE_JPEG, IMAGE_PPM */
     int size;
     int motionsize;
+
+    /*
+     * Motion detection size. The detection buffers above (ref, ref_dyn, mask,
+     * smartmask, tiles, bits and labels) have this size, see alg_detection_image.
+     */
+    int det_scale;                    /* 1, 2 or 4 */
+    int det_width;
+    int det_height;
+    int det_motionsize;
+    unsigned char *det_image;         /* image_virgin scaled down, image_virgin at scale 1 */
+    unsigned char *det_out;           /* Motion image of the detection, out at scale 1 */
+    int det_still;                    /* det_out is not from the current frame */
+
     int labelgroup_max;
     int labels_above;
     int labelsize_max;
@@ -385,6 +426,11 @@ struct context {
 #ifdef HAVE_MMAL
     struct mmalcam_context *mmalcam;
 #endif
+    struct synth_camera *synth;              /* Synthetic camera, see video_synth.c */
+
+    struct alg_workers *workers;             /* Detection worker threads, see alg_workers.c */
+    struct capture_queue *capture;           /* Capture thread and queue, see capture_queue.c */
+    struct output_queue *output;             /* Output thread and queue, see output_queue.c */
 
     struct image_data *current_image;        /* Pointer to a structure where the image, diffs etc is stored */
     unsigned int new_img;
@@ -485,11 +531,13 @@ struct context {
     unsigned int get_image;    /* Flag used to signal that we capture new image when we run the loop */
 
     unsigned int text_size_factor;
-    long int required_frame_time, frame_delay;
+    long int required_frame_time;
+    struct timespec frame_deadline; /* When the next frame is due, see frame_sleep */
 
     long int rolling_average_limit;
     long int *rolling_average_data;
     unsigned long int rolling_average;
+    long long int rolling_average_sum;
 
     int olddiffs;   //only need this in here for a printf later...do we need that printf?
     int smartmask_ratio;
@@ -503,6 +551,26 @@ struct context {
     unsigned int passflag;  //only purpose is to flag first frame vs all others.....
     int rolling_frame;
 
+    /* Frame time, kept in the latency histograms, see frame_time_add */
+    long long frame_start;          /* Monotonic ns */
+    time_t frame_time_start;        /* Start of the time frame_time_add reports on */
+
+    /* Totals of the whole run, logged when the camera stops, see motion_loop_summary */
+    unsigned int frame_run_count;
+    long long run_start;            /* Monotonic ns */
+    long long run_cpu;              /* CPU ns of the motion loop */
+
+    /* Detection skipped by the load governor, see governor_detect */
+    int shed_skip;
+    int shed_count;
+    unsigned long int frames_shed;
+
+    /* Task on the camera thread pool, NULL with a thread of its own, see executor.c */
+    struct executor_task *task;
+
+    /* Time spent in the stages of the motion loop, see latency.c */
+    struct latency *latency;
+
 };
 
 extern pthread_mutex_t global_lock;
@@ -513,6 +581,8 @@ extern FILE *ptr_logfile;
 extern pthread_key_t tls_key_threadnr; /* key for thread number */
 
 int http_bindsock(int, int, int);
+long long frame_due(struct timespec *, long);
+void frame_sleep(struct timespec *, long);
 void * mymalloc(size_t);
 void * myrealloc(void *, size_t, const char *);
 FILE * myfopen(const char *, const char *);
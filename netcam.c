@@ -46,6 +46,7 @@
 
 #include "netcam_ftp.h"
 #include "netcam_rtsp.h"
+#include "executor.h"
 
 #define CONNECT_TIMEOUT        10     /* Timeout on remote connection attempt */
 #define READ_TIMEOUT            5     /* Default timeout on recv requests */
@@ -1083,6 +1084,9 @@ void netcam_image_read_complete(netcam_context_ptr netcam)
      */
     pthread_cond_signal(&netcam->pic_ready);
     pthread_mutex_unlock(&netcam->mutex);
+
+    /* On the thread pool the camera runs once a frame is there. */
+    executor_wake(netcam->cnt);
 }
 
 /**
@@ -13,6 +13,7 @@
  */
 
 #include "rotate.h"    /* already includes motion.h */
+#include "latency.h"
 #include <jpeglib.h>
 #include <jerror.h>
 
@@ -332,12 +333,13 @@ static int netcam_init_jpeg(netcam_context_ptr netcam, j_decompress_ptr cinfo)
  *      netcam          pointer to netcam_context
  *      cinfo           pointer to JPEG decompression context
  *      image           pointer to buffer of destination image (yuv420)
+ *      start           when the decoding started, see latency_now
  *
  * Returns :  netcam->jpeg_error
  */
 static int netcam_image_conv(netcam_context_ptr netcam,
                                struct jpeg_decompress_struct *cinfo,
-                               unsigned char *image)
+                               unsigned char *image, long long start)
 {
     JSAMPARRAY      line;           /* Array of decomp data lines */
     unsigned char  *wline;          /* Will point to line[0] */
@@ -396,6 +398,8 @@ static int netcam_image_conv(netcam_context_ptr netcam,
     jpeg_finish_decompress(cinfo);
     jpeg_destroy_decompress(cinfo);
 
+    latency_add(netcam->cnt, LATENCY_DECODE, start);
+
     if (netcam->cnt->rotate_data.degrees > 0 || netcam->cnt->rotate_data.axis != FLIP_TYPE_NONE)
         /* Rotate as specified */
         rotate_map(netcam->cnt, image);
@@ -428,6 +432,7 @@ int netcam_proc_jpeg(netcam_context_ptr netcam, unsigned char *image)
     struct jpeg_decompress_struct cinfo;    /* Decompression control struct. */
     int retval = 0;                         /* Value returned to caller. */
     int ret;                                /* Working var. */
+    long long start = latency_now();
 
     /*
      * This routine is only called from the main thread.
@@ -464,7 +469,7 @@ int netcam_proc_jpeg(netcam_context_ptr netcam, unsigned char *image)
     }
 
     /* Do the conversion */
-    ret = netcam_image_conv(netcam, &cinfo, image);
+    ret = netcam_image_conv(netcam, &cinfo, image, start);
 
     if (ret != 0) {
         retval |= NETCAM_JPEG_CONV_ERROR;
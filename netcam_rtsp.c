@@ -1051,6 +1051,30 @@ int netcam_next_rtsp(unsigned char *image , netcam_context_ptr netcam){
      * used to safely call other netcam functions. */
 
     pthread_mutex_lock(&netcam->mutex);
+
+    /*
+     * Wait for a frame newer than the last one handed out, for up to half
+     * a second like netcam_init_jpeg. After that the last frame is handed
+     * out again.
+     */
+    if (netcam->cnt->conf.wait_for_frames && netcam->imgcnt_last == netcam->imgcnt) {
+        struct timespec waittime;
+        struct timeval curtime;
+
+        gettimeofday(&curtime, NULL);
+        curtime.tv_usec += 500000;
+        if (curtime.tv_usec >= 1000000) {
+            curtime.tv_usec -= 1000000;
+            curtime.tv_sec++;
+        }
+        waittime.tv_sec = curtime.tv_sec;
+        waittime.tv_nsec = 1000L * curtime.tv_usec;
+
+        while (netcam->imgcnt_last == netcam->imgcnt &&
+               pthread_cond_timedwait(&netcam->pic_ready, &netcam->mutex, &waittime) == 0);
+    }
+    netcam->imgcnt_last = netcam->imgcnt;
+
     memcpy(image, netcam->latest->ptr, netcam->latest->used);
     pthread_mutex_unlock(&netcam->mutex);
 
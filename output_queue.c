@@ -0,0 +1,288 @@
+/*
+ *    output_queue.c
+ *
+ *    Output thread that saves the pictures and encodes the movie frames of
+ *    an event, so a slow disk or encoder doesn't hold up the motion thread.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    The motion thread hands frames of the image ring to the output thread
+ *    with a reference to the image buffer, see image_pool.c. Each queued
+ *    frame carries a copy of the context as it was when the
+ *    frame was queued, so the event handlers see the same state they would
+ *    have seen when called from the motion thread. The movie and extpipe
+ *    themselves are shared; they are only opened and closed by the motion
+ *    thread while the queue is empty, see output_queue_flush.
+ *
+ *    When the queue is full the frames stay in the image ring and are
+ *    handed over on a later pass. If the ring fills up too, the oldest
+ *    frames are dropped, as they always were, instead of the motion thread
+ *    waiting for the disk.
+ */
+#include "motion.h"
+#include "output_queue.h"
+#include "event.h"
+#include "image_pool.h"
+#include "latency.h"
+
+struct output_frame {
+    struct context cnt;             /* Context when the frame was queued */
+    struct image_data data;         /* Holds a reference to the image */
+    unsigned char *out;             /* Copy of imgs.out for the debug movie */
+    int fillers;
+};
+
+struct output_queue {
+    struct context *cnt;
+    int size;
+    struct output_frame *frames;
+
+    int head;                       /* Frame filled next */
+    int tail;                       /* Frame written next */
+    int count;                      /* Frames queued */
+    unsigned long held;             /* Times the queue was full */
+
+    pthread_t thread_id;
+    int finish;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;           /* A frame was queued */
+    pthread_cond_t done;            /* A frame was written */
+};
+
+/**
+ * output_write
+ *      Saves the picture and puts it into the movie, followed by the filler
+ *      frames.
+ */
+static void output_write(struct context *cnt, struct image_data *img, int fillers)
+{
+    long long start = latency_now();
+
+    event(cnt, EVENT_IMAGE_DETECTED, img->image, NULL, NULL, &img->timestamp_tv);
+
+    if (fillers > 0 && cnt->log_level >= DBG) {
+        char tmp[25];
+
+        sprintf(tmp, "Fillerframes %d", fillers);
+        image_writable(&img->image);
+        draw_text(img->image, 10, 40, cnt->imgs.width, tmp, cnt->conf.text_double);
+    }
+
+    while (fillers-- > 0)
+        event(cnt, EVENT_FFMPEG_PUT, img->image, NULL, NULL, &img->timestamp_tv);
+
+    latency_add(cnt, LATENCY_ENCODE, start);
+}
+
+/**
+ * output_loop
+ *      Writes the queued frames in order until stopped and the queue is
+ *      empty.
+ */
+static void *output_loop(void *arg)
+{
+    struct output_queue *queue = arg;
+    struct context *cnt = queue->cnt;
+    struct output_frame *frame;
+    char tname[16];
+
+    snprintf(tname, sizeof(tname), "ml%d:out", cnt->threadnr);
+    MOTION_PTHREAD_SETNAME(tname);
+
+    /* Store the motion thread number in TLS for 'MOTION_LOG'. */
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    pthread_mutex_lock(&queue->lock);
+
+    for (;;) {
+        while (!queue->count && !queue->finish)
+            pthread_cond_wait(&queue->ready, &queue->lock);
+
+        if (!queue->count)
+            break;
+
+        frame = &queue->frames[queue->tail];
+        pthread_mutex_unlock(&queue->lock);
+
+        frame->cnt.current_image = &frame->data;
+        frame->cnt.finish = 0;
+        if (frame->cnt.ffmpeg_output_debug)
+            frame->cnt.imgs.out = frame->out;
+
+        output_write(&frame->cnt, &frame->data, frame->fillers);
+        image_unref(frame->data.image);
+        frame->data.image = NULL;
+
+        /* put_picture ends the thread when it can't write to the target dir */
+        if (frame->cnt.finish) {
+            cnt->restart = frame->cnt.restart;
+            cnt->finish = 1;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        queue->tail = (queue->tail + 1) % queue->size;
+        queue->count--;
+        pthread_cond_signal(&queue->done);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+/**
+ * output_queue_init
+ *
+ */
+void output_queue_init(struct context *cnt)
+{
+    struct output_queue *queue;
+
+    cnt->output = NULL;
+
+    if (cnt->conf.output_queue <= 0)
+        return;
+
+    /* The database connection of the camera is not shared between threads. */
+    if (cnt->conf.database_type) {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: output_queue is not used together "
+                   "with database_type, writing from the motion thread");
+        return;
+    }
+
+    queue = mymalloc(sizeof(*queue));
+    queue->cnt = cnt;
+    queue->size = cnt->conf.output_queue;
+    queue->frames = mymalloc(queue->size * sizeof(*queue->frames));
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+    pthread_cond_init(&queue->done, NULL);
+
+    if (pthread_create(&queue->thread_id, NULL, output_loop, queue)) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start the output thread");
+        pthread_cond_destroy(&queue->done);
+        pthread_cond_destroy(&queue->ready);
+        pthread_mutex_destroy(&queue->lock);
+        free(queue->frames);
+        free(queue);
+        return;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Output queue of %d frames", queue->size);
+
+    cnt->output = queue;
+}
+
+/**
+ * output_queue_deinit
+ *
+ */
+void output_queue_deinit(struct context *cnt)
+{
+    struct output_queue *queue = cnt->output;
+    int i;
+
+    if (!queue)
+        return;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->finish = 1;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_join(queue->thread_id, NULL);
+
+    for (i = 0; i < queue->size; i++)
+        free(queue->frames[i].out);
+
+    pthread_cond_destroy(&queue->done);
+    pthread_cond_destroy(&queue->ready);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->frames);
+    free(queue);
+    cnt->output = NULL;
+}
+
+/**
+ * output_queue_put
+ *
+ */
+int output_queue_put(struct context *cnt, struct image_data *img, int fillers, int wait)
+{
+    struct output_queue *queue = cnt->output;
+    struct output_frame *frame;
+
+    if (!queue) {
+        output_write(cnt, img, fillers);
+        return 1;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == queue->size) {
+        if (!wait) {
+            queue->held++;
+            pthread_mutex_unlock(&queue->lock);
+            return 0;
+        }
+        pthread_cond_wait(&queue->done, &queue->lock);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    /* The output thread is done with this frame, see the wait above. */
+    frame = &queue->frames[queue->head];
+
+    memcpy(&frame->cnt, cnt, sizeof(frame->cnt));
+    frame->data = *img;
+    frame->fillers = fillers;
+    image_ref(frame->data.image);
+
+    /* The debug movie is made of imgs.out, which changes every frame. */
+    if (cnt->ffmpeg_output_debug) {
+        if (!frame->out)
+            frame->out = mymalloc(cnt->imgs.size);
+        memcpy(frame->out, cnt->imgs.out, cnt->imgs.size);
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count++;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+
+    return 1;
+}
+
+/**
+ * output_queue_flush
+ *
+ */
+void output_queue_flush(struct context *cnt)
+{
+    struct output_queue *queue = cnt->output;
+
+    if (!queue)
+        return;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count)
+        pthread_cond_wait(&queue->done, &queue->lock);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * output_queue_held
+ *
+ */
+unsigned long output_queue_held(struct context *cnt)
+{
+    if (!cnt->output)
+        return 0;
+
+    /* Only the motion thread counts, in output_queue_put. */
+    return cnt->output->held;
+}
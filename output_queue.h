@@ -0,0 +1,84 @@
+/*
+ *    output_queue.h
+ *
+ *    Include file for the per camera output thread that writes pictures
+ *    and movie frames.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_OUTPUT_QUEUE_H
+#define _INCLUDE_OUTPUT_QUEUE_H
+
+#include "motion.h"
+
+/**
+ * output_queue_init
+ *
+ *  Allocates the queue and starts the output thread when output_queue is
+ *  set. Without a queue the frames are written by output_queue_put itself.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void output_queue_init(struct context *cnt);
+
+/**
+ * output_queue_deinit
+ *
+ *  Writes the frames still queued, stops the output thread and frees the
+ *  queue.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void output_queue_deinit(struct context *cnt);
+
+/**
+ * output_queue_put
+ *
+ *  Hands a frame of the image ring to the output thread, which saves the
+ *  picture and puts it into the movie or the extpipe, followed by fillers
+ *  copies of it to keep up the movie frame rate. The output thread keeps a
+ *  reference to the image until it is written.
+ *
+ * Parameters:
+ *
+ *   cnt     - current thread's context structure
+ *   img     - frame in the image ring
+ *   fillers - number of filler frames to put into the movie after it
+ *   wait    - wait for room when the queue is full
+ *
+ * Returns: 1 if the frame was written or queued, 0 if the queue is full
+ */
+int output_queue_put(struct context *cnt, struct image_data *img, int fillers, int wait);
+
+/**
+ * output_queue_flush
+ *
+ *  Waits until the output thread has written all queued frames. Must be
+ *  called before the movie or extpipe of the event is closed.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void output_queue_flush(struct context *cnt);
+
+/**
+ * output_queue_held
+ *
+ *  Returns the number of times a frame had to stay in the image ring
+ *  because the queue was full, since the queue was allocated.
+ */
+unsigned long output_queue_held(struct context *cnt);
+
+#endif /* _INCLUDE_OUTPUT_QUEUE_H */
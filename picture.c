@@ -835,10 +835,10 @@ void overlay_smartmask(struct context *cnt, unsigned char *out)
     unsigned char *smartmask = imgs->smartmask_final;
     unsigned char *out_y, *out_u, *out_v;
 
-    i = imgs->motionsize;
-    v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
+    i = imgs->det_motionsize;
+    v = i + ((imgs->det_motionsize) / 4);
+    width = imgs->det_width;
+    height = imgs->det_height;
 
     /* Set V to 255 to make smartmask appear red. */
     out_v = out + v;
@@ -859,7 +859,7 @@ void overlay_smartmask(struct context *cnt, unsigned char *out)
     }
     out_y = out;
     /* Set colour intensity for smartmask. */
-    for (i = 0; i < imgs->motionsize; i++) {
+    for (i = 0; i < imgs->det_motionsize; i++) {
         if (smartmask[i] == 0)
             *out_y = 0;
         out_y++;
@@ -879,10 +879,10 @@ void overlay_fixed_mask(struct context *cnt, unsigned char *out)
     unsigned char *mask = imgs->mask;
     unsigned char *out_y, *out_u, *out_v;
 
-    i = imgs->motionsize;
-    v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
+    i = imgs->det_motionsize;
+    v = i + ((imgs->det_motionsize) / 4);
+    width = imgs->det_width;
+    height = imgs->det_height;
 
     /* Set U and V to 0 to make fixed mask appear green. */
     out_v = out + v;
@@ -903,7 +903,7 @@ void overlay_fixed_mask(struct context *cnt, unsigned char *out)
     }
     out_y = out;
     /* Set colour intensity for mask. */
-    for (i = 0; i < imgs->motionsize; i++) {
+    for (i = 0; i < imgs->det_motionsize; i++) {
         if (mask[i] == 0)
             *out_y = 0;
         out_y++;
@@ -920,13 +920,13 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
 {
     int i, x, v, width, height, line;
     struct images *imgs = &cnt->imgs;
-    int *labels = imgs->labels;
+    unsigned short *labels = imgs->labels;
     unsigned char *out_y, *out_u, *out_v;
 
-    i = imgs->motionsize;
-    v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
+    i = imgs->det_motionsize;
+    v = i + ((imgs->det_motionsize) / 4);
+    width = imgs->det_width;
+    height = imgs->det_height;
 
     /* Set U to 255 to make label appear blue. */
     out_u = out + i;
@@ -947,7 +947,7 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
     }
     out_y = out;
     /* Set intensity for coloured label to have better visibility. */
-    for (i = 0; i < imgs->motionsize; i++) {
+    for (i = 0; i < imgs->det_motionsize; i++) {
         if (*labels++ & 32768)
             *out_y = 0;
         out_y++;
@@ -972,14 +972,26 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
  */
 int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image_size,
                        unsigned char *image, int quality)
+{
+    return put_picture_memory_size(cnt, dest_image, image_size, image, quality,
+                                   cnt->imgs.width, cnt->imgs.height);
+}
+
+/**
+ * put_picture_memory_size
+ *      Like put_picture_memory, for an image of the camera scaled to width
+ *      and height, see alg_half_image.
+ */
+int put_picture_memory_size(struct context *cnt, unsigned char* dest_image, int image_size,
+                            unsigned char *image, int quality, int width, int height)
 {
     switch (cnt->imgs.type) {
     case VIDEO_PALETTE_YUV420P:
         return put_jpeg_yuv420p_memory(dest_image, image_size, image,
-                                       cnt->imgs.width, cnt->imgs.height, quality, cnt, &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
+                                       width, height, quality, cnt, &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
     case VIDEO_PALETTE_GREY:
         return put_jpeg_grey_memory(dest_image, image_size, image,
-                                    cnt->imgs.width, cnt->imgs.height, quality);
+                                    width, height, quality);
     default:
         MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Unknown image type %d",
                    cnt->imgs.type);
@@ -988,8 +1000,50 @@ int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image
     return 0;
 }
 
+/**
+ * put_picture_shared
+ *      Compresses the image of cnt->current_image, which is a buffer of the
+ *      image pool, once for each quality. The stream, the pictures and the
+ *      snapshots of a frame all get the same jpeg when they use the same
+ *      quality. A copy made to draw on is a different frame.
+ *
+ * Returns the jpeg, valid while the caller holds the image, or NULL.
+ */
+struct image_jpeg *put_picture_shared(struct context *cnt, unsigned char *image, int quality)
+{
+    struct image_jpeg *jpeg;
+
+    jpeg = image_jpeg_find(image, quality);
+    if (jpeg)
+        return jpeg;
+
+    jpeg = mymalloc(sizeof(*jpeg) + cnt->imgs.size);
+    jpeg->quality = quality;
+    jpeg->size = put_picture_memory(cnt, jpeg->data, cnt->imgs.size, image, quality);
+
+    if (jpeg->size <= 0) {
+        free(jpeg);
+        return NULL;
+    }
+
+    jpeg = myrealloc(jpeg, sizeof(*jpeg) + jpeg->size, "put_picture_shared");
+
+    return image_jpeg_add(image, jpeg);
+}
+
 void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *image, int quality)
 {
+    struct image_jpeg *jpeg;
+
+    /* The frame itself may have been compressed for the stream already. */
+    if (cnt->imgs.picture_type == IMAGE_TYPE_JPEG && cnt->current_image &&
+        image == cnt->current_image->image &&
+        (jpeg = put_picture_shared(cnt, image, quality)) != NULL) {
+        if (fwrite(jpeg->data, 1, jpeg->size, picture) != (size_t)jpeg->size)
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Can't write picture");
+        return;
+    }
+
     if (cnt->imgs.picture_type == IMAGE_TYPE_PPM) {
         put_ppm_bgr24_file(picture, image, cnt->imgs.width, cnt->imgs.height);
     } else {
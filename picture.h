@@ -11,6 +11,7 @@
 #define _INCLUDE_PICTURE_H_
 
 #include "motion.h"
+#include "image_pool.h"
 
 void overlay_smartmask(struct context *, unsigned char *);
 void overlay_fixed_mask(struct context *, unsigned char *);
@@ -18,6 +19,8 @@ void put_fixed_mask(struct context *, const char *);
 void overlay_largest_label(struct context *, unsigned char *);
 void put_picture_fd(struct context *, FILE *, unsigned char *, int);
 int put_picture_memory(struct context *, unsigned char*, int, unsigned char *, int);
+int put_picture_memory_size(struct context *, unsigned char*, int, unsigned char *, int, int, int);
+struct image_jpeg *put_picture_shared(struct context *, unsigned char *, int);
 void put_picture(struct context *, char *, unsigned char *, int);
 unsigned char *get_pgm(FILE *, int, int);
 void preview_save(struct context *);
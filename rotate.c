@@ -30,6 +30,7 @@
  *      v1 (28-Aug-2004) - initial version
  */
 #include "rotate.h"
+#include "latency.h"
 #include <stdint.h>
 #if defined(__APPLE__)
 #include <libkern/OSByteOrder.h>
@@ -320,6 +321,7 @@ int rotate_map(struct context *cnt, unsigned char *map)
     int size, deg;
     enum FLIP_TYPE axis;
     int width, height;
+    long long start = latency_now();
 
     deg = cnt->rotate_data.degrees;
     axis = cnt->rotate_data.axis;
@@ -410,6 +412,8 @@ int rotate_map(struct context *cnt, unsigned char *map)
         return -1;
     }
 
+    latency_add(cnt, LATENCY_ROTATE, start);
+
     return 0;
 }
 
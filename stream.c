@@ -26,9 +26,48 @@
 #include <netdb.h>
 #include <ctype.h>
 #include <sys/fcntl.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#if defined(__linux__)
+#include <linux/sockios.h>
+#endif
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <time.h>
+#include <linux/errqueue.h>
+#endif
+
+/* Completions of MSG_ZEROCOPY are only looked for with epoll. */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_LINUX_ERRQUEUE_H) && \
+    defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define STREAM_ZEROCOPY
+#endif
 
 #define STREAM_REALM       "Motion Stream Security Access"
 #define KEEP_ALIVE_TIMEOUT 100
+/* Socket events the stream server handles at a time */
+#define STREAM_EVENTS      64
+/* Free frame buffers kept per camera */
+#define STREAM_POOL        8
+/* Shortest time the rate of a client is measured over, in us */
+#define STREAM_SAMPLE      1000000UL
+/* Time in us a client may take for a frame before it is dropped */
+#define STREAM_STALL       30000000UL
+/* Smallest jpeg sent with MSG_ZEROCOPY, copying smaller ones is cheaper */
+#define STREAM_ZEROCOPY_MIN 10240
+/* Time in us a closed client waits for the kernel to finish its frames */
+#define STREAM_LINGER      5000000UL
+
+/* What stream_wait reports about a socket */
+#define STREAM_HANGUP      1
+#define STREAM_ERRQUEUE    2
+
+/* Precedes each frame, followed by its Content-Length line */
+static const char stream_boundary[] = "--BoundaryString\r\n"
+                                      "Content-type: image/jpeg\r\n";
 
 typedef void* (*auth_handler)(void*);
 struct auth_param {
@@ -157,7 +196,7 @@ static int read_http_request(int sock, char* buffer, int buflen, char* uri, int
     return 1;
 }
 
-static void stream_add_client(struct stream *list, int sc);
+static void stream_add_auth_client(struct stream *list, int sc);
 
 /**
  * handle_basic_auth
@@ -230,11 +269,11 @@ static void* handle_basic_auth(void* param)
         goto Error;
     }
 
+    stream_add_auth_client(&p->cnt->stream, p->sock);
+
     /* Lock the mutex */
     pthread_mutex_lock(&stream_auth_mutex);
 
-    stream_add_client(&p->cnt->stream, p->sock);
-    p->cnt->stream_count++;
     p->thread_count--;
 
     /* Unlock the mutex */
@@ -593,12 +632,11 @@ Error:
     free(server_user);
     free(server_pass);
 
+    stream_add_auth_client(&p->cnt->stream, p->sock);
+
     /* Lock the mutex */
     pthread_mutex_lock(&stream_auth_mutex);
 
-    stream_add_client(&p->cnt->stream, p->sock);
-    p->cnt->stream_count++;
-
     p->thread_count--;
     /* Unlock the mutex */
     pthread_mutex_unlock(&stream_auth_mutex);
@@ -789,17 +827,20 @@ int http_bindsock(int port, int local, int ipv6_enabled)
  * http_acceptsock
  *
  *
- * Returns: socket descriptor or -1 if any error happens.
+ * Returns: socket descriptor or -1 if any error happens or no client is waiting.
  */
 static int http_acceptsock(int sl)
 {
     int sc;
     struct sockaddr_storage addr;
     socklen_t addr_len = sizeof(addr);
-    sc = accept(sl, (struct sockaddr*)&addr, &addr_len);
+    do {
+        sc = accept(sl, (struct sockaddr*)&addr, &addr_len);
+    } while (sc < 0 && errno == EINTR);
 
     if (sc < 0) {
-        MOTION_LOG(CRT, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream accept()");
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            MOTION_LOG(CRT, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream accept()");
         return -1;
     }
 
@@ -808,141 +849,631 @@ static int http_acceptsock(int sl)
     return sc;
 }
 
+/*
+ * The stream server is a single thread that owns the listen sockets and the
+ * clients of the streams of all cameras, so neither slow clients nor many
+ * of them take time from the motion loops. A camera only encodes its frame
+ * when a client waits for one and leaves it in the latest slot of its list
+ * head, see stream_put. The server hands it to the waiting clients and
+ * writes to each of them for as long as the socket takes data. Clients on
+ * slow links get smaller renditions of the frames at a lower rate, shared
+ * by all clients of the same tier, see stream_adapt.
+ *
+ * With epoll the sockets are edge triggered, otherwise they are polled.
+ * Everything but the latest slots and the number of waiting clients is
+ * only touched with the lock held. A camera that stops frees its clients
+ * while the server may be waiting with events of them, so the server
+ * drops those events and looks at all sockets instead, see stream_rescan.
+ */
+static struct {
+    int started;
+    pthread_t thread_id;
+    int poll_fd;                    /* epoll instance */
+    int wake[2];                    /* Pipe the cameras wake the server with */
+    int woken;                      /* A byte is on its way through the pipe */
+    unsigned long generation;       /* Counts the cameras that stopped */
+    struct stream *cameras;         /* List heads of the cameras */
+    struct stream *dead;            /* Clients closed while handling events */
+    pthread_mutex_t lock;
+    pthread_mutex_t pool_lock;      /* Only for the pools of stream buffers */
+} stream_server = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .pool_lock = PTHREAD_MUTEX_INITIALIZER
+};
 
 /**
- * stream_flush
- *      Sends any outstanding data to all connected clients.
- *      It continuously goes through the client list until no data is able
- *      to be sent (either because there isn't any, or because the clients
- *      are not able to accept it).
+ * stream_buffer_get
+ *      Takes a buffer for a jpeg of size bytes of a tier from the pool of
+ *      the camera, with room to copy it to unless it is shared. A buffer
+ *      that is too small grows, and one that is far larger than the frames
+ *      of any tier have lately been shrinks, so the buffers follow the size
+ *      of the frames. Called from the motion loop.
  */
-static void stream_flush(struct stream *list, int *stream_count, int lim)
+static struct stream_buffer *stream_buffer_get(struct stream *list, int tier, long size, int copy)
 {
-    int written;            /* The number of bytes actually written. */
-    struct stream *client;  /* Pointer to the client being served. */
-    int workdone = 0;       /* Flag set any time data is successfully
-                               written. */
+    struct stream_buffer *tmpbuffer;
+    long estimate, want, most = 0;
+    int i;
+
+    pthread_mutex_lock(&stream_server.pool_lock);
+    tmpbuffer = list->pool;
+    if (tmpbuffer) {
+        list->pool = tmpbuffer->next;
+        list->pool_count--;
+    }
+    pthread_mutex_unlock(&stream_server.pool_lock);
 
-    client = list->next;
+    if (!tmpbuffer) {
+        tmpbuffer = mymalloc(sizeof(struct stream_buffer));
+        tmpbuffer->list = list;
+    }
 
-    while (client) {
+    /*
+     * A running average over about 8 frames, from the first one. The stream
+     * server reads it to pick the tier of a client.
+     */
+    estimate = list->estimate[tier];
+    if (!estimate)
+        estimate = size;
+    else
+        estimate += (size - estimate) / 8;
+    __atomic_store_n(&list->estimate[tier], estimate, __ATOMIC_RELAXED);
+
+    if (copy) {
+        /* Room for somewhat larger frames than usual, of any tier */
+        for (i = 0; i < list->tiers; i++) {
+            if (list->estimate[i] > most)
+                most = list->estimate[i];
+        }
+        want = most + most / 4;
+        if (want < size)
+            want = size;
+
+        if (tmpbuffer->capacity < size || tmpbuffer->capacity > 2 * want) {
+            free(tmpbuffer->ptr);
+            tmpbuffer->ptr = mymalloc(want);
+            tmpbuffer->capacity = want;
+        }
+    }
 
-        /* If data waiting for client, try to send it. */
-        if (client->tmpbuffer) {
+    tmpbuffer->next = NULL;
+    tmpbuffer->ref = 0;
 
-            /*
-             * We expect that list->filepos < list->tmpbuffer->size
-             * should always be true.  The check is more for safety,
-             * in case of trouble is some other part of the code.
-             * Note that if it is false, the following section will
-             * clean up.
-             */
-            if (client->filepos < client->tmpbuffer->size) {
-
-                /*
-                 * Here we are finally ready to write out the
-                 * data.  Remember that (because the socket
-                 * has been set non-blocking) we may only
-                 * write out part of the buffer.  The var
-                 * 'filepos' contains how much of the buffer
-                 * has already been written.
-                 */
-                written = write(client->socket,
-                          client->tmpbuffer->ptr + client->filepos,
-                          client->tmpbuffer->size - client->filepos);
-
-                /*
-                 * If any data has been written, update the
-                 * data pointer and set the workdone flag.
-                 */
-                if (written > 0) {
-                    client->filepos += written;
-                    workdone = 1;
-                }
-            } else
-                written = 0;
+    return tmpbuffer;
+}
+
+/**
+ * stream_buffer_free
+ *      Frees the buffers in the pool of a camera that stopped.
+ */
+static void stream_buffer_free(struct stream *list)
+{
+    struct stream_buffer *tmpbuffer;
+
+    while ((tmpbuffer = list->pool)) {
+        list->pool = tmpbuffer->next;
+        free(tmpbuffer->ptr);
+        free(tmpbuffer);
+    }
+    list->pool_count = 0;
+}
+
+/**
+ * stream_unref
+ *      Drops a reference to a tmpbuffer. With the last one a frame lets go
+ *      of its jpeg and goes back to the pool of its camera, the header of a
+ *      client is freed.
+ */
+static void stream_unref(struct stream_buffer *tmpbuffer)
+{
+    struct stream *list;
+
+    if (!tmpbuffer || --tmpbuffer->ref > 0)
+        return;
+
+    image_jpeg_unref(tmpbuffer->jpeg);
+    tmpbuffer->jpeg = NULL;
+
+    list = tmpbuffer->list;
+    if (list) {
+        pthread_mutex_lock(&stream_server.pool_lock);
+        if (list->pool_count < STREAM_POOL) {
+            tmpbuffer->next = list->pool;
+            list->pool = tmpbuffer;
+            list->pool_count++;
+            tmpbuffer = NULL;
+        }
+        pthread_mutex_unlock(&stream_server.pool_lock);
+    }
+
+    if (tmpbuffer) {
+        free(tmpbuffer->ptr);
+        free(tmpbuffer);
+    }
+}
+
+/**
+ * stream_watch
+ *      Has the server wait until a socket can be written to, or for a listen
+ *      socket until a client connects. Called with the lock held.
+ */
+static int stream_watch(int sock, struct stream *stream)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (stream->prev ? EPOLLOUT | EPOLLRDHUP : EPOLLIN) | EPOLLET;
+    ev.data.ptr = stream;
+
+    if (epoll_ctl(stream_server.poll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: epoll_ctl");
+        return -1;
+    }
+#else
+    (void)sock;
+    (void)stream;
+#endif
+
+    return 0;
+}
+
+/**
+ * stream_release_client
+ *      Closes the socket of a client and lets go of the frames it sent. The
+ *      client is only freed after the events at hand are handled, as one of
+ *      them may still be for it. Called with the lock held.
+ */
+static void stream_release_client(struct stream *client)
+{
+    /* Closing the socket removes it from epoll as well. */
+    close(client->socket);
+    client->socket = -1;
+
+    while (client->zerocopy_count)
+        stream_unref(client->sent[--client->zerocopy_count].tmpbuffer);
+
+    client->next = stream_server.dead;
+    stream_server.dead = client;
+}
+
+/**
+ * stream_close_client
+ *      Disconnects a client. A frame sent with MSG_ZEROCOPY is still read by
+ *      the kernel until its completion arrives, and once back in the pool the
+ *      next frame would overwrite it. So a client with such frames keeps its
+ *      socket and waits on the closing list of its camera, see stream_linger.
+ *      Called with the lock held.
+ */
+static void stream_close_client(struct stream *client)
+{
+    struct stream *list = client->list;
+    struct timeval curtimeval;
+
+    if (client->tmpbuffer)
+        stream_unref(client->tmpbuffer);
+    else
+        __atomic_sub_fetch(&list->idle[client->tier], 1, __ATOMIC_RELAXED);
+    client->tmpbuffer = NULL;
+
+    if (client->next)
+        client->next->prev = client->prev;
+    client->prev->next = client->next;
+    list->cnt->stream_count--;
+
+    if (!client->zerocopy_count) {
+        stream_release_client(client);
+        return;
+    }
+
+    /* Nothing more is sent, the client gets the end of what is queued. */
+    shutdown(client->socket, SHUT_WR);
+
+    gettimeofday(&curtimeval, NULL);
+    client->closed = curtimeval.tv_usec + 1000000L * curtimeval.tv_sec;
+    client->next = list->closing;
+    list->closing = client;
+}
+
+/**
+ * stream_iov
+ *      Points iov at the parts of a tmpbuffer that are left after filepos
+ *      bytes, and returns their number. The boundary and the CRLF of all
+ *      frames are the same, only the jpeg and its length differ.
+ */
+static int stream_iov(struct stream_buffer *tmpbuffer, long filepos, struct iovec *iov)
+{
+    struct iovec part[4];
+    int i, parts = 0, count = 0;
+
+    if (tmpbuffer->list) {
+        part[parts].iov_base = (void *)stream_boundary;
+        part[parts++].iov_len = sizeof(stream_boundary) - 1;
+        part[parts].iov_base = tmpbuffer->head;
+        part[parts++].iov_len = tmpbuffer->head_size;
+    }
+
+    part[parts].iov_base = (void *)tmpbuffer->data;
+    part[parts++].iov_len = tmpbuffer->length;
+
+    if (tmpbuffer->list) {
+        part[parts].iov_base = (void *)"\r\n";
+        part[parts++].iov_len = 2;
+    }
+
+    for (i = 0; i < parts; i++) {
+        if (filepos >= (long)part[i].iov_len) {
+            filepos -= part[i].iov_len;
+            continue;
+        }
+        iov[count].iov_base = (char *)part[i].iov_base + filepos;
+        iov[count++].iov_len = part[i].iov_len - filepos;
+        filepos = 0;
+    }
+
+    return count;
+}
+
+/**
+ * stream_zerocopy_flag
+ *      MSG_ZEROCOPY when the frame of a client is large enough for it, and
+ *      the client doesn't have too many frames in the kernel already.
+ */
+static int stream_zerocopy_flag(struct stream *client)
+{
+#ifdef STREAM_ZEROCOPY
+    if (!client->zerocopy || client->tmpbuffer->length < STREAM_ZEROCOPY_MIN)
+        return 0;
+
+    if (client->zerocopy_count == STREAM_ZEROCOPY_FRAMES &&
+        client->sent[client->zerocopy_count - 1].tmpbuffer != client->tmpbuffer)
+        return 0;
+
+    return MSG_ZEROCOPY;
+#else
+    (void)client;
+
+    return 0;
+#endif
+}
+
+/**
+ * stream_zerocopy_sent
+ *      Keeps the frame of a client until the kernel is done with the send
+ *      just made. The kernel numbers the sends with MSG_ZEROCOPY of a socket
+ *      from 0, and those of a frame follow each other.
+ */
+static void stream_zerocopy_sent(struct stream *client)
+{
+    struct stream_zerocopy *sent = NULL;
+
+    if (client->zerocopy_count)
+        sent = &client->sent[client->zerocopy_count - 1];
+
+    if (!sent || sent->tmpbuffer != client->tmpbuffer) {
+        sent = &client->sent[client->zerocopy_count++];
+        sent->tmpbuffer = client->tmpbuffer;
+        sent->tmpbuffer->ref++;
+        sent->first = client->zerocopy_next;
+        sent->done = 0;
+    }
+
+    sent->last = client->zerocopy_next++;
+}
+
+#ifdef STREAM_ZEROCOPY
+/**
+ * stream_zerocopy_release
+ *      Counts a send the kernel is done with, and lets go of its frame when
+ *      all sends of the frame are. The numbers wrap around.
+ */
+static void stream_zerocopy_release(struct stream *client, unsigned int id)
+{
+    struct stream_zerocopy *sent;
+    int i;
+
+    for (i = 0; i < client->zerocopy_count; i++) {
+        sent = &client->sent[i];
+        if (id - sent->first > sent->last - sent->first)
+            continue;
+
+        if (++sent->done > sent->last - sent->first) {
+            stream_unref(sent->tmpbuffer);
+            client->zerocopy_count--;
+            memmove(sent, sent + 1, (client->zerocopy_count - i) * sizeof(*sent));
+        }
+        return;
+    }
+}
+#endif
+
+/**
+ * stream_zerocopy_done
+ *      Reads the completions of MSG_ZEROCOPY from the error queue of a
+ *      client. Returns -1 when the socket failed instead.
+ */
+static int stream_zerocopy_done(struct stream *client)
+{
+#ifdef STREAM_ZEROCOPY
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    char control[128];
+    unsigned int id;
+    socklen_t len;
+    int error;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(client->socket, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+
+            /* The queue is empty, but the error may be of the socket. */
+            error = 0;
+            len = sizeof(error);
+            if (getsockopt(client->socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error)
+                return -1;
+
+            return 0;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno)
+                return -1;
 
             /*
-             * If we have written the entire buffer to the socket,
-             * or if there was some error (other than EAGAIN, which
-             * means the system couldn't take it), this request is
-             * finished.
+             * The kernel had to copy the frame after all, as it does for
+             * clients on the same machine, so copying right away is cheaper.
              */
-            if ((client->filepos >= client->tmpbuffer->size) ||
-                (written < 0 && errno != EAGAIN)) {
-                /* If no other clients need this buffer, free it. */
-                if (--client->tmpbuffer->ref <= 0) {
-                    free(client->tmpbuffer->ptr);
-                    free(client->tmpbuffer);
-                }
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                client->zerocopy = 0;
 
-                /* Mark this client's buffer as empty. */
-                client->tmpbuffer = NULL;
-                client->nr++;
+            for (id = serr->ee_info; ; id++) {
+                stream_zerocopy_release(client, id);
+                if (id == serr->ee_data)
+                    break;
             }
+        }
+    }
+#else
+    (void)client;
 
-            /*
-             * If the client is no longer connected, or the total
-             * number of frames already sent to this client is
-             * greater than our configuration limit, disconnect
-             * the client and free the stream struct.
-             */
-            if ((written < 0 && errno != EAGAIN) ||
-                (lim && !client->tmpbuffer && client->nr > lim)) {
-                void *tmp;
+    return -1;
+#endif
+}
 
-                close(client->socket);
+/**
+ * stream_linger
+ *      Reads the completions of the clients on the closing list of a camera,
+ *      and releases those the kernel is done with, whose socket failed or
+ *      that waited for more than STREAM_LINGER. With force all of them, for
+ *      a camera that stops. Called with the lock held.
+ */
+static void stream_linger(struct stream *list, int force)
+{
+    struct stream **prev = &list->closing;
+    struct stream *client;
+    struct timeval curtimeval;
+    unsigned long int curtime;
 
-                if (client->next)
-                    client->next->prev = client->prev;
+    gettimeofday(&curtimeval, NULL);
+    curtime = curtimeval.tv_usec + 1000000L * curtimeval.tv_sec;
 
-                client->prev->next = client->next;
-                tmp = client;
-                client = client->prev;
-                free(tmp);
-                (*stream_count)--;
-            }
-        }   /* End if (client->tmpbuffer) */
+    while ((client = *prev)) {
+        if (!force && stream_zerocopy_done(client) == 0 && client->zerocopy_count &&
+            curtime - client->closed < STREAM_LINGER) {
+            prev = &client->next;
+            continue;
+        }
 
-        /*
-         * Step the the next client in the list.  If we get to the
-         * end of the list, check if anything was written during
-         * that loop; (if so) reset the 'workdone' flag and go back
-         * to the beginning.
-         */
-        client = client->next;
+        *prev = client->next;
+        stream_release_client(client);
+    }
+}
 
-        if (!client && workdone) {
-            client = list->next;
-            workdone = 0;
+/**
+ * stream_queued
+ *      Bytes in the socket of a client that have not been sent yet, 0 where
+ *      the system doesn't tell.
+ */
+static int stream_queued(struct stream *client)
+{
+    int queued = 0;
+
+#if defined(SIOCOUTQNSD)
+    if (ioctl(client->socket, SIOCOUTQNSD, &queued) < 0)
+        queued = 0;
+#elif defined(SIOCOUTQ)
+    if (ioctl(client->socket, SIOCOUTQ, &queued) < 0)
+        queued = 0;
+#elif defined(FIONWRITE)
+    if (ioctl(client->socket, FIONWRITE, &queued) < 0)
+        queued = 0;
+#else
+    (void)client;
+#endif
+
+    return queued;
+}
+
+/**
+ * stream_tier_size
+ *      Bytes a frame of a tier has lately had. A tier no client took yet is
+ *      guessed to be half the size of the one before.
+ */
+static unsigned long stream_tier_size(struct stream *list, int tier)
+{
+    long size = __atomic_load_n(&list->estimate[tier], __ATOMIC_RELAXED);
+
+    if (!size && tier)
+        return stream_tier_size(list, tier - 1) / 2;
+
+    return size;
+}
+
+/**
+ * stream_adapt
+ *      Estimates how fast a client takes data when its next frame is due,
+ *      and picks the tier and the rate of its frames from that. Only a link
+ *      with data still waiting in the socket each time tells its speed, as
+ *      it was busy all the time: the bytes that left the socket over at least
+ *      STREAM_SAMPLE. A client that ran empty took all it got, so its
+ *      estimate grows, up to half again what it took. A client that keeps up
+ *      with everything from the start stays at the first tier and
+ *      stream_maxrate. A client should get at least half of stream_maxrate,
+ *      and only moves to a better tier with a margin, so it doesn't go back
+ *      and forth. Returns the bytes waiting in the socket.
+ */
+static int stream_adapt(struct stream *client, unsigned long curtime)
+{
+    struct stream *list = client->list;
+    unsigned long elapsed, sample, need, fps;
+    long delivered;
+    int tier, queued = stream_queued(client);
+
+    if (client->measured) {
+        delivered = client->queued - queued;
+        if (delivered > 0)
+            client->delivered += delivered;
+        if (!client->since) {
+            client->since = client->measured;
+            client->busy = 1;
+        }
+        if (!queued)
+            client->busy = 0;
+
+        /* The buffers on the way make shorter samples too noisy. */
+        elapsed = curtime - client->since;
+        if (elapsed >= STREAM_SAMPLE) {
+            sample = client->delivered * 1000000ULL / elapsed;
+            if (client->busy)
+                client->rate = client->rate ? (client->rate + sample) / 2 : sample;
+            else if (client->rate && client->rate < sample + sample / 2)
+                client->rate = client->rate + client->rate / 4 < sample + sample / 2 ?
+                               client->rate + client->rate / 4 : sample + sample / 2;
+
+            client->delivered = 0;
+            client->since = curtime;
+            client->busy = 1;
         }
-    }   /* End while (client) */
+    }
+
+    client->queued = queued;
+    client->measured = curtime;
+
+    if (!client->rate)
+        return queued;
+
+    fps = list->cnt->conf.stream_maxrate > 1 ? list->cnt->conf.stream_maxrate / 2 : 1;
+
+    for (tier = 0; tier < list->tiers - 1; tier++) {
+        need = stream_tier_size(list, tier) * fps;
+        if (tier < client->tier)
+            need += need / 2;
+        if (client->rate >= need)
+            break;
+    }
+
+    if (tier != client->tier) {
+        MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO, "%s: Stream client at %lu bytes/s moves "
+                   "from tier %d to %d", client->rate, client->tier, tier);
+
+        /* It waits for a frame of the other tier now. */
+        __atomic_sub_fetch(&list->idle[client->tier], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&list->idle[tier], 1, __ATOMIC_RELAXED);
+        client->tier = tier;
+    }
+
+    client->interval = stream_tier_size(list, tier) * 1000000ULL / client->rate;
+
+    return queued;
 }
 
 /**
- * stream_tmpbuffer
- *      Routine to create a new "tmpbuffer", which is a common
- *      object used by all clients connected to a single camera.
- *
- * Returns: new allocated stream_buffer.
+ * stream_flush
+ *      Sends the outstanding data of a client for as long as the socket
+ *      takes it. A client that is done waits for the next frame, unless it
+ *      has had stream_limit frames. Called with the lock held.
  */
-static struct stream_buffer *stream_tmpbuffer(int size)
+static void stream_flush(struct stream *client)
 {
-    struct stream_buffer *tmpbuffer = mymalloc(sizeof(struct stream_buffer));
-    tmpbuffer->ref = 0;
-    tmpbuffer->ptr = mymalloc(size);
+    struct stream *list = client->list;
+    int lim = list->cnt->conf.stream_limit;
+    struct iovec iov[4];
+    struct msghdr msg;
+    ssize_t written;
+    int flags;
 
-    return tmpbuffer;
+    while (client->tmpbuffer) {
+        if (client->filepos < client->tmpbuffer->size) {
+            /*
+             * The socket is non-blocking, so we may only send part of the
+             * frame. 'filepos' holds how much of it has been sent.
+             */
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = stream_iov(client->tmpbuffer, client->filepos, iov);
+            flags = stream_zerocopy_flag(client);
+
+            written = sendmsg(client->socket, &msg, flags);
+
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+
+                /* No memory left to pin the pages in, copy from now on. */
+                if (flags && errno == ENOBUFS) {
+                    client->zerocopy = 0;
+                    continue;
+                }
+
+                /* The client is no longer connected. */
+                stream_close_client(client);
+                return;
+            }
+
+            if (flags)
+                stream_zerocopy_sent(client);
+
+            client->filepos += written;
+            continue;
+        }
+
+        /* The whole buffer is written, wait for the next frame. */
+        stream_unref(client->tmpbuffer);
+        client->tmpbuffer = NULL;
+        client->nr++;
+
+        if (lim && client->nr > lim) {
+            stream_close_client(client);
+            return;
+        }
+
+        __atomic_add_fetch(&list->idle[client->tier], 1, __ATOMIC_RELAXED);
+    }
 }
 
 /**
  * stream_add_client
- *
- *
+ *      Adds a connected client to the stream of a camera and sends it the
+ *      HTTP header. Called with the lock held.
  */
 static void stream_add_client(struct stream *list, int sc)
 {
-    struct stream *new = mymalloc(sizeof(struct stream));
+    struct stream *new;
     static const char header[] = "HTTP/1.0 200 OK\r\n"
                                  "Server: Motion/"VERSION"\r\n"
                                  "Connection: close\r\n"
@@ -953,15 +1484,33 @@ static void stream_add_client(struct stream *list, int sc)
                                  "Content-Type: multipart/x-mixed-replace; "
                                  "boundary=BoundaryString\r\n\r\n";
 
+    /* The camera stopped while the client was authenticating. */
+    if (list->socket == -1) {
+        close(sc);
+        return;
+    }
+
+    new = mymalloc(sizeof(struct stream));
     memset(new, 0, sizeof(struct stream));
     new->socket = sc;
-
-    if ((new->tmpbuffer = stream_tmpbuffer(sizeof(header))) == NULL) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error creating tmpbuffer in stream_add_client");
-    } else {
-        memcpy(new->tmpbuffer->ptr, header, sizeof(header)-1);
-        new->tmpbuffer->size = sizeof(header)-1;
+    new->list = list;
+
+    new->tmpbuffer = mymalloc(sizeof(struct stream_buffer));
+    new->tmpbuffer->data = (const unsigned char *)header;
+    new->tmpbuffer->length = sizeof(header)-1;
+    new->tmpbuffer->size = sizeof(header)-1;
+    new->tmpbuffer->ref = 1;
+
+#ifdef STREAM_ZEROCOPY
+    if (list->cnt->conf.stream_zerocopy) {
+        int one = 1;
+
+        if (setsockopt(sc, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+            new->zerocopy = 1;
+        else
+            MOTION_LOG(WRN, TYPE_STREAM, SHOW_ERRNO, "%s: Could not enable MSG_ZEROCOPY");
     }
+#endif
 
     new->prev = list;
     new->next = list->next;
@@ -970,244 +1519,557 @@ static void stream_add_client(struct stream *list, int sc)
         new->next->prev = new;
 
     list->next = new;
+    list->cnt->stream_count++;
+
+    if (stream_watch(sc, new) < 0) {
+        stream_close_client(new);
+        return;
+    }
+
+    stream_flush(new);
+}
+
+/**
+ * stream_add_auth_client
+ *      Adds a client once it has authenticated, from the thread that
+ *      checked it.
+ */
+static void stream_add_auth_client(struct stream *list, int sc)
+{
+    pthread_mutex_lock(&stream_server.lock);
+    stream_add_client(list, sc);
+    pthread_mutex_unlock(&stream_server.lock);
+}
+
+/**
+ * stream_accept
+ *      Accepts all clients waiting to connect to a camera. Called with the
+ *      lock held.
+ */
+static void stream_accept(struct stream *list)
+{
+    int sc;
+
+    while (list->socket != -1 && (sc = http_acceptsock(list->socket)) >= 0) {
+        if (list->cnt->conf.stream_auth_method == 0)
+            stream_add_client(list, sc);
+        else
+            do_client_auth(list->cnt, sc);
+    }
 }
 
 /**
  * stream_add_write
- *
- *
+ *      Hands the latest frames of a camera to the clients that wait for one
+ *      of their tier and are due according to stream_maxrate and the rate
+ *      they take data at, and starts sending them. A client with more than
+ *      a frame still in its socket skips frames, so they don't pile up in
+ *      the kernel, and one that has not taken its last frame in STREAM_STALL
+ *      is dropped, so it doesn't keep old frames for ever. Called with the
+ *      lock held.
  */
-static void stream_add_write(struct stream *list, struct stream_buffer *tmpbuffer, unsigned int fps)
+static void stream_add_write(struct stream *list, unsigned int fps)
 {
+    struct stream_buffer *tmpbuffer[STREAM_TIERS];
+    struct stream *client, *next;
     struct timeval curtimeval;
-    unsigned long int curtime;
+    unsigned long int curtime, interval;
+    int tier, queued, frames = 0;
+
+    for (tier = 0; tier < STREAM_TIERS; tier++) {
+        tmpbuffer[tier] = __atomic_exchange_n(&list->latest[tier], NULL, __ATOMIC_ACQUIRE);
+        if (tmpbuffer[tier])
+            frames++;
+    }
+
+    if (!frames)
+        return;
 
     gettimeofday(&curtimeval, NULL);
     curtime = curtimeval.tv_usec + 1000000L * curtimeval.tv_sec;
 
-    while (list->next) {
-        list = list->next;
+    for (client = list->next; client; client = next) {
+        next = client->next;
 
-        if (list->tmpbuffer == NULL && ((curtime - list->last) >= 1000000L / fps)) {
-            list->last = curtime;
-            list->tmpbuffer = tmpbuffer;
-            tmpbuffer->ref++;
-            list->filepos = 0;
+        if (client->tmpbuffer && client->tmpbuffer->list && curtime - client->last > STREAM_STALL) {
+            MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, "%s: Dropping a stream client that took "
+                       "more than %lu seconds for a frame", STREAM_STALL / 1000000);
+            stream_close_client(client);
+            continue;
         }
+
+        interval = 1000000L / fps;
+        if (client->interval > interval)
+            interval = client->interval;
+
+        if (client->tmpbuffer || curtime - client->last < interval)
+            continue;
+
+        queued = stream_adapt(client, curtime);
+        if (!tmpbuffer[client->tier] || queued > tmpbuffer[client->tier]->size)
+            continue;
+
+        client->last = curtime;
+        client->tmpbuffer = tmpbuffer[client->tier];
+        client->tmpbuffer->ref++;
+        client->queued += client->tmpbuffer->size;
+        client->filepos = 0;
+        __atomic_sub_fetch(&list->idle[client->tier], 1, __ATOMIC_RELAXED);
+        stream_flush(client);
     }
 
-    if (tmpbuffer->ref <= 0) {
-        free(tmpbuffer->ptr);
-        free(tmpbuffer);
+    /* Drop the references of the latest slots */
+    for (tier = 0; tier < STREAM_TIERS; tier++)
+        stream_unref(tmpbuffer[tier]);
+}
+
+/**
+ * stream_rescan
+ *      Looks at all sockets after events were dropped, which edge triggered
+ *      sockets would not report again. Called with the lock held.
+ */
+static void stream_rescan(void)
+{
+    struct stream *list, *client, *next;
+
+    for (list = stream_server.cameras; list; list = list->link) {
+        stream_accept(list);
+        stream_linger(list, 0);
+        for (client = list->next; client; client = next) {
+            next = client->next;
+            if (client->zerocopy_count && stream_zerocopy_done(client) < 0)
+                stream_close_client(client);
+            else
+                stream_flush(client);
+        }
+        stream_add_write(list, list->cnt->conf.stream_maxrate);
+    }
+}
+
+/**
+ * stream_handle
+ *      Handles an event of a socket, NULL being the wake up pipe. Called
+ *      with the lock held.
+ */
+static void stream_handle(struct stream *stream, int error)
+{
+    struct stream *list;
+    char drain[64];
+
+    if (!stream) {
+        __atomic_store_n(&stream_server.woken, 0, __ATOMIC_RELAXED);
+        while (read(stream_server.wake[0], drain, sizeof(drain)) > 0);
+
+        /* The frames of the cameras also time the closed clients out. */
+        for (list = stream_server.cameras; list; list = list->link) {
+            stream_linger(list, 0);
+            stream_add_write(list, list->cnt->conf.stream_maxrate);
+        }
+        return;
+    }
+
+    /* Closed while handling this batch of events */
+    if (stream->socket == -1)
+        return;
+
+    /* Waiting for the kernel to finish its frames */
+    if (stream->closed) {
+        stream_linger(stream->list, 0);
+        return;
     }
+
+    /* The error queue holds the completions of MSG_ZEROCOPY. */
+    if (!stream->prev)
+        stream_accept(stream);
+    else if ((error & STREAM_HANGUP) ||
+             ((error & STREAM_ERRQUEUE) && stream_zerocopy_done(stream) < 0))
+        stream_close_client(stream);
+    else
+        stream_flush(stream);
 }
 
+/**
+ * stream_wait
+ *      Waits for events of the sockets. Returns the number of them, with the
+ *      stream of each in streams and whether it failed in errors.
+ */
+static int stream_wait(struct stream **streams, int *errors)
+{
+    int i, count;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[STREAM_EVENTS];
+
+    count = epoll_wait(stream_server.poll_fd, events, STREAM_EVENTS, -1);
+
+    for (i = 0; i < count; i++) {
+        streams[i] = events[i].data.ptr;
+        errors[i] = (events[i].events & (EPOLLHUP | EPOLLRDHUP) ? STREAM_HANGUP : 0) |
+                    (events[i].events & EPOLLERR ? STREAM_ERRQUEUE : 0);
+    }
+#else
+    struct pollfd fds[STREAM_EVENTS];
+    struct stream *list, *client, *watched[STREAM_EVENTS];
+    int n = 1;
+
+    /*
+     * Without epoll the sockets are level triggered, so only the clients
+     * with data to send are polled, up to STREAM_EVENTS sockets at a time.
+     */
+    fds[0].fd = stream_server.wake[0];
+    fds[0].events = POLLIN;
+    watched[0] = NULL;
+
+    pthread_mutex_lock(&stream_server.lock);
+    for (list = stream_server.cameras; list && n < STREAM_EVENTS; list = list->link) {
+        fds[n].fd = list->socket;
+        fds[n].events = POLLIN;
+        watched[n++] = list;
+        for (client = list->next; client && n < STREAM_EVENTS; client = client->next) {
+            if (!client->tmpbuffer)
+                continue;
+            fds[n].fd = client->socket;
+            fds[n].events = POLLOUT;
+            watched[n++] = client;
+        }
+    }
+    pthread_mutex_unlock(&stream_server.lock);
+
+    if (poll(fds, n, 1000) < 0)
+        return -1;
+
+    count = 0;
+    for (i = 0; i < n; i++) {
+        if (!fds[i].revents)
+            continue;
+        streams[count] = watched[i];
+        errors[count++] = (fds[i].revents & (POLLHUP | POLLNVAL) ? STREAM_HANGUP : 0) |
+                          (fds[i].revents & POLLERR ? STREAM_ERRQUEUE : 0);
+    }
+#endif
+
+    return count;
+}
 
 /**
- * stream_check_write
- *      We walk through the chain of stream structs until we reach the end.
- *      Here we check if the tmpbuffer points to NULL.
- *      We return 1 if it finds a list->tmpbuffer which is a NULL pointer which would
- *      be the next client ready to be sent a new image. If not a 0 is returned.
- *
- * Returns:
+ * stream_server_loop
+ *      Handles the sockets of all streams until motion ends.
  */
-static int stream_check_write(struct stream *list)
+static void *stream_server_loop(void *arg ATTRIBUTE_UNUSED)
 {
-    while (list->next) {
-        list = list->next;
+    struct stream *streams[STREAM_EVENTS];
+    struct stream *client;
+    int errors[STREAM_EVENTS];
+    unsigned long generation;
+    int i, count;
+
+    MOTION_PTHREAD_SETNAME("stream");
+
+    for (;;) {
+        pthread_mutex_lock(&stream_server.lock);
+        generation = stream_server.generation;
+        pthread_mutex_unlock(&stream_server.lock);
+
+        count = stream_wait(streams, errors);
+
+        pthread_mutex_lock(&stream_server.lock);
+
+        if (count < 0) {
+            if (errno != EINTR)
+                MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Waiting for the stream sockets");
+        } else if (generation != stream_server.generation) {
+            /* A camera stopped, the events may be of its freed clients. */
+            stream_rescan();
+        } else {
+            for (i = 0; i < count; i++)
+                stream_handle(streams[i], errors[i]);
+        }
+
+        while ((client = stream_server.dead)) {
+            stream_server.dead = client->next;
+            free(client);
+        }
+
+        pthread_mutex_unlock(&stream_server.lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * stream_server_start
+ *      Starts the stream server with the first stream. Called with the lock
+ *      held.
+ */
+static int stream_server_start(void)
+{
+    unsigned long i = 1;
+
+    if (stream_server.started)
+        return 0;
+
+    if (pipe(stream_server.wake) < 0) {
+        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Could not create the stream server pipe");
+        return -1;
+    }
+    ioctl(stream_server.wake[0], FIONBIO, &i);
+    ioctl(stream_server.wake[1], FIONBIO, &i);
+
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+
+    stream_server.poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (stream_server.poll_fd < 0) {
+        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: epoll_create1");
+        goto Error;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(stream_server.poll_fd, EPOLL_CTL_ADD, stream_server.wake[0], &ev) < 0) {
+        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: epoll_ctl");
+        close(stream_server.poll_fd);
+        goto Error;
+    }
+#endif
 
-        if (list->tmpbuffer == NULL)
-            return 1;
+    if (pthread_create(&stream_server.thread_id, NULL, stream_server_loop, NULL)) {
+        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Could not start the stream server");
+#ifdef HAVE_SYS_EPOLL_H
+        close(stream_server.poll_fd);
+#endif
+        goto Error;
     }
+    pthread_detach(stream_server.thread_id);
+
+    stream_server.started = 1;
+    MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, "%s: Started the stream server");
+
     return 0;
+
+Error:
+    close(stream_server.wake[0]);
+    close(stream_server.wake[1]);
+    return -1;
 }
 
+/**
+ * stream_wake
+ *      Wakes up the stream server, once for any number of calls until it
+ *      has looked at the cameras.
+ */
+static void stream_wake(void)
+{
+    if (__atomic_exchange_n(&stream_server.woken, 1, __ATOMIC_RELAXED))
+        return;
+
+    if (write(stream_server.wake[1], "", 1) < 0 && errno != EAGAIN)
+        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Could not wake the stream server");
+}
 
 /**
  * stream_init
  *      This function is called from motion.c for each motion thread starting up.
- *      The function setup the incoming tcp socket that the clients connect to.
- *      The function returns an integer representing the socket.
+ *      The function setup the incoming tcp socket that the clients connect to
+ *      and hands it to the stream server.
  *
  * Returns: stream socket descriptor.
  */
 int stream_init(struct context *cnt)
 {
-    cnt->stream.socket = http_bindsock(cnt->conf.stream_port, cnt->conf.stream_localhost,
-                                       cnt->conf.ipv6_enabled);
-    cnt->stream.next = NULL;
-    cnt->stream.prev = NULL;
-    return cnt->stream.socket;
-}
+    struct stream *list = &cnt->stream;
+    unsigned long i = 1;
 
-/**
- * stream_stop
- *      This function is called from the motion_loop when it ends
- *      and motion is terminated or restarted.
- */
-void stream_stop(struct context *cnt)
-{
-    struct stream *list;
-    struct stream *next = cnt->stream.next;
+    memset(list, 0, sizeof(*list));
+    list->cnt = cnt;
 
-    MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, "%s: Closing motion-stream listen socket"
-               " & active motion-stream sockets");
+    /* Only a camera whose image halves into whole jpeg blocks gets all tiers. */
+    list->tiers = STREAM_TIERS;
+    if ((cnt->imgs.width / 2) % 16 || (cnt->imgs.height / 2) % 16)
+        list->tiers--;
+    list->socket = http_bindsock(cnt->conf.stream_port, cnt->conf.stream_localhost,
+                                 cnt->conf.ipv6_enabled);
+    if (list->socket == -1)
+        return -1;
 
-    close(cnt->stream.socket);
-    cnt->stream.socket = -1;
+    /* All clients waiting are accepted at once, until there are no more. */
+    ioctl(list->socket, FIONBIO, &i);
 
-    while (next) {
-        list = next;
-        next = list->next;
+#ifndef STREAM_ZEROCOPY
+    if (cnt->conf.stream_zerocopy)
+        MOTION_LOG(WRN, TYPE_STREAM, NO_ERRNO, "%s: stream_zerocopy is not supported "
+                   "on this system");
+#endif
 
-        if (list->tmpbuffer) {
-            free(list->tmpbuffer->ptr);
-            free(list->tmpbuffer);
-        }
+    pthread_mutex_lock(&stream_server.lock);
 
+    if (stream_server_start() < 0 || stream_watch(list->socket, list) < 0) {
+        pthread_mutex_unlock(&stream_server.lock);
         close(list->socket);
-        free(list);
+        list->socket = -1;
+        return -1;
     }
 
-    MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, "%s: Closed motion-stream listen socket"
-               " & active motion-stream sockets");
+    list->link = stream_server.cameras;
+    stream_server.cameras = list;
+
+    pthread_mutex_unlock(&stream_server.lock);
+
+    return list->socket;
 }
 
-/*
- * stream_put
- *      Is the starting point of the stream loop. It is called from
- *      the motion_loop with the argument 'image' pointing to the latest frame.
- *      If config option 'stream_motion' is 'on' this function is called once
- *      per second (frame 0) and when Motion is detected excl pre_capture.
- *      If config option 'stream_motion' is 'off' this function is called once
- *      per captured picture frame.
- *      It is always run in setup mode for each picture frame captured and with
- *      the special setup image.
- *      The function does two things:
- *          It looks for possible waiting new clients and adds them.
- *          It sends latest picture frame to all connected clients.
- *      Note: Clients that have disconnected are handled in the stream_flush()
- *          function.
+/**
+ * stream_stop
+ *      This function is called from the motion_loop when it ends
+ *      and motion is terminated or restarted.
  */
-void stream_put(struct context *cnt, unsigned char *image)
+void stream_stop(struct context *cnt)
 {
-    struct timeval timeout;
-    struct stream_buffer *tmpbuffer;
-    fd_set fdread;
-    int sl = cnt->stream.socket;
-    int sc;
-    /* Tthe following string has an extra 16 chars at end for length. */
-    const char jpeghead[] = "--BoundaryString\r\n"
-                            "Content-type: image/jpeg\r\n"
-                            "Content-Length:                ";
-    int headlength = sizeof(jpeghead) - 1;    /* Don't include terminator. */
-    char len[20];    /* Will be used for sprintf, must be >= 16 */
+    struct stream *list = &cnt->stream;
+    struct stream **prev;
+    struct stream *client;
+    int i;
 
-    /*
-     * Timeout struct used to timeout the time we wait for a client
-     * and we do not wait at all.
-     */
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    FD_ZERO(&fdread);
-    FD_SET(cnt->stream.socket, &fdread);
+    MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, "%s: Closing motion-stream listen socket"
+               " & active motion-stream sockets");
 
-    /*
-     * If we have not reached the max number of allowed clients per
-     * thread we will check to see if new clients are waiting to connect.
-     * If this is the case we add the client as a new stream struct and
-     * add this to the end of the chain of stream structs that are linked
-     * to each other.
-     */
-    if ((cnt->stream_count < DEF_MAXSTREAMS) &&
-        (select(sl + 1, &fdread, NULL, NULL, &timeout) > 0)) {
-        sc = http_acceptsock(sl);
-        if (cnt->conf.stream_auth_method == 0) {
-            stream_add_client(&cnt->stream, sc);
-            cnt->stream_count++;
-        } else  {
-            do_client_auth(cnt, sc);
+    pthread_mutex_lock(&stream_server.lock);
+
+    for (prev = &stream_server.cameras; *prev; prev = &(*prev)->link) {
+        if (*prev == list) {
+            *prev = list->link;
+            break;
         }
     }
 
-    /* Lock the mutex */
-    if (cnt->conf.stream_auth_method != 0)
-        pthread_mutex_lock(&stream_auth_mutex);
+    close(list->socket);
+    list->socket = -1;
 
+    while (list->next)
+        stream_close_client(list->next);
 
-    /* Call flush to send any previous partial-sends which are waiting. */
-    stream_flush(&cnt->stream, &cnt->stream_count, cnt->conf.stream_limit);
+    /* The pool is freed below even if the kernel still sends from it. */
+    stream_linger(list, 1);
 
-    /* Check if any clients have available buffers. */
-    if (stream_check_write(&cnt->stream)) {
-        /*
-         * Yes - create a new tmpbuffer for current image.
-         * Note that this should create a buffer which is *much* larger
-         * than necessary, but it is difficult to estimate the
-         * minimum size actually required.
-         */
-        tmpbuffer = stream_tmpbuffer(cnt->imgs.size);
+    while ((client = stream_server.dead)) {
+        stream_server.dead = client->next;
+        free(client);
+    }
 
-        /* Check if allocation was ok. */
-        if (tmpbuffer) {
-            int imgsize;
+    for (i = 0; i < STREAM_TIERS; i++)
+        stream_unref(__atomic_exchange_n(&list->latest[i], NULL, __ATOMIC_ACQUIRE));
 
-            /*
-             * We need a pointer that points to the picture buffer
-             * just after the mjpeg header. We create a working pointer wptr
-             * to be used in the call to put_picture_memory which we can change
-             * and leave tmpbuffer->ptr intact.
-             */
-            unsigned char *wptr = tmpbuffer->ptr;
+    /* The server may be waiting with events of the clients just freed. */
+    stream_server.generation++;
 
-            /*
-             * For web protocol, our image needs to be preceded
-             * with a little HTTP, so we put that into the buffer
-             * first.
-             */
-            memcpy(wptr, jpeghead, headlength);
+    pthread_mutex_unlock(&stream_server.lock);
 
-            /* Update our working pointer to point past header. */
-            wptr += headlength;
+    /* No buffer of the camera is in use any more. */
+    stream_buffer_free(list);
+    free(list->scratch);
+    list->scratch = NULL;
+    free(list->small);
+    list->small = NULL;
 
-            /* Create a jpeg image and place into tmpbuffer. */
-            tmpbuffer->size = put_picture_memory(cnt, wptr, cnt->imgs.size, image,
-                                                 cnt->conf.stream_quality);
+    MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, "%s: Closed motion-stream listen socket"
+               " & active motion-stream sockets");
+}
 
-            /* Fill in the image length into the header. */
-            imgsize = sprintf(len, "%9ld\r\n\r\n", tmpbuffer->size);
-            memcpy(wptr - imgsize, len, imgsize);
+/**
+ * stream_put_tier
+ *      Compresses the rendition of a tier and leaves it in the latest slot
+ *      of the tier. The frame itself, as opposed to the motion or setup
+ *      image, is compressed once for the stream and the pictures of the
+ *      same quality, and the clients send that jpeg as it is. Other images
+ *      and the image at half the size are compressed into the scratch
+ *      buffer of the camera, which is as large as an image because it is
+ *      difficult to estimate the minimum size actually required, and copied
+ *      to a buffer of their own.
+ */
+static void stream_put_tier(struct context *cnt, unsigned char *image, int tier)
+{
+    struct stream *list = &cnt->stream;
+    struct stream_buffer *tmpbuffer;
+    struct image_jpeg *jpeg = NULL;
+    int quality = cnt->conf.stream_quality;
+    int size;
 
-            /* Append a CRLF for good measure. */
-            memcpy(wptr + tmpbuffer->size, "\r\n", 2);
+    if (tier)
+        quality = (quality + 1) / 2;
 
-            /*
-             * Now adjust tmpbuffer->size to reflect the
-             * header at the beginning and the extra CRLF
-             * at the end.
-             */
-            tmpbuffer->size += headlength + 2;
+    if (tier < STREAM_TIERS - 1 && cnt->current_image && image == cnt->current_image->image)
+        jpeg = put_picture_shared(cnt, image, quality);
 
-            /*
-             * And finally put this buffer to all clients with
-             * no outstanding data from previous frames.
-             */
-            stream_add_write(&cnt->stream, tmpbuffer, cnt->conf.stream_maxrate);
+    if (jpeg) {
+        tmpbuffer = stream_buffer_get(list, tier, jpeg->size, 0);
+        tmpbuffer->jpeg = image_jpeg_ref(jpeg);
+        tmpbuffer->data = jpeg->data;
+        tmpbuffer->length = jpeg->size;
+    } else {
+        if (!list->scratch)
+            list->scratch = mymalloc(cnt->imgs.size);
+
+        if (tier == STREAM_TIERS - 1) {
+            if (!list->small)
+                list->small = mymalloc(cnt->imgs.size / 4);
+            alg_half_image(cnt, image, list->small);
+            size = put_picture_memory_size(cnt, list->scratch, cnt->imgs.size, list->small,
+                                           quality, cnt->imgs.width / 2, cnt->imgs.height / 2);
         } else {
-            MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error creating tmpbuffer");
+            size = put_picture_memory(cnt, list->scratch, cnt->imgs.size, image, quality);
         }
+
+        tmpbuffer = stream_buffer_get(list, tier, size, 1);
+        memcpy(tmpbuffer->ptr, list->scratch, size);
+        tmpbuffer->data = tmpbuffer->ptr;
+        tmpbuffer->length = size;
     }
 
     /*
-     * Now we call flush again.  This time (assuming some clients were
-     * ready for the new frame) the new data will be written out.
+     * For web protocol, our image is preceded with the boundary and its
+     * length, and followed by a CRLF, see stream_iov.
      */
-    stream_flush(&cnt->stream, &cnt->stream_count, cnt->conf.stream_limit);
+    tmpbuffer->head_size = snprintf(tmpbuffer->head, sizeof(tmpbuffer->head),
+                                    "Content-Length: %d\r\n\r\n", tmpbuffer->length);
+    tmpbuffer->size = sizeof(stream_boundary) - 1 + tmpbuffer->head_size + tmpbuffer->length + 2;
 
-    /* Unlock the mutex */
-    if (cnt->conf.stream_auth_method != 0)
-        pthread_mutex_unlock(&stream_auth_mutex);
+    /*
+     * And finally leave it in the latest slot, in place of a frame the
+     * server has not got to yet, for the clients of the tier with no
+     * outstanding data from previous frames.
+     */
+    tmpbuffer->ref = 1;
+    tmpbuffer = __atomic_exchange_n(&list->latest[tier], tmpbuffer, __ATOMIC_ACQ_REL);
+    if (tmpbuffer)
+        stream_unref(tmpbuffer);
+}
 
-    return;
+/*
+ * stream_put
+ *      Is the starting point of the stream loop. It is called from
+ *      the motion_loop with the argument 'image' pointing to the latest frame.
+ *      If config option 'stream_motion' is 'on' this function is called once
+ *      per second (frame 0) and when Motion is detected excl pre_capture.
+ *      If config option 'stream_motion' is 'off' this function is called once
+ *      per captured picture frame.
+ *      It is always run in setup mode for each picture frame captured and with
+ *      the special setup image.
+ *      For each tier with a client waiting for a frame, the function encodes
+ *      it and leaves it to the stream server, which sends it to the clients.
+ */
+void stream_put(struct context *cnt, unsigned char *image)
+{
+    struct stream *list = &cnt->stream;
+    int tier, frames = 0;
+
+    /* Only the tiers with clients waiting for a frame are compressed. */
+    for (tier = 0; tier < list->tiers; tier++) {
+        if (__atomic_load_n(&list->idle[tier], __ATOMIC_RELAXED)) {
+            stream_put_tier(cnt, image, tier);
+            frames++;
+        }
+    }
+
+    if (frames)
+        stream_wake();
 }
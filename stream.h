@@ -21,12 +21,47 @@
 #ifndef _INCLUDE_STREAM_H_
 #define _INCLUDE_STREAM_H_
 
+/*
+ * Data sent to the clients of a stream. A frame is sent as the boundary, its
+ * Content-Length line in head, the jpeg and a CRLF, see stream_iov. The
+ * jpeg is either shared with the pictures of the frame or copied to ptr.
+ */
 struct stream_buffer {
     unsigned char *ptr;
     int ref;
-    long size;
+    long size;                          /* Bytes sent in all */
+    long capacity;                      /* Bytes allocated at ptr */
+    struct stream *list;                /* Camera whose pool a frame returns to */
+    struct stream_buffer *next;         /* Next buffer in the pool */
+    struct image_jpeg *jpeg;            /* Jpeg shared with the frame */
+    const unsigned char *data;          /* The jpeg, or the HTTP header of a client */
+    int length;                         /* Bytes at data */
+    int head_size;
+    char head[32];
+};
+
+/*
+ * Renditions of the stream: the frame at stream_quality, at half of it, and
+ * at half of it and half the size. A client gets the first one its link
+ * keeps up with, see stream_adapt.
+ */
+#define STREAM_TIERS 3
+
+/* Frames a client may have sent with MSG_ZEROCOPY and not had back yet */
+#define STREAM_ZEROCOPY_FRAMES 4
+
+/* The sends of a frame with MSG_ZEROCOPY, numbered first to last */
+struct stream_zerocopy {
+    struct stream_buffer *tmpbuffer;
+    unsigned int first;
+    unsigned int last;
+    unsigned int done;                  /* Sends the kernel has finished */
 };
 
+/*
+ * A client of the stream of a camera, or the list head of the clients of a
+ * camera, with prev set to NULL, and socket the listen socket.
+ */
 struct stream {
     int socket;
     FILE *fwrite;
@@ -36,6 +71,33 @@ struct stream {
     unsigned long int last;
     struct stream *prev;
     struct stream *next;
+    struct stream *list;                /* List head of a client */
+    int zerocopy;                       /* Large frames go with MSG_ZEROCOPY */
+    unsigned int zerocopy_next;         /* Number the kernel gives the next one */
+    int zerocopy_count;
+    struct stream_zerocopy sent[STREAM_ZEROCOPY_FRAMES];
+    int tier;                           /* Rendition the client gets */
+    unsigned long rate;                 /* Bytes per second it takes, 0 as much as it gets */
+    unsigned long interval;             /* Least us between frames at that rate */
+    long queued;                        /* Bytes left to send as of measured */
+    unsigned long measured;             /* When the rate was last looked at */
+    long delivered;                     /* Bytes that left the socket in the sample */
+    unsigned long since;                /* Start of the current sample */
+    int busy;                           /* The socket never ran empty since then */
+    unsigned long closed;               /* When it was closed with frames in the kernel */
+
+    /* Only used in the list head, see stream_put */
+    struct context *cnt;
+    struct stream_buffer *latest[STREAM_TIERS]; /* Frames the stream server has not sent yet */
+    int idle[STREAM_TIERS];             /* Clients of each tier waiting for a frame */
+    int tiers;                          /* Renditions the camera can make */
+    struct stream *link;                /* Next camera of the stream server */
+    struct stream *closing;             /* Closed clients waiting for the kernel */
+    struct stream_buffer *pool;         /* Free frame buffers */
+    int pool_count;
+    long estimate[STREAM_TIERS];        /* Running average of the jpeg size of each tier */
+    unsigned char *scratch;             /* Compresses images that aren't frames */
+    unsigned char *small;               /* The image at half the size */
 };
 
 int stream_init(struct context *);
@@ -13,6 +13,7 @@
 #include "video_common.h"
 #include "video_v4l2.h"
 #include "video_bktr.h"
+#include "video_synth.h"
 #include "jpegutils.h"
 
 typedef unsigned char uint8_t;
@@ -577,6 +578,12 @@ void vid_close(struct context *cnt)
     }
 #endif
 
+    if (cnt->synth) {
+        MOTION_LOG(INF, TYPE_VIDEO, NO_ERRNO, "%s: calling synth_cleanup");
+        synth_cleanup(cnt);
+        return;
+    }
+
     if (cnt->netcam) {
         MOTION_LOG(INF, TYPE_VIDEO, NO_ERRNO, "%s: calling netcam_cleanup");
         netcam_cleanup(cnt->netcam, 0);
@@ -596,7 +603,7 @@ void vid_close(struct context *cnt)
         return;
     }
 
-    MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO, "%s: No Camera device cleanup (MMAL, Netcam, V4L2, BKTR)");
+    MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO, "%s: No Camera device cleanup (MMAL, Netcam, V4L2, BKTR, synthetic)");
     return;
 
 
@@ -641,6 +648,11 @@ int vid_start(struct context *cnt)
     }
 #endif
 
+    if (cnt->camera_type == CAMERA_TYPE_SYNTH) {
+        MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO, "%s: Opening synthetic camera");
+        return synth_start(cnt);
+    }
+
     if (cnt->camera_type == CAMERA_TYPE_NETCAM) {
         MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO, "%s: Opening Netcam");
         dev = netcam_start(cnt);
@@ -670,7 +682,7 @@ int vid_start(struct context *cnt)
         return dev;
     }
 
-    MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO, "%s: No Camera device specified (MMAL, Netcam, V4L2, BKTR)");
+    MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO, "%s: No Camera device specified (MMAL, Netcam, V4L2, BKTR, synthetic)");
     return dev;
 
 }
@@ -707,6 +719,13 @@ int vid_next(struct context *cnt, unsigned char *map)
     }
 #endif
 
+    if (cnt->camera_type == CAMERA_TYPE_SYNTH) {
+        if (cnt->synth == NULL)
+            return NETCAM_GENERAL_ERROR;
+
+        return synth_next(cnt, map);
+    }
+
     if (cnt->camera_type == CAMERA_TYPE_NETCAM) {
         if (cnt->video_dev == -1)
             return NETCAM_GENERAL_ERROR;
@@ -0,0 +1,318 @@
+/*
+ *    video_synth.c
+ *
+ *    Synthetic camera that generates its frames, so the detection, the
+ *    events and the capacity of a system can be tried out without cameras.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ *
+ *    The synthetic_camera option holds a comma separated list of settings,
+ *    for example "objects=2,noise=4,light=40":
+ *
+ *      objects - number of moving boxes, default 1
+ *      size    - size of the boxes in percent of the width, default 10
+ *      speed   - pixels the boxes move per frame, default 4
+ *      noise   - amplitude of the noise on each pixel, default 3
+ *      light   - change of the brightness when the light switches, default 0
+ *      period  - seconds each part of the script lasts, default 10
+ *      seed    - start of the random numbers, default the camera number
+ *
+ *    The script alternates between a period with the boxes moving across
+ *    a still background and a period without them. Halfway through the
+ *    periods without boxes the light is switched on or off. A frame only
+ *    depends on the settings and on its number, so each run and each
+ *    camera with the same seed sees the same frames.
+ */
+#include "motion.h"
+#include "video_synth.h"
+#include "rotate.h"
+
+/* Extra noise values, the noise of a frame starts somewhere in them */
+#define SYNTH_NOISE_SPAN 4096
+
+struct synth_object {
+    unsigned int x, y;              /* Start position in 1/16 pixels */
+    unsigned int dx, dy;            /* Movement per frame in 1/16 pixels */
+    unsigned char luma, u, v;
+};
+
+struct synth_camera {
+    int width;
+    int height;
+    int objects;
+    int size;                       /* Box size in pixels */
+    int speed;
+    int noise;
+    int light;
+    int period;                     /* Frames per part of the script */
+    unsigned int seed;
+    unsigned long frame;
+    unsigned char *background;      /* Luma of the still background */
+    signed char *noise_table;       /* width * height + SYNTH_NOISE_SPAN values */
+    struct synth_object *object;
+};
+
+/**
+ * synth_random
+ *      Next pseudo random number of a xorshift generator.
+ */
+static unsigned int synth_random(unsigned int *state)
+{
+    unsigned int x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+/**
+ * synth_parse
+ *      Reads the settings from the synthetic_camera option.
+ */
+static void synth_parse(struct synth_camera *synth, const char *spec)
+{
+    char *copy, *token, *save = NULL, *value;
+    int size = 10;
+
+    copy = mystrdup(spec);
+
+    for (token = strtok_r(copy, ", ", &save); token; token = strtok_r(NULL, ", ", &save)) {
+        value = strchr(token, '=');
+        if (!value) {
+            if (strcasecmp(token, "on"))
+                MOTION_LOG(WRN, TYPE_VIDEO, NO_ERRNO, "%s: Ignoring %s", token);
+            continue;
+        }
+        *value++ = '\0';
+
+        if (!strcasecmp(token, "objects"))
+            synth->objects = atoi(value);
+        else if (!strcasecmp(token, "size"))
+            size = atoi(value);
+        else if (!strcasecmp(token, "speed"))
+            synth->speed = atoi(value);
+        else if (!strcasecmp(token, "noise"))
+            synth->noise = atoi(value);
+        else if (!strcasecmp(token, "light"))
+            synth->light = atoi(value);
+        else if (!strcasecmp(token, "period"))
+            synth->period = atoi(value);
+        else if (!strcasecmp(token, "seed"))
+            synth->seed = atoi(value);
+        else
+            MOTION_LOG(WRN, TYPE_VIDEO, NO_ERRNO, "%s: Unknown setting %s", token);
+    }
+
+    free(copy);
+
+    if (synth->objects < 0)
+        synth->objects = 0;
+    if (size < 1 || size > 100)
+        size = 10;
+    synth->size = (synth->width * size / 100) & ~1;
+    if (synth->size < 2)
+        synth->size = 2;
+    if (synth->size > synth->height)
+        synth->size = synth->height & ~1;
+    if (synth->noise < 0 || synth->noise > 127)
+        synth->noise = 3;
+    if (synth->period < 1)
+        synth->period = 10;
+    /* xorshift never leaves 0 */
+    if (!synth->seed)
+        synth->seed = 1;
+}
+
+/**
+ * synth_position
+ *      Position of a box along one axis after frame frames, bouncing off
+ *      the edges. All in 1/16 pixels.
+ */
+static unsigned int synth_position(unsigned int start, unsigned int step, unsigned long frame,
+                                   unsigned int range)
+{
+    unsigned long long pos;
+
+    if (!range)
+        return 0;
+
+    pos = (start + (unsigned long long)step * frame) % (2ULL * range);
+
+    return pos > range ? 2 * range - pos : pos;
+}
+
+/**
+ * synth_box
+ *      Draws a box into the frame.
+ */
+static void synth_box(struct synth_camera *synth, struct synth_object *object,
+                      unsigned char *map, int x, int y)
+{
+    unsigned char *u = map + synth->width * synth->height;
+    unsigned char *v = u + synth->width * synth->height / 4;
+    int row, half = synth->width / 2;
+
+    x &= ~1;
+    y &= ~1;
+
+    for (row = 0; row < synth->size; row++)
+        memset(map + (y + row) * synth->width + x, object->luma, synth->size);
+
+    for (row = 0; row < synth->size / 2; row++) {
+        memset(u + (y / 2 + row) * half + x / 2, object->u, synth->size / 2);
+        memset(v + (y / 2 + row) * half + x / 2, object->v, synth->size / 2);
+    }
+}
+
+/**
+ * synth_start
+ *
+ */
+int synth_start(struct context *cnt)
+{
+    struct synth_camera *synth;
+    unsigned int random;
+    int i, x, y;
+
+    if ((cnt->conf.width % 8) || (cnt->conf.height % 8)) {
+        MOTION_LOG(ERR, TYPE_VIDEO, NO_ERRNO, "%s: Width %d and height %d must be a multiple of 8",
+                   cnt->conf.width, cnt->conf.height);
+        return -2;
+    }
+
+    synth = mymalloc(sizeof(*synth));
+    synth->width = cnt->conf.width;
+    synth->height = cnt->conf.height;
+    synth->objects = 1;
+    synth->speed = 4;
+    synth->noise = 3;
+    synth->period = 10;
+    synth->seed = cnt->threadnr;
+
+    synth_parse(synth, cnt->conf.synthetic_camera);
+    if (cnt->conf.frame_limit > 0)
+        synth->period *= cnt->conf.frame_limit;
+
+    /* A gradient from top to bottom with a checkerboard of 16 pixel squares */
+    synth->background = mymalloc(synth->width * synth->height);
+    for (y = 0; y < synth->height; y++) {
+        for (x = 0; x < synth->width; x++)
+            synth->background[y * synth->width + x] = 40 + y * 120 / synth->height +
+                                                      (((x >> 4) ^ (y >> 4)) & 1) * 24;
+    }
+
+    random = synth->seed;
+
+    if (synth->noise) {
+        synth->noise_table = mymalloc(synth->width * synth->height + SYNTH_NOISE_SPAN);
+        for (i = 0; i < synth->width * synth->height + SYNTH_NOISE_SPAN; i++)
+            synth->noise_table[i] = (int)(synth_random(&random) % (2 * synth->noise + 1)) - synth->noise;
+    }
+
+    if (synth->objects) {
+        synth->object = mymalloc(synth->objects * sizeof(*synth->object));
+        for (i = 0; i < synth->objects; i++) {
+            struct synth_object *object = &synth->object[i];
+
+            object->x = synth_random(&random) % ((synth->width - synth->size) * 16 + 1);
+            object->y = synth_random(&random) % ((synth->height - synth->size) * 16 + 1);
+            object->dx = synth->speed * 8 + synth_random(&random) % (synth->speed * 8 + 1);
+            object->dy = synth->speed * 8 + synth_random(&random) % (synth->speed * 8 + 1);
+            object->luma = (i & 1) ? 16 : 235;
+            object->u = synth_random(&random) & 0xff;
+            object->v = synth_random(&random) & 0xff;
+        }
+    }
+
+    cnt->imgs.width = synth->width;
+    cnt->imgs.height = synth->height;
+    cnt->imgs.size = (synth->width * synth->height * 3) / 2;
+    cnt->imgs.motionsize = synth->width * synth->height;
+    cnt->imgs.type = VIDEO_PALETTE_YUV420P;
+
+    MOTION_LOG(NTC, TYPE_VIDEO, NO_ERRNO, "%s: Synthetic camera of %dx%d with %d objects of %d "
+               "pixels, noise %d, light %d, %d frames per period, seed %u",
+               synth->width, synth->height, synth->objects, synth->size, synth->noise,
+               synth->light, synth->period, synth->seed);
+
+    cnt->synth = synth;
+
+    return 0;
+}
+
+/**
+ * synth_next
+ *
+ */
+int synth_next(struct context *cnt, unsigned char *map)
+{
+    struct synth_camera *synth = cnt->synth;
+    unsigned long frame = synth->frame++;
+    unsigned long phase = frame / synth->period;
+    int i, size = synth->width * synth->height;
+    int light = 0;
+
+    /* The light switches halfway through every other period without boxes. */
+    if (((frame + synth->period / 2) / (2 * synth->period)) & 1)
+        light = synth->light;
+
+    if (synth->noise) {
+        const signed char *noise = synth->noise_table +
+                                   (frame * 2654435761UL) % SYNTH_NOISE_SPAN;
+
+        for (i = 0; i < size; i++) {
+            int value = synth->background[i] + light + noise[i];
+
+            map[i] = value < 0 ? 0 : value > 255 ? 255 : value;
+        }
+    } else if (light) {
+        for (i = 0; i < size; i++) {
+            int value = synth->background[i] + light;
+
+            map[i] = value < 0 ? 0 : value > 255 ? 255 : value;
+        }
+    } else {
+        memcpy(map, synth->background, size);
+    }
+
+    memset(map + size, 128, size / 2);
+
+    if (!(phase & 1)) {
+        for (i = 0; i < synth->objects; i++) {
+            struct synth_object *object = &synth->object[i];
+
+            synth_box(synth, object, map,
+                      synth_position(object->x, object->dx, frame,
+                                     (synth->width - synth->size) * 16) / 16,
+                      synth_position(object->y, object->dy, frame,
+                                     (synth->height - synth->size) * 16) / 16);
+        }
+    }
+
+    if (cnt->rotate_data.degrees > 0 || cnt->rotate_data.axis != FLIP_TYPE_NONE)
+        rotate_map(cnt, map);
+
+    return 0;
+}
+
+/**
+ * synth_cleanup
+ *
+ */
+void synth_cleanup(struct context *cnt)
+{
+    struct synth_camera *synth = cnt->synth;
+
+    if (!synth)
+        return;
+
+    free(synth->object);
+    free(synth->noise_table);
+    free(synth->background);
+    free(synth);
+    cnt->synth = NULL;
+}
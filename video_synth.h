@@ -0,0 +1,57 @@
+/*
+ *    video_synth.h
+ *
+ *    Include file for the synthetic camera, which generates frames with
+ *    moving objects, noise and lighting changes instead of capturing them.
+ *
+ *    This software is distributed under the GNU Public license
+ *    Version 2.  See also the file 'COPYING'.
+ */
+#ifndef _INCLUDE_VIDEO_SYNTH_H
+#define _INCLUDE_VIDEO_SYNTH_H
+
+#include "motion.h"
+
+/**
+ * synth_start
+ *
+ *  Sets up the synthetic camera from the synthetic_camera option, at the
+ *  width and height of the configuration.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: 0 on success, -2 when the dimensions are not a multiple of 8
+ */
+int synth_start(struct context *cnt);
+
+/**
+ * synth_next
+ *
+ *  Generates the next frame. The frames only depend on the options and
+ *  on how many frames were generated before, so every run sees the same.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *   map - buffer for the YUV420P frame
+ *
+ * Returns: 0
+ */
+int synth_next(struct context *cnt, unsigned char *map);
+
+/**
+ * synth_cleanup
+ *
+ *  Frees the synthetic camera.
+ *
+ * Parameters:
+ *
+ *   cnt - current thread's context structure
+ *
+ * Returns: nothing
+ */
+void synth_cleanup(struct context *cnt);
+
+#endif /* _INCLUDE_VIDEO_SYNTH_H */
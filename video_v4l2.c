@@ -18,7 +18,9 @@
 #include "rotate.h"    /* Already includes motion.h */
 #include "video_common.h"
 #include "video_v4l2.h"
+#include "latency.h"
 #include <sys/mman.h>
+#include <poll.h>
 
 
 #ifdef HAVE_V4L2
@@ -891,6 +893,37 @@ static int v4l2_capture(struct context *cnt, struct video_dev *viddev, unsigned
         return ret;
     }
 
+    /*
+     * The driver hands out the oldest filled buffer first. Frames that were
+     * filled while the camera thread was busy or sleeping are stale, so
+     * return them to the driver and keep the newest one.
+     */
+    if (cnt->conf.wait_for_frames) {
+        struct pollfd pfd;
+        struct v4l2_buffer newer;
+
+        pfd.fd = vid_source->fd_device;
+        pfd.events = POLLIN;
+
+        while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+            memset(&newer, 0, sizeof(newer));
+            newer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            newer.memory = V4L2_MEMORY_MMAP;
+
+            if (xioctl(vid_source, VIDIOC_DQBUF, &newer) == -1)
+                break;
+
+            if (xioctl(vid_source, VIDIOC_QBUF, &vid_source->buf) == -1) {
+                MOTION_LOG(ERR, TYPE_VIDEO, SHOW_ERRNO, "%s: VIDIOC_QBUF");
+                vid_source->buf = newer;
+                pthread_sigmask(SIG_UNBLOCK, &old, NULL);
+                return -1;
+            }
+
+            vid_source->buf = newer;
+        }
+    }
+
     MOTION_LOG(DBG, TYPE_VIDEO, NO_ERRNO, "%s: 2) vid_source->pframe %i",
                vid_source->pframe);
 
@@ -907,33 +940,38 @@ static int v4l2_capture(struct context *cnt, struct video_dev *viddev, unsigned
 
     {
         video_buff *the_buffer = &vid_source->buffers[vid_source->buf.index];
+        long long start;
+        int ret = 0;
 
         MOTION_LOG(DBG, TYPE_VIDEO, NO_ERRNO, "%s: the_buffer index %d Address (%x)",
                    vid_source->buf.index, the_buffer->ptr);
 
+        start = latency_now();
+
         switch (vid_source->dst_fmt.fmt.pix.pixelformat) {
         case V4L2_PIX_FMT_RGB24:
             vid_rgb24toyuv420p(map, the_buffer->ptr, width, height);
-            return 0;
+            break;
 
         case V4L2_PIX_FMT_UYVY:
             vid_uyvyto420p(map, the_buffer->ptr, (unsigned)width, (unsigned)height);
-            return 0;
+            break;
 
         case V4L2_PIX_FMT_YUYV:
         case V4L2_PIX_FMT_YUV422P:
             vid_yuv422to420p(map, the_buffer->ptr, width, height);
-            return 0;
+            break;
 
         case V4L2_PIX_FMT_YUV420:
             memcpy(map, the_buffer->ptr, viddev->v4l_bufsize);
-            return 0;
+            break;
 
         case V4L2_PIX_FMT_PJPG:
         case V4L2_PIX_FMT_JPEG:
         case V4L2_PIX_FMT_MJPEG:
-            return vid_mjpegtoyuv420p(map, the_buffer->ptr, width, height,
-                                  vid_source->buffers[vid_source->buf.index].content_length);
+            ret = vid_mjpegtoyuv420p(map, the_buffer->ptr, width, height,
+                                     vid_source->buffers[vid_source->buf.index].content_length);
+            break;
 
         /* FIXME: quick hack to allow work all bayer formats */
         case V4L2_PIX_FMT_SBGGR16:
@@ -943,26 +981,32 @@ static int v4l2_capture(struct context *cnt, struct video_dev *viddev, unsigned
         case V4L2_PIX_FMT_SBGGR8:    /* bayer */
             vid_bayer2rgb24(cnt->imgs.common_buffer, the_buffer->ptr, width, height);
             vid_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
-            return 0;
+            break;
 
         case V4L2_PIX_FMT_SPCA561:
         case V4L2_PIX_FMT_SN9C10X:
             vid_sonix_decompress(map, the_buffer->ptr, width, height);
             vid_bayer2rgb24(cnt->imgs.common_buffer, map, width, height);
             vid_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
-            return 0;
+            break;
         case V4L2_PIX_FMT_Y12:
             shift += 2;
         case V4L2_PIX_FMT_Y10:
             shift += 2;
             vid_y10torgb24(cnt->imgs.common_buffer, the_buffer->ptr, width, height, shift);
             vid_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
-            return 0;
+            break;
         case V4L2_PIX_FMT_GREY:
             vid_greytoyuv420p(map, the_buffer->ptr, width, height);
-            return 0;
+            break;
 
+        default:
+            return 1;
         }
+
+        latency_add(cnt, LATENCY_DECODE, start);
+
+        return ret;
     }
 
     return 1;
@@ -11,6 +11,8 @@
  *
  */
 #include "webhttpd.h"    /* already includes motion.h */
+#include "governor.h"
+#include "latency.h"
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -70,6 +72,28 @@ static const char *ok_response_raw =
     "Pragma: no-cache\r\n"
     "Content-type: text/plain\r\n\r\n";
 
+static const char *ok_response_prometheus =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: Motion-httpd/"VERSION"\r\n"
+    "Connection: close\r\n"
+    "Max-Age: 0\r\n"
+    "Expires: 0\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Cache-Control: private\r\n"
+    "Pragma: no-cache\r\n"
+    "Content-type: text/plain; version=0.0.4\r\n\r\n";
+
+static const char *ok_response_json =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: Motion-httpd/"VERSION"\r\n"
+    "Connection: close\r\n"
+    "Max-Age: 0\r\n"
+    "Expires: 0\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Cache-Control: private\r\n"
+    "Pragma: no-cache\r\n"
+    "Content-type: application/json\r\n\r\n";
+
 static const char *bad_request_response =
     "HTTP/1.0 400 Bad Request\r\n"
     "Content-type: text/html\r\n\r\n"
@@ -305,6 +329,26 @@ static void send_template_raw(int client_socket, char *res)
         MOTION_LOG(DBG, TYPE_STREAM, SHOW_ERRNO, "%s: write_nonblock returned value less than zero.");
 }
 
+/**
+ * send_template_long
+ *      Writes a text that may not fit into the socket buffer at once.
+ */
+static void send_template_long(int client_socket, const char *res)
+{
+    size_t len = strlen(res);
+    ssize_t nwrite;
+
+    while (len > 0) {
+        nwrite = write_nonblock(client_socket, res, len);
+        if (nwrite <= 0) {
+            MOTION_LOG(DBG, TYPE_STREAM, SHOW_ERRNO, "%s: write_nonblock returned value less than zero.");
+            return;
+        }
+        res += nwrite;
+        len -= nwrite;
+    }
+}
+
 /**
  * send_template_end_client
  */
@@ -1314,6 +1358,77 @@ static unsigned int detection(char *pointer, char *res, unsigned int length_uri,
              else
                  response_client(client_socket, not_found_response_valid_command_raw, NULL);
         }
+    } else if (!strcmp(command, "load")) {
+        pointer = pointer + 4;
+        length_uri = length_uri - 4;
+
+        if (length_uri == 0) {
+            /* call load, the frames skipped by the load governor */
+            int load, skip;
+
+            load = governor_load(&skip);
+            i = (thread == 0 && cnt[1]) ? 1 : thread;
+
+            if (cnt[0]->conf.webcontrol_html_output) {
+                send_template_ini_client(client_socket, ini_template);
+                sprintf(res, "<a href=/%u/detection>&lt;&ndash; back</a><br><br>\n"
+                             "<b>Load</b> %d%% of the CPUs, budget %d%%, idle cameras skip %d frames<br>\n",
+                             thread, load, cnt[0]->conf.cpu_budget, skip);
+                send_template(client_socket, res);
+                do {
+                    sprintf(res, "<b>Camera %d%s%s</b> skips %d frames, %lu skipped so far<br>\n",
+                                 cnt[i]->conf.camera_id,
+                                 cnt[i]->conf.camera_name ? " -- " : "",
+                                 cnt[i]->conf.camera_name ? cnt[i]->conf.camera_name : "",
+                                 cnt[i]->shed_skip, cnt[i]->frames_shed);
+                    send_template(client_socket, res);
+                } while (thread == 0 && cnt[++i]);
+                send_template_end_client(client_socket);
+            } else {
+                send_template_ini_client_raw(client_socket);
+                sprintf(res, "Load %d budget %d skip %d\n", load, cnt[0]->conf.cpu_budget, skip);
+                send_template_raw(client_socket, res);
+                do {
+                    sprintf(res, "Camera %d skip %d skipped %lu\n", cnt[i]->conf.camera_id,
+                                 cnt[i]->shed_skip, cnt[i]->frames_shed);
+                    send_template_raw(client_socket, res);
+                } while (thread == 0 && cnt[++i]);
+            }
+        } else {
+            /* error */
+            if (cnt[0]->conf.webcontrol_html_output)
+                response_client(client_socket, not_found_response_valid_command, NULL);
+            else
+                response_client(client_socket, not_found_response_valid_command_raw, NULL);
+        }
+    } else if (!strcmp(command, "latency")) {
+        pointer = pointer + 7;
+        length_uri = length_uri - 7;
+
+        /*
+         * call latency, the time spent in each stage of the motion loop. The
+         * text format of Prometheus, or JSON with .json, whatever the html
+         * output is set to.
+         */
+        if (length_uri == 0 || !strcmp(pointer, ".json")) {
+            char *text;
+
+            if (length_uri == 0) {
+                text = latency_prometheus(cnt, thread);
+                response_client(client_socket, ok_response_prometheus, NULL);
+            } else {
+                text = latency_json(cnt, thread);
+                response_client(client_socket, ok_response_json, NULL);
+            }
+            send_template_long(client_socket, text);
+            free(text);
+        } else {
+            /* error */
+            if (cnt[0]->conf.webcontrol_html_output)
+                response_client(client_socket, not_found_response_valid_command, NULL);
+            else
+                response_client(client_socket, not_found_response_valid_command_raw, NULL);
+        }
     } else {
         if (cnt[0]->conf.webcontrol_html_output)
             response_client(client_socket, not_found_response_valid_command, NULL);
@@ -2237,19 +2352,21 @@ static unsigned int handle_get(int client_socket, const char *url, void *userdat
                                              "<a href=/%d/detection/status>status</a><br>\n"
                                              "<a href=/%d/detection/start>start</a><br>\n"
                                              "<a href=/%d/detection/pause>pause</a><br>\n"
-                                             "<a href=/%d/detection/connection>connection</a><br>\n",
+                                             "<a href=/%d/detection/connection>connection</a><br>\n"
+                                             "<a href=/%d/detection/load>load</a><br>\n"
+                                             "<a href=/%d/detection/latency>latency</a><br>\n",
                                              thread, cnt[thread]->conf.camera_id,
                                              cnt[thread]->conf.camera_name ? " -- " : "",
                                              cnt[thread]->conf.camera_name ? cnt[thread]->conf.camera_name : "",
-                                             thread, thread, thread, thread);
+                                             thread, thread, thread, thread, thread, thread);
                                 send_template(client_socket, res);
                                 send_template_end_client(client_socket);
                             } else {
                                 send_template_ini_client_raw(client_socket);
-                                sprintf(res, "Camera %d\nstatus\nstart\npause\nconnection\n", cnt[thread]->conf.camera_id);
+                                sprintf(res, "Camera %d\nstatus\nstart\npause\nconnection\nload\nlatency\n", cnt[thread]->conf.camera_id);
                                 send_template_raw(client_socket, res);
                             }
-                        } else if ((slash == '/') && (length_uri > 5)) {
+                        } else if ((slash == '/') && (length_uri > 4)) {
                             pointer++;
                             length_uri--;
                             /* call detection() */